@@ -37,6 +37,24 @@ int ht_create(hash_table **ht, char *name)
 	return 1;
 }
 
+/*empties the table, the users can keep using it meanwhile*/
+int ht_clear(hash_table *ht)
+{
+	hashtable *tmp, *old;
+
+	if (createHashtable(ht->table->maxsize, compareBlockNumberNoPointer, NULL, NULL, &tmp) != STATUS_OK) {
+		return -1;
+	}
+
+	HT_AT_lock(&ht->lock);
+	old = ht->table;
+	ht->table = tmp;
+	HT_AT_unlock(&ht->lock);
+
+	deleteHashtable(&old);
+	return 1;
+}
+
 int ht_get_size(hash_table *ht)
 {
 	return ht->table->size;
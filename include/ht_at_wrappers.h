@@ -31,6 +31,7 @@ int ht_scan(hash_table *ht, int *blk);
 int ht_create_with_size(hash_table **ht, char *name, int size);
 int ht_create(hash_table **ht, char *name);
 int ht_destroy(hash_table *ht);
+int ht_clear(hash_table *ht);
 void ht_print(hash_table *ht);
 int ht_get_size(hash_table *ht);
 
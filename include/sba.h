@@ -2,33 +2,26 @@
 #define __INCLUDE_SBA_H__
 
 #include "sba_common.h"
+#include "sba_wlog.h"
 
 #define DEVICE_NAME 	"sba"
 
-/* 
- * This structure holds device specific information.
- */
- 
-typedef struct _sba_dev {
-	struct block_device *f_dev;
-	struct block_device *j_dev;
-	unsigned long size;
-	spinlock_t lock;
-	struct gendisk *gd;
-	int usage;
-}	sba_dev;
-
 /* fwd declarations */
 
 long long diff_time(struct timeval st, struct timeval et);
 int sba_open(struct inode *inode, struct file *filp);
 int sba_release(struct inode *inode, struct file *filp);
 int sba_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg);
+int sba_dev_ioctl(sba_dev *dev, unsigned int cmd, unsigned long arg);
+sba_dev *sba_get_dev(int id);
 int sba_check_change(struct gendisk *gd);
 int sba_revalidate(struct gendisk *gd);
-int sba_get_f_device_number(void);
-int sba_get_device_number(void);
-char *read_block(int block);
+int sba_attach(sba_dev *dev, sba_backing *b);
+int sba_detach(sba_dev *dev);
+int sba_snapshot(sba_dev *dev);
+int sba_rollback(sba_dev *dev, int drop);
+int sba_get_device_number(int id);
+char *read_block(sba_dev *dev, int block);
 
 #endif /* __INCLUDE_SBA_H__ */
 
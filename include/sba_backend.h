@@ -0,0 +1,25 @@
+#ifndef __INCLUDE_SBA_BACKEND_H__
+#define __INCLUDE_SBA_BACKEND_H__
+
+#include "sba_common_defs.h"
+
+/*
+ * A backend stores the blocks of an sba instance. Every bio that
+ * leaves the driver goes through map(): it either points the bio at
+ * the storage and returns 1, for generic_make_request to send it on,
+ * or does the io itself, ends the bio and returns 0.
+ */
+typedef struct _sba_backend_ops {
+	char *name;
+	int (*attach)(sba_dev *dev, sba_backing *b);	//sets dev->size, 0 or -errno
+	int (*map)(sba_dev *dev, struct bio *sba_bio);
+	void (*release)(sba_dev *dev);					//no io is in flight any more
+} sba_backend_ops;
+
+sba_backend_ops *sba_backend_get(int type);
+int sba_backend_map(sba_dev *dev, struct bio *sba_bio);
+void sba_backend_submit(sba_dev *dev, struct bio *sba_bio);
+int sba_backend_snapshot(sba_dev *dev);
+int sba_backend_rollback(sba_dev *dev, int drop);
+
+#endif
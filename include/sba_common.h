@@ -18,9 +18,22 @@
 #include <linux/stat.h>
 #include <linux/timer.h>
 #include <linux/fcntl.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
 #include <asm/uaccess.h>
+#include <asm/div64.h>
+#include <asm/timex.h>
+
+/*an sba instance (see below). the fs headers need the name*/
+typedef struct _sba_dev sba_dev;
+
 #include "sba_common_defs.h"
 #include "sba_common_model.h"
+#include "sba_trace.h"
+#include "sba_throttle.h"
+#include "sba_backend.h"
+#include "sba_fault.h"
 
 #ifdef INC_EXT3
 #include "sba_ext3.h"
@@ -34,25 +47,141 @@
 #include "sba_jfs.h"
 #endif
 
+/*a metadata block read by read_block_cached*/
+typedef struct _sba_cached_block {
+	int blocknr;					//-1 while the entry is empty
+	unsigned long last_used;
+	char *data;
+} sba_cached_block;
+
+/*
+ * The metadata blocks the driver read last, the least recently used
+ * one is replaced first. A write of a block forgets it (see
+ * sba_common_bcache_write).
+ */
+typedef struct _sba_block_cache {
+	sba_cached_block *blocks;
+	int nr_blocks;					//0 without a cache
+	atomic_t users;					//entries cached plus misses in flight
+	unsigned long clock;
+	atomic_t gen;					//bumped by the writes while users
+	spinlock_t lock;
+} sba_block_cache;
+
+/*
+ * This structure holds the state of an sba instance (/dev/SBAN):
+ * its backing device and everything about its fault campaign.
+ * The instances share only the pools and the clock.
+ */
+struct _sba_dev {
+	int id;
+	sba_backend_ops *backend;		//NULL while detached
+	void *backend_data;
+	void *cow_data;					//overlay since SNAPSHOT, NULL without one
+	struct _sba_wlog *wlog;			//the write log, NULL when writes are not logged
+	struct block_device *f_dev;		//of the block backend
+	struct block_device *j_dev;
+	unsigned long size;				//KB, from the backend
+	spinlock_t lock;				//guards wlog
+	struct gendisk *gd;
+	struct request_queue *queue;
+	int usage;
+	int media_change;				//set by attach/detach, seen on the next open
+
+	/*to avoid the mke2fs traffic*/
+	int start_sba;
+
+	/*to only check selected traffic*/
+	int test_system;
+
+	/*to crash the file system*/
+	int squash_writes;
+
+	/*to emulate system crash*/
+	int crash_system;
+
+	/*to crash a system after commit and before checkpointing to initiate recovery*/
+	int crash_after_commit;
+
+	/*the faults to inject (see sba_fault.c). legacy_fault is the one
+	 *of INJECT_FAULT, -1 if there is none. fault_injected is set once
+	 *a fault fired*/
+	sba_fault_table faults;
+	int legacy_fault;
+	int fault_injected;
+
+	/*the journaling model, which has the current state of the system*/
+	journaling_model *model;
+
+	/*holds the statistics*/
+	sba_stat ss;
+
+	/*the throttle of each class, and how many classes have a limit -
+	 *zero keeps the fast path*/
+	sba_throttle throttle[SBA_THR_CLASSES];
+	int throttling;
+
+	/*the trace and its extraction cursor (see sba_common_extract_stats)*/
+	sba_trace_buf trace;
+	char *extract_page;
+	int extract_len;
+
+	/*the metadata blocks it read last*/
+	sba_block_cache bcache;
+
+	/*the tables of the file system on the instance*/
+	#ifdef INC_EXT3
+	struct _sba_ext3_state *ext3;
+	#endif
+
+	#ifdef INC_REISERFS
+	struct _sba_reiserfs_state *reiserfs;
+	#endif
+
+	#ifdef INC_JFS
+	struct _sba_jfs_state *jfs;
+	#endif
+};
+
 /*
- * This structure stores the trace information
+ * This structure stores the trace information of a block
+ * until its io completes and it goes to the trace buffer
  */
 typedef struct _stat_info{
-	char btype[6];
 	long blocknr;
-	long ref_blocknr;
-	struct timeval stv;
-	struct timeval etv;
+	int btype;
 	int rw;
-	struct _stat_info *prev;
-	struct _stat_info *next;
+	unsigned long long stime;	//ns since the driver was loaded
+	unsigned long long etime;
 } stat_info;
 
+/*number of record pointers embedded in every sba_request. a bio
+ *carrying a single block (the common case) needs no pointer array*/
+#define SBA_INLINE_RECORDS		1
+
+/*largest number of blocks (segments) whose type we track in a
+ *single bio. a bio never carries more than BIO_MAX_PAGES pages*/
+#define SBA_MAX_BIO_BLOCKS		BIO_MAX_PAGES
+
+/*how long to count cycles when calibrating the trace clock*/
+#define SBA_CLOCK_CALIBRATE_MSECS	20
+
+/*longest line of a text trace*/
+#define SBA_MAX_LINE			128
+
+/*minimum number of preallocated elements in the mempools*/
+#define SBA_MIN_REQUESTS		64
+#define SBA_MIN_STAT_INFOS		256
+#define SBA_MIN_READ_PAGES		64
+
 /*
  * This structure is stored as private in buffer heads
  * and passed to sba_end_io.
  */
 typedef struct _sba_request {
+	/*the instance the bio was sent to*/
+	sba_dev *dev;
+
 	/*the original bio from the fs*/
 	struct bio *sba_bio;
 
@@ -65,69 +194,134 @@ typedef struct _sba_request {
 
 	/*number of records*/
 	int count; 
+
+	/*set once the records are filled in and should be traced*/
+	int collected;
+
+	/*record points here when count <= SBA_INLINE_RECORDS,
+	 *and its entries point to inline_stat*/
+	stat_info *inline_record[SBA_INLINE_RECORDS];
+	stat_info inline_stat[SBA_INLINE_RECORDS];
+
+	/*block type of each segment of sba_bio, indexed by segment*/
+	int nr_btypes;
+	unsigned short btype[SBA_MAX_BIO_BLOCKS];
+
+	/*segments failed by the fault injector, indexed by segment*/
+	int nr_failed;
+	unsigned char failed[SBA_MAX_BIO_BLOCKS];
+
+	/*private copies of the segments corrupted on a write, chained
+	 *on page->private, page->index is the segment*/
+	struct page *corrupt_pages;
+
+	/*clones of a split write still in flight (see sba_split_write)*/
+	atomic_t pending;
+
+	/*a completed read waiting to be classified (see sba_queue_read)*/
+	struct list_head list;
+	int uptodate;
+
+	/*SBA_DELAY: how long to hold the request (see sba_delay_request)*/
+	int delay_msecs;
+	unsigned long delay_expires;
+	struct bio *delay_bio;
+
+	/*throttle classes that are holding the request (1 << SBA_THR_*)*/
+	int throttle_mask;
 } sba_request;
 
 
 typedef void (*bh_endio_t)(struct bio *sba_bio, int uptodate);
 
 long long sba_common_diff_time(struct timeval st, struct timeval et);
-int sba_common_journal_block(struct bio *sba_bio, sector_t sector);
-int sba_common_build_writeback_journaling_model(void);
-int sba_common_build_ordered_journaling_model(void);
-int sba_common_build_data_journaling_model(void);
-int sba_common_build_model(void);
-int sba_common_destroy_model(void);
-int sba_common_print_model(void);
+int sba_common_init_clock(void);
+unsigned long long sba_common_get_time_ns(void);
+int sba_common_journal_block(sba_dev *dev, struct bio *sba_bio, sector_t sector);
+int sba_common_build_writeback_journaling_model(sba_dev *dev);
+int sba_common_build_ordered_journaling_model(sba_dev *dev);
+int sba_common_build_data_journaling_model(sba_dev *dev);
+int sba_common_build_model(sba_dev *dev);
+int sba_common_destroy_model(sba_dev *dev);
+int sba_common_print_model(sba_dev *dev);
+int sba_common_create_pools(void);
+int sba_common_destroy_pools(void);
+sba_request *sba_common_alloc_request(int gfp_mask);
+int sba_common_free_request(sba_request *sba_req);
+stat_info *sba_common_alloc_stat_info(int gfp_mask);
+int sba_common_free_stat_info(stat_info *si);
 int sba_common_init(void);
 int sba_common_cleanup(void);
+int sba_common_init_dev(sba_dev *dev);
+int sba_common_cleanup_dev(sba_dev *dev);
+int sba_common_init_fs(sba_dev *dev);
+int sba_common_cleanup_fs(sba_dev *dev);
 int sba_common_zero_stat(sba_stat *ss);
-int sba_common_print_stat(sba_stat *ss);
-int sba_common_print_journal(void);
-int sba_common_handle_mkfs_write(int sector);
-struct bio *sba_common_alloc_and_init_bio(struct block_device *dev, int block, bio_end_io_t end_io_func, int rw);
-struct bio *alloc_bio_for_read(struct block_device *dev, int block, bio_end_io_t end_io_func);
-char *read_block(int block);
-int sba_common_init_indir_blocks(unsigned long inodenr);
-int sba_common_init_dir_blocks(unsigned long inodenr);
-int sba_common_process_fault(void);
-int reinit_fault(fault *f);
-int add_fault(fault *f);
+int sba_common_print_stat(sba_dev *dev);
+int sba_common_print_journal(sba_dev *dev);
+int sba_common_handle_mkfs_write(sba_dev *dev, int sector);
+struct bio *sba_common_alloc_and_init_bio(struct block_device *dev, int block, bio_end_io_t end_io_func, int rw, struct page *sba_page);
+struct bio *alloc_bio_for_read(struct block_device *dev, int block, bio_end_io_t end_io_func, struct page *sba_page);
+int sba_common_end_io(struct bio *sba_bio, unsigned int bytes, int error);
+char *read_block(sba_dev *dev, int block);
+int read_blocks(sba_dev *dev, int *blocks, int n, char **out);
+char *read_block_cached(sba_dev *dev, int block);
+void put_block(char *data);
+void sba_common_bcache_write(sba_dev *dev, struct bio *sba_bio);
+void sba_common_bcache_flush(sba_dev *dev);
+int sba_common_bcache_init(sba_dev *dev);
+int sba_common_bcache_cleanup(sba_dev *dev);
+int sba_common_init_indir_blocks(sba_dev *dev, unsigned long inodenr);
+int sba_common_init_dir_blocks(sba_dev *dev, unsigned long inodenr);
+int sba_common_process_fault(sba_dev *dev, fault *f);
+int sba_common_process_legacy_fault(sba_dev *dev);
+int sba_common_fault_blocknr(sba_dev *dev, fault *f);
+int reinit_fault(sba_dev *dev, fault *f);
+int add_fault(sba_dev *dev, fault *f);
 //int sba_common_add_fault_correction(int blocknr, int offset, int size, void *original);
-int remove_fault(int force);
-char *sba_common_get_block_type_str(hash_table *h_btype, int sector);
-int sba_common_print_fault(void);
-int sba_common_fault_match(char *data, sector_t sector, struct bio *sba_bio, hash_table *h_this);
-int sba_common_commit_block(hash_table *h_this, int sector);
+int remove_fault(sba_dev *dev, int force);
+char *sba_common_get_block_type_str(sba_request *sba_req, int seg);
+int sba_common_print_fault(fault *sba_fault);
+u32 sba_common_xorshift(u32 x);
+u32 sba_common_random(void);
+int sba_common_delay_msecs(fault *f);
+int sba_common_corrupt_block(sba_dev *dev, fault *f, char *data, int len, sector_t sector);
+int sba_common_corrupt_segment(struct bio *sba_bio, sba_request *sba_req, int seg, fault *f);
+int sba_common_use_corrupt_pages(sba_request *sba_req, struct bio *sba_bio_clone);
+int sba_common_free_corrupt_pages(sba_request *sba_req);
+int sba_common_fault_match(fault *sba_fault, char *data, sector_t sector, struct bio *sba_bio, sba_request *sba_req, int seg);
+int sba_common_commit_block(sba_request *sba_req, int seg);
 int sba_common_inject_fault(struct bio *sba_bio, sba_request *sba_req, int *uptodate);
-int sba_common_execute_fault(struct bio *sba_bio, int *uptodate, hash_table *h_this);
+int sba_common_execute_fault(struct bio *sba_bio, int *uptodate, sba_request *sba_req);
 int sba_common_print_block(struct bio *sba_bio);
 char *sba_common_get_btype_str(int btype);
-int sba_common_move_to_start(void);
-sba_state *sba_common_get_current_state(void);
-int sba_common_get_block_type(hash_table *h_this, sector_t sector);
-int sba_common_destroy_block_types_table(hash_table *h_this);
-hash_table *sba_common_build_block_types_table(struct bio *sba_bio);
-int sba_common_find_last_block_type(struct bio *sba_bio, hash_table *h_this);
+int sba_common_move_to_start(sba_dev *dev);
+sba_state *sba_common_get_current_state(sba_dev *dev);
+int sba_common_get_block_type(sba_request *sba_req, int seg);
+int sba_common_build_block_types(struct bio *sba_bio, sba_request *sba_req);
+int sba_common_find_last_block_type(struct bio *sba_bio, sba_request *sba_req);
 int sba_common_edge_match(sba_state_input e1, sba_state_input e2);
-int sba_common_move(int btype, int response);
+int sba_common_move(sba_dev *dev, int btype, int response);
 int sba_common_is_valid_move(sba_state *s, int btype);
-int sba_common_model_checker(struct bio *sba_bio, hash_table *h_this);
+int sba_common_model_checker(struct bio *sba_bio, sba_request *sba_req);
 int sba_common_print_all_blocks(struct bio *sba_bio);
-int sba_common_report_error(struct bio *sba_bio, hash_table *h_this);
-int sba_common_print_journaled_blocks(void);
-int sba_common_add_desc_stats(int blocknr);
-int sba_common_add_workload_end(void);
-int sba_common_add_workload_start(void);
-int sba_common_add_crash_stats(void);
-int sba_common_add_fault_injection_stats(hash_table *h_this, int sector);
-int sba_common_add_stats(stat_info *si, stat_info **list);
+int sba_common_report_error(struct bio *sba_bio, sba_request *sba_req);
+int sba_common_print_journaled_blocks(sba_dev *dev);
+int sba_common_add_desc_stats(sba_dev *dev, int blocknr);
+int sba_common_add_workload_end(sba_dev *dev);
+int sba_common_add_workload_start(sba_dev *dev);
+int sba_common_add_start_stats(sba_dev *dev, unsigned long long stime);
+int sba_common_add_crash_stats(sba_dev *dev);
+int sba_common_add_fault_injection_stats(sba_request *sba_req, int seg, int sector, fault *f);
+int sba_common_add_event_stats(sba_dev *dev, int event, int blocknr, int btype);
+int sba_common_add_stats(sba_dev *dev, stat_info *si);
 int sba_common_get_start_timestamp(sba_request *sba_req);
 int sba_common_get_end_timestamp(sba_request *sba_req);
-int sba_common_collect_stats(sba_request *sba_req, hash_table *h_this);
-int sba_common_clean_stats(void);
-int sba_common_clean_all_stats(void);
-int my_div(int a, int b);
-int my_mod(int a, int b);
-int sba_common_extract_stats(char *ubuf, struct timeval start_time);
+int sba_common_collect_stats(sba_request *sba_req);
+int sba_common_clean_stats(sba_dev *dev);
+int sba_common_clean_all_stats(sba_dev *dev);
+int sba_common_format_stats(sba_trace_rec *rec, char *print_stmt);
+int sba_common_flush_extract_page(sba_dev *dev, char *ubuf, int *pos);
+int sba_common_extract_stats(sba_dev *dev, char *ubuf);
 
 #endif
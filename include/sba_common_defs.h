@@ -12,7 +12,8 @@
 #define JOUR_MINOR		1
 
 #define SBA_MAJOR		0
-#define SBA_DEVS		1	/*these are # devices exported by SBA*/
+#define SBA_DEVS		1	/*these are # devices exported by SBA (default)*/
+#define SBA_MAX_DEVS	16	/*upper bound on the sba_devs module param*/
 #define SBA_PHY_DEVS	1	/*these are the # underlying phy devices*/
 
 #define SBA_BLKSIZE			4096	/* block size */
@@ -23,14 +24,6 @@
 #define SBA_SECTOR_TO_BLOCK(a)	((a) >> (SBA_BLKSIZE_BITS - SBA_HARDSECT_BITS))
 #define SBA_BLOCK_TO_SECTOR(a)	((a) << (SBA_BLKSIZE_BITS - SBA_HARDSECT_BITS))
 
-//#define SBA_SIZE			248976  /* no of blocks in each of sba device (KB) */
-//#define SBA_SIZE			498012	/* no of blocks in each of sba device (KB) */
-//#define SBA_SIZE			987996  /* no of blocks in each of sba device (KB) */
-#define SBA_SIZE			4008216	/* no of blocks in each of sba device (KB) */
-
-//#define SBA_JOURNAL_SIZE	1004028	/* no of blocks in each of sba device (KB) */
-#define SBA_JOURNAL_SIZE	4008216	/* no of blocks in each of sba device (KB) */
-
 /* Define debugging macros */
 #define SBA_DEBUG
 #ifdef SBA_DEBUG
@@ -69,6 +62,25 @@
 #define SBA_DESC			9879
 #define SBA_WKLOAD_START	9880
 #define SBA_WKLOAD_END		9881
+#define SBA_DELAY			9882
+#define SBA_START			9883	//START_SBA, from its start to its end
+
+/*distributions of the SBA_DELAY latency*/
+#define SBA_DELAY_FIXED		0	//delay_msecs
+#define SBA_DELAY_UNIFORM	1	//between delay_msecs and delay_max_msecs
+#define SBA_DELAY_EXP		2	//mean delay_msecs, capped at delay_max_msecs if set
+
+/*what an SBA_CORRUPT fault does to the block*/
+#define SBA_CORRUPT_BITFLIP	0	//flips corrupt_count random bits, drawn from corrupt_seed
+#define SBA_CORRUPT_ZERO	1	//zeroes corrupt_len bytes at corrupt_offset
+#define SBA_CORRUPT_PATTERN	2	//writes WR_PATTERN over corrupt_len bytes at corrupt_offset
+#define SBA_CORRUPT_FIELD	3	//sets the field corrupt_field number corrupt_index to corrupt_value
+
+/*when a fault fires on the blocks that match it*/
+#define SBA_TRIGGER_FIRST	0	//on the first match
+#define SBA_TRIGGER_PROB	1	//on a match with a chance of trigger_ppm in a million
+#define SBA_TRIGGER_NTH		2	//on match number trigger_n only
+#define SBA_TRIGGER_EVERY	3	//on every trigger_n-th match
 
 /*io types*/
 #define SBA_READ		0
@@ -102,11 +114,44 @@ typedef struct _fault {
 	int blocknr;		//optional
 
 	fs_spec_fault spec;	//file system specific fault specification
+
+	int delay_dist;			//SBA_DELAY: one of SBA_DELAY_*
+	int delay_msecs;
+	int delay_max_msecs;
+
+	int corrupt_mode;		//SBA_CORRUPT: one of SBA_CORRUPT_*
+	unsigned int corrupt_seed;
+	int corrupt_count;
+	int corrupt_offset;
+	int corrupt_len;
+	int corrupt_field;		//EXT3_INODE_I_BLOCK etc.
+	int corrupt_index;		//i_block slot, bitmap word or group
+	unsigned int corrupt_value;
+
+	int trigger;			//one of SBA_TRIGGER_*
+	unsigned int trigger_ppm;
+	unsigned int trigger_n;
+	unsigned int window_start_msecs;	//only blocks this long after WORKLOAD_START match,
+	unsigned int window_end_msecs;		//up to this long after it. 0 is no window
 } fault;
 
+/*argument of GET_FAULT: the id of the fault, filled in with the rest*/
+typedef struct _sba_fault_info {
+	int id;
+	int armed;			//0 once a TRANSIENT fault fired
+	unsigned int matches;	//blocks it matched
+	unsigned int hits;		//times it fired
+	fault f;
+} sba_fault_info;
+
 typedef struct _sba_stat {
 	int total_reads;
 	int total_writes;
+
+	/*allocator overhead of the trace path*/
+	int traced_bios;		//bios that went through allocate_trace
+	int trace_allocs;		//allocator calls made for them
+	int kmalloc_allocs;		//calls the old per-block kmalloc scheme needed
 } sba_stat;
 
 /* different ioctls */
@@ -140,6 +185,64 @@ typedef struct _sba_stat {
 #define DONT_CRASH_COMMIT		6027
 #define WORKLOAD_START			6028
 #define WORKLOAD_END			6029
+#define TRACE_DROPPED			6030
+#define TRACE_POLICY			6031
+#define SET_THROTTLE			6032
+#define THROTTLE_STATS			6033
+#define ATTACH_DEV				6034
+#define DETACH_DEV				6035
+#define SNAPSHOT				6036
+#define ROLLBACK				6037
+#define DROP_SNAPSHOT			6038
+#define WLOG_START				6039
+#define WLOG_STOP				6040
+#define ADD_FAULT				6041
+#define DEL_FAULT				6042
+#define GET_FAULT				6043
+#define FAULT_SEED				6044
+
+/*classes of blocks that the throttle limits separately*/
+#define SBA_THR_JDATA			0	//journal blocks other than commits
+#define SBA_THR_COMMIT			1
+#define SBA_THR_CHECKPOINT		2	//in place metadata other than inodes and bitmaps
+#define SBA_THR_ORDERED			3
+#define SBA_THR_UNORDERED		4
+#define SBA_THR_INODE			5
+#define SBA_THR_BITMAP			6
+#define SBA_THR_CLASSES			7
+
+/*argument of SET_THROTTLE. a zero rate is no limit*/
+typedef struct _sba_throttle_limit {
+	int tclass;					//SBA_THR_*
+	unsigned int bps;			//bytes per second
+	unsigned int iops;			//ios per second
+	unsigned int burst_msecs;	//how much unused rate can be saved up
+} sba_throttle_limit;
+
+/*THROTTLE_STATS copies out one of these per class*/
+typedef struct _sba_throttle_stat {
+	unsigned int ios;			//ios of the class
+	unsigned int throttled;		//ios that were held
+	unsigned int depth;			//ios held right now
+	unsigned int max_depth;
+	unsigned long long throttled_ns;	//total time the ios were held
+} sba_throttle_stat;
+
+/*the backends an instance can store its blocks in*/
+#define SBA_BACKEND_BLOCK		0	//a block device (and a journal device, with jour_dev)
+#define SBA_BACKEND_RAM			1	//pages in memory, lost on detach
+#define SBA_BACKEND_FILE		2	//a regular file, through the page cache
+
+/*argument of ATTACH_DEV*/
+typedef struct _sba_backing {
+	int type;					//SBA_BACKEND_*
+	unsigned int f_major;		//block
+	unsigned int f_minor;
+	unsigned int j_major;
+	unsigned int j_minor;
+	unsigned int size_mb;		//ram
+	char path[128];				//file
+} sba_backing;
 
 /* Types of Blocks */
 #define SBA_EXT3_UNKNOWN		0x1000
@@ -180,7 +283,7 @@ typedef struct _sba_stat {
 #define TOTAL_FIELDS		5 
 
 /*ext3 inode*/
-#define EXT3_INODE_I_BLOCK			0
+#define EXT3_INODE_I_BLOCK			0	//of the inode of the fault, else the first of the block
 #define EXT3_INODE_BITMAP			1
 #define EXT3_DATA_BITMAP			2
 #define EXT3_GRPDESC_BLOCK_BITMAP	3
@@ -7,37 +7,134 @@
 #include "sba_ext3_defs.h"
 #include "ht_at_wrappers.h"
 
+/*
+ * The type of every block outside the journal, as an offset from
+ * SBA_EXT3_UNKNOWN (0 is a data block). START_SBA builds a new map
+ * and swaps it in, the INIT_*_BLKS ioctls set blocks of the current
+ * one under map_lock. The io path reads it under rcu_read_lock, the
+ * old map is freed once no reader can see it.
+ */
+typedef struct _sba_ext3_map {
+	unsigned long nr_blocks;
+	unsigned char *dense;			//SBA_EXT3_MAP_DENSE
+
+	/*SBA_EXT3_MAP_SPARSE: the bytes of a chunk, or NULL while all
+	 *the blocks of the chunk are of type uniform[chunk]*/
+	unsigned char **leaf;
+	unsigned char *uniform;
+	unsigned long nr_chunks;
+	int nr_leaves;
+
+	int broken;						//a block could not be set, the probes decide
+} sba_ext3_map;
+
+/*a run of len contiguous journal blocks*/
+typedef struct _sba_ext3_extent {
+	u32 start;
+	u32 len;
+} sba_ext3_extent;
+
+/*
+ * The blocks of the journal, as extents sorted by start that neither
+ * overlap nor touch. The journal is mostly one extent, or a few.
+ */
+typedef struct _sba_ext3_journal {
+	sba_ext3_extent *ext;
+	int nr_ext;
+	int max_ext;
+	unsigned long nr_blocks;
+	spinlock_t lock;
+} sba_ext3_journal;
+
+/*the layout of a group, from its descriptor*/
+typedef struct _sba_ext3_group {
+	u32 block_bitmap;
+	u32 inode_bitmap;
+	u32 inode_table;
+} sba_ext3_group;
+
+/*the layout of the fs, read by sba_ext3_start. a new START_SBA swaps
+ *in a new one, the io path reads it under rcu_read_lock*/
+typedef struct _sba_ext3_layout {
+	int nr_groups;
+
+	/*a copy of the group descriptor table follows each copy of the
+	 *super block. with sparse_super only groups 0, 1 and the powers
+	 *of 3, 5 and 7 have one*/
+	int first_data_block;
+	int blocks_per_group;
+	int gdt_blocks;
+	int sparse_super;
+
+	sba_ext3_group *group;			//allocated right after the struct
+} sba_ext3_layout;
+
+/* The ext3 tables of an sba instance */
+typedef struct _sba_ext3_state {
+	sba_ext3_layout *layout;		//NULL until sba_ext3_start read it
+
+	/*the journal blocks - journal is not contiguous!*/
+	sba_ext3_journal journal;
+
+	/*a hash table to keep track of the journaled blocks*/
+	hash_table *journaled_blocks;
+
+	/*hash table to keep the dir blocks*/
+	hash_table *dir_blocks;
+
+	/*hash table to keep the indir blocks*/
+	hash_table *indir_blocks;
+
+	/*hash table to keep the journal indir blocks*/
+	hash_table *journal_indir_blocks;
+
+	/*hash table to keep the journal to real block mapping.
+	 *this table will be constructed during journal desc
+	 *block read during recovery.*/
+	hash_table *journal_2_real;
+
+	/*inode blocks per group*/
+	int inode_blks_per_group;
+
+	/*the block types, built at START_SBA. NULL without a map*/
+	sba_ext3_map *map;
+	spinlock_t map_lock;
+} sba_ext3_state;
+
 /* Function declarations */
-int sba_ext3_init(void);
-int sba_ext3_cleanup(void);
-int sba_ext3_clean_stats(void);
+int sba_ext3_init(sba_dev *dev);
+int sba_ext3_cleanup(sba_dev *dev);
+int sba_ext3_clean_stats(sba_dev *dev);
 char *sba_ext3_get_block_type_str(int btype);
-int sba_ext3_inode_block(long sector);
-int sba_ext3_inodenr_2_blocknr(int inodenr, int *blocknr, int *ioffset);
-int sba_ext3_group_2_inode_bitmap(int group);
-int sba_ext3_get_inode_bitmap_blk(long sector);
-int sba_ext3_get_inode_bitmap_offset(long sector);
-int sba_ext3_group_2_data_bitmap(int group);
-int sba_ext3_get_data_bitmap_blk(long sector);
-int sba_ext3_data_bitmap_block(long sector);
-int sba_ext3_inode_bitmap_block(long sector);
-int sba_ext3_bitmap_block(long sector);
+int sba_ext3_inode_block(sba_dev *dev, long sector);
+int sba_ext3_inodenr_2_blocknr(sba_dev *dev, int inodenr, int *blocknr, int *ioffset);
+int sba_ext3_group_2_inode_bitmap(sba_dev *dev, int group);
+int sba_ext3_get_inode_bitmap_blk(sba_dev *dev, long sector);
+int sba_ext3_get_inode_bitmap_offset(sba_dev *dev, long sector);
+int sba_ext3_group_2_data_bitmap(sba_dev *dev, int group);
+int sba_ext3_get_data_bitmap_blk(sba_dev *dev, long sector);
+int sba_ext3_data_bitmap_block(sba_dev *dev, long sector);
+int sba_ext3_inode_bitmap_block(sba_dev *dev, long sector);
+int sba_ext3_bitmap_block(sba_dev *dev, long sector);
 int sba_ext3_super_block(long sector, int size);
-int sba_ext3_group_desc_block(long sector);
+int sba_ext3_group_desc_block(sba_dev *dev, long sector);
+int sba_ext3_map_build(sba_dev *dev);
 int sba_ext3_journal_request(struct bio *sba_bio);
-int sba_ext3_journal_block(struct bio *sba_bio, sector_t sector);
-int sba_ext3_mkfs_write(struct bio *sba_bio);
-int sba_ext3_start(void);
-int sba_ext3_print_journal(void);
-int sba_ext3_find_journal_entries(void);
-int sba_ext3_indir_block(int sector);
-int sba_ext3_dir_block(int sector);
+int sba_ext3_journal_block(sba_dev *dev, struct bio *sba_bio, sector_t sector);
+int sba_ext3_mkfs_write(sba_dev *dev, struct bio *sba_bio);
+int sba_ext3_start(sba_dev *dev);
+int sba_ext3_print_journal(sba_dev *dev);
+int sba_ext3_find_journal_entries(sba_dev *dev);
+int sba_ext3_indir_block(sba_dev *dev, int sector);
+int sba_ext3_dir_block(sba_dev *dev, int sector);
 int sba_ext3_unjournaled_block_type(int blocknr);
-int sba_ext3_non_journal_block_type(long sector, char *type, int size);
-int sba_ext3_block_type(char *data, sector_t sector, char *type, struct bio *sba_bio);
-int sba_ext3_init_indir_blocks(unsigned long inodenr);
-int sba_ext3_init_dir_blocks(unsigned long inodenr);
-int sba_ext3_fault_match(char *data, sector_t sector, fault *sba_fault);
-int sba_ext3_process_fault(fault *sba_fault);
+int sba_ext3_non_journal_block_type(sba_dev *dev, long sector, char *type, int size);
+int sba_ext3_block_type(sba_dev *dev, char *data, sector_t sector, char *type, struct bio *sba_bio);
+int sba_ext3_init_indir_blocks(sba_dev *dev, unsigned long inodenr);
+int sba_ext3_init_dir_blocks(sba_dev *dev, unsigned long inodenr);
+int sba_ext3_fault_match(sba_dev *dev, char *data, sector_t sector, fault *sba_fault);
+int sba_ext3_process_fault(sba_dev *dev, fault *sba_fault);
+int sba_ext3_fault_blocknr(sba_dev *dev, fault *sba_fault);
+int sba_ext3_field_location(sba_dev *dev, fault *sba_fault, sector_t sector, int *offset, int *size);
 
 #endif /* __INCLUDE_SBA_EXT3_H__ */
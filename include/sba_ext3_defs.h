@@ -24,6 +24,15 @@
 #define SBA_GET_BITMAP_BLK(g) 	((g%2)?((g*SBA_BLKS_PER_GP)+SBA_BITMAP_OFF):(g*SBA_BLKS_PER_GP))
 #define SBA_BLOCK_TO_SECTOR_v2(b,s)	(((b)*(s))/SBA_HARDSECT)
 
+/*kinds of block type map (see sba_ext3_map_build)*/
+#define SBA_EXT3_MAP_NONE		0	//classify with the probes
+#define SBA_EXT3_MAP_DENSE		1	//a byte per block
+#define SBA_EXT3_MAP_SPARSE		2	//a byte per block only in the chunks of mixed types
+#define SBA_EXT3_MAP_AUTO		3	//dense up to ext3_dense_map_mb, else sparse
+
+#define SBA_EXT3_MAP_CHUNK_BITS	9
+#define SBA_EXT3_MAP_CHUNK		(1 << SBA_EXT3_MAP_CHUNK_BITS)
+
 //vp - FIXME
 #define JOURNAL_INODE_BLK	4
 #define JOURNAL_INODE_NO	7
@@ -0,0 +1,52 @@
+#ifndef __INCLUDE_SBA_FAULT_H__
+#define __INCLUDE_SBA_FAULT_H__
+
+#include "sba_common_defs.h"
+#include "ht_at_wrappers.h"
+
+struct _sba_request;
+
+/*a fault of the table, or a free slot*/
+typedef struct _sba_fault_slot {
+	fault f;
+	int used;
+	int armed;				//in the index, it can still fire
+	unsigned int matches;	//blocks it matched, in its window
+	unsigned int hits;		//times it fired
+	int exact;				//indexed by block, else by block type
+	int key;				//of its chain in the index, the block or block type
+	int next;				//next slot of the chain or of the free list, -1 at the end
+} sba_fault_slot;
+
+/*
+ * The faults of an instance. An armed fault is on a chain of the
+ * index of its rw: by block when it only matches a single block, by
+ * block type otherwise. The indexes map the block or block type to
+ * the first slot of its chain.
+ */
+typedef struct _sba_fault_table {
+	sba_fault_slot *slots;
+	int nr_slots;
+	int free;				//first free slot
+	int nr_faults;
+	int nr_armed;
+	spinlock_t lock;
+	hash_table *by_blk[SBA_READ_WRITE + 1];		//indexed by rw
+	hash_table *by_type[SBA_READ_WRITE + 1];
+	u32 rand;				//state of the SBA_TRIGGER_PROB draws
+	unsigned long long workload_start;	//ns, 0 before WORKLOAD_START
+} sba_fault_table;
+
+int sba_fault_init(sba_dev *dev);
+int sba_fault_cleanup(sba_dev *dev);
+int sba_fault_add(sba_dev *dev, fault *f);
+int sba_fault_update(sba_dev *dev, int id, fault *f);
+int sba_fault_del(sba_dev *dev, int id);
+int sba_fault_clear(sba_dev *dev, int force);
+int sba_fault_get(sba_dev *dev, sba_fault_info *info);
+int sba_fault_lookup(sba_dev *dev, char *data, sector_t sector, struct bio *sba_bio, struct _sba_request *sba_req, int seg, fault *f);
+int sba_fault_print(sba_dev *dev);
+int sba_fault_seed(sba_dev *dev, unsigned int seed);
+int sba_fault_workload_start(sba_dev *dev);
+
+#endif
@@ -9,29 +9,43 @@
 
 #define REISER_SUPER (REISERFS_DISK_OFFSET_IN_BYTES/SBA_BLKSIZE)
 
-int sba_reiserfs_init(void);
-int sba_reiserfs_cleanup(void);
+/* The reiserfs tables of an sba instance */
+typedef struct _sba_reiserfs_state {
+	/*reiserfs journal info*/
+	int jour_start;
+	int jour_size;
+	int trans_id;		/*to keep track of commit block*/
+
+	/*We need a journal table - journal is not contiguous!*/
+	hash_table *journal;
+
+	/*We need a hash table to keep track of the journaled blocks*/
+	hash_table *journaled_blocks;
+} sba_reiserfs_state;
+
+int sba_reiserfs_init(sba_dev *dev);
+int sba_reiserfs_cleanup(sba_dev *dev);
 int sba_reiserfs_journal_request(struct bio *sba_bio);
-int sba_reiserfs_journal_block(struct bio *sba_bio, sector_t sector);
-int sba_reiserfs_mkfs_write(struct bio *sba_bio);
-int sba_reiserfs_print_journal(void);
-int sba_reiserfs_start(void);
+int sba_reiserfs_journal_block(sba_dev *dev, struct bio *sba_bio, sector_t sector);
+int sba_reiserfs_mkfs_write(sba_dev *dev, struct bio *sba_bio);
+int sba_reiserfs_print_journal(sba_dev *dev);
+int sba_reiserfs_start(sba_dev *dev);
 int sba_reiserfs_is_reiserfs_3_5(struct reiserfs_super_block * rs);
 int sba_reiserfs_is_reiserfs_3_6(struct reiserfs_super_block * rs);
 int sba_reiserfs_is_reiserfs_jr(struct reiserfs_super_block * rs);
 int sba_reiserfs_is_any_reiserfs_magic_string (struct reiserfs_super_block *rs);
-int sba_reiserfs_find_journal_entries(void);
-int sba_reiserfs_insert_journaled_blocks(int blocknr);
-int sba_reiserfs_remove_journaled_blocks(int blocknr);
-int sba_reiserfs_journaled_block(int blocknr);
-int sba_reiserfs_handle_descriptor_block(char *data);
+int sba_reiserfs_find_journal_entries(sba_dev *dev);
+int sba_reiserfs_insert_journaled_blocks(sba_dev *dev, int blocknr);
+int sba_reiserfs_remove_journaled_blocks(sba_dev *dev, int blocknr);
+int sba_reiserfs_journaled_block(sba_dev *dev, int blocknr);
+int sba_reiserfs_handle_descriptor_block(sba_dev *dev, char *data);
 int sba_reiserfs_unjournaled_block_type(int blocknr);
-int sba_reiserfs_non_journal_block_type(char *data, long sector, char *type, int size);
-int sba_reiserfs_journal_commit_block(char *data);
+int sba_reiserfs_non_journal_block_type(sba_dev *dev, char *data, long sector, char *type, int size);
+int sba_reiserfs_journal_commit_block(sba_dev *dev, char *data);
 char *sba_reiserfs_get_journal_desc_magic(char *data);
-int sba_reiserfs_journal_desc_block(char *data);
+int sba_reiserfs_journal_desc_block(sba_dev *dev, char *data);
 int sba_reiserfs_journal_super_block(char *data);
-int sba_reiserfs_block_type(char *data, sector_t sector, char *type, struct bio *sba_bio);
-int sba_reiserfs_fault_match(char *data, sector_t sector, fault *sba_fault);
+int sba_reiserfs_block_type(sba_dev *dev, char *data, sector_t sector, char *type, struct bio *sba_bio);
+int sba_reiserfs_fault_match(sba_dev *dev, char *data, sector_t sector, fault *sba_fault);
 
 #endif
@@ -0,0 +1,26 @@
+#ifndef __INCLUDE_SBA_THROTTLE_H__
+#define __INCLUDE_SBA_THROTTLE_H__
+
+#include "sba_common_defs.h"
+
+struct _sba_request;
+
+/*the buckets and counters of a class of blocks of an instance*/
+typedef struct _sba_throttle {
+	spinlock_t lock;
+	sba_throttle_limit limit;
+	unsigned long long byte_tat;
+	unsigned long long io_tat;
+	sba_throttle_stat stat;
+	atomic_t depth;
+} sba_throttle;
+
+int sba_throttle_init(sba_dev *dev);
+int sba_throttle_class(int btype);
+int sba_throttle_set(sba_dev *dev, sba_throttle_limit *l);
+int sba_throttle_request(struct bio *sba_bio, struct _sba_request *sba_req);
+int sba_throttle_release(struct _sba_request *sba_req);
+int sba_throttle_get_stats(sba_dev *dev, sba_throttle_stat *st);
+int sba_throttle_zero_stats(sba_dev *dev);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __INCLUDE_SBA_TRACE_H__
+#define __INCLUDE_SBA_TRACE_H__
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/miscdevice.h>
+#include <asm/semaphore.h>
+#include <asm/system.h>
+#include "sba_common_defs.h"
+#include "sba_trace_defs.h"
+
+/*the trace buffer of an sba instance*/
+typedef struct _sba_trace_buf {
+	/*the header pages followed by the rings*/
+	char *buf;
+	unsigned long buf_size;
+	sba_trace_hdr *hdr;
+
+	/*private copy of the geometry of the buffer*/
+	unsigned int nr_rings;
+	unsigned int size;
+	int policy;
+
+	/*serializes the consumers (extraction, reset and the mmap reader)*/
+	struct semaphore sem;
+
+	/*the oldest record of every ring, as last peeked by the in kernel
+	 *consumer. it stays in the ring until it is consumed*/
+	sba_trace_rec next[SBA_TRACE_MAX_RINGS];
+	int next_valid[SBA_TRACE_MAX_RINGS];
+
+	/*the sba_traceN misc device*/
+	char name[16];
+	struct miscdevice miscdev;
+} sba_trace_buf;
+
+int sba_trace_init(sba_trace_buf *tb, int id);
+int sba_trace_cleanup(sba_trace_buf *tb);
+int sba_trace_event(int rw);
+int sba_trace_btype(int btype);
+int sba_trace_add(sba_trace_buf *tb, sba_trace_rec *rec);
+int sba_trace_set_base(sba_trace_buf *tb, unsigned int sec, unsigned int nsec);
+int sba_trace_set_policy(sba_trace_buf *tb, int policy);
+unsigned int sba_trace_dropped(sba_trace_buf *tb);
+int sba_trace_trylock_consumer(sba_trace_buf *tb);
+int sba_trace_unlock_consumer(sba_trace_buf *tb);
+int sba_trace_peek(sba_trace_buf *tb, sba_trace_rec *rec);
+int sba_trace_consume(sba_trace_buf *tb, int ring);
+int sba_trace_reset(sba_trace_buf *tb);
+
+#endif
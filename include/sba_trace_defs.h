@@ -0,0 +1,162 @@
+#ifndef __INCLUDE_SBA_TRACE_DEFS_H__
+#define __INCLUDE_SBA_TRACE_DEFS_H__
+
+/*
+ * Layout of the sba trace buffer and of the binary trace dumps.
+ * This file is shared with the user level tools, so keep it free
+ * of kernel types.
+ *
+ * The buffer starts with a header (sba_trace_hdr) followed, at
+ * data_offset, by nr_rings rings of ring_size records each. Ring i belongs to cpu i.
+ * head and tail are free running counters; the slot of position p
+ * is p & (ring_size - 1).
+ */
+
+#define SBA_TRACE_MAGIC			0x53424154	/* "SBAT" */
+#define SBA_TRACE_DUMP_MAGIC	0x53424144	/* "SBAD" */
+
+/*bump this whenever a structure or an enum below changes*/
+#define SBA_TRACE_VERSION		6
+
+/*upper bound on the number of cpu rings*/
+#define SBA_TRACE_MAX_RINGS		128
+
+/*default number of records in each ring - must be a power of 2*/
+#define SBA_TRACE_RING_SIZE		(1 << 16)
+
+/*what the producer does when its ring is full*/
+#define SBA_TRACE_DROP_NEWEST		0
+#define SBA_TRACE_OVERWRITE_OLDEST	1
+
+/*trace events*/
+#define SBA_TRACE_EV_READ			0
+#define SBA_TRACE_EV_WRITE			1
+#define SBA_TRACE_EV_FAIL			2
+#define SBA_TRACE_EV_CRASH			3
+#define SBA_TRACE_EV_DESC			4
+#define SBA_TRACE_EV_WKLOAD_START	5
+#define SBA_TRACE_EV_WKLOAD_END		6
+#define SBA_TRACE_EV_UNKNOWN		7
+#define SBA_TRACE_EV_DELAY			8
+#define SBA_TRACE_EV_CORRUPT		9
+#define SBA_TRACE_EV_START			10
+
+/*block types of the trace (the SBA_EXT3_* types, packed)*/
+#define SBA_TRACE_BT_UNKNOWN		0
+#define SBA_TRACE_BT_INODE			1
+#define SBA_TRACE_BT_DBITMAP		2
+#define SBA_TRACE_BT_IBITMAP		3
+#define SBA_TRACE_BT_SUPER			4
+#define SBA_TRACE_BT_GROUP			5
+#define SBA_TRACE_BT_DATA			6
+#define SBA_TRACE_BT_REVOKE			7
+#define SBA_TRACE_BT_DESC			8
+#define SBA_TRACE_BT_COMMIT			9
+#define SBA_TRACE_BT_JSUPER			10
+#define SBA_TRACE_BT_JDATA			11
+#define SBA_TRACE_BT_DIR			12
+#define SBA_TRACE_BT_INDIR			13
+#define SBA_TRACE_BT_SINDIR			14
+#define SBA_TRACE_BT_DINDIR			15
+#define SBA_TRACE_BT_TINDIR			16
+#define SBA_TRACE_BT_JINDIR			17
+
+/*
+ * One trace record (24 bytes). Times are in nano seconds since
+ * the driver was loaded. blocknr is -1 for events that are not
+ * about a block.
+ */
+typedef struct _sba_trace_rec {
+	int blocknr;
+	unsigned char btype;		//SBA_TRACE_BT_*
+	unsigned char event;		//SBA_TRACE_EV_*
+	unsigned short pad;
+	unsigned long long stime;
+	unsigned long long etime;
+} sba_trace_rec;
+
+typedef struct _sba_trace_ring {
+	unsigned int head;			//next position the producer fills
+	unsigned int reserve;		//position being filled + 1
+	unsigned int tail;			//next position the consumer reads
+	unsigned int dropped;		//records the producer dropped (drop newest)
+	unsigned int overwritten;	//records the consumer lost (overwrite oldest)
+	unsigned int pad[3];
+} sba_trace_ring;
+
+typedef struct _sba_trace_hdr {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int nr_rings;
+	unsigned int ring_size;
+	unsigned int rec_size;
+	unsigned int policy;
+	unsigned int data_offset;	//offset of ring 0 from the start of the buffer
+	unsigned int base_sec;		//wall clock time of trace time 0
+	unsigned int base_nsec;
+	unsigned int pad[3];
+
+	sba_trace_ring ring[SBA_TRACE_MAX_RINGS];
+} sba_trace_hdr;
+
+/*a binary dump is this header followed by the records*/
+typedef struct _sba_trace_dump_hdr {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int rec_size;
+	unsigned int pad;
+	unsigned int base_sec;		//wall clock time of trace time 0
+	unsigned int base_nsec;
+} sba_trace_dump_hdr;
+
+/*the letter of the event in the text traces*/
+static inline char sba_trace_event_char(int event)
+{
+	switch(event) {
+		case SBA_TRACE_EV_READ:			return 'R';
+		case SBA_TRACE_EV_WRITE:		return 'W';
+		case SBA_TRACE_EV_FAIL:			return 'F';
+		case SBA_TRACE_EV_CRASH:		return 'C';
+		case SBA_TRACE_EV_DESC:			return 'D';
+		case SBA_TRACE_EV_WKLOAD_START:	return 'S';
+		case SBA_TRACE_EV_WKLOAD_END:	return 'E';
+		case SBA_TRACE_EV_DELAY:		return 'L';
+		case SBA_TRACE_EV_CORRUPT:		return 'X';
+		case SBA_TRACE_EV_START:		return 'I';
+		default:						return '?';
+	}
+}
+
+/*the block type name of a record in the text traces*/
+static inline char *sba_trace_btype_name(sba_trace_rec *rec)
+{
+	switch(rec->event) {
+		case SBA_TRACE_EV_DESC:			return "DDATA";
+		case SBA_TRACE_EV_WKLOAD_START:	return "WSTRT";
+		case SBA_TRACE_EV_WKLOAD_END:	return "WEND";
+		case SBA_TRACE_EV_CRASH:		return "CRASH";
+		case SBA_TRACE_EV_START:		return "START";
+	}
+
+	switch(rec->btype) {
+		case SBA_TRACE_BT_INODE:		return "E_INO";
+		case SBA_TRACE_BT_DBITMAP:		return "E_DBM";
+		case SBA_TRACE_BT_IBITMAP:		return "E_IBM";
+		case SBA_TRACE_BT_SUPER:		return "E_SUP";
+		case SBA_TRACE_BT_GROUP:		return "E_GRP";
+		case SBA_TRACE_BT_DATA:			return "E_DAT";
+		case SBA_TRACE_BT_REVOKE:		return "E_REV";
+		case SBA_TRACE_BT_DESC:			return "E_DES";
+		case SBA_TRACE_BT_COMMIT:		return "E_COM";
+		case SBA_TRACE_BT_JSUPER:		return "E_JSB";
+		case SBA_TRACE_BT_JDATA:		return "E_JDB";
+		case SBA_TRACE_BT_DIR:			return "E_DIR";
+		case SBA_TRACE_BT_SINDIR:		return "E_SIB";
+		case SBA_TRACE_BT_DINDIR:		return "E_DIB";
+		case SBA_TRACE_BT_TINDIR:		return "E_TIB";
+		case SBA_TRACE_BT_JINDIR:		return "E_JIB";
+		default:						return "UNKON";	//also SBA_TRACE_BT_INDIR, as before
+	}
+}
+
+#endif
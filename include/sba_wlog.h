@@ -0,0 +1,11 @@
+#ifndef __INCLUDE_SBA_WLOG_H__
+#define __INCLUDE_SBA_WLOG_H__
+
+#include "sba_common.h"
+#include "sba_wlog_defs.h"
+
+int sba_wlog_start(sba_dev *dev, char *path);
+int sba_wlog_stop(sba_dev *dev);
+void sba_wlog_write(sba_dev *dev, struct bio *sba_bio, unsigned long rw, struct _sba_request *sba_req);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef __INCLUDE_SBA_WLOG_DEFS_H__
+#define __INCLUDE_SBA_WLOG_DEFS_H__
+
+/*
+ * Layout of the write log (see sba_wlog.c). This file is shared
+ * with the user level tools, so keep it free of kernel types.
+ *
+ * The log is a sba_wlog_hdr followed by records in the order the
+ * driver saw the events. A write is logged when it is sent to the
+ * storage, one SBA_WLOG_WRITE record per segment followed by the
+ * len bytes of the segment; the segments of one bio share its seq.
+ * An SBA_WLOG_DONE record is logged when the bio completes, so a
+ * write that comes after the DONE of another was issued after the
+ * other one was on the storage.
+ */
+
+#define SBA_WLOG_MAGIC			0x5342414c	/* "SBAL" */
+
+/*bump this whenever a structure or a define below changes*/
+#define SBA_WLOG_VERSION		1
+
+/*record types*/
+#define SBA_WLOG_WRITE			1
+#define SBA_WLOG_DONE			2
+
+/*flags of a record*/
+#define SBA_WLOG_BARRIER		0x1		//a barrier write
+#define SBA_WLOG_SYNC			0x2		//a sync write
+#define SBA_WLOG_ERROR			0x4		//DONE: the storage failed the write
+
+/*argument of WLOG_START*/
+#define SBA_WLOG_PATH_LEN		128
+
+typedef struct _sba_wlog_hdr {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int rec_size;
+	unsigned int pad;
+} sba_wlog_hdr;
+
+/*one record (32 bytes). times are in nano seconds since the driver was loaded*/
+typedef struct _sba_wlog_rec {
+	unsigned int type;			//SBA_WLOG_WRITE or SBA_WLOG_DONE
+	unsigned int seq;			//of the bio
+	unsigned long long sector;	//WRITE: where the data goes
+	unsigned int len;			//WRITE: bytes of data after the record
+	unsigned char btype;		//WRITE: SBA_TRACE_BT_*
+	unsigned char pad;
+	unsigned short flags;		//SBA_WLOG_*
+	unsigned long long stime;
+} sba_wlog_rec;
+
+#endif
@@ -19,14 +19,26 @@ cd $SRCDIR;
 
 major=`cat /proc/devices | awk "\\$2==\"$modname\" {print \\$1}"`
 
-# Remove stale nodes and replace them, then give gid and perms
-rm -f /dev/${device}0
-mknod /dev/${device}0 b $major 0
-ln -sf ${device}0 /dev/${device}
-chgrp $group /dev/${device}0
-chmod $mode  /dev/${device}0
+# one block device and one trace device for each instance (sba_devs=N)
+ninst=`cat /proc/misc | awk '$2 ~ /^sba_trace[0-9]+$/' | wc -l`
+i=0
+while [ $i -lt $ninst ]; do
+    # Remove stale nodes and replace them, then give gid and perms
+    rm -f /dev/${device}$i
+    mknod /dev/${device}$i b $major $i
+    chgrp $group /dev/${device}$i
+    chmod $mode  /dev/${device}$i
+
+    # the trace buffer of the instance is exported through a misc device
+    minor=`cat /proc/misc | awk "\\$2==\"sba_trace$i\" {print \\$1}"`
+    rm -f /dev/sba_trace$i
+    mknod /dev/sba_trace$i c 10 $minor
+    chgrp $group /dev/sba_trace$i
+    chmod $mode  /dev/sba_trace$i
 
-#rm -f /dev/${device}1
-#mknod /dev/${device}1 b $major 1
-#chgrp $group /dev/${device}1
-#chmod $mode  /dev/${device}1
+    i=`expr $i + 1`
+done
+
+# the tools default to the first instance
+ln -sf ${device}0 /dev/${device}
+ln -sf sba_trace0 /dev/sba_trace
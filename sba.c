@@ -2,50 +2,39 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/init.h>
+#include <linux/namei.h>
 #include "sba.h"
  
 static int sba_major;       /* 0 - let the system assign the major no */
 
-/*This holds the sba device related info*/
-extern sba_dev sba_device;
+/*the sba instances, /dev/SBA0 to /dev/SBA<sba_devs - 1>*/
+static sba_dev sba_devices[SBA_MAX_DEVS];
 
-/*This struct contains some of the statistics*/
-extern sba_stat ss;
-
-/* Our request queue */
-static struct request_queue *sba_queue;
+/*number of instances to create*/
+int sba_devs = SBA_DEVS;
+module_param(sba_devs, int, 0);
 
 /*Type of file system*/
 extern int filesystem;
 
-/* To avoid the mke2fs traffic */
-int start_sba;
-
-/* To only check selected traffic */
-int test_system = 0;
-
-/* To crash the file system */
-int squash_writes = 0;
-
 /*Is journal in a separate device ?*/
 extern int jour_dev;
 
 /* When the driver starts*/
 struct timeval start_time;
 
-/*flag to indicate whether fault has been injected*/
-extern int fault_injected;
-
-/*to emulate system crash*/
-extern int crash_system;
-
-/*to crash a system after commit and before checkpointing to initiate recovery*/
-extern int crash_after_commit;
+/*
+ * backing devices of the instances, comma separated, one per instance:
+ * a device path or major:minor, ram:<MB> or file:<path>. an instance
+ * without one (empty entry) is created detached; ATTACH_DEV gives it
+ * a backend later.
+ */
+static char *backing = "8:35";
+module_param(backing, charp, 0);
 
-/*array of physical device number*/
-//static int f_dev[] = {MKDEV(8, 33)}; 
-static int f_dev[] = {MKDEV(8, 35)}; 
-static int j_dev[] = {MKDEV(8, 51)}; 
+/*the journal devices, in the same format (only with jour_dev)*/
+static char *jbacking = "8:51";
+module_param(jbacking, charp, 0);
 
 /*separate journal device can also be specified while loading*/
 module_param(jour_dev, int, 0);
@@ -53,17 +42,63 @@ module_param(jour_dev, int, 0);
 /*end io function*/
 static bio_end_io_t sba_end_io;
 
+/*releases the trace of a request*/
+int free_trace(sba_request *sba_req);
+
+/*
+ * reads are classified and their faults injected once the data is
+ * in, which is in the bio completion. that is too much work for an
+ * interrupt, so the completions are queued per cpu and handled by
+ * a workqueue, which then ends the original bio.
+ */
+typedef struct _sba_read_queue {
+	spinlock_t lock;
+	struct list_head reqs;
+	struct work_struct work;
+} sba_read_queue;
+
+static sba_read_queue read_queue[NR_CPUS];
+static struct workqueue_struct *sba_read_wq;
+
+/*read completions classified in one pass of the work (1 = no batching)*/
+int read_batch = 64;
+module_param(read_batch, int, 0);
+
+/*
+ * requests held by an SBA_DELAY fault, sorted by expiry. the timer
+ * only wakes the delay work: writes are sent on and reads ended
+ * from there, as the timer cannot issue io.
+ */
+static LIST_HEAD(delay_list);
+static spinlock_t delay_lock = SPIN_LOCK_UNLOCKED;
+static struct timer_list delay_timer;
+static struct work_struct delay_work;
+static struct workqueue_struct *sba_delay_wq;
+
 /*------------------------------------------------------------------*/
 
+/*returns instance id, or NULL if there is no such instance*/
+sba_dev *sba_get_dev(int id)
+{
+	if ((id < 0) || (id >= sba_devs)) {
+		return NULL;
+	}
+
+	return &sba_devices[id];
+}
+
 /* Open the device. Increment the usage count */
 int sba_open(struct inode *inode, struct file *filp)
 {
-	int num = iminor(inode);
-	if (num >= SBA_DEVS) {
+	sba_dev *dev = sba_get_dev(iminor(inode));
+	if (!dev) {
 		return -ENODEV;
 	}
 
-	sba_device.usage ++;
+	/*drops the cached blocks of a previous backing device*/
+	check_disk_change(inode->i_bdev);
+
+	dev->usage ++;
 
 	return 0;
 }
@@ -72,9 +107,11 @@ int sba_open(struct inode *inode, struct file *filp)
 int sba_release(struct inode *inode, struct file *filp)
 {
 	struct block_device *bd = I_BDEV(inode);
-	sba_device.usage --;
+	sba_dev *dev = (sba_dev *)bd->bd_disk->private_data;
+
+	dev->usage --;
 
-	if (!sba_device.usage) { 
+	if (!dev->usage) { 
 		fsync_bdev(bd);
 	}
 
@@ -84,10 +121,25 @@ int sba_release(struct inode *inode, struct file *filp)
 int sba_ioctl(struct inode *inode, struct file *filp,
 				unsigned int cmd, unsigned long arg)
 {
+	sba_dev *dev = (sba_dev *)inode->i_bdev->bd_disk->private_data;
+
+	return sba_dev_ioctl(dev, cmd, arg);
+}
+
+/*the ioctls of an instance, from its block device or its trace device*/
+int sba_dev_ioctl(sba_dev *dev, unsigned int cmd, unsigned long arg)
+{
+	unsigned long long stime;
+	int ret;
+
 	switch (cmd) {
 
 	case START_SBA:
-		start_sba = 1;
+		if (!dev->backend) {
+			return -ENXIO;
+		}
+		dev->start_sba = 1;
+		stime = sba_common_get_time_ns();
 
 		/*find the journal entries only when the file system is ext3
 		  and there is no separate journal device*/
@@ -95,7 +147,7 @@ int sba_ioctl(struct inode *inode, struct file *filp,
 			#ifdef INC_EXT3
 			case EXT3:
 				if (!jour_dev) {
-					sba_ext3_start();
+					sba_ext3_start(dev);
 				}
 			break;
 			#endif
@@ -103,7 +155,7 @@ int sba_ioctl(struct inode *inode, struct file *filp,
 			#ifdef INC_REISERFS
 			case REISERFS:
 				if (!jour_dev) {
-					sba_reiserfs_start();
+					sba_reiserfs_start(dev);
 				}
 			break;
 			#endif
@@ -111,65 +163,119 @@ int sba_ioctl(struct inode *inode, struct file *filp,
 			#ifdef INC_JFS
 			case JFS:
 				if (!jour_dev) {
-					sba_jfs_start();
+					sba_jfs_start(dev);
 				}
 			break;
 			#endif
 		}
 		
-		sba_common_print_model();
+		sba_common_add_start_stats(dev, stime);
+		sba_common_print_model(dev);
 	break;
 
 	case STOP_SBA:
-		start_sba = 0;
+		dev->start_sba = 0;
 		break;
 
 	case INJECT_FAULT:
-		add_fault((fault *)arg);
-		break;
-
 	case REINIT_FAULT:
-		reinit_fault((fault *)arg);
+		{
+			fault f;
+
+			if (copy_from_user(&f, (void *)arg, sizeof(f))) {
+				return -EFAULT;
+			}
+
+			if (cmd == INJECT_FAULT) {
+				add_fault(dev, &f);
+			}
+			else {
+				reinit_fault(dev, &f);
+			}
+		}
 		break;
 
+	case ADD_FAULT:
+		{
+			fault f;
+
+			if (copy_from_user(&f, (void *)arg, sizeof(f))) {
+				return -EFAULT;
+			}
+			if (f.filesystem != filesystem) {
+				return -EINVAL;
+			}
+
+			/*the fs work is done once, before the fault is armed*/
+			sba_common_process_fault(dev, &f);
+			dev->fault_injected = 0;
+
+			return sba_fault_add(dev, &f);
+		}
+
+	case DEL_FAULT:
+		return sba_fault_del(dev, (int)arg);
+
+	case FAULT_SEED:
+		sba_fault_seed(dev, (unsigned int)arg);
+		return 0;
+
+	case GET_FAULT:
+		{
+			sba_fault_info info;
+			int ret;
+
+			if (copy_from_user(&info, (void *)arg, sizeof(info))) {
+				return -EFAULT;
+			}
+			if ((ret = sba_fault_get(dev, &info)) < 0) {
+				return ret;
+			}
+			if (copy_to_user((void *)arg, &info, sizeof(info))) {
+				return -EFAULT;
+			}
+		}
+		return 0;
+
 	case REMOVE_FAULT:
-		remove_fault(REM_FORCE);
+		remove_fault(dev, REM_FORCE);
 		break;
 
 	case PRINT_JOURNAL:
-		sba_common_print_journal();
+		sba_common_print_journal(dev);
 		break;
 
 	case PRINT_STAT:
-		sba_common_print_stat(&ss);
-		sba_common_zero_stat(&ss);
+		sba_common_print_stat(dev);
+		sba_common_zero_stat(&dev->ss);
 		break;
 
 	case ZERO_STAT:
-		sba_common_zero_stat(&ss);
+		sba_common_zero_stat(&dev->ss);
+		sba_throttle_zero_stats(dev);
 		break;
 
 	case CLEAN_STAT:
-		sba_common_clean_stats();
-		break;
+		ret = sba_common_clean_stats(dev);
+		return (ret < 0) ? ret : 0;
 
 	case CLEAN_ALL_STAT:
-		sba_common_clean_all_stats();
-		break;
+		ret = sba_common_clean_all_stats(dev);
+		return (ret < 0) ? ret : 0;
 
 	case PRINT_FAULT:
-		sba_common_print_fault();
+		sba_fault_print(dev);
 		break;
 
 	case FAULT_INJECTED:
 		{
 			int *response = (int *)arg;
-			copy_to_user(response, &fault_injected, sizeof(fault_injected));
+			copy_to_user(response, &dev->fault_injected, sizeof(dev->fault_injected));
 		}
 		break;
 
 	case PROCESS_FAULT:
-		sba_common_process_fault();
+		sba_common_process_legacy_fault(dev);
 		break;
 
 	case INIT_DIR_BLKS:
@@ -180,7 +286,7 @@ int sba_ioctl(struct inode *inode, struct file *filp,
 			inodenr = *(temp_inodenr);
 			sba_debug(1, "<<<--------inode nr = %ld----------------------->>>\n", inodenr);
 
-			sba_common_init_dir_blocks(inodenr);
+			sba_common_init_dir_blocks(dev, inodenr);
 		}
 		break;
 
@@ -192,71 +298,148 @@ int sba_ioctl(struct inode *inode, struct file *filp,
 			inodenr = *(temp_inodenr);
 			sba_debug(1, "<<<--------inode nr = %ld----------------------->>>\n", inodenr);
 
-			sba_common_init_indir_blocks(inodenr);
+			sba_common_init_indir_blocks(dev, inodenr);
 		}
 		break;
 
 	case MOVE_2_START:
-		sba_common_move_to_start();
+		sba_common_move_to_start(dev);
 		break;
 
 	case TEST_SYSTEM:
-		test_system = 1;
+		dev->test_system = 1;
 		break;
 
 	case DONT_TEST:
-		test_system = 0;
+		dev->test_system = 0;
 		break;
 
 	case SQUASH_WRITES:
-		squash_writes = 1;
+		dev->squash_writes = 1;
 		break;
 
 	case ALLOW_WRITES:
-		squash_writes = 0;
+		dev->squash_writes = 0;
 		break;
 
 	case PRINT_JBLOCKS:
-		sba_common_print_journaled_blocks();
+		sba_common_print_journaled_blocks(dev);
 		break;
 
 	case CRASH_COMMIT:
-		crash_after_commit = 1;
+		dev->crash_after_commit = 1;
 		break;
 
 	case DONT_CRASH_COMMIT:
-		crash_after_commit = 0;
-		crash_system = 0;
+		dev->crash_after_commit = 0;
+		dev->crash_system = 0;
 		break;
 
 	case CRASH_SYSTEM:
-		crash_system = 1;
+		dev->crash_system = 1;
 		break;
 
 	case DONT_CRASH:
-		crash_system = 0;
+		dev->crash_system = 0;
 		break;
 
 	case WORKLOAD_START:
-		sba_common_add_workload_start();
+		sba_common_add_workload_start(dev);
 		break;
 
 	case WORKLOAD_END:
-		sba_common_add_workload_end();
+		sba_common_add_workload_end(dev);
 		break;
 
+	case TRACE_DROPPED:
+		{
+			unsigned int __user *response = (unsigned int __user *)arg;
+			unsigned int dropped = sba_trace_dropped(&dev->trace);
+
+			if (copy_to_user(response, &dropped, sizeof(dropped))) {
+				return -EFAULT;
+			}
+		}
+		break;
+
+	case TRACE_POLICY:
+		sba_trace_set_policy(&dev->trace, (int)arg);
+		break;
+
+	case SET_THROTTLE:
+		{
+			sba_throttle_limit limit;
+
+			if (copy_from_user(&limit, (void *)arg, sizeof(limit))) {
+				return -EFAULT;
+			}
+			if (!sba_throttle_set(dev, &limit)) {
+				return -EINVAL;
+			}
+		}
+		return 0;
+
+	case THROTTLE_STATS:
+		{
+			sba_throttle_stat st[SBA_THR_CLASSES];
+
+			sba_throttle_get_stats(dev, st);
+			if (copy_to_user((void *)arg, st, sizeof(st))) {
+				return -EFAULT;
+			}
+		}
+		return 0;
+
+	case ATTACH_DEV:
+		{
+			sba_backing att;
+
+			if (copy_from_user(&att, (void *)arg, sizeof(att))) {
+				return -EFAULT;
+			}
+
+			return sba_attach(dev, &att);
+		}
+
+	case DETACH_DEV:
+		return sba_detach(dev);
+
+	case SNAPSHOT:
+		return sba_snapshot(dev);
+
+	case ROLLBACK:
+		return sba_rollback(dev, 0);
+
+	case DROP_SNAPSHOT:
+		return sba_rollback(dev, 1);
+
+	case WLOG_START:
+		{
+			char path[SBA_WLOG_PATH_LEN];
+
+			if (copy_from_user(path, (void *)arg, sizeof(path))) {
+				return -EFAULT;
+			}
+			path[sizeof(path) - 1] = '\0';
+
+			return sba_wlog_start(dev, path);
+		}
+
+	case WLOG_STOP:
+		return sba_wlog_stop(dev);
+
 	case EXTRACT_STATS:
 		{
 			char *ubuf = (char *)arg;
 
-			if (access_ok(VERIFY_WRITE, ubuf, MAX_UBUF_SIZE)) {
-				sba_common_extract_stats(ubuf, start_time);
-			}
-			else {
+			if (!access_ok(VERIFY_WRITE, ubuf, MAX_UBUF_SIZE)) {
 				sba_debug(1, "Invalid user buffer\n");
+				return -EFAULT;
 			}
+
+			ret = sba_common_extract_stats(dev, ubuf);
+			return (ret < 0) ? ret : 0;
 		}
-		break;
 
 	}
 
@@ -265,11 +448,16 @@ int sba_ioctl(struct inode *inode, struct file *filp,
 
 int sba_media_changed(struct gendisk *gd)
 {
-	return 1;
+	sba_dev *dev = (sba_dev *)gd->private_data;
+
+	return dev->media_change;
 }
 
 int sba_revalidate_disk(struct gendisk *gd)
 {
+	sba_dev *dev = (sba_dev *)gd->private_data;
+
+	dev->media_change = 0;
 	return 0;
 }
 
@@ -283,20 +471,251 @@ struct block_device_operations sba_bdops = {
 	.revalidate_disk = sba_revalidate_disk
 };
 
-int sba_get_j_device_number(void)
+/*Returns the physical device number of instance id, 0 if it is detached*/
+int sba_get_device_number(int id)
 {
-	return j_dev[0];
+	sba_dev *dev = sba_get_dev(id);
+
+	if ((!dev) || (!dev->f_dev)) {
+		return 0;
+	}
+
+	return dev->f_dev->bd_dev;
 }
 
-int sba_get_f_device_number(void)
+/*copies entry id of a comma separated list into buf*/
+static char *sba_list_entry(char *list, int id, char *buf, int len)
 {
-	return f_dev[0];
+	int i = 0;
+
+	buf[0] = '\0';
+	if (!list) {
+		return buf;
+	}
+
+	while ((id > 0) && (*list)) {
+		if (*list++ == ',') {
+			id --;
+		}
+	}
+
+	while ((id == 0) && (*list) && (*list != ',') && (i < len - 1)) {
+		buf[i++] = *list++;
+	}
+	buf[i] = '\0';
+
+	return buf;
+}
+
+/*
+ * returns the device number of a block device given as major:minor
+ * or as the path of its node, the way device mapper looks them up
+ */
+static int sba_lookup_device(char *spec, dev_t *devt)
+{
+	unsigned int major, minor;
+	struct nameidata nd;
+	struct inode *inode;
+	int r;
+
+	if (sscanf(spec, "%u:%u", &major, &minor) == 2) {
+		*devt = MKDEV(major, minor);
+		return 0;
+	}
+
+	if ((r = path_lookup(spec, LOOKUP_FOLLOW, &nd))) {
+		return r;
+	}
+
+	inode = nd.dentry->d_inode;
+	if (!inode) {
+		r = -ENOENT;
+	}
+	else
+	if (!S_ISBLK(inode->i_mode)) {
+		r = -ENOTBLK;
+	}
+	else {
+		*devt = inode->i_rdev;
+	}
+
+	path_release(&nd);
+	return r;
+}
+
+/*
+ * fills b from a backing device given as ram:<MB>, file:<path>, or
+ * a block device; the journal device (jspec) only matters for a block
+ * device with jour_dev
+ */
+static int sba_parse_backing(char *spec, char *jspec, sba_backing *b)
+{
+	dev_t devt;
+	int r;
+
+	memset(b, 0, sizeof(sba_backing));
+
+	if (strncmp(spec, "ram:", 4) == 0) {
+		b->type = SBA_BACKEND_RAM;
+		b->size_mb = simple_strtoul(spec + 4, NULL, 0);
+		return 0;
+	}
+
+	if (strncmp(spec, "file:", 5) == 0) {
+		b->type = SBA_BACKEND_FILE;
+		strncpy(b->path, spec + 5, sizeof(b->path) - 1);
+		return 0;
+	}
+
+	b->type = SBA_BACKEND_BLOCK;
+	if ((r = sba_lookup_device(spec, &devt)) < 0) {
+		return r;
+	}
+	b->f_major = MAJOR(devt);
+	b->f_minor = MINOR(devt);
+
+	if (jour_dev) {
+		if ((r = sba_lookup_device(jspec, &devt)) < 0) {
+			return r;
+		}
+		b->j_major = MAJOR(devt);
+		b->j_minor = MINOR(devt);
+	}
+
+	return 0;
+}
+
+/*
+ * Gives a detached instance its backend and sizes the instance after
+ * it. the new size is seen on the next first open of the instance,
+ * so only the caller may have it open.
+ */
+int sba_attach(sba_dev *dev, sba_backing *b)
+{
+	sba_backend_ops *ops;
+	int ret;
+
+	if ((dev->backend) || (dev->usage > 1)) {
+		return -EBUSY;
+	}
+
+	if (!(ops = sba_backend_get(b->type))) {
+		return -EINVAL;
+	}
+
+	if ((ret = ops->attach(dev, b)) < 0) {
+		return ret;
+	}
+
+	set_capacity(dev->gd, dev->size * 2);
+	dev->media_change = 1;
+
+	/*the io path takes an instance without a backend as detached*/
+	wmb();
+	dev->backend = ops;
+
+	sba_debug(1, "sba%d: attached to a %s backend (total sec %lu)\n", dev->id, ops->name, dev->size * 2);
+
+	return 0;
+}
+
+/*writes back and forgets the cached blocks of the instance*/
+static void sba_flush_dev(sba_dev *dev)
+{
+	struct block_device *bdev;
+
+	bdev = bdget_disk(dev->gd, 0);
+	if (bdev) {
+		fsync_bdev(bdev);
+		invalidate_bdev(bdev, 0);
+		bdput(bdev);
+	}
+
+	sba_common_bcache_flush(dev);
+}
+
+/*
+ * Flushes the instance and releases its backend. the tables built
+ * from the old file system are dropped, the fault is kept.
+ */
+int sba_detach(sba_dev *dev)
+{
+	sba_backend_ops *ops = dev->backend;
+
+	if (!ops) {
+		return -ENXIO;
+	}
+	if (dev->usage > 1) {
+		return -EBUSY;
+	}
+
+	sba_flush_dev(dev);
+	if (dev->cow_data) {
+		sba_backend_rollback(dev, 1);
+	}
+
+	dev->start_sba = 0;
+	dev->backend = NULL;
+	wmb();
+
+	set_capacity(dev->gd, 0);
+	dev->size = 0;
+	dev->media_change = 1;
+
+	ops->release(dev);
+
+	sba_common_cleanup_fs(dev);
+	sba_common_init_fs(dev);
+
+	sba_debug(1, "sba%d: detached\n", dev->id);
+
+	return 0;
+}
+
+/*the image as it is now is kept; the writes from here on can be rolled back*/
+int sba_snapshot(sba_dev *dev)
+{
+	if (dev->usage > 1) {
+		return -EBUSY;
+	}
+
+	sba_flush_dev(dev);
+
+	return sba_backend_snapshot(dev);
+}
+
+/*
+ * Back to the image of the snapshot, dropping the snapshot too with
+ * drop. the file system has to be unmounted: only the caller may have
+ * the instance open.
+ */
+int sba_rollback(sba_dev *dev, int drop)
+{
+	int ret;
+
+	if (dev->usage > 1) {
+		return -EBUSY;
+	}
+
+	/*what is still cached goes to the overlay that is thrown away*/
+	sba_flush_dev(dev);
+	ret = sba_backend_rollback(dev, drop);
+	sba_flush_dev(dev);
+
+	return ret;
 }
 
-/*Returns the physical device number*/
-int sba_get_device_number(void)
+/*
+ * sends a clone to the storage. fs_bio is the bio from the fs that
+ * it was made of, sba_req its request if it is traced.
+ */
+static void sba_submit(sba_dev *dev, struct bio *sba_bio, struct bio *fs_bio, sba_request *sba_req)
 {
-	return sba_get_f_device_number();
+	if ((unlikely(dev->wlog != NULL)) && (bio_data_dir(sba_bio) == WRITE)) {
+		sba_wlog_write(dev, sba_bio, fs_bio->bi_rw, sba_req);
+	}
+
+	sba_backend_submit(dev, sba_bio);
 }
 
 /* this end io routine is to handle mkfs traffic - it doesn't do any 
@@ -324,6 +743,202 @@ int sba_mkfs_end_io(struct bio *sba_bio, unsigned int bytes, int error)
 	return 0;
 }
 
+int sba_delay_request(sba_request *sba_req, struct bio *sba_bio);
+
+/*ends a read after its faults are injected*/
+int sba_end_read(sba_request *sba_req)
+{
+	int uptodate = sba_req->uptodate;
+	struct bio *sba_bio_org = sba_req->sba_bio;
+
+	if (uptodate) {
+		bio_endio(sba_bio_org, sba_bio_org->bi_size, 0);
+	}
+	else {
+		bio_endio(sba_bio_org, sba_bio_org->bi_size, -EIO);
+	}
+
+	free_trace(sba_req);
+
+	return 1;
+}
+
+/*classifies a completed read, injects its fault or throttles it, and ends it*/
+int sba_complete_read(sba_request *sba_req)
+{
+	if (sba_req->dev->test_system) {
+		sba_common_inject_fault(sba_req->sba_bio, sba_req, &sba_req->uptodate);
+	}
+	else
+	if (sba_req->dev->throttling) {
+		sba_common_build_block_types(sba_req->sba_bio, sba_req);
+	}
+
+	if (sba_req->dev->throttling) {
+		sba_throttle_request(sba_req->sba_bio, sba_req);
+	}
+
+	if (sba_req->delay_msecs) {
+		return sba_delay_request(sba_req, NULL);
+	}
+
+	return sba_end_read(sba_req);
+}
+
+/*
+ * takes up to read_batch completions off the queue of this cpu
+ * at once, and queues itself again if there are more left
+ */
+static void sba_read_work(void *data)
+{
+	sba_read_queue *rq = (sba_read_queue *)data;
+	sba_request *sba_req;
+	unsigned long flags;
+	int n = 0;
+	int more;
+	LIST_HEAD(batch);
+
+	spin_lock_irqsave(&rq->lock, flags);
+	while ((!list_empty(&rq->reqs)) && ((n < read_batch) || (read_batch <= 0))) {
+		list_move_tail(rq->reqs.next, &batch);
+		n ++;
+	}
+	more = !list_empty(&rq->reqs);
+	spin_unlock_irqrestore(&rq->lock, flags);
+
+	while (!list_empty(&batch)) {
+		sba_req = list_entry(batch.next, sba_request, list);
+		list_del(&sba_req->list);
+		sba_complete_read(sba_req);
+	}
+
+	if (more) {
+		queue_work(sba_read_wq, &rq->work);
+	}
+}
+
+/*called from the bio completion, so only queue the request*/
+int sba_queue_read(sba_request *sba_req, int uptodate)
+{
+	sba_read_queue *rq = &read_queue[smp_processor_id()];
+	unsigned long flags;
+
+	sba_req->uptodate = uptodate;
+
+	spin_lock_irqsave(&rq->lock, flags);
+	list_add_tail(&sba_req->list, &rq->reqs);
+	spin_unlock_irqrestore(&rq->lock, flags);
+
+	/*does nothing if the work is already queued on this cpu*/
+	queue_work(sba_read_wq, &rq->work);
+
+	return 1;
+}
+
+/*
+ * holds a request for its delay_msecs. sba_bio is the clone to send
+ * to the device afterwards, or NULL for a read that is to be ended.
+ */
+int sba_delay_request(sba_request *sba_req, struct bio *sba_bio)
+{
+	struct list_head *pos;
+	unsigned long flags;
+
+	sba_req->delay_bio = sba_bio;
+	sba_req->delay_expires = jiffies + msecs_to_jiffies(sba_req->delay_msecs);
+
+	spin_lock_irqsave(&delay_lock, flags);
+
+	/*most requests expire last, so search from the end*/
+	for (pos = delay_list.prev; pos != &delay_list; pos = pos->prev) {
+		if (time_before_eq(list_entry(pos, sba_request, list)->delay_expires, sba_req->delay_expires)) {
+			break;
+		}
+	}
+	list_add(&sba_req->list, pos);
+
+	if (delay_list.next == &sba_req->list) {
+		mod_timer(&delay_timer, sba_req->delay_expires);
+	}
+
+	spin_unlock_irqrestore(&delay_lock, flags);
+
+	return 1;
+}
+
+/*releases the delayed requests that expired, or all of them*/
+int sba_delay_dispatch(int all)
+{
+	sba_request *sba_req;
+	unsigned long flags;
+	LIST_HEAD(expired);
+
+	spin_lock_irqsave(&delay_lock, flags);
+	while (!list_empty(&delay_list)) {
+		sba_req = list_entry(delay_list.next, sba_request, list);
+		if ((!all) && (time_after(sba_req->delay_expires, jiffies))) {
+			mod_timer(&delay_timer, sba_req->delay_expires);
+			break;
+		}
+		list_move_tail(&sba_req->list, &expired);
+	}
+	spin_unlock_irqrestore(&delay_lock, flags);
+
+	while (!list_empty(&expired)) {
+		sba_req = list_entry(expired.next, sba_request, list);
+		list_del(&sba_req->list);
+		sba_throttle_release(sba_req);
+
+		if (sba_req->delay_bio) {
+			sba_submit(sba_req->dev, sba_req->delay_bio, sba_req->sba_bio, sba_req);
+		}
+		else {
+			sba_end_read(sba_req);
+		}
+	}
+
+	return 1;
+}
+
+static void sba_delay_work(void *data)
+{
+	sba_delay_dispatch(0);
+}
+
+static void sba_delay_timer(unsigned long data)
+{
+	queue_work(sba_delay_wq, &delay_work);
+}
+
+int sba_init_queues(void)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu ++) {
+		spin_lock_init(&read_queue[cpu].lock);
+		INIT_LIST_HEAD(&read_queue[cpu].reqs);
+		INIT_WORK(&read_queue[cpu].work, sba_read_work, &read_queue[cpu]);
+	}
+
+	sba_read_wq = create_workqueue("sba_read");
+	if (!sba_read_wq) {
+		return -1;
+	}
+
+	init_timer(&delay_timer);
+	delay_timer.function = sba_delay_timer;
+	delay_timer.data = 0;
+	INIT_WORK(&delay_work, sba_delay_work, NULL);
+
+	sba_delay_wq = create_singlethread_workqueue("sba_delay");
+	if (!sba_delay_wq) {
+		destroy_workqueue(sba_read_wq);
+		return -1;
+	}
+
+	return 1;
+}
+
 int sba_end_io(struct bio *sba_bio, unsigned int bytes, int error)
 {
 	int uptodate;
@@ -348,8 +963,10 @@ int sba_end_io(struct bio *sba_bio, unsigned int bytes, int error)
 		sba_common_get_end_timestamp(sba_req);
 
 		if ((bio_data_dir(sba_bio) == READ) || (bio_data_dir(sba_bio) == READA) || (bio_data_dir(sba_bio) == READ_SYNC)) {
-			if (test_system) {
-				sba_common_inject_fault(sba_bio_org, sba_req, &uptodate);
+			if ((sba_req->dev->test_system) || (sba_req->dev->throttling)) {
+				sba_queue_read(sba_req, uptodate);
+				bio_put(sba_bio);
+				return 0;
 			}
 		}
 
@@ -360,9 +977,8 @@ int sba_end_io(struct bio *sba_bio, unsigned int bytes, int error)
 			bio_endio(sba_bio_org, sba_bio_org->bi_size, -EIO);
 		}
 
-		/*free the record pointers*/
-		kfree(sba_req->record);
-		kfree(sba_req);
+		/*trace and free the records*/
+		free_trace(sba_req);
 
 		bio_put(sba_bio);
 		return 0;
@@ -400,12 +1016,14 @@ int sba_print_bio(struct bio *sba_bio)
 	return 1;
 }
 
-sba_request *allocate_trace(struct bio *sba_bio_clone, struct bio *sba_bio_org)
+sba_request *allocate_trace(sba_dev *dev, struct bio *sba_bio_clone, struct bio *sba_bio_org)
 {
 	int i;
+	int allocs = 1;
 	sba_request *sba_req;
 
-	sba_req = kmalloc(sizeof(sba_request), GFP_KERNEL);
+	/*we are on the make_request path, so dont recurse into the io*/
+	sba_req = sba_common_alloc_request(GFP_NOIO);
 	if (!sba_req) {
 		sba_debug(1, "Error: unable to allocate memory to sba request\n");
 		return NULL;
@@ -415,6 +1033,7 @@ sba_request *allocate_trace(struct bio *sba_bio_clone, struct bio *sba_bio_org)
 		sba_debug(1, "More than one block (%d) in sba_bio request\n", bio_sectors(sba_bio_org)/8);
 	}
 
+	sba_req->dev = dev;
 	sba_req->sba_bio = sba_bio_org;
 
 	if (bio_sectors(sba_bio_org) < 8) {
@@ -425,36 +1044,194 @@ sba_request *allocate_trace(struct bio *sba_bio_clone, struct bio *sba_bio_org)
 		sba_req->count = bio_sectors(sba_bio_org)/8;
 	}
 
-	/*allocate mem for pointers*/
-	sba_req->record = kmalloc(sizeof(stat_info *)*sba_req->count, GFP_KERNEL);
-	if (!sba_req->record) {
-		sba_debug(1, "Error: unable to allocate memory to records\n");
-		kfree(sba_req);
-		return NULL;
+	/*allocate mem only if the records don't fit in the request*/
+	if (sba_req->count <= SBA_INLINE_RECORDS) {
+		sba_req->record = sba_req->inline_record;
+		for (i = 0; i < sba_req->count; i ++) {
+			sba_req->record[i] = &sba_req->inline_stat[i];
+		}
 	}
-
-	/*allocate mem for records*/
-	for (i = 0; i < sba_req->count; i ++) {
-		sba_req->record[i] = kmalloc(sizeof(stat_info), GFP_KERNEL);
-		if (!sba_req->record[i]) {
+	else {
+		sba_req->record = kmalloc(sizeof(stat_info *)*sba_req->count, GFP_NOIO);
+		if (!sba_req->record) {
 			sba_debug(1, "Error: unable to allocate memory to records\n");
-			kfree(sba_req);
+			sba_req->record = sba_req->inline_record;
+			sba_common_free_request(sba_req);
 			return NULL;
 		}
-		memset(sba_req->record[i], 0, sizeof(stat_info));
+		allocs ++;
+
+		for (i = 0; i < sba_req->count; i ++) {
+			sba_req->record[i] = sba_common_alloc_stat_info(GFP_NOIO);
+			allocs ++;
+		}
 	}
 
 	sba_req->rw = bio_data_dir(sba_bio_org);
 
+	#ifdef COLLECT_STAT
+		dev->ss.traced_bios ++;
+		dev->ss.trace_allocs += allocs;
+		dev->ss.kmalloc_allocs += 2 + sba_req->count;
+	#endif
+
 	return sba_req;
 }
 
+/* 
+ * adds the records of the request to the trace buffer, if
+ * they were filled in (ie. we are testing the system), and
+ * frees the request along with its records.
+ */
+int free_trace(sba_request *sba_req)
+{
+	int i;
+
+	sba_common_free_corrupt_pages(sba_req);
+
+	for (i = 0; i < sba_req->count; i ++) {
+		if (sba_req->collected) {
+			sba_common_add_stats(sba_req->dev, sba_req->record[i]);
+		}
+
+		if (sba_req->count > SBA_INLINE_RECORDS) {
+			sba_common_free_stat_info(sba_req->record[i]);
+		}
+	}
+
+	sba_common_free_request(sba_req);
+
+	return 1;
+}
+
 int sba_crash_system(struct bio *sba_bio)
 {
 	bio_endio(sba_bio, sba_bio->bi_size, -EIO);
 	return 1;
 }
 
+/*
+ * drops a reference on the pieces of a split write. the last one
+ * ends the original bio - with an error, as some of its blocks
+ * were failed. a bio cannot complete partially, so the fs still
+ * sees the whole bio fail, but the other blocks are on the disk.
+ */
+int sba_split_put(sba_request *sba_req)
+{
+	struct bio *sba_bio_org = sba_req->sba_bio;
+
+	if (!atomic_dec_and_test(&sba_req->pending)) {
+		return 0;
+	}
+
+	sba_common_get_end_timestamp(sba_req);
+	bio_endio(sba_bio_org, sba_bio_org->bi_size, -EIO);
+	free_trace(sba_req);
+
+	return 1;
+}
+
+int sba_split_end_io(struct bio *sba_bio, unsigned int bytes, int error)
+{
+	sba_request *sba_req = (sba_request *)sba_bio->bi_private;
+
+	if (sba_bio->bi_size) {
+		return 1;
+	}
+
+	if (!test_bit(BIO_UPTODATE, &sba_bio->bi_flags)) {
+		sba_debug(1, "Error: write of blk %ld failed on the device\n", SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector));
+	}
+
+	bio_put(sba_bio);
+	sba_split_put(sba_req);
+
+	return 0;
+}
+
+/*
+ * sends the segments [first, last) of sba_bio to the device. if they
+ * cannot be sent they are marked failed on the request, like the ones
+ * the fault injector failed.
+ */
+int sba_split_submit(struct bio *sba_bio, sba_request *sba_req, int first, int last)
+{
+	int i;
+	struct bio *sba_bio_clone;
+	sector_t sector = sba_bio->bi_sector + (first - sba_bio->bi_idx)*8;
+
+	sba_bio_clone = bio_clone(sba_bio, GFP_NOIO);
+	if (!sba_bio_clone) {
+		sba_debug(1, "Error: unable to clone blk %ld for a split write\n", SBA_SECTOR_TO_BLOCK(sector));
+		for (i = first; i < last; i ++) {
+			sba_req->failed[i] = 1;
+		}
+		sba_req->nr_failed += last - first;
+		return -1;
+	}
+
+	sba_bio_clone->bi_sector = sector;
+	sba_bio_clone->bi_idx = first;
+	sba_bio_clone->bi_vcnt = last;
+	sba_bio_clone->bi_size = 0;
+	for (i = first; i < last; i ++) {
+		sba_bio_clone->bi_size += bio_iovec_idx(sba_bio, i)->bv_len;
+	}
+	/*the segment counts of the clone are stale now*/
+	sba_bio_clone->bi_flags &= ~(1 << BIO_SEG_VALID);
+	sba_common_use_corrupt_pages(sba_req, sba_bio_clone);
+
+	sba_bio_clone->bi_end_io = sba_split_end_io;
+	sba_bio_clone->bi_private = sba_req;
+	sba_bio_clone->bi_rw = bio_data_dir(sba_bio);
+
+	atomic_inc(&sba_req->pending);
+	sba_submit(sba_req->dev, sba_bio_clone, sba_bio, sba_req);
+
+	return 1;
+}
+
+/*
+ * writes the segments of sba_bio that the fault injector did not
+ * fail, one clone for each run of contiguous segments. the pending
+ * count starts at 1 so that the bio cannot end while we submit.
+ */
+int sba_split_write(struct bio *sba_bio, sba_request *sba_req)
+{
+	int i;
+	int first = -1;
+	int unwritten = 0;
+
+	atomic_set(&sba_req->pending, 1);
+
+	for (i = sba_bio->bi_idx; i <= sba_bio->bi_vcnt; i ++) {
+		if ((i < sba_bio->bi_vcnt) && (!sba_req->failed[i])) {
+			if (first < 0) {
+				first = i;
+			}
+			continue;
+		}
+
+		if (first >= 0) {
+			sba_debug(1, "Writing blks %ld - %ld of a failed write\n", 
+			SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector + (first - sba_bio->bi_idx)*8),
+			SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector + (i - 1 - sba_bio->bi_idx)*8));
+			if (sba_split_submit(sba_bio, sba_req, first, i) < 0) {
+				unwritten += i - first;
+			}
+			first = -1;
+		}
+	}
+
+	if (unwritten) {
+		sba_debug(1, "Error: %d blks of a failed write at blk %ld were not written\n", unwritten, SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector));
+	}
+
+	sba_split_put(sba_req);
+
+	return 1;
+}
+
 /*
  * in this function, we check if the request matches the model
  * we've build for the system. if it matches, then we pass the
@@ -471,17 +1248,48 @@ int sba_crash_system(struct bio *sba_bio)
  * 2. if so, fail it
  */
 
+/*
+ * true when there is nothing to do with a request but pass it on:
+ * the records are only collected, and faults and crashes only
+ * injected, while we are testing the system. logged writes need
+ * their block types, so they take the long way too.
+ */
+static inline int sba_passthrough(sba_dev *dev)
+{
+	return (dev->start_sba && !dev->test_system && !dev->crash_system && !dev->crash_after_commit && !dev->faults.nr_armed && !dev->throttling && !dev->wlog);
+}
+
 int sba_new_request(request_queue_t *queue, struct bio *sba_bio)
 {
 	int uptodate;
 	struct bio *sba_bio_clone;
+	sba_request *sba_req = NULL;
+	sba_dev *dev = (sba_dev *)queue->queuedata;
+
+	if (unlikely(!dev->backend)) {
+		bio_endio(sba_bio, sba_bio->bi_size, -EIO);
+		return 0;
+	}
+
+	if (sba_passthrough(dev)) {
+		#ifdef COLLECT_STAT
+			if (bio_data_dir(sba_bio) == WRITE) {
+				dev->ss.total_writes += bio_sectors(sba_bio)/8;
+			}
+			else {
+				dev->ss.total_reads += bio_sectors(sba_bio)/8;
+			}
+		#endif
+
+		/*a remapped bio is resubmitted by generic_make_request*/
+		return sba_backend_map(dev, sba_bio);
+	}
 
 	sba_bio_clone = bio_clone(sba_bio, GFP_NOIO);
 
-	sba_bio_clone->bi_bdev = sba_device.f_dev;
 	sba_bio_clone->bi_sector = sba_bio->bi_sector;
 
-	if (!start_sba) {
+	if (!dev->start_sba) {
 		/* these are mkfs traffic - allow them to go as usual */
 		sba_bio_clone->bi_end_io = sba_mkfs_end_io;
 		sba_bio_clone->bi_private = sba_bio;
@@ -501,17 +1309,15 @@ int sba_new_request(request_queue_t *queue, struct bio *sba_bio)
 				case EXT3:
 				case REISERFS:
 				case JFS:
-					sba_common_handle_mkfs_write(sba_bio->bi_sector);
+					sba_common_handle_mkfs_write(dev, sba_bio->bi_sector);
 				break;
 			}
 		}
 	}
 	else {
-		sba_request *sba_req;
-
 		sba_print_bio(sba_bio);
 
-		if (crash_system) {
+		if (dev->crash_system) {
 			/* this is to emulate crashing of the system *
 			 * we fail all the reads and writes          */
 			sba_crash_system(sba_bio);
@@ -519,7 +1325,16 @@ int sba_new_request(request_queue_t *queue, struct bio *sba_bio)
 			return 0;
 		}
 		
-		sba_req = allocate_trace(sba_bio_clone, sba_bio);
+		sba_req = allocate_trace(dev, sba_bio_clone, sba_bio);
+		if (!sba_req) {
+			/* we cannot trace this bio - let it go as usual */
+			sba_bio_clone->bi_end_io = sba_mkfs_end_io;
+			sba_bio_clone->bi_private = sba_bio;
+			sba_bio_clone->bi_rw = bio_data_dir(sba_bio);
+			sba_submit(dev, sba_bio_clone, sba_bio, NULL);
+			return 0;
+		}
+
 		sba_common_get_start_timestamp(sba_req);
 
 		sba_bio_clone->bi_end_io = sba_end_io;
@@ -528,21 +1343,28 @@ int sba_new_request(request_queue_t *queue, struct bio *sba_bio)
 
 		if ((bio_data_dir(sba_bio) == READ) || (bio_data_dir(sba_bio) == READA) || (bio_data_dir(sba_bio) == READ_SYNC)) {
 			#ifdef COLLECT_STAT
-				ss.total_reads += bio_sectors(sba_bio)/8;
+				dev->ss.total_reads += bio_sectors(sba_bio)/8;
 			#endif
 		}
 		else {
 			#ifdef COLLECT_STAT
-				ss.total_writes += bio_sectors(sba_bio)/8;
+				dev->ss.total_writes += bio_sectors(sba_bio)/8;
 			#endif
 
-			if (test_system) {
+			if (dev->test_system) {
 				int proceed = 1;
 
 				/*we can administer the fault now, if any*/
 				proceed = sba_common_inject_fault(sba_bio, sba_req, &uptodate);
 
 				if (!proceed) {
+					/*fail only the targeted blocks, the rest go to the device*/
+					if ((!uptodate) && (sba_req->nr_failed < sba_bio->bi_vcnt - sba_bio->bi_idx)) {
+						bio_put(sba_bio_clone);
+						sba_split_write(sba_bio, sba_req);
+						return 0;
+					}
+
 					if (uptodate) {
 						sba_bio->bi_size = 0;
 						bio_endio(sba_bio, sba_bio->bi_size, 0);
@@ -551,104 +1373,188 @@ int sba_new_request(request_queue_t *queue, struct bio *sba_bio)
 						bio_endio(sba_bio, sba_bio->bi_size, -EIO);
 					}
 					
+					sba_common_get_end_timestamp(sba_req);
+					free_trace(sba_req);
 					bio_put(sba_bio_clone);
 					return 0;
 				}
+
+				/*SBA_CORRUPT: the disk gets the private copies*/
+				sba_common_use_corrupt_pages(sba_req, sba_bio_clone);
+			}
+			else
+			if ((dev->throttling) || (dev->wlog)) {
+				sba_common_build_block_types(sba_bio, sba_req);
+			}
+
+			if (dev->throttling) {
+				sba_throttle_request(sba_bio, sba_req);
+			}
+
+			/*an SBA_DELAY fault or the throttle holds the write before it reaches the device*/
+			if (sba_req->delay_msecs) {
+				sba_delay_request(sba_req, sba_bio_clone);
+				return 0;
 			}
 		}
 	}
 	
 	/*make the actual request*/
-	generic_make_request(sba_bio_clone);
+	sba_submit(dev, sba_bio_clone, sba_bio, sba_req);
 
 	return 0;
 }
 
-/* This method will initialize the device specific structures */
-int __init sba_init(void)
+/*undoes sba_init_dev, also when it failed half way*/
+void sba_cleanup_dev(sba_dev *dev)
 {
-	int nsectors;
+	/*the caller does del_gendisk, if add_disk was done*/
+	if (dev->gd) {
+		put_disk(dev->gd);
+		dev->gd = NULL;
+	}
 
-	do_gettimeofday(&start_time);
+	if (dev->queue) {
+		blk_cleanup_queue(dev->queue);
+		dev->queue = NULL;
+	}
 
-	SBA_LOCK_INIT(&(sba_device.lock));
+	sba_common_cleanup_dev(dev);
 
-	if (jour_dev) {
-		dev_t f_dev_no = sba_get_f_device_number();
-		dev_t j_dev_no = sba_get_j_device_number();
+	if (dev->wlog) {
+		sba_wlog_stop(dev);
+	}
+
+	if (dev->cow_data) {
+		sba_backend_rollback(dev, 1);
+	}
+
+	if (dev->backend) {
+		dev->backend->release(dev);
+		dev->backend = NULL;
+	}
+}
+
+/* This method will initialize the structures of instance id */
+int sba_init_dev(sba_dev *dev, int id)
+{
+	char spec[128], jspec[128];
+	sba_backing b;
+	int ret;
+
+	memset(dev, 0, sizeof(sba_dev));
+	dev->id = id;
+	SBA_LOCK_INIT(&(dev->lock));
+
+	/* Get a request queue */
+	dev->queue = blk_alloc_queue(GFP_KERNEL);
+	if (!dev->queue) {
+		return -ENOMEM;
+	}
+	blk_queue_hardsect_size(dev->queue, SBA_HARDSECT);
+	blk_queue_make_request(dev->queue, sba_new_request);
+	dev->queue->queuedata = dev;
+
+	/*initialize the model, fault, trace and tables of the instance*/
+	if (sba_common_init_dev(dev) < 0) {
+		return -ENOMEM;
+	}
+
+	/* Add the gendisk structure */
+	dev->gd = alloc_disk(1);
+	if (!dev->gd) {
+		return -ENOMEM;
+	}
+
+	dev->gd->major = sba_major;
+	dev->gd->first_minor = id;
+	dev->gd->fops = &sba_bdops;
+	dev->gd->private_data = dev;
+	dev->gd->queue = dev->queue;
+	sprintf(dev->gd->disk_name, "%s%d", DEVICE_NAME, id);
+	set_capacity(dev->gd, 0);
+
+	//add the journal disk partition
+	//add_partition(dev->gd, 1, SBA_SIZE*2, SBA_JOURNAL_SIZE);
 
-		sba_device.size = SBA_SIZE + SBA_JOURNAL_SIZE;
+	/*a backing device that is given has to be there*/
+	if (*sba_list_entry(backing, id, spec, sizeof(spec))) {
+		sba_list_entry(jbacking, id, jspec, sizeof(jspec));
 
-		sba_device.f_dev = open_by_devnum(f_dev_no, FMODE_READ|FMODE_WRITE);
-		if (IS_ERR(sba_device.f_dev)) {
-			return PTR_ERR(sba_device.f_dev);
+		if ((ret = sba_parse_backing(spec, jspec, &b)) < 0) {
+			sba_debug(1, "sba%d: no backing device %s\n", id, spec);
+			return ret;
 		}
 
-		sba_device.j_dev = open_by_devnum(j_dev_no, FMODE_READ|FMODE_WRITE);
-		if (IS_ERR(sba_device.j_dev)) {
-			return PTR_ERR(sba_device.j_dev);
+		if ((ret = sba_attach(dev, &b)) < 0) {
+			return ret;
 		}
 	}
 	else {
-		dev_t f_dev_no = sba_get_f_device_number();
+		sba_debug(1, "sba%d: no backing device, waiting for ATTACH_DEV\n", id);
+	}
 
-		sba_device.size = SBA_SIZE;
+	add_disk(dev->gd);
 
-		sba_device.f_dev = open_by_devnum(f_dev_no, FMODE_READ|FMODE_WRITE);
-		if (IS_ERR(sba_device.f_dev)) {
-			goto out;
-		}
+	return 0;
+}
+
+/* This method will initialize the device specific structures */
+int __init sba_init(void)
+{
+	int i;
+	int ret = -ENOMEM;
+
+	if ((sba_devs < 1) || (sba_devs > SBA_MAX_DEVS)) {
+		sba_debug(1, "sba: sba_devs must be between 1 and %d\n", SBA_MAX_DEVS);
+		return -EINVAL;
 	}
 
-	nsectors = sba_device.size * 2;
+	sba_common_init_clock();
 
-	/* Get a request queue */
-	//sba_queue = blk_init_queue(sba_request, &sba_device.lock);
-	sba_queue = blk_alloc_queue(GFP_KERNEL);
-	if (!sba_queue) {
+	/*initialize the data structures shared by the instances*/
+	if (sba_common_init() < 0) {
 		goto out;
 	}
-	blk_queue_hardsect_size(sba_queue, SBA_HARDSECT);
-	blk_queue_make_request(sba_queue, sba_new_request);
+
+	if (sba_init_queues() < 0) {
+		sba_debug(1, "sba: can't create the workqueues\n");
+		goto out_pools;
+	}
 
 	/* Register */
 	sba_major = register_blkdev(sba_major, DEVICE_NAME);
 	if (sba_major <= 0) {
 		sba_debug(1, "sba: can't get major %d\n", sba_major);
-		goto out;
-    }
-
-	/* Add the gendisk structure */
-	sba_device.gd = alloc_disk(SBA_DEVS);
-	if (!sba_device.gd) {
-		goto out_unregister;
+		goto out_queues;
 	}
 
-	sba_device.gd->major = sba_major;
-	sba_device.gd->first_minor = 0;
-	sba_device.gd->fops = &sba_bdops;
-	sba_device.gd->private_data = &sba_device;
-	sba_device.gd->queue = sba_queue;
-	strcpy(sba_device.gd->disk_name, DEVICE_NAME);
-	set_capacity(sba_device.gd, nsectors);
-
-	//add the journal disk partition
-	//add_partition(sba_device->gd, 1, SBA_SIZE*2, SBA_JOURNAL_SIZE);
-
-	add_disk(sba_device.gd);
-
-	/*initialize other data structures*/
-	sba_common_init();
+	for (i = 0; i < sba_devs; i ++) {
+		if ((ret = sba_init_dev(&sba_devices[i], i)) < 0) {
+			sba_debug(1, "sba%d: unable to initialize the instance\n", i);
+			goto out_devs;
+		}
+	}
 
-	sba_debug(1, "SBA init over ... successfully added the driver (total sec %d)\n", nsectors);
+	sba_debug(1, "SBA init over ... successfully added %d instances\n", sba_devs);
 
 	return 0;
 
-	out_unregister:
-    	unregister_blkdev(sba_major, DEVICE_NAME);
-  	out:
+	out_devs:
+		sba_cleanup_dev(&sba_devices[i]);
+		while (--i >= 0) {
+			del_gendisk(sba_devices[i].gd);
+			sba_cleanup_dev(&sba_devices[i]);
+		}
+		unregister_blkdev(sba_major, DEVICE_NAME);
+	out_queues:
+		destroy_workqueue(sba_read_wq);
+		destroy_workqueue(sba_delay_wq);
+	out_pools:
+		sba_common_cleanup();
+	out:
 		sba_debug(1, "Unable to load the device\n");
-    	return -ENOMEM;
+		return ret;
 }
 
 /*
@@ -657,10 +1563,24 @@ int __init sba_init(void)
 
 static __exit void sba_cleanup(void)
 {
-	del_gendisk(sba_device.gd);
-	put_disk(sba_device.gd);
+	int i;
+
+	/*no new io once the disks are gone*/
+	for (i = 0; i < sba_devs; i ++) {
+		del_gendisk(sba_devices[i].gd);
+	}
+
+	/*completes the reads still queued, then lets the delayed requests go*/
+	destroy_workqueue(sba_read_wq);
+	del_timer_sync(&delay_timer);
+	destroy_workqueue(sba_delay_wq);
+	del_timer_sync(&delay_timer);
+	sba_delay_dispatch(1);
+
+	for (i = 0; i < sba_devs; i ++) {
+		sba_cleanup_dev(&sba_devices[i]);
+	}
 	unregister_blkdev(sba_major, DEVICE_NAME);
-	blk_cleanup_queue(sba_queue);
 
 	sba_common_cleanup();
 
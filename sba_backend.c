@@ -0,0 +1,661 @@
+/*
+ * This file contains the backends of sba.
+ *
+ * block: the bios are remapped to a block device, as always.
+ * ram:   the blocks live in pages held in a radix tree, allocated on
+ *        the first write; unwritten blocks read as zeroes. the io is
+ *        done in map(), so a request never waits for a disk.
+ * file:  the bios are queued to a thread of the instance, which does
+ *        them with the read and write of a regular file.
+ *
+ * A snapshot puts a copy-on-write overlay on top of any of them.
+ */
+
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/file.h>
+#include "sba.h"
+
+extern int jour_dev;
+
+/*------------------------------ block -----------------------------*/
+
+static int sba_blk_attach(sba_dev *dev, sba_backing *b)
+{
+	struct block_device *f, *j = NULL;
+	loff_t bytes;
+
+	f = open_by_devnum(MKDEV(b->f_major, b->f_minor), FMODE_READ|FMODE_WRITE);
+	if (IS_ERR(f)) {
+		return PTR_ERR(f);
+	}
+	bytes = i_size_read(f->bd_inode);
+
+	if (jour_dev) {
+		j = open_by_devnum(MKDEV(b->j_major, b->j_minor), FMODE_READ|FMODE_WRITE);
+		if (IS_ERR(j)) {
+			blkdev_put(f);
+			return PTR_ERR(j);
+		}
+		bytes += i_size_read(j->bd_inode);
+	}
+
+	dev->f_dev = f;
+	dev->j_dev = j;
+	dev->size = bytes >> 10;
+
+	return 0;
+}
+
+static int sba_blk_map(sba_dev *dev, struct bio *sba_bio)
+{
+	sba_bio->bi_bdev = dev->f_dev;
+	return 1;
+}
+
+static void sba_blk_release(sba_dev *dev)
+{
+	blkdev_put(dev->f_dev);
+	dev->f_dev = NULL;
+
+	if (dev->j_dev) {
+		blkdev_put(dev->j_dev);
+		dev->j_dev = NULL;
+	}
+}
+
+/*------------------------------- ram ------------------------------*/
+
+/*a sparse set of pages indexed by block: the ram backend, and the overlay of a snapshot*/
+typedef struct _sba_ram_store {
+	spinlock_t lock;
+	struct radix_tree_root pages;	//page index -> page (page->index is the key)
+	unsigned long nr_pages;
+} sba_ram_store;
+
+static sba_ram_store *sba_store_create(void)
+{
+	sba_ram_store *rs;
+
+	rs = kmalloc(sizeof(sba_ram_store), GFP_KERNEL);
+	if (!rs) {
+		return NULL;
+	}
+
+	spin_lock_init(&rs->lock);
+	INIT_RADIX_TREE(&rs->pages, GFP_ATOMIC);
+	rs->nr_pages = 0;
+
+	return rs;
+}
+
+/*frees the pages and the store, in O(pages)*/
+static void sba_store_destroy(sba_ram_store *rs)
+{
+	struct page *pages[16];
+	unsigned long index = 0;
+	int i, n;
+
+	while ((n = radix_tree_gang_lookup(&rs->pages, (void **)pages, index, 16)) > 0) {
+		for (i = 0; i < n; i ++) {
+			index = pages[i]->index;
+			radix_tree_delete(&rs->pages, index);
+			__free_page(pages[i]);
+		}
+		index ++;
+	}
+
+	kfree(rs);
+}
+
+static struct page *sba_store_lookup(sba_ram_store *rs, unsigned long index)
+{
+	struct page *page;
+
+	spin_lock(&rs->lock);
+	page = radix_tree_lookup(&rs->pages, index);
+	spin_unlock(&rs->lock);
+
+	return page;
+}
+
+/*puts page at index; returns the page that is there, NULL without memory*/
+static struct page *sba_store_insert(sba_ram_store *rs, unsigned long index, struct page *page)
+{
+	page->index = index;
+
+	if (radix_tree_preload(GFP_NOIO)) {
+		__free_page(page);
+		return NULL;
+	}
+
+	spin_lock(&rs->lock);
+	if (radix_tree_insert(&rs->pages, index, page) < 0) {
+		/*a write to the same page got there first*/
+		__free_page(page);
+		page = radix_tree_lookup(&rs->pages, index);
+	}
+	else {
+		rs->nr_pages ++;
+	}
+	spin_unlock(&rs->lock);
+	radix_tree_preload_end();
+
+	return page;
+}
+
+/*copies len bytes at done of a bio segment to or from page. no page reads as zeroes*/
+static void sba_store_copy(struct bio_vec *bvec, unsigned int done, struct page *page, unsigned int off, unsigned int len, int write)
+{
+	char *addr, *buf, *store;
+
+	addr = (char *)kmap_atomic(bvec->bv_page, KM_USER0);
+	buf = addr + bvec->bv_offset + done;
+	if (page) {
+		store = (char *)kmap_atomic(page, KM_USER1);
+		if (write) {
+			memcpy(store + off, buf, len);
+		}
+		else {
+			memcpy(buf, store + off, len);
+		}
+		kunmap_atomic(store, KM_USER1);
+	}
+	else {
+		memset(buf, 0, len);
+	}
+	kunmap_atomic(addr, KM_USER0);
+
+	if (!write) {
+		flush_dcache_page(bvec->bv_page);
+	}
+}
+
+static int sba_ram_attach(sba_dev *dev, sba_backing *b)
+{
+	sba_ram_store *rs;
+
+	if (!b->size_mb) {
+		return -EINVAL;
+	}
+
+	if (!(rs = sba_store_create())) {
+		return -ENOMEM;
+	}
+
+	dev->backend_data = rs;
+	dev->size = (unsigned long)b->size_mb << 10;
+
+	return 0;
+}
+
+/*the page at index. a hole is filled on a write and NULL on a read*/
+static struct page *sba_ram_page(sba_ram_store *rs, unsigned long index, int fill)
+{
+	struct page *page = sba_store_lookup(rs, index);
+
+	if ((page) || (!fill)) {
+		return page;
+	}
+
+	page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+	if (!page) {
+		return NULL;
+	}
+	clear_highpage(page);
+
+	return sba_store_insert(rs, index, page);
+}
+
+static int sba_ram_map(sba_dev *dev, struct bio *sba_bio)
+{
+	sba_ram_store *rs = (sba_ram_store *)dev->backend_data;
+	int write = (bio_data_dir(sba_bio) == WRITE);
+	sector_t sector = sba_bio->bi_sector;
+	struct bio_vec *bvec;
+	int i, error = 0;
+
+	if (sector + bio_sectors(sba_bio) > dev->size * 2) {
+		bio_endio(sba_bio, sba_bio->bi_size, -EIO);
+		return 0;
+	}
+
+	bio_for_each_segment(bvec, sba_bio, i) {
+		unsigned int done = 0;
+
+		/*a segment can straddle two store pages*/
+		while (done < bvec->bv_len) {
+			unsigned int off = (sector << SBA_HARDSECT_BITS) & ~PAGE_MASK;
+			unsigned int len = min_t(unsigned int, bvec->bv_len - done, PAGE_SIZE - off);
+			struct page *page = sba_ram_page(rs, sector >> (PAGE_SHIFT - SBA_HARDSECT_BITS), write);
+
+			if ((write) && (!page)) {
+				error = -ENOMEM;
+				goto out;
+			}
+			sba_store_copy(bvec, done, page, off, len, write);
+
+			done += len;
+			sector += len >> SBA_HARDSECT_BITS;
+		}
+	}
+
+	out:
+		bio_endio(sba_bio, sba_bio->bi_size, error);
+		return 0;
+}
+
+static void sba_ram_release(sba_dev *dev)
+{
+	sba_ram_store *rs = (sba_ram_store *)dev->backend_data;
+
+	sba_debug(1, "sba%d: freeing %lu ram pages\n", dev->id, rs->nr_pages);
+
+	sba_store_destroy(rs);
+	dev->backend_data = NULL;
+}
+
+/*------------------------------- file -----------------------------*/
+
+typedef struct _sba_file_store {
+	struct file *filp;
+	spinlock_t lock;
+	struct bio *head;				//bios waiting for the thread, on bi_next
+	struct bio *tail;
+	struct work_struct work;
+	struct workqueue_struct *wq;
+	char name[16];
+} sba_file_store;
+
+static void sba_file_work(void *data);
+
+static int sba_file_attach(sba_dev *dev, sba_backing *b)
+{
+	sba_file_store *fs;
+	struct file *filp;
+	loff_t bytes;
+
+	b->path[sizeof(b->path) - 1] = '\0';
+
+	filp = filp_open(b->path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(filp)) {
+		return PTR_ERR(filp);
+	}
+
+	if (!S_ISREG(filp->f_dentry->d_inode->i_mode)) {
+		filp_close(filp, NULL);
+		return -EINVAL;
+	}
+	bytes = i_size_read(filp->f_dentry->d_inode);
+
+	fs = kmalloc(sizeof(sba_file_store), GFP_KERNEL);
+	if (!fs) {
+		filp_close(filp, NULL);
+		return -ENOMEM;
+	}
+	memset(fs, 0, sizeof(sba_file_store));
+
+	fs->filp = filp;
+	spin_lock_init(&fs->lock);
+	INIT_WORK(&fs->work, sba_file_work, fs);
+	sprintf(fs->name, "sba_file%d", dev->id);
+
+	fs->wq = create_singlethread_workqueue(fs->name);
+	if (!fs->wq) {
+		filp_close(filp, NULL);
+		kfree(fs);
+		return -ENOMEM;
+	}
+
+	dev->backend_data = fs;
+
+	/*whole blocks only*/
+	dev->size = (bytes >> SBA_BLKSIZE_BITS) << (SBA_BLKSIZE_BITS - 10);
+
+	return 0;
+}
+
+static int sba_file_map(sba_dev *dev, struct bio *sba_bio)
+{
+	sba_file_store *fs = (sba_file_store *)dev->backend_data;
+	unsigned long flags;
+
+	sba_bio->bi_next = NULL;
+
+	spin_lock_irqsave(&fs->lock, flags);
+	if (fs->tail) {
+		fs->tail->bi_next = sba_bio;
+	}
+	else {
+		fs->head = sba_bio;
+	}
+	fs->tail = sba_bio;
+	spin_unlock_irqrestore(&fs->lock, flags);
+
+	queue_work(fs->wq, &fs->work);
+
+	return 0;
+}
+
+/*does the io of a bio with the read and write of the file*/
+static int sba_file_rw(sba_file_store *fs, struct bio *sba_bio)
+{
+	loff_t pos = (loff_t)sba_bio->bi_sector << SBA_HARDSECT_BITS;
+	struct bio_vec *bvec;
+	mm_segment_t old_fs;
+	ssize_t ret;
+	char *buf;
+	int i, error = 0;
+
+	old_fs = get_fs();
+	set_fs(get_ds());
+
+	bio_for_each_segment(bvec, sba_bio, i) {
+		buf = (char *)kmap(bvec->bv_page) + bvec->bv_offset;
+		if (bio_data_dir(sba_bio) == WRITE) {
+			ret = vfs_write(fs->filp, buf, bvec->bv_len, &pos);
+		}
+		else {
+			ret = vfs_read(fs->filp, buf, bvec->bv_len, &pos);
+			flush_dcache_page(bvec->bv_page);
+		}
+		kunmap(bvec->bv_page);
+
+		if (ret != bvec->bv_len) {
+			error = -EIO;
+			break;
+		}
+	}
+
+	set_fs(old_fs);
+
+	return error;
+}
+
+static void sba_file_work(void *data)
+{
+	sba_file_store *fs = (sba_file_store *)data;
+	struct bio *sba_bio;
+
+	for (;;) {
+		spin_lock_irq(&fs->lock);
+		sba_bio = fs->head;
+		if (sba_bio) {
+			fs->head = sba_bio->bi_next;
+			if (!fs->head) {
+				fs->tail = NULL;
+			}
+			sba_bio->bi_next = NULL;
+		}
+		spin_unlock_irq(&fs->lock);
+
+		if (!sba_bio) {
+			break;
+		}
+
+		bio_endio(sba_bio, sba_bio->bi_size, sba_file_rw(fs, sba_bio));
+	}
+}
+
+static void sba_file_release(sba_dev *dev)
+{
+	sba_file_store *fs = (sba_file_store *)dev->backend_data;
+
+	/*the bios still queued are done first*/
+	flush_workqueue(fs->wq);
+	destroy_workqueue(fs->wq);
+	filp_close(fs->filp, NULL);
+
+	kfree(fs);
+	dev->backend_data = NULL;
+}
+
+/*----------------------------- snapshot ---------------------------*/
+
+/*
+ * After SNAPSHOT the writes go to an overlay (a ram store) and the
+ * image below is left alone. reads of a bio that has no block in the
+ * overlay go to the backend as usual; the others are put together
+ * here, a block at a time. ROLLBACK frees the overlay.
+ */
+
+/*reads a block of the image, from below the overlay*/
+static int sba_cow_read_image(sba_dev *dev, struct page *page, unsigned long index)
+{
+	struct completion event;
+	struct bio *sba_bio;
+	int uptodate;
+
+	sba_bio = bio_alloc(GFP_NOIO, 1);
+	if (!sba_bio) {
+		return -ENOMEM;
+	}
+	init_completion(&event);
+
+	sba_bio->bi_io_vec[0].bv_page = page;
+	sba_bio->bi_io_vec[0].bv_len = PAGE_SIZE;
+	sba_bio->bi_io_vec[0].bv_offset = 0;
+	sba_bio->bi_vcnt = 1;
+	sba_bio->bi_idx = 0;
+	sba_bio->bi_size = PAGE_SIZE;
+	sba_bio->bi_sector = index << (PAGE_SHIFT - SBA_HARDSECT_BITS);
+	sba_bio->bi_end_io = sba_common_end_io;
+	sba_bio->bi_private = &event;
+	sba_bio->bi_rw = READ;
+
+	if (dev->backend->map(dev, sba_bio)) {
+		generic_make_request(sba_bio);
+	}
+	wait_for_completion(&event);
+
+	uptodate = test_bit(BIO_UPTODATE, &sba_bio->bi_flags);
+	bio_put(sba_bio);
+
+	return uptodate ? 0 : -EIO;
+}
+
+/*the overlay page of a written block. a block written only in part is copied from the image first*/
+static struct page *sba_cow_page(sba_dev *dev, sba_ram_store *cow, unsigned long index, int whole)
+{
+	struct page *page = sba_store_lookup(cow, index);
+
+	if (page) {
+		return page;
+	}
+
+	page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+	if (!page) {
+		return NULL;
+	}
+
+	if (whole) {
+		clear_highpage(page);
+	}
+	else
+	if (sba_cow_read_image(dev, page, index) < 0) {
+		__free_page(page);
+		return NULL;
+	}
+
+	return sba_store_insert(cow, index, page);
+}
+
+/*whether a block of the bio is in the overlay*/
+static int sba_cow_touches(sba_ram_store *cow, struct bio *sba_bio)
+{
+	unsigned long last = (sba_bio->bi_sector + bio_sectors(sba_bio) - 1) >> (PAGE_SHIFT - SBA_HARDSECT_BITS);
+	struct page *page;
+	int n;
+
+	spin_lock(&cow->lock);
+	n = radix_tree_gang_lookup(&cow->pages, (void **)&page, sba_bio->bi_sector >> (PAGE_SHIFT - SBA_HARDSECT_BITS), 1);
+	spin_unlock(&cow->lock);
+
+	return ((n) && (page->index <= last));
+}
+
+static int sba_cow_map(sba_dev *dev, struct bio *sba_bio)
+{
+	sba_ram_store *cow = (sba_ram_store *)dev->cow_data;
+	int write = (bio_data_dir(sba_bio) == WRITE);
+	sector_t sector = sba_bio->bi_sector;
+	struct page *image = NULL;
+	struct bio_vec *bvec;
+	int i, error = 0;
+
+	if ((!write) && (!sba_cow_touches(cow, sba_bio))) {
+		return dev->backend->map(dev, sba_bio);
+	}
+
+	bio_for_each_segment(bvec, sba_bio, i) {
+		unsigned int done = 0;
+
+		while (done < bvec->bv_len) {
+			unsigned int off = (sector << SBA_HARDSECT_BITS) & ~PAGE_MASK;
+			unsigned int len = min_t(unsigned int, bvec->bv_len - done, PAGE_SIZE - off);
+			unsigned long index = sector >> (PAGE_SHIFT - SBA_HARDSECT_BITS);
+			struct page *page;
+
+			if (write) {
+				page = sba_cow_page(dev, cow, index, (len == PAGE_SIZE));
+			}
+			else
+			if (!(page = sba_store_lookup(cow, index))) {
+				/*a block of the image next to one of the overlay*/
+				if ((!image) && (!(image = alloc_page(GFP_NOIO | __GFP_HIGHMEM)))) {
+					error = -ENOMEM;
+					goto out;
+				}
+				if (sba_cow_read_image(dev, image, index) < 0) {
+					error = -EIO;
+					goto out;
+				}
+				page = image;
+			}
+
+			if (!page) {
+				error = -ENOMEM;
+				goto out;
+			}
+			sba_store_copy(bvec, done, page, off, len, write);
+
+			done += len;
+			sector += len >> SBA_HARDSECT_BITS;
+		}
+	}
+
+	out:
+		if (image) {
+			__free_page(image);
+		}
+		bio_endio(sba_bio, sba_bio->bi_size, error);
+		return 0;
+}
+
+/*sends the writes of an attached instance to an empty overlay from now on*/
+int sba_backend_snapshot(sba_dev *dev)
+{
+	sba_ram_store *cow;
+
+	if (!dev->backend) {
+		return -ENXIO;
+	}
+	if (dev->cow_data) {
+		return -EBUSY;
+	}
+
+	if (!(cow = sba_store_create())) {
+		return -ENOMEM;
+	}
+
+	wmb();
+	dev->cow_data = cow;
+
+	return 0;
+}
+
+/*
+ * Throws away the overlay, back to the image of the snapshot. with
+ * drop the snapshot ends, else the writes go to a new empty overlay.
+ * no io may be in flight.
+ */
+int sba_backend_rollback(sba_dev *dev, int drop)
+{
+	sba_ram_store *old = (sba_ram_store *)dev->cow_data;
+	sba_ram_store *cow = NULL;
+
+	if (!old) {
+		return -ENXIO;
+	}
+
+	if ((!drop) && (!(cow = sba_store_create()))) {
+		return -ENOMEM;
+	}
+
+	dev->cow_data = cow;
+	wmb();
+
+	sba_debug(1, "sba%d: %lu blocks rolled back\n", dev->id, old->nr_pages);
+	sba_store_destroy(old);
+
+	return 0;
+}
+
+/*------------------------------------------------------------------*/
+
+static sba_backend_ops sba_backends[] = {
+	{
+		.name = "block",
+		.attach = sba_blk_attach,
+		.map = sba_blk_map,
+		.release = sba_blk_release
+	},
+	{
+		.name = "ram",
+		.attach = sba_ram_attach,
+		.map = sba_ram_map,
+		.release = sba_ram_release
+	},
+	{
+		.name = "file",
+		.attach = sba_file_attach,
+		.map = sba_file_map,
+		.release = sba_file_release
+	}
+};
+
+/*returns the backend of an SBA_BACKEND_* type, NULL for a bad type*/
+sba_backend_ops *sba_backend_get(int type)
+{
+	if ((type < SBA_BACKEND_BLOCK) || (type > SBA_BACKEND_FILE)) {
+		return NULL;
+	}
+
+	return &sba_backends[type];
+}
+
+/*
+ * map() of the instance, with the overlay of a snapshot on top. every
+ * bio on its way to the storage goes through here, so the metadata
+ * cache forgets the blocks of the writes here, before they can end.
+ */
+int sba_backend_map(sba_dev *dev, struct bio *sba_bio)
+{
+	if (bio_data_dir(sba_bio) == WRITE) {
+		sba_common_bcache_write(dev, sba_bio);
+	}
+
+	if (dev->cow_data) {
+		return sba_cow_map(dev, sba_bio);
+	}
+
+	return dev->backend->map(dev, sba_bio);
+}
+
+/*sends a bio of an attached instance to its storage*/
+void sba_backend_submit(sba_dev *dev, struct bio *sba_bio)
+{
+	if (sba_backend_map(dev, sba_bio)) {
+		generic_make_request(sba_bio);
+	}
+}
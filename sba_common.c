@@ -3,25 +3,13 @@
  * 
  * IMPORTANT: Note that we have to call the sba_ext3_block_type() function only once.
  * The reason is that the state that is used to find the block type of a dynamically
- * typed block is destroyed once its type is asked for. Therefore, we maintain a 
- * hash table h_block_types in which we store the block types of the blocks.
+ * typed block is destroyed once its type is asked for. Therefore, we store the block 
+ * types of the blocks of a request in the btype vector of its sba_request.
  */
 
+#include <linux/moduleparam.h>
 #include "sba_common.h"
 
-/*holds the statistics*/
-sba_stat ss;
-
-/*to emulate system crash*/
-int crash_system = 0;
-
-/*to crash a system after commit and before checkpointing to initiate recovery*/
-int crash_after_commit = 0;
-
-
-/*used to limit one fault at a time*/
-int fault_on_queue = 0;
-
 /*type of file system*/
 #ifdef INC_EXT3
 	int filesystem = EXT3;
@@ -33,12 +21,6 @@ int fault_on_queue = 0;
 	int filesystem = JFS;
 #endif
 
-/*this holds the fault*/
-fault *sba_fault = NULL;
-
-/*for the f_dev structure*/
-sba_dev sba_device;
-
 /*Is journal in a separate device ?*/
 int jour_dev = SAME_DEV;
 
@@ -47,22 +29,35 @@ int jour_dev = SAME_DEV;
 int journaling_mode = ORDERED_JOURNALING;
 //int journaling_mode = WRITEBACK_JOURNALING;
 
-/* this global value represents the current state of the system */
-journaling_model *sba_current_model = NULL;
+/*the trace times are relative to the load of the driver*/
+extern struct timeval start_time;
+
+/*the trace clock: the cycle counter, calibrated once when the
+ *driver is loaded. cycles_per_msec is 0 if there is no counter*/
+cycles_t start_cycles = 0;
+unsigned long cycles_per_msec = 0;
 
-static bio_end_io_t sba_common_end_io;
+/*seed of the random delays of SBA_DELAY, so that runs can be repeated*/
+unsigned int fault_seed = 1;
+module_param(fault_seed, uint, 0);
 
-/*to control addition and removal of statistics record*/
-stat_info *stat_list;
-spinlock_t stat_lock;
+static u32 fault_rand_state = 1;
+static spinlock_t fault_rand_lock = SPIN_LOCK_UNLOCKED;
 
-/*this flag indicates if the fault has been successfully injected*/
-int fault_injected = 0;
+/*slab caches and mempools for the structures that are
+ *allocated for every bio on the make_request path*/
+kmem_cache_t *sba_request_cache = NULL;
+mempool_t *sba_request_pool = NULL;
+kmem_cache_t *stat_info_cache = NULL;
+mempool_t *stat_info_pool = NULL;
 
-/*statistics will be collected by a series of calls. 
- *prev_count stores the amount of data copied on the
- *previous call*/
-int prev_count = 0;
+/*the pages of read_blocks, so that the driver can read its metadata
+ *while memory is short*/
+mempool_t *sba_page_pool = NULL;
+
+/*blocks in the metadata cache of an instance, 0 for none*/
+static int block_cache_size = 32;
+module_param(block_cache_size, int, 0);
 
 /*--------------------------------------------------------------------------*/
 
@@ -80,24 +75,85 @@ long long sba_common_diff_time(struct timeval st, struct timeval et)
 	return diff;
 }
 
-int sba_common_journal_block(struct bio *sba_bio, sector_t sector)
+/*
+ * sets start_time and calibrates the cycle counter against it.
+ * the counters of the cpus are assumed to be in sync.
+ */
+int sba_common_init_clock(void)
+{
+	struct timeval tv;
+	cycles_t c0, c1;
+	unsigned long long cycles;
+	long long usecs;
+
+	do_gettimeofday(&tv);
+	c0 = get_cycles();
+	mdelay(SBA_CLOCK_CALIBRATE_MSECS);
+	c1 = get_cycles();
+	do_gettimeofday(&start_time);
+
+	start_cycles = c1;
+	cycles_per_msec = 0;
+
+	usecs = sba_common_diff_time(tv, start_time);
+	if ((c1 <= c0) || (usecs <= 0)) {
+		sba_debug(1, "No cycle counter, the trace will use do_gettimeofday\n");
+		return 0;
+	}
+
+	cycles = (unsigned long long)(c1 - c0)*1000;
+	do_div(cycles, (unsigned long)usecs);
+	cycles_per_msec = (unsigned long)cycles;
+
+	sba_debug(1, "trace clock: %lu cycles per msec\n", cycles_per_msec);
+
+	return 1;
+}
+
+/*time for the trace, in nano seconds since the driver was loaded*/
+unsigned long long sba_common_get_time_ns(void)
+{
+	struct timeval now;
+	unsigned long long cycles, rem;
+	cycles_t c;
+
+	if (cycles_per_msec) {
+		c = get_cycles();
+		if (c < start_cycles) {
+			return 0;
+		}
+
+		cycles = (unsigned long long)(c - start_cycles);
+		rem = do_div(cycles, cycles_per_msec);
+		rem *= 1000000;
+		do_div(rem, cycles_per_msec);
+
+		return cycles*1000000 + rem;
+	}
+
+	do_gettimeofday(&now);
+
+	return (unsigned long long)sba_common_diff_time(start_time, now)*1000;
+}
+
+int sba_common_journal_block(sba_dev *dev, struct bio *sba_bio, sector_t sector)
 {
 	switch(filesystem) {
 		#ifdef INC_EXT3
 		case EXT3:
-			return sba_ext3_journal_block(sba_bio, sector);
+			return sba_ext3_journal_block(dev, sba_bio, sector);
 		break;
 		#endif
 
 		#ifdef INC_REISERFS
 		case REISERFS:
-			return sba_reiserfs_journal_block(sba_bio, sector);
+			return sba_reiserfs_journal_block(dev, sba_bio, sector);
 		break;
 		#endif
 
 		#ifdef INC_JFS
 		case JFS:
-			return sba_jfs_journal_block(sba_bio, sector);
+			return sba_jfs_journal_block(dev, sba_bio, sector);
 		break;
 		#endif
 
@@ -105,7 +161,7 @@ int sba_common_journal_block(struct bio *sba_bio, sector_t sector)
 	}
 }
 
-int sba_common_build_writeback_journaling_model(void)
+int sba_common_build_writeback_journaling_model(sba_dev *dev)
 {
 	/* states for writeback journaling 
 	 * 
@@ -351,7 +407,7 @@ int sba_common_build_writeback_journaling_model(void)
 
 	writeback_journaling->states = wbackj;
 	writeback_journaling->current_state = wbackj[0];
-	sba_current_model = writeback_journaling;
+	dev->model = writeback_journaling;
 
 	return 1;
 
@@ -362,7 +418,7 @@ ret_err:
 }
 
 
-int sba_common_build_ordered_journaling_model(void)
+int sba_common_build_ordered_journaling_model(sba_dev *dev)
 {
 	/* states for ordered journaling 
 	 * 
@@ -609,7 +665,7 @@ int sba_common_build_ordered_journaling_model(void)
 
 	ordered_journaling->states = ordj;
 	ordered_journaling->current_state = ordj[0];
-	sba_current_model = ordered_journaling;
+	dev->model = ordered_journaling;
 
 	return 1;
 
@@ -620,7 +676,7 @@ ret_err:
 }
 
 
-int sba_common_build_data_journaling_model(void)
+int sba_common_build_data_journaling_model(sba_dev *dev)
 {
 	/* states for data journaling 
 	 * 
@@ -838,7 +894,7 @@ int sba_common_build_data_journaling_model(void)
 
 	data_journaling->states = dataj;
 	data_journaling->current_state = dataj[0];
-	sba_current_model = data_journaling;
+	dev->model = data_journaling;
 
 	return 1;
 
@@ -848,19 +904,19 @@ ret_err:
 	return 0;
 }
 
-int sba_common_build_model(void)
+int sba_common_build_model(sba_dev *dev)
 {
 	switch(journaling_mode) {
 		case DATA_JOURNALING:
-			sba_common_build_data_journaling_model();
+			sba_common_build_data_journaling_model(dev);
 		break;
 
 		case ORDERED_JOURNALING:
-			sba_common_build_ordered_journaling_model();
+			sba_common_build_ordered_journaling_model(dev);
 		break;
 
 		case WRITEBACK_JOURNALING:
-			sba_common_build_writeback_journaling_model();
+			sba_common_build_writeback_journaling_model(dev);
 		break;
 
 		default:
@@ -868,17 +924,22 @@ int sba_common_build_model(void)
 			return -1;
 	}
 	
-	sba_common_print_model();
+	sba_common_print_model(dev);
 
 	return 1;
 }
 
-int sba_common_destroy_model(void)
+int sba_common_destroy_model(sba_dev *dev)
 {
 	int i;
-	sba_state **model = sba_current_model->states;
-	
-	for (i = 0; i < sba_current_model->total_states; i ++) {
+	sba_state **model;
+
+	if (!dev->model) {
+		return 1;
+	}
+
+	model = dev->model->states;
+	for (i = 0; i < dev->model->total_states; i ++) {
 		int j;
 
 		/* free all the edges from this state */
@@ -899,17 +960,19 @@ int sba_common_destroy_model(void)
 		kfree(model[i]);
 	}
 
-	kfree(sba_current_model);
+	kfree(dev->model);
+	dev->model = NULL;
 	
 	return 1;
 }
 
-int sba_common_print_model(void)
+int sba_common_print_model(sba_dev *dev)
 {
 	int i;
-	sba_state **states = sba_current_model->states;
+	sba_state **states = dev->model->states;
 
-	switch(sba_current_model->mode) {
+	printk("sba%d: ", dev->id);
+	switch(dev->model->mode) {
 		case DATA_JOURNALING:
 			printk("<<-----------Data journaling mode----------->>\n");
 		break;
@@ -923,7 +986,7 @@ int sba_common_print_model(void)
 		break;
 	}
 	
-	for (i = 0; i < sba_current_model->total_states; i ++) {
+	for (i = 0; i < dev->model->total_states; i ++) {
 		int j;
 
 		printk("%s  ", states[i]->name);
@@ -996,41 +1059,172 @@ int sba_common_print_model(void)
 	return 1;
 }
 
-/*initialize some of the common data structures*/
-int sba_common_init(void)
+static void *sba_common_page_alloc(int gfp_mask, void *pool_data)
 {
-	if (!sba_common_build_model()) {
-		return -1;
+	return alloc_page(gfp_mask);
+}
+
+static void sba_common_page_free(void *element, void *pool_data)
+{
+	__free_page((struct page *)element);
+}
+
+int sba_common_create_pools(void)
+{
+	sba_request_cache = kmem_cache_create("sba_request", sizeof(sba_request), 
+	0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+	if (!sba_request_cache) {
+		goto ret_err;
 	}
 
-	sba_fault = kmalloc(sizeof(fault), GFP_KERNEL);
-	if (!sba_fault) {
-		sba_debug(1, "Error: cannot allocate memory\n");
+	sba_request_pool = mempool_create(SBA_MIN_REQUESTS, mempool_alloc_slab, 
+	mempool_free_slab, sba_request_cache);
+	if (!sba_request_pool) {
+		goto ret_err;
+	}
+
+	stat_info_cache = kmem_cache_create("sba_stat_info", sizeof(stat_info), 
+	0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+	if (!stat_info_cache) {
+		goto ret_err;
+	}
+
+	stat_info_pool = mempool_create(SBA_MIN_STAT_INFOS, mempool_alloc_slab, 
+	mempool_free_slab, stat_info_cache);
+	if (!stat_info_pool) {
+		goto ret_err;
+	}
+
+	sba_page_pool = mempool_create(SBA_MIN_READ_PAGES, sba_common_page_alloc, 
+	sba_common_page_free, NULL);
+	if (!sba_page_pool) {
+		goto ret_err;
+	}
+
+	return 1;
+
+ret_err:
+	sba_debug(1, "Error: unable to create the slab caches and mempools\n");
+	sba_common_destroy_pools();
+
+	return 0;
+}
+
+int sba_common_destroy_pools(void)
+{
+	if (sba_page_pool) {
+		mempool_destroy(sba_page_pool);
+		sba_page_pool = NULL;
+	}
+
+	if (stat_info_pool) {
+		mempool_destroy(stat_info_pool);
+		stat_info_pool = NULL;
+	}
+
+	if (stat_info_cache) {
+		kmem_cache_destroy(stat_info_cache);
+		stat_info_cache = NULL;
+	}
+
+	if (sba_request_pool) {
+		mempool_destroy(sba_request_pool);
+		sba_request_pool = NULL;
+	}
+
+	if (sba_request_cache) {
+		kmem_cache_destroy(sba_request_cache);
+		sba_request_cache = NULL;
+	}
+
+	return 1;
+}
+
+/* 
+ * the mempools never return NULL for a gfp_mask that can
+ * wait (eg. GFP_NOIO). GFP_ATOMIC callers fall back to the
+ * preallocated elements and may still get NULL.
+ */
+sba_request *sba_common_alloc_request(int gfp_mask)
+{
+	sba_request *sba_req;
+
+	sba_req = mempool_alloc(sba_request_pool, gfp_mask);
+	if (sba_req) {
+		memset(sba_req, 0, sizeof(sba_request));
+	}
+
+	return sba_req;
+}
+
+int sba_common_free_request(sba_request *sba_req)
+{
+	if (sba_req->record != sba_req->inline_record) {
+		kfree(sba_req->record);
+	}
+
+	mempool_free(sba_req, sba_request_pool);
+
+	return 1;
+}
+
+stat_info *sba_common_alloc_stat_info(int gfp_mask)
+{
+	stat_info *si;
+
+	si = mempool_alloc(stat_info_pool, gfp_mask);
+	if (si) {
+		memset(si, 0, sizeof(stat_info));
+	}
+
+	return si;
+}
+
+int sba_common_free_stat_info(stat_info *si)
+{
+	mempool_free(si, stat_info_pool);
+	return 1;
+}
+
+/*initialize the data structures shared by the instances*/
+int sba_common_init(void)
+{
+	if (!sba_common_create_pools()) {
 		return -1;
 	}
-	memset(sba_fault, 0, sizeof(fault));
 
-	ss.total_reads = 0;
-	ss.total_writes = 0;
+	/*xorshift gets stuck at 0*/
+	fault_rand_state = fault_seed ? fault_seed : 1;
+
+	return 1;
+}
+
+int sba_common_cleanup(void)
+{
+	sba_common_destroy_pools();
 
-	SBA_LOCK_INIT(&(stat_lock));
+	return 1;
+}
 
+/*the file system tables of an instance*/
+int sba_common_init_fs(sba_dev *dev)
+{
 	switch(filesystem) {
 		#ifdef INC_EXT3
 		case EXT3:
-			sba_ext3_init();
+			sba_ext3_init(dev);
 		break;
 		#endif
 
 		#ifdef INC_REISERFS
 		case REISERFS:
-			sba_reiserfs_init();
+			sba_reiserfs_init(dev);
 		break;
 		#endif
 
 		#ifdef INC_JFS
 		case JFS:
-			sba_jfs_init();
+			sba_jfs_init(dev);
 		break;
 		#endif
 	}
@@ -1038,31 +1232,90 @@ int sba_common_init(void)
 	return 1;
 }
 
-int sba_common_cleanup(void)
+int sba_common_cleanup_fs(sba_dev *dev)
 {
-	kfree(sba_fault);
-
 	switch(filesystem) {
 		#ifdef INC_EXT3
 		case EXT3:
-			sba_ext3_cleanup();
+			sba_ext3_cleanup(dev);
 		break;
 		#endif
 
 		#ifdef INC_REISERFS
 		case REISERFS:
-			sba_reiserfs_cleanup();
+			sba_reiserfs_cleanup(dev);
 		break;
 		#endif
 
 		#ifdef INC_JFS
 		case JFS:
-			sba_jfs_cleanup();
+			sba_jfs_cleanup(dev);
 		break;
 		#endif
 	}
 
-	sba_common_destroy_model();
+	return 1;
+}
+
+/*initialize the model, fault, trace and tables of an instance*/
+int sba_common_init_dev(sba_dev *dev)
+{
+	if (!sba_common_build_model(dev)) {
+		return -1;
+	}
+
+	dev->legacy_fault = -1;
+	if (!sba_fault_init(dev)) {
+		return -1;
+	}
+
+	sba_common_zero_stat(&dev->ss);
+	sba_throttle_init(dev);
+
+	if (!sba_trace_init(&dev->trace, dev->id)) {
+		return -1;
+	}
+	sba_trace_set_base(&dev->trace, start_time.tv_sec, start_time.tv_usec*1000);
+
+	/*
+	 * the extraction cursor. lines are formatted into the staging page
+	 * and copied out a page at a time. a record leaves the trace buffer
+	 * once its line is in the page; lines that could not be copied out
+	 * stay there for the next EXTRACT_STATS. protected by the consumer
+	 * lock of the trace buffer.
+	 */
+	dev->extract_page = (char *)__get_free_page(GFP_KERNEL);
+	if (!dev->extract_page) {
+		sba_debug(1, "Error: cannot allocate memory\n");
+		return -1;
+	}
+	dev->extract_len = 0;
+
+	if (!sba_common_bcache_init(dev)) {
+		return -1;
+	}
+
+	sba_common_init_fs(dev);
+
+	return 1;
+}
+
+/*undoes sba_common_init_dev, also when it failed half way*/
+int sba_common_cleanup_dev(sba_dev *dev)
+{
+	sba_fault_cleanup(dev);
+
+	sba_common_cleanup_fs(dev);
+
+	sba_common_destroy_model(dev);
+
+	sba_common_bcache_cleanup(dev);
+
+	if (dev->extract_page) {
+		free_page((unsigned long)dev->extract_page);
+		dev->extract_page = NULL;
+	}
+	sba_trace_cleanup(&dev->trace);
 
 	return 1;
 }
@@ -1070,33 +1323,46 @@ int sba_common_cleanup(void)
 int sba_common_zero_stat(sba_stat *ss)
 {
 	ss->total_reads = ss->total_writes = 0;
+	ss->traced_bios = ss->trace_allocs = ss->kmalloc_allocs = 0;
 	return 1;
 }
 
-int sba_common_print_stat(sba_stat *ss)
+int sba_common_print_stat(sba_dev *dev)
 {
-	printk("reads %d writes %d\n", ss->total_reads, ss->total_writes);
+	sba_stat *ss = &dev->ss;
+
+	printk("sba%d: reads %d writes %d\n", dev->id, ss->total_reads, ss->total_writes);
+
+	if (ss->traced_bios) {
+		/*print the allocator calls per bio with two decimals*/
+		printk("traced bios %d: allocs/bio %d.%02d (kmalloc scheme %d.%02d)\n", ss->traced_bios, 
+		ss->trace_allocs/ss->traced_bios, ((ss->trace_allocs*100)/ss->traced_bios)%100,
+		ss->kmalloc_allocs/ss->traced_bios, ((ss->kmalloc_allocs*100)/ss->traced_bios)%100);
+	}
+
+	printk("trace records dropped %u\n", sba_trace_dropped(&dev->trace));
+
 	return 1;
 }
 
-int sba_common_print_journal(void)
+int sba_common_print_journal(sba_dev *dev)
 {
 	switch(filesystem) {
 		#ifdef INC_EXT3
 		case EXT3:
-			sba_ext3_print_journal();
+			sba_ext3_print_journal(dev);
 		break;
 		#endif
 
 		#ifdef INC_REISERFS
 		case REISERFS:
-			sba_reiserfs_print_journal();
+			sba_reiserfs_print_journal(dev);
 		break;
 		#endif
 
 		#ifdef INC_JFS
 		case JFS:
-			sba_jfs_print_journal();
+			sba_jfs_print_journal(dev);
 		break;
 		#endif
 	}
@@ -1104,7 +1370,7 @@ int sba_common_print_journal(void)
 	return 1;
 }
 
-int sba_common_handle_mkfs_write(int sector)
+int sba_common_handle_mkfs_write(sba_dev *dev, int sector)
 {
 	sba_debug(0, "Received WRITE for blk# %d\n", SBA_SECTOR_TO_BLOCK(sector));
 
@@ -1129,11 +1395,11 @@ int sba_common_handle_mkfs_write(int sector)
 }
 
 
+/*a bio for one block, of the page sba_page or of a new page if it is NULL*/
 struct bio *sba_common_alloc_and_init_bio
-(struct block_device *dev, int block, bio_end_io_t end_io_func, int rw)
+(struct block_device *dev, int block, bio_end_io_t end_io_func, int rw, struct page *sba_page)
 {
 	struct bio *sba_bio = NULL;
-	struct page *sba_page = NULL;
 
 	sba_bio = bio_alloc(GFP_KERNEL, 1);
 	if (!sba_bio) {
@@ -1141,11 +1407,13 @@ struct bio *sba_common_alloc_and_init_bio
 		return NULL;
 	}
 
-	sba_page = alloc_page(GFP_KERNEL);
 	if (!sba_page) {
-		sba_debug(1, "Error: mem allocation\n");
-		bio_put(sba_bio);
-		return NULL;
+		sba_page = alloc_page(GFP_KERNEL);
+		if (!sba_page) {
+			sba_debug(1, "Error: mem allocation\n");
+			bio_put(sba_bio);
+			return NULL;
+		}
 	}
 
 	sba_bio->bi_io_vec[0].bv_page = sba_page;
@@ -1167,11 +1435,11 @@ struct bio *sba_common_alloc_and_init_bio
 }
 
 struct bio *alloc_bio_for_read
-(struct block_device *dev, int block, bio_end_io_t end_io_func)
+(struct block_device *dev, int block, bio_end_io_t end_io_func, struct page *sba_page)
 {
 	struct bio *sba_bio = NULL;
 
-	sba_bio = sba_common_alloc_and_init_bio(dev, block, sba_common_end_io, READ_SYNC);
+	sba_bio = sba_common_alloc_and_init_bio(dev, block, end_io_func, READ_SYNC, sba_page);
 	return sba_bio;
 }
 
@@ -1197,164 +1465,454 @@ int sba_common_end_io(struct bio *sba_bio, unsigned int bytes, int error)
 	return 0;
 }
 
-char *read_block(int block)
+/*the reads of a read_blocks call, done when pending drops to 0*/
+typedef struct _sba_read_batch {
+	atomic_t pending;
+	struct completion done;
+} sba_read_batch;
+
+static int sba_common_end_io_batch(struct bio *sba_bio, unsigned int bytes, int error)
 {
-	char *ret = NULL;
-	struct bio *sba_bio = NULL;
-	struct completion *event = NULL;
+	sba_read_batch *batch = (sba_read_batch *)sba_bio->bi_private;
 
-	sba_debug(0, "Reading block %d\n", block);
+	if (sba_bio->bi_size) {
+		return 1;
+	}
+
+	if (!test_bit(BIO_UPTODATE, &sba_bio->bi_flags)) {
+		sba_debug(1, "Error: Read sec %ld\n", sba_bio->bi_sector);
+	}
+
+	if (atomic_dec_and_test(&batch->pending)) {
+		complete(&batch->done);
+	}
 
-	//this is used to wait for the completion of the io
-	event = kmalloc(sizeof(struct completion), GFP_KERNEL);
-	if (!event) {
+	return 0;
+}
+
+/*
+ * reads n blocks in one go: all the reads are sent before waiting for
+ * any of them. out[i] gets the data of blocks[i], a page to give back
+ * with put_block, or NULL if it could not be read. returns the number
+ * of blocks read.
+ */
+int read_blocks(sba_dev *dev, int *blocks, int n, char **out)
+{
+	struct bio **bios;
+	struct page *sba_page;
+	sba_read_batch batch;
+	int i, last = -1, nr_read = 0;
+
+	bios = kmalloc(n*sizeof(struct bio *), GFP_KERNEL);
+	if (!bios) {
 		sba_debug(1, "Error: mem allocation\n");
-		return NULL;
+		memset(out, 0, n*sizeof(char *));
+		return 0;
 	}
-	init_completion(event);
 
+	atomic_set(&batch.pending, 1);
+	init_completion(&batch.done);
 
-	if (!(sba_bio = alloc_bio_for_read(sba_device.f_dev, block, sba_common_end_io))) {
-		kfree(event);
-		return NULL;
+	for (i = 0; i < n; i ++) {
+		sba_page = mempool_alloc(sba_page_pool, GFP_NOIO);
+
+		bios[i] = alloc_bio_for_read(dev->f_dev, blocks[i], sba_common_end_io_batch, sba_page);
+		if (!bios[i]) {
+			mempool_free(sba_page, sba_page_pool);
+			continue;
+		}
+		bios[i]->bi_private = &batch;
+		bios[i]->bi_rw = READ;
+		last = i;
 	}
-	sba_bio->bi_private = event;
-	ret = bio_data(sba_bio);
 
-	generic_make_request(sba_bio);
-	//blk_run_queues(); //only for 2.6.5
+	/*the queue stays plugged until the last read, which is sync, so that
+	 *the elevator sees the whole batch and can merge the adjacent blocks*/
+	if (last >= 0) {
+		bios[last]->bi_rw = READ_SYNC;
+	}
 
-	wait_for_completion(event);
+	for (i = 0; i < n; i ++) {
+		if (!bios[i]) {
+			continue;
+		}
 
-	/*io over - so free the event*/
-	kfree(event);
+		sba_debug(0, "Reading block %d\n", blocks[i]);
 
-	if (test_bit(BIO_UPTODATE, &sba_bio->bi_flags)) {
-		bio_put(sba_bio);
+		atomic_inc(&batch.pending);
+		sba_backend_submit(dev, bios[i]);
 	}
-	else {
-		sba_debug(1, "Error: IO error reading block %d\n", block);
-		free_page((int)ret);
-		bio_put(sba_bio);
-		return NULL;
+
+	/*the reference of the caller, so that the batch ends after the last submit*/
+	if (!atomic_dec_and_test(&batch.pending)) {
+		wait_for_completion(&batch.done);
 	}
 
-	sba_debug(0, "Returning block %d\n", block);
-	return ret;
+	for (i = 0; i < n; i ++) {
+		out[i] = NULL;
+		if (!bios[i]) {
+			continue;
+		}
+
+		if (test_bit(BIO_UPTODATE, &bios[i]->bi_flags)) {
+			out[i] = bio_data(bios[i]);
+			nr_read ++;
+		}
+		else {
+			sba_debug(1, "Error: IO error reading block %d\n", blocks[i]);
+			mempool_free(bio_page(bios[i]), sba_page_pool);
+		}
+		bio_put(bios[i]);
+	}
+
+	kfree(bios);
+
+	return nr_read;
 }
 
-int sba_common_init_indir_blocks(unsigned long inodenr)
+char *read_block(sba_dev *dev, int block)
 {
-	switch(filesystem) {
-		#ifdef INC_EXT3
-		case EXT3:
-			sba_ext3_init_indir_blocks(inodenr);
-		break;
-		#endif
+	char *ret = NULL;
 
-		#ifdef INC_REISERFS
-		case REISERFS:
-			sba_reiserfs_init_indir_blocks(inodenr);
-		break;
-		#endif
+	read_blocks(dev, &block, 1, &ret);
 
-		#ifdef INC_JFS
-		case JFS:
-			sba_jfs_init_indir_blocks(inodenr);
-		break;
-		#endif
-	}
+	return ret;
+}
 
-	return 1;
+/*gives back a block of read_block, read_blocks or read_block_cached*/
+void put_block(char *data)
+{
+	mempool_free(virt_to_page(data), sba_page_pool);
 }
 
-int sba_common_init_dir_blocks(unsigned long inodenr)
+/*
+ * read_block for the metadata blocks that are read again and again,
+ * e.g. the inode blocks of the faults and of INIT_*_BLKS. the block
+ * comes from the cache of the instance if it is there.
+ */
+char *read_block_cached(sba_dev *dev, int block)
 {
-	switch(filesystem) {
-		#ifdef INC_EXT3
-		case EXT3:
-			sba_ext3_init_dir_blocks(inodenr);
-		break;
-		#endif
+	sba_block_cache *bc = &dev->bcache;
+	sba_cached_block *cb, *victim = NULL;
+	char *data;
+	int i, gen;
 
-		#ifdef INC_REISERFS
-		case REISERFS:
-			sba_reiserfs_init_dir_blocks(inodenr);
-		break;
-		#endif
+	if (!bc->nr_blocks) {
+		return read_block(dev, block);
+	}
 
-		#ifdef INC_JFS
-		case JFS:
-			sba_jfs_init_dir_blocks(inodenr);
-		break;
-		#endif
+	data = (char *)page_address(mempool_alloc(sba_page_pool, GFP_NOIO));
+
+	spin_lock_irq(&bc->lock);
+	for (i = 0; i < bc->nr_blocks; i ++) {
+		cb = &bc->blocks[i];
+		if (cb->blocknr == block) {
+			cb->last_used = ++ bc->clock;
+			memcpy(data, cb->data, SBA_BLKSIZE);
+			spin_unlock_irq(&bc->lock);
+			return data;
+		}
 	}
+	spin_unlock_irq(&bc->lock);
 
-	return 1;
-}
+	put_block(data);
 
-/* 
- * looks at the fault specification and collects more information
- * for fault injection 
- */
-int sba_common_process_fault()
-{
-	if (sba_fault) {
-		if (fault_on_queue) {
-			switch(filesystem) {
-				#ifdef INC_EXT3
-				case EXT3:
-					sba_ext3_process_fault(sba_fault);
-				break;
-				#endif
+	/*
+	 * announce the miss before taking gen: a write that does not see
+	 * it was mapped before our read, a write that sees it bumps gen
+	 * and we don't keep the block, or finds the entry and forgets it.
+	 */
+	atomic_inc(&bc->users);
+	smp_mb();
 
-				#ifdef INC_REISERFS
-				case REISERFS:
-					sba_reiserfs_process_fault(sba_fault);
-				break;
-				#endif
+	gen = atomic_read(&bc->gen);
+	if (!(data = read_block(dev, block))) {
+		atomic_dec(&bc->users);
+		return NULL;
+	}
+
+	spin_lock_irq(&bc->lock);
 
-				#ifdef INC_JFS
-				case JFS:
-					sba_jfs_process_fault(sba_fault);
+	if (atomic_read(&bc->gen) == gen) {
+		for (i = 0; i < bc->nr_blocks; i ++) {
+			cb = &bc->blocks[i];
+			if (cb->blocknr < 0) {
+				victim = cb;
 				break;
-				#endif
+			}
+			if ((!victim) || (cb->last_used < victim->last_used)) {
+				victim = cb;
 			}
 		}
-	}
 
-	return 1;
-}
+		if (!victim->data) {
+			victim->data = (char *)__get_free_page(GFP_ATOMIC);
+		}
 
-int reinit_fault(fault *f)
+		if (victim->data) {
+			/*the miss becomes the entry*/
+			if (victim->blocknr >= 0) {
+				atomic_dec(&bc->users);
+			}
+			memcpy(victim->data, data, SBA_BLKSIZE);
+			victim->blocknr = block;
+			victim->last_used = ++ bc->clock;
+			spin_unlock_irq(&bc->lock);
+			return data;
+		}
+	}
+
+	spin_unlock_irq(&bc->lock);
+	atomic_dec(&bc->users);
+
+	return data;
+}
+
+/*forgets the blocks that a write to the storage changes*/
+void sba_common_bcache_write(sba_dev *dev, struct bio *sba_bio)
+{
+	sba_block_cache *bc = &dev->bcache;
+	long first, last;
+	unsigned long flags;
+	int i;
+
+	/*nothing cached and no miss in flight, the usual case on the io path*/
+	if (!atomic_read(&bc->users)) {
+		return;
+	}
+
+	/*a miss that takes bc->lock after us sees it*/
+	atomic_inc(&bc->gen);
+
+	first = SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector);
+	last = SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector + (sba_bio->bi_size >> SBA_HARDSECT_BITS) - 1);
+
+	spin_lock_irqsave(&bc->lock, flags);
+	for (i = 0; i < bc->nr_blocks; i ++) {
+		if ((bc->blocks[i].blocknr >= first) && (bc->blocks[i].blocknr <= last)) {
+			bc->blocks[i].blocknr = -1;
+			atomic_dec(&bc->users);
+		}
+	}
+	spin_unlock_irqrestore(&bc->lock, flags);
+}
+
+/*forgets all the blocks, e.g. when the storage changes under the instance*/
+void sba_common_bcache_flush(sba_dev *dev)
+{
+	sba_block_cache *bc = &dev->bcache;
+	int i;
+
+	atomic_inc(&bc->gen);
+
+	spin_lock_irq(&bc->lock);
+	for (i = 0; i < bc->nr_blocks; i ++) {
+		if (bc->blocks[i].blocknr >= 0) {
+			bc->blocks[i].blocknr = -1;
+			atomic_dec(&bc->users);
+		}
+	}
+	spin_unlock_irq(&bc->lock);
+}
+
+int sba_common_bcache_init(sba_dev *dev)
+{
+	sba_block_cache *bc = &dev->bcache;
+	int i;
+
+	spin_lock_init(&bc->lock);
+	atomic_set(&bc->gen, 0);
+	atomic_set(&bc->users, 0);
+
+	if (block_cache_size <= 0) {
+		return 1;
+	}
+
+	bc->blocks = kmalloc(block_cache_size*sizeof(sba_cached_block), GFP_KERNEL);
+	if (!bc->blocks) {
+		sba_debug(1, "Error: cannot allocate memory\n");
+		return 0;
+	}
+
+	for (i = 0; i < block_cache_size; i ++) {
+		bc->blocks[i].blocknr = -1;
+		bc->blocks[i].last_used = 0;
+		bc->blocks[i].data = NULL;
+	}
+	bc->nr_blocks = block_cache_size;
+
+	return 1;
+}
+
+int sba_common_bcache_cleanup(sba_dev *dev)
+{
+	sba_block_cache *bc = &dev->bcache;
+	int i;
+
+	if (!bc->blocks) {
+		return 1;
+	}
+
+	for (i = 0; i < bc->nr_blocks; i ++) {
+		if (bc->blocks[i].data) {
+			free_page((unsigned long)bc->blocks[i].data);
+		}
+	}
+
+	kfree(bc->blocks);
+	bc->blocks = NULL;
+	bc->nr_blocks = 0;
+
+	return 1;
+}
+
+int sba_common_init_indir_blocks(sba_dev *dev, unsigned long inodenr)
+{
+	switch(filesystem) {
+		#ifdef INC_EXT3
+		case EXT3:
+			sba_ext3_init_indir_blocks(dev, inodenr);
+		break;
+		#endif
+
+		#ifdef INC_REISERFS
+		case REISERFS:
+			sba_reiserfs_init_indir_blocks(dev, inodenr);
+		break;
+		#endif
+
+		#ifdef INC_JFS
+		case JFS:
+			sba_jfs_init_indir_blocks(dev, inodenr);
+		break;
+		#endif
+	}
+
+	return 1;
+}
+
+int sba_common_init_dir_blocks(sba_dev *dev, unsigned long inodenr)
+{
+	switch(filesystem) {
+		#ifdef INC_EXT3
+		case EXT3:
+			sba_ext3_init_dir_blocks(dev, inodenr);
+		break;
+		#endif
+
+		#ifdef INC_REISERFS
+		case REISERFS:
+			sba_reiserfs_init_dir_blocks(dev, inodenr);
+		break;
+		#endif
+
+		#ifdef INC_JFS
+		case JFS:
+			sba_jfs_init_dir_blocks(dev, inodenr);
+		break;
+		#endif
+	}
+
+	return 1;
+}
+
+/* 
+ * looks at the fault specification and collects more information
+ * for fault injection 
+ */
+int sba_common_process_fault(sba_dev *dev, fault *f)
+{
+	switch(filesystem) {
+		#ifdef INC_EXT3
+		case EXT3:
+			sba_ext3_process_fault(dev, f);
+		break;
+		#endif
+
+		#ifdef INC_REISERFS
+		case REISERFS:
+			sba_reiserfs_process_fault(dev, f);
+		break;
+		#endif
+
+		#ifdef INC_JFS
+		case JFS:
+			sba_jfs_process_fault(dev, f);
+		break;
+		#endif
+	}
+
+	return 1;
+}
+
+/*PROCESS_FAULT: processes the fault of INJECT_FAULT while it is armed*/
+int sba_common_process_legacy_fault(sba_dev *dev)
 {
+	sba_fault_info info;
+
+	info.id = dev->legacy_fault;
+	if ((info.id >= 0) && (sba_fault_get(dev, &info) == 0) && (info.armed)) {
+		sba_common_process_fault(dev, &info.f);
+		sba_fault_update(dev, info.id, &info.f);
+	}
+
+	return 1;
+}
+
+/*
+ * the only block that fault f can match, or -1 if it can match any
+ * block of its type. the fault table indexes the fault by it.
+ */
+int sba_common_fault_blocknr(sba_dev *dev, fault *f)
+{
+	switch(filesystem) {
+		#ifdef INC_EXT3
+		case EXT3:
+			return sba_ext3_fault_blocknr(dev, f);
+		#endif
+
+		default:
+			return -1;
+	}
+}
+
+/*REINIT_FAULT: replaces the fault of INJECT_FAULT while it is armed*/
+int reinit_fault(sba_dev *dev, fault *f)
+{
+	sba_fault_info info;
+
 	if (f) {
-		if (fault_on_queue > 0) {
+		info.id = dev->legacy_fault;
+		if ((info.id >= 0) && (sba_fault_get(dev, &info) == 0) && (info.armed)) {
 			if (filesystem != f->filesystem) {
 				sba_debug(1, "Error: wrong file system specified\n");
 				return 0;
 			}
 			
-			memcpy(sba_fault, f, sizeof(fault));
-
-			fault_on_queue = 1;
-			sba_common_print_fault();
+			sba_fault_update(dev, info.id, f);
+			sba_common_print_fault(f);
 
 			/*set this flag to indicate a new fault has been 
 			 *added that has not yet been injected*/
-			fault_injected = 0;
+			dev->fault_injected = 0;
 		}
 	}
 	
 	return 1;
 }
 
-/*adds the user issued fault to sba_fault structure*/
-//TODO: change this to accept a list of faults to emulate
-int add_fault(fault *f)
+/*
+ * INJECT_FAULT: adds the user issued fault to the fault table. there
+ * is one such fault at a time, ADD_FAULT adds as many as needed.
+ */
+int add_fault(sba_dev *dev, fault *f)
 {
+	sba_fault_info info;
+	int id;
+
 	if (f) {
-		if (fault_on_queue > 0) {
+		info.id = dev->legacy_fault;
+		if ((info.id >= 0) && (sba_fault_get(dev, &info) == 0) && (info.armed)) {
 			sba_debug(1, "Warning: Already a fault is on queue\n");
 			return 0;
 		}
@@ -1363,36 +1921,48 @@ int add_fault(fault *f)
 				sba_debug(1, "Error: wrong file system specified\n");
 				return 0;
 			}
-			
-			memcpy(sba_fault, f, sizeof(fault));
 
-			fault_on_queue = 1;
-			sba_common_print_fault();
+			if (dev->legacy_fault >= 0) {
+				sba_fault_del(dev, dev->legacy_fault);
+				dev->legacy_fault = -1;
+			}
+
+			if ((id = sba_fault_add(dev, f)) < 0) {
+				return 0;
+			}
+			dev->legacy_fault = id;
+			sba_common_print_fault(f);
 
 			/*set this flag to indicate a new fault has been 
 			 *added that has not yet been injected*/
-			fault_injected = 0;
+			dev->fault_injected = 0;
 		}
 	}
 	
 	return 1;
 }
 
-int remove_fault(int force)
+/*removes all the faults, or with REM_NOFORCE the ones that are not STICKY*/
+int remove_fault(sba_dev *dev, int force)
 {
-	if ((force == REM_FORCE) || (sba_fault->fault_mode != STICKY)) { 
-		sba_debug(1, "Removing the fault ...\n");
-		fault_on_queue = 0;
+	sba_fault_info info;
+
+	sba_debug(1, "Removing the faults ...\n");
+	sba_fault_clear(dev, force);
+
+	info.id = dev->legacy_fault;
+	if ((info.id >= 0) && (sba_fault_get(dev, &info) < 0)) {
+		dev->legacy_fault = -1;
 	}
 
 	return 1;
 }
 
-char *sba_common_get_block_type_str(hash_table *h_btype, int sector)
+char *sba_common_get_block_type_str(sba_request *sba_req, int seg)
 {
-	int blk_type = sba_common_get_block_type(h_btype, sector);
+	int blk_type = sba_common_get_block_type(sba_req, seg);
 
-	switch(sba_fault->filesystem) {
+	switch(filesystem) {
 	#ifdef INC_EXT3
 		case EXT3:
 			return sba_ext3_get_block_type_str(blk_type);
@@ -1416,7 +1986,7 @@ char *sba_common_get_block_type_str(hash_table *h_btype, int sector)
 	}
 }
 
-int sba_common_print_fault(void)
+int sba_common_print_fault(fault *sba_fault)
 {
 	char *filesystem = "";
 	char *rw = "";
@@ -1473,6 +2043,10 @@ int sba_common_print_fault(void)
 			ftype = "corrupt";
 		break;
 
+		case SBA_DELAY:
+			ftype = "delay";
+		break;
+
 		default:
 			ftype = "unknown";
 		break;
@@ -1494,12 +2068,250 @@ int sba_common_print_fault(void)
 	}
 
 	sba_debug(1, "FS: %s RW: %s TYPE: %s MODE: %s BLK: %s NR: %d\n", filesystem, rw, ftype, fmode, btype, sba_fault->blocknr);
+	if (sba_fault->fault_type == SBA_DELAY) {
+		sba_debug(1, "DELAY: dist %d msecs %d max %d\n", sba_fault->delay_dist, sba_fault->delay_msecs, sba_fault->delay_max_msecs);
+	}
+	if (sba_fault->fault_type == SBA_CORRUPT) {
+		sba_debug(1, "CORRUPT: mode %d seed %u bits %d offset %d len %d field %d index %d value %u\n", sba_fault->corrupt_mode,
+		sba_fault->corrupt_seed, sba_fault->corrupt_count, sba_fault->corrupt_offset, sba_fault->corrupt_len,
+		sba_fault->corrupt_field, sba_fault->corrupt_index, sba_fault->corrupt_value);
+	}
+	if ((sba_fault->trigger != SBA_TRIGGER_FIRST) || (sba_fault->window_end_msecs)) {
+		sba_debug(1, "TRIGGER: %d ppm %u n %u window %u-%u msecs\n", sba_fault->trigger, sba_fault->trigger_ppm,
+		sba_fault->trigger_n, sba_fault->window_start_msecs, sba_fault->window_end_msecs);
+	}
+
+	return 1;
+}
+
+/*xorshift32 - good enough to spread the delays*/
+u32 sba_common_xorshift(u32 x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return x;
+}
+
+u32 sba_common_random(void)
+{
+	u32 x;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fault_rand_lock, flags);
+	x = sba_common_xorshift(fault_rand_state);
+	fault_rand_state = x;
+	spin_unlock_irqrestore(&fault_rand_lock, flags);
+
+	return x;
+}
+
+/*log2 of x (> 0) in 16.16 fixed point*/
+static u32 sba_common_log2(u32 x)
+{
+	int i;
+	int msb = 31;
+	u32 result;
+	u64 y;
+
+	while (!(x & (1U << msb))) {
+		msb --;
+	}
+	result = msb << 16;
+
+	/*the fraction, a bit at a time: y in [1, 2) with 31 fraction bits*/
+	y = ((u64)x << 31) >> msb;
+	for (i = 15; i >= 0; i --) {
+		y = (y*y) >> 31;
+		if (y >= (2ULL << 31)) {
+			y >>= 1;
+			result |= 1 << i;
+		}
+	}
+
+	return result;
+}
+
+/*draws the delay of an SBA_DELAY fault from its distribution*/
+int sba_common_delay_msecs(fault *f)
+{
+	u32 r;
+	u64 nlog;
+	u64 delay;
+
+	switch(f->delay_dist) {
+		case SBA_DELAY_FIXED:
+			return f->delay_msecs;
+
+		case SBA_DELAY_UNIFORM:
+			if (f->delay_max_msecs <= f->delay_msecs) {
+				return f->delay_msecs;
+			}
+			return f->delay_msecs + sba_common_random() % (f->delay_max_msecs - f->delay_msecs + 1);
+
+		case SBA_DELAY_EXP:
+			/*-ln(u) = (32 - log2(r)) * ln(2), for u = r/2^32, in 16.16*/
+			r = sba_common_random();
+			nlog = ((u64)((32 << 16) - sba_common_log2(r))*45426) >> 16;
+			delay = ((u64)f->delay_msecs*nlog) >> 16;
+
+			if ((f->delay_max_msecs > 0) && (delay > f->delay_max_msecs)) {
+				delay = f->delay_max_msecs;
+			}
+			return (int)delay;
+
+		default:
+			return 0;
+	}
+}
+
+/*clips [*offset, *offset + *len) to a block of size bytes, returns 0 if nothing is left*/
+static int sba_common_clip_range(int *offset, int *len, int size)
+{
+	if ((*offset < 0) || (*offset >= size) || (*len <= 0)) {
+		return 0;
+	}
+
+	if (*len > size - *offset) {
+		*len = size - *offset;
+	}
 
 	return 1;
 }
 
-int sba_common_fault_match(char *data, sector_t sector, struct bio *sba_bio, hash_table *h_this)
+/*
+ * does what an SBA_CORRUPT fault says to the len bytes of the block
+ * at sector. the same fault always corrupts a block the same way.
+ */
+int sba_common_corrupt_block(sba_dev *dev, fault *f, char *data, int len, sector_t sector)
 {
+	int i;
+	u32 x, bit;
+	int offset = f->corrupt_offset;
+	int size = f->corrupt_len;
+	int plen = strlen(WR_PATTERN);
+
+	switch(f->corrupt_mode) {
+		case SBA_CORRUPT_BITFLIP:
+			x = f->corrupt_seed ? f->corrupt_seed : 1;
+			for (i = 0; i < ((f->corrupt_count > 0) ? f->corrupt_count : 1); i ++) {
+				x = sba_common_xorshift(x);
+				bit = x % (len*8);
+				data[bit >> 3] ^= 1 << (bit & 7);
+			}
+		break;
+
+		case SBA_CORRUPT_ZERO:
+			if (!sba_common_clip_range(&offset, &size, len)) {
+				return 0;
+			}
+			memset(data + offset, 0, size);
+		break;
+
+		case SBA_CORRUPT_PATTERN:
+			if (!sba_common_clip_range(&offset, &size, len)) {
+				return 0;
+			}
+			for (i = 0; i < size; i ++) {
+				data[offset + i] = WR_PATTERN[i % plen];
+			}
+		break;
+
+		case SBA_CORRUPT_FIELD:
+			switch(filesystem) {
+				#ifdef INC_EXT3
+				case EXT3:
+					if (!sba_ext3_field_location(dev, f, sector, &offset, &size)) {
+						return 0;
+					}
+				break;
+				#endif
+
+				default:
+					return 0;
+			}
+
+			if (!sba_common_clip_range(&offset, &size, len)) {
+				return 0;
+			}
+			*(__le32 *)(data + offset) = cpu_to_le32(f->corrupt_value);
+		break;
+
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * corrupts segment seg of a request. a read is corrupted in its own
+ * buffer: that is what the disk returned. a write must not touch the
+ * page of the fs, so the segment is copied to a private page, which
+ * sba_common_use_corrupt_pages later puts in the clone sent to disk.
+ */
+int sba_common_corrupt_segment(struct bio *sba_bio, sba_request *sba_req, int seg, fault *f)
+{
+	struct bio_vec *bvec = bio_iovec_idx(sba_bio, seg);
+	char *data = page_address(bvec->bv_page) + bvec->bv_offset;
+	struct page *page;
+
+	if (bio_data_dir(sba_bio) == WRITE) {
+		page = alloc_page(GFP_NOIO);
+		if (!page) {
+			sba_debug(1, "Error: no page to corrupt blk %ld\n", SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector + seg*8));
+			return 0;
+		}
+
+		memcpy(page_address(page) + bvec->bv_offset, data, bvec->bv_len);
+		data = page_address(page) + bvec->bv_offset;
+
+		page->index = seg;
+		page->private = (unsigned long)sba_req->corrupt_pages;
+		sba_req->corrupt_pages = page;
+	}
+
+	if (!sba_common_corrupt_block(sba_req->dev, f, data, bvec->bv_len, sba_bio->bi_sector + seg*8)) {
+		sba_debug(1, "Error: the corruption does not apply to blk %ld\n", SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector + seg*8));
+		return 0;
+	}
+
+	return 1;
+}
+
+/*points the corrupted segments of a clone of the request at their private copies*/
+int sba_common_use_corrupt_pages(sba_request *sba_req, struct bio *sba_bio_clone)
+{
+	struct page *page;
+
+	for (page = sba_req->corrupt_pages; page; page = (struct page *)page->private) {
+		if ((page->index >= sba_bio_clone->bi_idx) && (page->index < sba_bio_clone->bi_vcnt)) {
+			bio_iovec_idx(sba_bio_clone, page->index)->bv_page = page;
+		}
+	}
+
+	return 1;
+}
+
+/*once the clones are done*/
+int sba_common_free_corrupt_pages(sba_request *sba_req)
+{
+	struct page *page;
+
+	while ((page = sba_req->corrupt_pages)) {
+		sba_req->corrupt_pages = (struct page *)page->private;
+		page->private = 0;
+		__free_page(page);
+	}
+
+	return 1;
+}
+
+int sba_common_fault_match(fault *sba_fault, char *data, sector_t sector, struct bio *sba_bio, sba_request *sba_req, int seg)
+{
+	sba_dev *dev = sba_req->dev;
+
 	if (sba_fault->rw == SBA_WRITE) {
 		if ((sba_bio->bi_rw == WRITE) || (sba_bio->bi_rw == WRITE_SYNC)) {
 		}
@@ -1527,22 +2339,22 @@ int sba_common_fault_match(char *data, sector_t sector, struct bio *sba_bio, has
 		switch(sba_fault->filesystem) {
 			#ifdef INC_EXT3
 			case EXT3:
-				if (sba_common_get_block_type(h_this, sector) == sba_fault->blk_type) {
-					if (sba_ext3_fault_match(data, sector, sba_fault)) {
+				if (sba_common_get_block_type(sba_req, seg) == sba_fault->blk_type) {
+					if (sba_ext3_fault_match(dev, data, sector, sba_fault)) {
 						sba_debug(1, "Block %ld MATCHES with sba_fault\n", SBA_SECTOR_TO_BLOCK(sector));
 						return 1;
 					}
 				}
 				else {
-					sba_debug(0, "block %ld in ht %x didn't match the fault\n", SBA_SECTOR_TO_BLOCK(sector), (int)h_this);
+					sba_debug(0, "block %ld in req %x didn't match the fault\n", SBA_SECTOR_TO_BLOCK(sector), (int)sba_req);
 				}
 			break;
 			#endif
 
 			#ifdef INC_REISERFS
 			case REISERFS:
-				if (sba_common_get_block_type(h_this, sector) == sba_fault->blk_type) {
-					if (sba_reiserfs_fault_match(data, sector, sba_fault)) {
+				if (sba_common_get_block_type(sba_req, seg) == sba_fault->blk_type) {
+					if (sba_reiserfs_fault_match(dev, data, sector, sba_fault)) {
 						sba_debug(1, "Block %ld MATCHES with sba_fault\n", SBA_SECTOR_TO_BLOCK(sector));
 						return 1;
 					}
@@ -1552,9 +2364,9 @@ int sba_common_fault_match(char *data, sector_t sector, struct bio *sba_bio, has
 
 			#ifdef INC_JFS
 			case JFS:
-				if (sba_common_get_block_type(h_this, sector) == sba_fault->blk_type) {
+				if (sba_common_get_block_type(sba_req, seg) == sba_fault->blk_type) {
 					sba_debug(0, "sba_common_get_block_type matches with type %s\n", sba_common_get_btype_str(sba_fault->blk_type));
-					if (sba_jfs_fault_match(data, sector, sba_fault)) {
+					if (sba_jfs_fault_match(dev, data, sector, sba_fault)) {
 						sba_debug(1, "Block %ld MATCHES with sba_fault\n", SBA_SECTOR_TO_BLOCK(sector));
 						return 1;
 					}
@@ -1579,11 +2391,11 @@ int sba_common_fault_match(char *data, sector_t sector, struct bio *sba_bio, has
 	return 0;
 }
 
-int sba_common_commit_block(hash_table *h_this, int sector)
+int sba_common_commit_block(sba_request *sba_req, int seg)
 {
 	switch (filesystem) {
 		case EXT3:
-			if (sba_common_get_block_type(h_this, sector) == SBA_EXT3_COMMIT) {
+			if (sba_common_get_block_type(sba_req, seg) == SBA_EXT3_COMMIT) {
 				return 1;
 			}
 		break;
@@ -1606,37 +2418,33 @@ int sba_common_commit_block(hash_table *h_this, int sector)
 int sba_common_inject_fault(struct bio *sba_bio, sba_request *sba_req, int *uptodate)
 {
 	int proceed = 1;
-	hash_table *h_this_block_types = NULL;
 
 	/* 
-	 * Before doing anything, first build the table that 
-	 * stores the block types for the set of blocks in 
-	 * this request. This is important as we will use that 
-	 * table for future references in this function for 
-	 * this request. We create one hash_table for each new
-	 * request and destroy it at the end of the request 
-	 * because if we use just one table for all the request 
-	 * then we may get into potential concurrency problems.
+	 * Before doing anything, first find the block types 
+	 * of the set of blocks in this request. This is 
+	 * important as we will use them for future references 
+	 * in this function for this request. They are kept in 
+	 * the request itself (one entry per segment), so that 
+	 * concurrent requests never share any state and no 
+	 * memory is allocated here.
 	 */
 	
-	h_this_block_types = sba_common_build_block_types_table(sba_bio);
-	sba_common_collect_stats(sba_req, h_this_block_types);
+	sba_common_build_block_types(sba_bio, sba_req);
+	sba_common_collect_stats(sba_req);
 
 	/*we can administer the fault now, if any*/
-	proceed = sba_common_execute_fault(sba_bio, uptodate, h_this_block_types);
-
-	/* Now clear the table. */
-	sba_common_destroy_block_types_table(h_this_block_types);
+	proceed = sba_common_execute_fault(sba_bio, uptodate, sba_req);
 
 	return proceed;
 }
 
-int sba_common_execute_fault(struct bio *sba_bio, int *uptodate, hash_table *h_this)
+int sba_common_execute_fault(struct bio *sba_bio, int *uptodate, sba_request *sba_req)
 {
+	sba_dev *dev = sba_req->dev;
+	fault f;
 	int i;
 	char *data;
 	struct bio_vec *bvl;
-	int rem_fault = 1;
 
 	/*to know if the request need to be passed to the actual device*/
 	int proceed = 1; 
@@ -1648,46 +2456,46 @@ int sba_common_execute_fault(struct bio *sba_bio, int *uptodate, hash_table *h_t
 
 		data = (page_address(bio_iovec_idx(sba_bio, i)->bv_page) + bio_iovec_idx(sba_bio, i)->bv_offset);
 
-		/*is there a fault to cause ?*/
-		if (fault_on_queue > 0) {
+		/*does this block match one of the faults ?*/
+		if (sba_fault_lookup(dev, data, sba_bio->bi_sector + i*8, sba_bio, sba_req, i, &f) >= 0) {
 
-			/*does this block matches the fault criterion ?*/
-			if (sba_common_fault_match(data, sba_bio->bi_sector + i*8, sba_bio, h_this)) {
+			sba_debug(1, "rw %ld blk %ld size %d\n", sba_bio->bi_rw, SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector + i*8), size);
+			sba_common_print_fault(&f);
 
-				sba_debug(1, "rw %ld blk %ld size %d\n", sba_bio->bi_rw, SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector + i*8), size);
-				sba_common_print_fault();
+			/*add statistics about the fault*/
+			sba_common_add_fault_injection_stats(sba_req, i, sba_bio->bi_sector + i*8, &f);
 
-				/*add statistics about the fault*/
-				sba_common_add_fault_injection_stats(h_this, sba_bio->bi_sector + i*8);
+			/*only this segment fails, the caller writes the rest*/
+			if (f.fault_type == SBA_FAIL) {
+				sba_req->failed[i] = 1;
+				sba_req->nr_failed ++;
+				*uptodate = 0;
+				proceed = 0;
+			}
 
-				if (sba_fault->fault_type == SBA_FAIL) {
-					*uptodate = 0;
-					proceed = 0;
-				}
+			if (f.fault_type == SBA_CORRUPT) {
+				sba_common_corrupt_segment(sba_bio, sba_req, i, &f);
+			}
 
-				/*we can remove the fault*/
-				if (rem_fault) {
-					sba_debug(1, "Removing the fault ...\n");
-					remove_fault(REM_NOFORCE);
-				}
-				else {
-					sba_debug(1, "Not removing the fault ...\n");
-				}
+			/*hold the whole request for the longest delay of its blocks*/
+			if (f.fault_type == SBA_DELAY) {
+				int delay = sba_common_delay_msecs(&f);
 
-				/*set this flag to indicate that the fault has been injected*/
-				fault_injected = 1;
+				if (delay > sba_req->delay_msecs) {
+					sba_req->delay_msecs = delay;
+				}
 			}
-		}
-		else {
-			sba_debug(0, "There is no fault on queue\n");
+
+			/*set this flag to indicate that the fault has been injected*/
+			dev->fault_injected = 1;
 		}
 
 		/* if this is a commit block, and if we are asked to crash after 
 		 * commit, set the corresponding flags */
-		if (crash_after_commit) {
-			if (sba_common_commit_block(h_this, sba_bio->bi_sector + i*8)) {
-				crash_system = 1;
-				sba_common_add_crash_stats();
+		if (dev->crash_after_commit) {
+			if (sba_common_commit_block(sba_req, i)) {
+				dev->crash_system = 1;
+				sba_common_add_crash_stats(dev);
 			}
 		}
 	}
@@ -1752,47 +2560,30 @@ char *sba_common_get_btype_str(int btype)
 	return ret;
 }
 
-int sba_common_move_to_start(void)
+int sba_common_move_to_start(sba_dev *dev)
 {
-	sba_current_model->current_state = sba_current_model->states[0];
+	dev->model->current_state = dev->model->states[0];
 	return 1;
 }
 
-sba_state *sba_common_get_current_state(void)
+sba_state *sba_common_get_current_state(sba_dev *dev)
 {
-	return sba_current_model->current_state;
+	return dev->model->current_state;
 }
 
-/* this routine will get the block type for a particular block */
-int sba_common_get_block_type(hash_table *h_this, sector_t sector)
+/* this routine will get the block type for a particular segment of the request */
+int sba_common_get_block_type(sba_request *sba_req, int seg)
 {
-	int ret;
-	
-	if (!ht_lookup_val(h_this, sector, &ret)) {
-		sba_debug(1, "Error: block type not found for block %ld (ht %x)\n", SBA_SECTOR_TO_BLOCK(sector), (int)h_this);
-		ret = UNKNOWN_BLOCK;
+	if ((seg < 0) || (seg >= sba_req->nr_btypes)) {
+		sba_debug(1, "Error: block type not found for segment %d (req %x)\n", seg, (int)sba_req);
+		return UNKNOWN_BLOCK;
 	}
 	
-	return ret;
-}
-
-/* this method removes all the block numbers from the hash table */
-int sba_common_destroy_block_types_table(hash_table *h_this)
-{
-	int sector;
-	ht_open_scan(h_this);
-
-	while (ht_scan(h_this, &sector) > 0) {
-		ht_remove(h_this, sector);
-	}
-
-	ht_destroy(h_this);
-
-	return 1;
+	return sba_req->btype[seg];
 }
 
-/* this method constructs a table with block numbers and their types */
-hash_table *sba_common_build_block_types_table(struct bio *sba_bio)
+/* this method fills the btype vector of the request with the block types */
+int sba_common_build_block_types(struct bio *sba_bio, sba_request *sba_req)
 {
 	int i;
 	struct bio_vec *bvl;
@@ -1800,18 +2591,22 @@ hash_table *sba_common_build_block_types_table(struct bio *sba_bio)
 	char *data;
 	int btype;
 	char type[12];
-	hash_table *h_this = NULL;
 
-	ht_create(&h_this, "this_hashtable");
+	sba_req->nr_btypes = 0;
 
 	bio_for_each_segment(bvl, sba_bio, i) {
 		data = (page_address(bio_iovec_idx(sba_bio, i)->bv_page) + bio_iovec_idx(sba_bio, i)->bv_offset);
 		sector = sba_bio->bi_sector + i*8;
 
+		if (i >= SBA_MAX_BIO_BLOCKS) {
+			sba_debug(1, "Error: more than %d blocks in bio %x\n", SBA_MAX_BIO_BLOCKS, (int)sba_bio);
+			break;
+		}
+
 		switch(filesystem) {
 			#ifdef INC_EXT3
 			case EXT3:
-				btype = sba_ext3_block_type(data, sector, type, sba_bio);
+				btype = sba_ext3_block_type(sba_req->dev, data, sector, type, sba_bio);
 
 				//if (btype == UNKNOWN_BLOCK) {
 					//sba_debug(1, "block = %d btype = %s\n", SBA_SECTOR_TO_BLOCK(sector), sba_ext3_get_block_type_str(btype));
@@ -1821,13 +2616,13 @@ hash_table *sba_common_build_block_types_table(struct bio *sba_bio)
 
 			#ifdef INC_REISERFS
 			case REISERFS:
-				btype = sba_reiserfs_block_type(data, sector, type, sba_bio);
+				btype = sba_reiserfs_block_type(sba_req->dev, data, sector, type, sba_bio);
 			break;
 			#endif
 
 			#ifdef INC_JFS
 			case JFS:
-				btype = sba_jfs_block_type(data, sector, type, sba_bio);
+				btype = sba_jfs_block_type(sba_req->dev, data, sector, type, sba_bio);
 				sba_debug(1, "JFS block %d is of type %s\n", 
 				SBA_SECTOR_TO_BLOCK(sector), sba_common_get_btype_str(btype));
 			break;
@@ -1837,24 +2632,23 @@ hash_table *sba_common_build_block_types_table(struct bio *sba_bio)
 				btype = UNKNOWN_BLOCK;
 		}
 
-		sba_debug(0, "adding block = %d to ht %x from bio %x\n", SBA_SECTOR_TO_BLOCK(sector), (int)h_this, (int)sba_bio);
-		ht_add_val(h_this, sector, btype);
+		sba_debug(0, "block = %d is segment %d of req %x from bio %x\n", SBA_SECTOR_TO_BLOCK(sector), i, (int)sba_req, (int)sba_bio);
+		sba_req->btype[i] = btype;
+		sba_req->nr_btypes = i + 1;
 	}
 
-	return h_this;
+	return 1;
 }
 
 /* this routine will get the block type of the last block in the entire bio */
-int sba_common_find_last_block_type(struct bio *sba_bio, hash_table *h_this)
+int sba_common_find_last_block_type(struct bio *sba_bio, sba_request *sba_req)
 {
 	int i;
 	struct bio_vec *bvl;
-	int sector;
 	int btype = UNKNOWN_BLOCK;
 
 	bio_for_each_segment(bvl, sba_bio, i) {
-		sector = sba_bio->bi_sector + i*8;
-		btype = sba_common_get_block_type(h_this, sector);
+		btype = sba_common_get_block_type(sba_req, i);
 	}
 
 	return btype;
@@ -1879,10 +2673,10 @@ int sba_common_edge_match(sba_state_input e1, sba_state_input e2)
 	return ret;
 }
 
-int sba_common_move(int btype, int response)
+int sba_common_move(sba_dev *dev, int btype, int response)
 {
 	int ret = INVALID_STATE;
-	sba_state *s = sba_current_model->current_state;
+	sba_state *s = dev->model->current_state;
 
 
 	if (s) {
@@ -1899,7 +2693,7 @@ int sba_common_move(int btype, int response)
 			if (ht_lookup_val(s->h_out_edges, i, (int*)&e)) {
 				if (sba_common_edge_match(e->input, this_input)) {
 					/* set the current state to the new value */
-					sba_current_model->current_state = e->dest;
+					dev->model->current_state = e->dest;
 
 					sba_debug(0, "Match found ... moving to the next state %s\n", e->dest->name);
 					return VALID_STATE;
@@ -1945,7 +2739,7 @@ int sba_common_is_valid_move(sba_state *s, int btype)
 	return ret;
 }
 
-int sba_common_model_checker(struct bio *sba_bio, hash_table *h_this)
+int sba_common_model_checker(struct bio *sba_bio, sba_request *sba_req)
 {
 	int i;
 	int sector;
@@ -1960,10 +2754,10 @@ int sba_common_model_checker(struct bio *sba_bio, hash_table *h_this)
 		data = (page_address(bio_iovec_idx(sba_bio, i)->bv_page) + bio_iovec_idx(sba_bio, i)->bv_offset);
 		sector = sba_bio->bi_sector + i*8;
 
-		btype = sba_common_get_block_type(h_this, sector);
+		btype = sba_common_get_block_type(sba_req, i);
 		sba_debug(1, "Write block %d (%s)\n", SBA_SECTOR_TO_BLOCK(sector), sba_common_get_btype_str(btype)); 
 		
-		s = sba_common_get_current_state();
+		s = sba_common_get_current_state(sba_req->dev);
 
 		if (s) {
 			if (sba_common_is_valid_move(s, btype) == VALID_STATE) {
@@ -2006,7 +2800,7 @@ int sba_common_print_all_blocks(struct bio *sba_bio)
 	return 1;
 }
 
-int sba_common_report_error(struct bio *sba_bio, hash_table *h_this)
+int sba_common_report_error(struct bio *sba_bio, sba_request *sba_req)
 {
 	int i;
 	int btype;
@@ -2014,7 +2808,7 @@ int sba_common_report_error(struct bio *sba_bio, hash_table *h_this)
 	int size = bio_sectors(sba_bio)*SBA_HARDSECT;
 
 	bio_for_each_segment(bvl, sba_bio, i) {
-		btype = sba_common_get_block_type(h_this, sba_bio->bi_sector + i*8);
+		btype = sba_common_get_block_type(sba_req, i);
 		sba_debug(1, "Error: rw %ld blk %ld size %d type %s\n", 
 		sba_bio->bi_rw, SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector+i*8), size, sba_common_get_btype_str(btype));
 	}
@@ -2023,12 +2817,12 @@ int sba_common_report_error(struct bio *sba_bio, hash_table *h_this)
 	return 1;
 }
 
-int sba_common_print_journaled_blocks(void)
+int sba_common_print_journaled_blocks(sba_dev *dev)
 {
 	switch(filesystem) {
 		#ifdef INC_JFS
 		case JFS:
-			sba_jfs_print_journaled_blocks();
+			sba_jfs_print_journaled_blocks(dev);
 		break;
 		#endif
 	}
@@ -2036,158 +2830,102 @@ int sba_common_print_journaled_blocks(void)
 	return 1;
 }
 
-int sba_common_add_desc_stats(int blocknr)
+/*adds an event that has no io of its own to the trace*/
+int sba_common_add_event_stats(sba_dev *dev, int event, int blocknr, int btype)
 {
-	stat_info *record;
-
-	record = kmalloc(sizeof(stat_info), GFP_KERNEL);
-	if (!record) {
-		sba_debug(1, "Error: unable to allocate memory to stat_info\n");
-		return -1;
-	}
+	stat_info record;
 
-	record->rw = SBA_DESC;
-	record->prev = record->next = NULL;
-	record->blocknr = blocknr;
-	record->ref_blocknr = -1;
-	strcpy(record->btype, "DDATA");
-	do_gettimeofday(&(record->stv));
-	do_gettimeofday(&(record->etv));
+	record.rw = event;
+	record.blocknr = blocknr;
+	record.btype = btype;
+	record.stime = record.etime = sba_common_get_time_ns();
 
-	SBA_LOCK(&stat_lock);
-	sba_common_add_stats(record, &stat_list);
-	SBA_UNLOCK(&stat_lock);
-
-	return 1;
+	return sba_common_add_stats(dev, &record);
 }
 
-int sba_common_add_workload_end()
+int sba_common_add_desc_stats(sba_dev *dev, int blocknr)
 {
-	stat_info *record;
-
-	record = kmalloc(sizeof(stat_info), GFP_KERNEL);
-	if (!record) {
-		sba_debug(1, "Error: unable to allocate memory to stat_info\n");
-		return -1;
-	}
+	return sba_common_add_event_stats(dev, SBA_DESC, blocknr, UNKNOWN_BLOCK);
+}
 
-	record->rw = SBA_WKLOAD_END;
-	record->prev = record->next = NULL;
-	record->blocknr = -1;
-	record->ref_blocknr = -1;
-	strcpy(record->btype, "WEND");
-	do_gettimeofday(&(record->stv));
-	do_gettimeofday(&(record->etv));
+int sba_common_add_workload_end(sba_dev *dev)
+{
+	return sba_common_add_event_stats(dev, SBA_WKLOAD_END, -1, UNKNOWN_BLOCK);
+}
 
-	SBA_LOCK(&stat_lock);
-	sba_common_add_stats(record, &stat_list);
-	SBA_UNLOCK(&stat_lock);
+int sba_common_add_workload_start(sba_dev *dev)
+{
+	sba_fault_workload_start(dev);
 
-	return 1;
+	return sba_common_add_event_stats(dev, SBA_WKLOAD_START, -1, UNKNOWN_BLOCK);
 }
 
-int sba_common_add_workload_start()
+/*START_SBA took from stime to now*/
+int sba_common_add_start_stats(sba_dev *dev, unsigned long long stime)
 {
-	stat_info *record;
+	stat_info record;
 
-	record = kmalloc(sizeof(stat_info), GFP_KERNEL);
-	if (!record) {
-		sba_debug(1, "Error: unable to allocate memory to stat_info\n");
-		return -1;
-	}
+	record.rw = SBA_START;
+	record.blocknr = -1;
+	record.btype = UNKNOWN_BLOCK;
+	record.stime = stime;
+	record.etime = sba_common_get_time_ns();
 
-	record->rw = SBA_WKLOAD_START;
-	record->prev = record->next = NULL;
-	record->blocknr = -1;
-	record->ref_blocknr = -1;
-	strcpy(record->btype, "WSTRT");
-	do_gettimeofday(&(record->stv));
-	do_gettimeofday(&(record->etv));
+	sba_debug(1, "sba%d started in %llu us\n", dev->id, (record.etime - stime)/1000);
 
-	SBA_LOCK(&stat_lock);
-	sba_common_add_stats(record, &stat_list);
-	SBA_UNLOCK(&stat_lock);
+	return sba_common_add_stats(dev, &record);
+}
 
-	return 1;
+int sba_common_add_crash_stats(sba_dev *dev)
+{
+	return sba_common_add_event_stats(dev, SBA_CRASH, -1, UNKNOWN_BLOCK);
 }
 
-int sba_common_add_crash_stats()
+int sba_common_add_fault_injection_stats(sba_request *sba_req, int seg, int sector, fault *f)
 {
-	stat_info *record;
+	int event = f->fault_type;
 
-	record = kmalloc(sizeof(stat_info), GFP_KERNEL);
-	if (!record) {
-		sba_debug(1, "Error: unable to allocate memory to stat_info\n");
-		return -1;
+	if ((event != SBA_DELAY) && (event != SBA_CORRUPT)) {
+		event = SBA_FAIL;
 	}
 
-	record->rw = SBA_CRASH;
-	record->prev = record->next = NULL;
-	record->blocknr = -1;
-	record->ref_blocknr = -1;
-	strcpy(record->btype, "CRASH");
-	do_gettimeofday(&(record->stv));
-	do_gettimeofday(&(record->etv));
-
-	SBA_LOCK(&stat_lock);
-	sba_common_add_stats(record, &stat_list);
-	SBA_UNLOCK(&stat_lock);
-
-	return 1;
+	return sba_common_add_event_stats(sba_req->dev, event, SBA_SECTOR_TO_BLOCK(sector), sba_common_get_block_type(sba_req, seg));
 }
 
-int sba_common_add_fault_injection_stats(hash_table *h_this, int sector)
+/*converts the record into a trace record and adds it to the trace buffer*/
+int sba_common_add_stats(sba_dev *dev, stat_info *si)
 {
-	stat_info *record;
+	sba_trace_rec rec;
 
-	record = kmalloc(sizeof(stat_info), GFP_KERNEL);
-	if (!record) {
-		sba_debug(1, "Error: unable to allocate memory to stat_info\n");
+	if (!si) {
+		sba_debug(1, "Error: invalid si\n");
 		return -1;
 	}
 
-	record->rw = SBA_FAIL;
-	record->prev = record->next = NULL;
-	record->blocknr = SBA_SECTOR_TO_BLOCK(sector);
-	record->ref_blocknr = -1;
-	strcpy(record->btype, sba_common_get_block_type_str(h_this, sector));
-	do_gettimeofday(&(record->stv));
-	do_gettimeofday(&(record->etv));
+	rec.blocknr = si->blocknr;
+	rec.event = sba_trace_event(si->rw);
+	rec.btype = sba_trace_btype(si->btype);
+	rec.pad = 0;
+	rec.stime = si->stime;
+	rec.etime = si->etime;
 
-	SBA_LOCK(&stat_lock);
-	sba_common_add_stats(record, &stat_list);
-	SBA_UNLOCK(&stat_lock);
+	if (!sba_trace_add(&dev->trace, &rec)) {
+		sba_debug(0, "Dropped the record for block %ld\n", si->blocknr);
+		return 0;
+	}
 
 	return 1;
 }
 
-int sba_common_add_stats(stat_info *si, stat_info **list)
-{
-    if ((!si) || (!list)) {
-        sba_debug(1, "Error: invalid si/list\n");
-        return -1;
-    }
-
-    si->next = NULL;
-    si->prev = NULL;
-
-    if ((*list)) {
-        si->next = (*list);
-        (*list)->prev = si;
-    }
-
-    *list = si;
-
-    return 1;
-}
-
 int sba_common_get_start_timestamp(sba_request *sba_req)
 {
 	int i;
 	stat_info **record = sba_req->record;
 
+	unsigned long long now = sba_common_get_time_ns();
+
 	for (i = 0; i < sba_req->count; i ++) {
-		do_gettimeofday(&record[i]->stv);
+		record[i]->stime = now;
 	}
 
 	return 1;
@@ -2198,14 +2936,16 @@ int sba_common_get_end_timestamp(sba_request *sba_req)
 	int i;
 	stat_info **record = sba_req->record;
 
+	unsigned long long now = sba_common_get_time_ns();
+
 	for (i = 0; i < sba_req->count; i ++) {
-		do_gettimeofday(&record[i]->etv);
+		record[i]->etime = now;
 	}
 
 	return 1;
 }
 
-int sba_common_collect_stats(sba_request *sba_req, hash_table *h_this)
+int sba_common_collect_stats(sba_request *sba_req)
 {
 	int i;
 	stat_info **record;
@@ -2221,74 +2961,56 @@ int sba_common_collect_stats(sba_request *sba_req, hash_table *h_this)
 		sector = sba_bio->bi_sector + i*8;
 
 		record[i]->rw = sba_req->rw;
-		record[i]->prev = record[i]->next = NULL;
 		record[i]->blocknr = SBA_SECTOR_TO_BLOCK(sector);
-		record[i]->ref_blocknr = -1;
-
-		if ((sba_bio->bi_rw == WRITE) || (sba_bio->bi_rw == WRITE_SYNC)) {
-			strcpy(record[i]->btype, sba_common_get_block_type_str(h_this, sector));
-		}
-		else {
-			strcpy(record[i]->btype, sba_common_get_block_type_str(h_this, sector));
-		}
-
-		SBA_LOCK(&stat_lock);
-		sba_debug(0, "Adding record %x for block %d rw = %d\n", (int)record[i], SBA_SECTOR_TO_BLOCK(sector), record[i]->rw);
-		sba_common_add_stats(record[i], &stat_list);
-		SBA_UNLOCK(&stat_lock);
+		record[i]->btype = sba_common_get_block_type(sba_req, i);
 	}
 
+	/*the records go to the trace buffer when the io completes*/
+	sba_req->collected = 1;
+
 	return 1;
 }
 
-int sba_common_clean_stats()
+/*returns -EBUSY if the trace is being consumed, e.g. by a reader of sba_traceN*/
+int sba_common_clean_stats(sba_dev *dev)
 {
-	stat_info **list = &stat_list;
-	stat_info *temp;
-	stat_info *freeme;
-
-	sba_debug(1, "Clearing the statistics\n");
-
-	if ((!list) || (!(*list))) {
-		sba_debug(1, "Error: invalid list\n");
-		return -1;
-	}
-
-	temp = *list;
+	sba_debug(1, "Clearing the statistics of sba%d\n", dev->id);
 
-	while (temp) {
-		freeme = temp;
-		temp = temp->next;
-		sba_debug(0, "Freeing record %x\n", (int)freeme);
-		kfree(freeme);
+	if (!sba_trace_trylock_consumer(&dev->trace)) {
+		return -EBUSY;
 	}
-
-	*list = NULL;
+	sba_trace_reset(&dev->trace);
+	dev->extract_len = 0;
+	sba_trace_unlock_consumer(&dev->trace);
 
 	return 1;
 }
 
-int sba_common_clean_all_stats()
+int sba_common_clean_all_stats(sba_dev *dev)
 {
-	sba_common_clean_stats();
+	int ret;
+
+	if ((ret = sba_common_clean_stats(dev)) < 0) {
+		return ret;
+	}
 
 	/*now clean the file system specific statistics*/
 	switch(filesystem) {
 		#ifdef INC_EXT3
 			case EXT3:
-				sba_ext3_clean_stats();
+				sba_ext3_clean_stats(dev);
 			break;
 		#endif
 
 		#ifdef INC_REISERFS
 			case REISERFS:
-				sba_reiserfs_clean_stats();
+				sba_reiserfs_clean_stats(dev);
 			break;
 		#endif
 
 		#ifdef INC_JFS
 			case JFS:
-				sba_jfs_clean_stats();
+				sba_jfs_clean_stats(dev);
 			break;
 		#endif
 	}
@@ -2296,132 +3018,115 @@ int sba_common_clean_all_stats()
 	return 1;
 }
 
-int my_div(int a, int b)
+/*prints a trace record as a line of text. returns its length*/
+int sba_common_format_stats(sba_trace_rec *rec, char *print_stmt)
 {
-	return (int)(a/b);
-}
+	unsigned long long stime = rec->stime;
+	unsigned long long etime = rec->etime;
+	unsigned long s_nsec, e_nsec;
 
-int my_mod(int a, int b)
-{
-	return (int)(a%b);
-}
+	if (rec->event == SBA_TRACE_EV_UNKNOWN) {
+		sba_debug(1, "Error: unknown event in the trace\n");
+		print_stmt[0] = '\0';
+		return 0;
+	}
 
+	/*do_div leaves the quotient in its first argument*/
+	s_nsec = do_div(stime, 1000000000);
+	e_nsec = do_div(etime, 1000000000);
 
-int sba_common_extract_stats(char *ubuf, struct timeval start_time)
+	return sprintf(print_stmt, "%c %d t= %s b= %lu.%06lu e= %lu.%06lu\n", 
+		sba_trace_event_char(rec->event), rec->blocknr, sba_trace_btype_name(rec), 
+		(unsigned long)stime, s_nsec/1000, (unsigned long)etime, e_nsec/1000); 
+}
+
+/*
+ * copies the staged lines to ubuf+(*pos). returns 0 if the user
+ * buffer is bad; the lines then stay staged.
+ */
+int sba_common_flush_extract_page(sba_dev *dev, char *ubuf, int *pos)
 {
-	stat_info *temp;
-	stat_info *tail;
-	char print_stmt[512];
-	int pos;
-	int temp_count = 1;
-	long long timediff1, timediff2;
-	stat_info **list = &stat_list;
+	if (!dev->extract_len) {
+		return 1;
+	}
 
-	if ((!list) || (!(*list))) {
-		pos = 0;
-		sba_debug(1, "Error: invalid list\n");
-		sprintf(print_stmt, "COPY COMPLETED");
-		if ((pos + strlen(print_stmt)) < MAX_UBUF_SIZE) {
-			copy_to_user(ubuf+pos, print_stmt, strlen(print_stmt));
-			pos += strlen(print_stmt);
-			ubuf[pos] = '\0';
-		}
-		return -1;
+	if (copy_to_user(ubuf + *pos, dev->extract_page, dev->extract_len)) {
+		sba_debug(1, "Error: unable to copy %d bytes to the user\n", dev->extract_len);
+		return 0;
 	}
 
-	SBA_LOCK(&stat_lock);
+	*pos += dev->extract_len;
+	dev->extract_len = 0;
 
-	temp = *list;
+	return 1;
+}
 
-	while (temp->next) {
-		temp = temp->next;
-	}
+/*
+ * copies the oldest records of the trace buffer to ubuf as text,
+ * at most MAX_MSGS of them per call, resuming where the previous
+ * call stopped. the cost is linear in the records copied out.
+ * "COPY COMPLETED" is appended once the buffer is empty. returns
+ * -EBUSY if the trace is being consumed, e.g. by a reader of
+ * sba_traceN, and -EFAULT if ubuf could not be written.
+ */
+int sba_common_extract_stats(sba_dev *dev, char *ubuf)
+{
+	sba_trace_rec rec;
+	char *done = "COPY COMPLETED";
+	int pos = 0;
+	int copied = 0;
+	int empty = 0;
+	int ring;
+	int ret = 1;
 
-	tail = temp;
-	pos = 0;
+	if (!sba_trace_trylock_consumer(&dev->trace)) {
+		return -EBUSY;
+	}
 
-	//sds_print("Going to start the while loop\n");
-	while (tail) {
+	/*lines left over by the previous call go first*/
+	if (!sba_common_flush_extract_page(dev, ubuf, &pos)) {
+		ret = -EFAULT;
+		goto out;
+	}
 
-		//sds_print("Inside while loop %d\n", temp_count);
+	while (copied < MAX_MSGS) {
 
-		if (prev_count < temp_count) {
+		/*leave room for the line and the terminating message*/
+		if (pos + dev->extract_len + SBA_MAX_LINE + strlen(done) + 1 > MAX_UBUF_SIZE) {
+			sba_debug(1, "Kernel log messages are greater than the user buffer size\n");
+			break;
+		}
 
-			timediff1 = sba_common_diff_time(start_time, tail->stv);
-			timediff2 = sba_common_diff_time(start_time, tail->etv);
-			
-			if ((tail->rw == READ) || (tail->rw == READA) || (tail->rw == READ_SYNC)) {
-				sprintf(print_stmt,"R %ld t= %s b= %d.%06d e= %d.%06d\n", tail->blocknr, 
-				tail->btype, my_div(timediff1,1000000), my_mod(timediff1,1000000), 
-				my_div(timediff2,1000000), my_mod(timediff2,1000000)); 
-			}
-			else 
-			if ((tail->rw == WRITE) || (tail->rw == WRITE_SYNC)) {
-				sprintf(print_stmt,"W %ld t= %s b= %d.%06d e= %d.%06d\n", tail->blocknr, 
-				tail->btype, my_div(timediff1,1000000), my_mod(timediff1,1000000), 
-				my_div(timediff2,1000000), my_mod(timediff2,1000000)); 
-			}
-			else
-			if (tail->rw == SBA_FAIL) {
-				sprintf(print_stmt,"F %ld t= %s b= %d.%06d e= %d.%06d\n", tail->blocknr, 
-				tail->btype, my_div(timediff1,1000000), my_mod(timediff1,1000000), 
-				my_div(timediff2,1000000), my_mod(timediff2,1000000)); 
-			}
-			else
-			if (tail->rw == SBA_CRASH) {
-				sprintf(print_stmt,"C %ld t= %s b= %d.%06d e= %d.%06d\n", tail->blocknr, 
-				tail->btype, my_div(timediff1,1000000), my_mod(timediff1,1000000), 
-				my_div(timediff2,1000000), my_mod(timediff2,1000000)); 
-			}
-			else
-			if (tail->rw == SBA_DESC) {
-				sprintf(print_stmt,"D %ld t= %s b= %d.%06d e= %d.%06d\n", tail->blocknr, 
-				tail->btype, my_div(timediff1,1000000), my_mod(timediff1,1000000), 
-				my_div(timediff2,1000000), my_mod(timediff2,1000000)); 
-			}
-			else
-			if (tail->rw == SBA_WKLOAD_START) {
-				sprintf(print_stmt,"S %ld t= %s b= %d.%06d e= %d.%06d\n", tail->blocknr, 
-				tail->btype, my_div(timediff1,1000000), my_mod(timediff1,1000000), 
-				my_div(timediff2,1000000), my_mod(timediff2,1000000)); 
-			}
-			else
-			if (tail->rw == SBA_WKLOAD_END) {
-				sprintf(print_stmt,"E %ld t= %s b= %d.%06d e= %d.%06d\n", tail->blocknr, 
-				tail->btype, my_div(timediff1,1000000), my_mod(timediff1,1000000), 
-				my_div(timediff2,1000000), my_mod(timediff2,1000000)); 
-			}
+		if ((ring = sba_trace_peek(&dev->trace, &rec)) < 0) {
+			empty = 1;
+			break;
+		}
 
-			if ((pos + strlen(print_stmt)) < MAX_UBUF_SIZE) {
-				copy_to_user(ubuf+pos, print_stmt, strlen(print_stmt));
-				pos += strlen(print_stmt);
-			}
-			else {
-				sba_debug(1, "Kernel log messages are greater than the user buffer size\n");
-				break;
+		if (dev->extract_len + SBA_MAX_LINE > PAGE_SIZE) {
+			if (!sba_common_flush_extract_page(dev, ubuf, &pos)) {
+				ret = -EFAULT;
+				goto out;
 			}
 		}
-		
 
-		if (((temp_count+1) - prev_count) > MAX_MSGS) {
-			prev_count = temp_count;
-			break;
-		}	
-		
-		temp_count ++;
-		tail = tail->prev;
+		dev->extract_len += sba_common_format_stats(&rec, dev->extract_page + dev->extract_len);
+		sba_trace_consume(&dev->trace, ring);
+		copied ++;
+	}
+
+	if (!sba_common_flush_extract_page(dev, ubuf, &pos)) {
+		ret = -EFAULT;
+		goto out;
 	}
 
-	if (!tail) {
-		sprintf(print_stmt, "COPY COMPLETED");
-		if ((pos + strlen(print_stmt)) < MAX_UBUF_SIZE) {
-			copy_to_user(ubuf+pos, print_stmt, strlen(print_stmt));
-			pos += strlen(print_stmt);
-			ubuf[pos] = '\0';
+	if (empty) {
+		if (copy_to_user(ubuf + pos, done, strlen(done) + 1)) {
+			ret = -EFAULT;
 		}
 	}
 
-	SBA_UNLOCK(&stat_lock);
+out:
+	sba_trace_unlock_consumer(&dev->trace);
 
-	return 1;
+	return ret;
 }
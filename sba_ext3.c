@@ -1,83 +1,133 @@
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
 #include "sba_ext3.h"
 
 /*do we have a separate journal device*/
 extern int jour_dev;
 
-//this is where we store the faults issued
-extern fault *sba_fault;
+/*how to map the block types, one of SBA_EXT3_MAP_* (see sba_ext3_map_build)*/
+static int ext3_type_map = SBA_EXT3_MAP_AUTO;
+module_param(ext3_type_map, int, 0);
+
+/*largest dense map, in MB (a MB maps 4 GB), that SBA_EXT3_MAP_AUTO builds*/
+static int ext3_dense_map_mb = 64;
+module_param(ext3_dense_map_mb, int, 0);
 
 /*the journaling mode under which we work*/
 extern int journaling_mode;
 
-/*inode start table lists the starting block of the inode table
- *for each cyl group*/
-hash_table *h_ext3_inode_table_start = NULL;
+static void sba_ext3_map_destroy(sba_ext3_map *m);
 
-/*tables for inode and data bitmaps*/
-hash_table *h_ext3_inode_bitmap = NULL;
-hash_table *h_ext3_data_bitmap = NULL;
+int sba_ext3_init(sba_dev *dev)
+{
+	sba_ext3_state *es;
 
-/*We need a journal table - journal is not contiguous!*/
-hash_table *h_sba_ext3_journal = NULL;
+	sba_debug(1, "Initializing the ext3 data structures of sba%d\n", dev->id);
 
-/*a hash table to keep track of the journaled blocks*/
-hash_table *h_ext3_journaled_blocks = NULL;
+	es = kmalloc(sizeof(sba_ext3_state), GFP_KERNEL);
+	if (!es) {
+		sba_debug(1, "Error: cannot allocate memory\n");
+		return 0;
+	}
+	memset(es, 0, sizeof(sba_ext3_state));
 
-/*hash table to keep the dir blocks*/
-hash_table *h_ext3_dir_blocks = NULL;
+	ht_create(&es->journaled_blocks, "ext3 journal");
+	ht_create(&es->dir_blocks, "ext3 dirs");
+	ht_create(&es->indir_blocks, "ext3 indirs");
+	ht_create(&es->journal_indir_blocks, "ext3jindirs");
+	ht_create(&es->journal_2_real, "journal2real");
+	es->inode_blks_per_group = SBA_EXT3_INODE_BLKS_PER_GROUP;
+	spin_lock_init(&es->map_lock);
+	spin_lock_init(&es->journal.lock);
 
-/*hash table to keep the indir blocks*/
-hash_table *h_ext3_indir_blocks = NULL;
+	dev->ext3 = es;
 
-/*hash table to keep the journal indir blocks*/
-hash_table *h_ext3_journal_indir_blocks = NULL;
+	return 1;
+}
 
-/*hash table to keep the journal to real block mapping.
- *this table will be constructed during journal desc
- *block read during recovery.*/
-hash_table *h_ext3_journal_2_real = NULL;
+int sba_ext3_cleanup(sba_dev *dev)
+{
+	sba_ext3_state *es = dev->ext3;
 
-/*inode blocks per group*/
-int sba_ext3_inode_blks_per_group = SBA_EXT3_INODE_BLKS_PER_GROUP;
+	if (!es) {
+		return 1;
+	}
 
-int sba_ext3_init()
-{
-	sba_debug(1, "Initializing the ext3 data structures\n");
-	ht_create(&h_ext3_inode_table_start, "ext3inotab");
-	ht_create(&h_ext3_inode_bitmap, "ext3inobm");
-	ht_create(&h_ext3_data_bitmap, "ext3databm");
-	ht_create(&h_sba_ext3_journal, "ext3 journal");
-	ht_create(&h_ext3_journaled_blocks, "ext3 journal");
-	ht_create(&h_ext3_dir_blocks, "ext3 dirs");
-	ht_create(&h_ext3_indir_blocks, "ext3 indirs");
-	ht_create(&h_ext3_journal_indir_blocks, "ext3jindirs");
-	ht_create(&h_ext3_journal_2_real, "journal2real");
+	ht_destroy(es->journaled_blocks);
+	ht_destroy(es->dir_blocks);
+	ht_destroy(es->indir_blocks);
+	ht_destroy(es->journal_indir_blocks);
+	ht_destroy(es->journal_2_real);
 
-	return 1;
-}
+	if (es->map) {
+		sba_ext3_map_destroy(es->map);
+	}
 
-int sba_ext3_cleanup()
-{
-	ht_destroy(h_ext3_inode_table_start);
-	ht_destroy(h_ext3_inode_bitmap);
-	ht_destroy(h_ext3_data_bitmap);
-	ht_destroy(h_sba_ext3_journal);
-	ht_destroy(h_ext3_journaled_blocks);
-	ht_destroy(h_ext3_dir_blocks);
-	ht_destroy(h_ext3_indir_blocks);
-	ht_destroy(h_ext3_journal_indir_blocks);
-	ht_destroy(h_ext3_journal_2_real);
+	if (es->journal.ext) {
+		kfree(es->journal.ext);
+	}
+
+	if (es->layout) {
+		vfree(es->layout);
+	}
+
+	kfree(es);
+	dev->ext3 = NULL;
 
 	return 1;
 }
 
-int sba_ext3_clean_stats()
+/*
+ * forgets what was learnt about the fs. the io path keeps using the
+ * state while we are at it, so the tables are emptied in place and the
+ * map and layout are only freed once no reader can see them.
+ */
+int sba_ext3_clean_stats(sba_dev *dev)
 {
-	/*first destroy everything that was stored previously*/
-	sba_ext3_cleanup();
+	sba_ext3_state *es = dev->ext3;
+	sba_ext3_map *old_map;
+	sba_ext3_layout *old_layout;
+	sba_ext3_extent *old_ext;
 
-	/*and now, create new hash tables*/
-	sba_ext3_init();
+	if (!es) {
+		return 1;
+	}
+
+	spin_lock(&es->map_lock);
+	old_map = es->map;
+	rcu_assign_pointer(es->map, NULL);
+	spin_unlock(&es->map_lock);
+
+	old_layout = es->layout;
+	rcu_assign_pointer(es->layout, NULL);
+
+	spin_lock_irq(&es->journal.lock);
+	old_ext = es->journal.ext;
+	es->journal.ext = NULL;
+	es->journal.nr_ext = 0;
+	es->journal.max_ext = 0;
+	es->journal.nr_blocks = 0;
+	spin_unlock_irq(&es->journal.lock);
+
+	ht_clear(es->journaled_blocks);
+	ht_clear(es->dir_blocks);
+	ht_clear(es->indir_blocks);
+	ht_clear(es->journal_indir_blocks);
+	ht_clear(es->journal_2_real);
+
+	synchronize_kernel();
+
+	if (old_map) {
+		sba_ext3_map_destroy(old_map);
+	}
+
+	if (old_layout) {
+		vfree(old_layout);
+	}
+
+	if (old_ext) {
+		kfree(old_ext);
+	}
 
 	return 1;
 }
@@ -154,30 +204,42 @@ char *sba_ext3_get_block_type_str(int btype)
 	}
 }
 
-int sba_ext3_inode_block(long sector)
+/*copies the layout of group to g, returns 0 if there is no such group*/
+static int sba_ext3_get_group(sba_dev *dev, int group, sba_ext3_group *g)
+{
+	sba_ext3_layout *l;
+	int ret = 0;
+
+	rcu_read_lock();
+	l = rcu_dereference(dev->ext3->layout);
+	if ((l) && (group >= 0) && (group < l->nr_groups)) {
+		*g = l->group[group];
+		ret = 1;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+int sba_ext3_inode_block(sba_dev *dev, long sector)
 {
 	int group = SBA_GP_NO(sector);
 	int blk = SBA_SECTOR_TO_BLOCK(sector);
 	int inode_start = 0;
+	sba_ext3_group g;
 	
-	/*128 because each grp desc is of size 32 bytes*/
-	if (group < 128) {
-		if (ht_lookup_val(h_ext3_inode_table_start, group, &inode_start)) {
-		}
-		else {
-			sba_debug(1, "Error: unable to find the inode table start for grp# %d\n", group);
-			return -1;
-		}
+	if (sba_ext3_get_group(dev, group, &g)) {
+		inode_start = g.inode_table;
 	}
 	else {
-		sba_debug(1, "Error: grp greater than 128\n");
+		sba_debug(1, "Error: unable to find the inode table start for grp# %d\n", group);
 		return -1;
 	}
 
-	if ((blk >= inode_start) && (blk < inode_start + sba_ext3_inode_blks_per_group)) {
+	if ((blk >= inode_start) && (blk < inode_start + dev->ext3->inode_blks_per_group)) {
 		/* for every group, we track the two bitmap blks, 
 		 * two possible superblocks and the inode blks */
-		int pos = (sba_ext3_inode_blks_per_group + 4)*group + (blk - inode_start);
+		int pos = (dev->ext3->inode_blks_per_group + 4)*group + (blk - inode_start);
 		return pos;
   	}
 
@@ -185,30 +247,25 @@ int sba_ext3_inode_block(long sector)
 }
 
 /*The inodenr passed here is the one that is returned by fstat*/
-int sba_ext3_inodenr_2_blocknr(int inodenr, int *blocknr, int *ioffset)
+int sba_ext3_inodenr_2_blocknr(sba_dev *dev, int inodenr, int *blocknr, int *ioffset)
 {
 	int group;
 	int inodes_per_gp;
 	int inode_start;
 	int offset_inodes;
+	sba_ext3_group g;
 
 	/*calculate the inode block number and the inode offset*/
 	inodenr --;
 
-	inodes_per_gp = (sba_ext3_inode_blks_per_group * SBA_NR_INODES_PER_BLK);
+	inodes_per_gp = (dev->ext3->inode_blks_per_group * SBA_NR_INODES_PER_BLK);
 	group = inodenr / inodes_per_gp;
 
-	/*128 because each grp desc is of size 32 bytes*/
-	if (group < 128) {
-		if (ht_lookup_val(h_ext3_inode_table_start, group, &inode_start)) {
-		}
-		else {
-			sba_debug(1, "Error: unable to find the inode table start for grp# %d\n", group);
-			return -1;
-		}
+	if (sba_ext3_get_group(dev, group, &g)) {
+		inode_start = g.inode_table;
 	}
 	else {
-		sba_debug(1, "Error: grp greater than 128\n");
+		sba_debug(1, "Error: unable to find the inode table start for grp# %d\n", group);
 		return -1;
 	}
 
@@ -227,18 +284,21 @@ int sba_ext3_inodenr_2_blocknr(int inodenr, int *blocknr, int *ioffset)
  * given a group, this method returns the block number of 
  * the inode bitmap block for that group
  */
-int sba_ext3_group_2_inode_bitmap(int group)
+int sba_ext3_group_2_inode_bitmap(sba_dev *dev, int group)
 {
-	int inobm_blk = -1;
-	ht_lookup_val(h_ext3_inode_bitmap, group, &inobm_blk);
+	sba_ext3_group g;
 
-	return inobm_blk;
+	if (sba_ext3_get_group(dev, group, &g)) {
+		return g.inode_bitmap;
+	}
+
+	return -1;
 }
 
-int sba_ext3_get_inode_bitmap_blk(long sector)
+int sba_ext3_get_inode_bitmap_blk(sba_dev *dev, long sector)
 {
 	int group = SBA_GP_NO(sector);
-	return sba_ext3_group_2_inode_bitmap(group);
+	return sba_ext3_group_2_inode_bitmap(dev, group);
 }
 
 /*
@@ -246,27 +306,22 @@ int sba_ext3_get_inode_bitmap_blk(long sector)
  * block in the inode bitmap.
  */
 
-int sba_ext3_get_inode_bitmap_offset(long sector)
+int sba_ext3_get_inode_bitmap_offset(sba_dev *dev, long sector)
 {
 	int group = SBA_GP_NO(sector);
 	int blk = SBA_SECTOR_TO_BLOCK(sector);
 	int inode_start;
+	sba_ext3_group g;
 
-	/*128 because each grp desc is of size 32 bytes*/
-	if (group < 128) {
-		if (ht_lookup_val(h_ext3_inode_table_start, group, &inode_start)) {
-		}
-		else {
-			sba_debug(1, "Error: unable to find the inode table start for grp# %d\n", group);
-			return -1;
-		}
+	if (sba_ext3_get_group(dev, group, &g)) {
+		inode_start = g.inode_table;
 	}
 	else {
-		sba_debug(1, "Error: grp greater than 128\n");
+		sba_debug(1, "Error: unable to find the inode table start for grp# %d\n", group);
 		return -1;
 	}
 
-	if (!((blk >= inode_start) && (blk < inode_start+ sba_ext3_inode_blks_per_group))) {
+	if (!((blk >= inode_start) && (blk < inode_start+ dev->ext3->inode_blks_per_group))) {
 		sba_debug(1, "Error: Invalid inode block %d specified", blk);
 		return -1;
   	}
@@ -279,48 +334,51 @@ int sba_ext3_get_inode_bitmap_offset(long sector)
  * given a group, this method returns the block number of 
  * the data bitmap block for that group
  */
-int sba_ext3_group_2_data_bitmap(int group)
+int sba_ext3_group_2_data_bitmap(sba_dev *dev, int group)
 {
-	int databm_blk = -1;
-	ht_lookup_val(h_ext3_data_bitmap, group, &databm_blk);
+	sba_ext3_group g;
 
-	return databm_blk;
+	if (sba_ext3_get_group(dev, group, &g)) {
+		return g.block_bitmap;
+	}
+
+	return -1;
 }
 
-int sba_ext3_get_data_bitmap_blk(long sector)
+int sba_ext3_get_data_bitmap_blk(sba_dev *dev, long sector)
 {
 	int group = SBA_GP_NO(sector);
-	return sba_ext3_group_2_data_bitmap(group);
+	return sba_ext3_group_2_data_bitmap(dev, group);
 }
 
-int sba_ext3_data_bitmap_block(long sector)
+int sba_ext3_data_bitmap_block(sba_dev *dev, long sector)
 {
 	int blk = SBA_SECTOR_TO_BLOCK(sector);
 
-	if (blk == sba_ext3_get_data_bitmap_blk(sector)) {
+	if (blk == sba_ext3_get_data_bitmap_blk(dev, sector)) {
 		return 1;
 	}
 	return -1;
 }
 
-int sba_ext3_inode_bitmap_block(long sector)
+int sba_ext3_inode_bitmap_block(sba_dev *dev, long sector)
 {
 	int blk = SBA_SECTOR_TO_BLOCK(sector);
 
-	if (blk == sba_ext3_get_inode_bitmap_blk(sector)) {
+	if (blk == sba_ext3_get_inode_bitmap_blk(dev, sector)) {
 		return 1;
   	}
 	return -1;
 }
 
-int sba_ext3_bitmap_block(long sector)
+int sba_ext3_bitmap_block(sba_dev *dev, long sector)
 {
 	int blk = SBA_SECTOR_TO_BLOCK(sector);
 
-	if (blk == sba_ext3_get_data_bitmap_blk(sector)) {
+	if (blk == sba_ext3_get_data_bitmap_blk(dev, sector)) {
 		return 1;
 	}
-	if (blk == sba_ext3_get_inode_bitmap_blk(sector)) {
+	if (blk == sba_ext3_get_inode_bitmap_blk(dev, sector)) {
 		return 1;
   	}
 	return -1;
@@ -339,70 +397,529 @@ int sba_ext3_super_block(long sector, int size)
 	return -1;
 }
  
-int sba_ext3_group_desc_block(long sector)
+/*does the group have a copy of the super block and the group descriptors*/
+static int sba_ext3_group_has_super(sba_ext3_layout *l, int group)
 {
-	int group;
-	int blk;
+	int base, n;
 
-    group = SBA_GP_NO(sector);
-    blk = SBA_SECTOR_TO_BLOCK(sector);
+	if ((group <= 1) || (!l->sparse_super)) {
+		return 1;
+	}
 
-	if (group < 4096/sizeof(struct ext3_group_desc)) {
-		/*grp desc is in block 1*/
-		if (blk == 1) {
+	/*with sparse_super, only the powers of 3, 5 and 7*/
+	for (base = 3; base <= 7; base += 2) {
+		for (n = base; n < group; n *= base);
+		if (n == group) {
 			return 1;
 		}
 	}
-	else {
-		/*we don't handle this case*/
-		sba_debug(1, "ERROR: We cannot handle FS with more than 128 groups for now\n");
-		sba_debug(1, "ERROR: But we got %d groups. Fix this problem and continue\n", group);
+
+	return 0;
+}
+
+/*a block of the group descriptor table or of one of its backup copies*/
+int sba_ext3_group_desc_block(sba_dev *dev, long sector)
+{
+	sba_ext3_layout *l;
+	int blk = SBA_SECTOR_TO_BLOCK(sector);
+	int group, offset;
+	int ret = -1;
+
+	rcu_read_lock();
+	l = rcu_dereference(dev->ext3->layout);
+
+	if (!l) {
+		/*before START_SBA we only know that it starts in block 1*/
+		ret = (blk == 1) ? 1 : -1;
 	}
+	else
+	if (blk >= l->first_data_block) {
+		group = (blk - l->first_data_block) / l->blocks_per_group;
+		offset = (blk - l->first_data_block) % l->blocks_per_group;
 
-	return -1;
+		if ((group < l->nr_groups) && (offset >= 1) && (offset <= l->gdt_blocks) && (sba_ext3_group_has_super(l, group))) {
+			ret = 1;
+		}
+	}
+	rcu_read_unlock();
+
+	return ret;
 }
 
-int sba_ext3_journal_request(struct bio *sba_bio)
+/*
+ * The block type map. Once START_SBA has read the layout of the fs,
+ * the type of a block outside the journal is a load from the map
+ * instead of the chain of probes of sba_ext3_non_journal_block_type.
+ * The dense map is a byte per block of the device. The sparse one
+ * splits the device in chunks of SBA_EXT3_MAP_CHUNK blocks and only
+ * keeps the bytes of the chunks whose blocks are not all of one type:
+ * a chunk of data or of an inode table costs one byte.
+ */
+
+#define SBA_EXT3_MAP_CODE(bt)	((bt) - SBA_EXT3_UNKNOWN)
+
+/*a block takes the first type the probes would have found*/
+static int sba_ext3_map_rank(int code)
 {
-	if (jour_dev) {
-		if (iminor(sba_bio->bi_bdev->bd_inode) == JOUR_MINOR) {
-			return 1;
+	switch(code + SBA_EXT3_UNKNOWN) {
+		case SBA_EXT3_INODE:	return 7;
+		case SBA_EXT3_SUPER:	return 6;
+		case SBA_EXT3_IBITMAP:	return 5;
+		case SBA_EXT3_DBITMAP:	return 4;
+		case SBA_EXT3_GROUP:	return 3;
+		case SBA_EXT3_DIR:		return 2;
+		case SBA_EXT3_INDIR:	return 1;
+		default:				return 0;
+	}
+}
+
+static inline int sba_ext3_map_get(sba_ext3_map *m, unsigned long blk)
+{
+	unsigned char *leaf;
+	int code;
+
+	if (m->dense) {
+		code = m->dense[blk];
+	}
+	else {
+		leaf = m->leaf[blk >> SBA_EXT3_MAP_CHUNK_BITS];
+		if (leaf) {
+			code = leaf[blk & (SBA_EXT3_MAP_CHUNK - 1)];
+		}
+		else {
+			code = m->uniform[blk >> SBA_EXT3_MAP_CHUNK_BITS];
 		}
 	}
 
-	return 0;
+	return code ? SBA_EXT3_UNKNOWN + code : SBA_EXT3_DATA;
 }
 
-int sba_ext3_journal_block(struct bio *sba_bio, sector_t sector)
+/*the type of blk from the map, -1 without a map of blk*/
+static int sba_ext3_map_lookup(sba_dev *dev, unsigned long blk)
 {
-	if (jour_dev) {
-		if (sba_ext3_journal_request(sba_bio)) {
-			int blk = SBA_SECTOR_TO_BLOCK(sector);
+	sba_ext3_map *m;
+	int ret = -1;
 
-			if (ht_lookup(h_sba_ext3_journal, blk)) {
-				return 1;
+	rcu_read_lock();
+	m = rcu_dereference(dev->ext3->map);
+	if ((m) && (!m->broken) && (blk < m->nr_blocks)) {
+		ret = sba_ext3_map_get(m, blk);
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * sets the type of n blocks from blk, returns 0 when out of memory. a
+ * published map is only set with map_lock held, and then with GFP_ATOMIC
+ */
+static int sba_ext3_map_fill(sba_ext3_map *m, unsigned long blk, unsigned long n, int btype, int gfp)
+{
+	unsigned char code = SBA_EXT3_MAP_CODE(btype);
+	unsigned long end = blk + n;
+	unsigned long c;
+	unsigned char *leaf;
+
+	if (end > m->nr_blocks) {
+		end = m->nr_blocks;
+	}
+
+	while (blk < end) {
+		if (m->dense) {
+			if (sba_ext3_map_rank(code) > sba_ext3_map_rank(m->dense[blk])) {
+				m->dense[blk] = code;
 			}
-			else {
+			blk ++;
+			continue;
+		}
+
+		c = blk >> SBA_EXT3_MAP_CHUNK_BITS;
+		leaf = m->leaf[c];
+
+		if (!leaf) {
+			if (sba_ext3_map_rank(code) <= sba_ext3_map_rank(m->uniform[c])) {
+				blk = (c + 1) << SBA_EXT3_MAP_CHUNK_BITS;
+				continue;
+			}
+
+			/*the whole chunk gets the type*/
+			if ((!(blk & (SBA_EXT3_MAP_CHUNK - 1))) && (blk + SBA_EXT3_MAP_CHUNK <= end)) {
+				m->uniform[c] = code;
+				blk += SBA_EXT3_MAP_CHUNK;
+				continue;
+			}
+
+			leaf = kmalloc(SBA_EXT3_MAP_CHUNK, gfp);
+			if (!leaf) {
+				sba_debug(1, "Error: no memory for the type map of blk %lu\n", blk);
 				return 0;
 			}
+			memset(leaf, m->uniform[c], SBA_EXT3_MAP_CHUNK);
+
+			/*the readers see the bytes before the leaf*/
+			smp_wmb();
+			m->leaf[c] = leaf;
+			m->nr_leaves ++;
 		}
-		else {
-			return 0;
+
+		if (sba_ext3_map_rank(code) > sba_ext3_map_rank(leaf[blk & (SBA_EXT3_MAP_CHUNK - 1)])) {
+			leaf[blk & (SBA_EXT3_MAP_CHUNK - 1)] = code;
+		}
+		blk ++;
+	}
+
+	return 1;
+}
+
+/*a block the layout just told us about, e.g. a dir block*/
+static int sba_ext3_map_set(sba_dev *dev, unsigned long blk, int btype)
+{
+	sba_ext3_state *es = dev->ext3;
+	int ret = 0;
+
+	spin_lock(&es->map_lock);
+	if ((es->map) && (!es->map->broken)) {
+		ret = sba_ext3_map_fill(es->map, blk, 1, btype, GFP_ATOMIC);
+
+		/*it would call the block data, leave it to the probes until the next START_SBA*/
+		if (!ret) {
+			es->map->broken = 1;
+		}
+	}
+	spin_unlock(&es->map_lock);
+
+	return ret;
+}
+
+/*frees a map that no reader can see any more*/
+static void sba_ext3_map_destroy(sba_ext3_map *m)
+{
+	unsigned long c;
+
+	if (m->dense) {
+		vfree(m->dense);
+	}
+
+	if (m->leaf) {
+		for (c = 0; c < m->nr_chunks; c ++) {
+			if (m->leaf[c]) {
+				kfree(m->leaf[c]);
+			}
+		}
+		vfree(m->leaf);
+	}
+
+	if (m->uniform) {
+		vfree(m->uniform);
+	}
+
+	kfree(m);
+}
+
+static sba_ext3_map *sba_ext3_map_alloc(unsigned long nr_blocks)
+{
+	sba_ext3_map *m;
+	int kind = ext3_type_map;
+
+	if (kind == SBA_EXT3_MAP_AUTO) {
+		kind = (nr_blocks <= ((unsigned long)ext3_dense_map_mb << 20)) ? SBA_EXT3_MAP_DENSE : SBA_EXT3_MAP_SPARSE;
+	}
+
+	m = kmalloc(sizeof(sba_ext3_map), GFP_KERNEL);
+	if (!m) {
+		sba_debug(1, "Error: cannot allocate memory\n");
+		return NULL;
+	}
+	memset(m, 0, sizeof(sba_ext3_map));
+	m->nr_blocks = nr_blocks;
+
+	if (kind == SBA_EXT3_MAP_DENSE) {
+		m->dense = vmalloc(nr_blocks);
+		if (!m->dense) {
+			sba_debug(1, "Error: no memory for a dense type map of %lu blocks\n", nr_blocks);
+			goto out_free;
+		}
+		memset(m->dense, 0, nr_blocks);
+	}
+	else
+	if (kind == SBA_EXT3_MAP_SPARSE) {
+		m->nr_chunks = (nr_blocks + SBA_EXT3_MAP_CHUNK - 1) >> SBA_EXT3_MAP_CHUNK_BITS;
+		m->leaf = vmalloc(m->nr_chunks*sizeof(unsigned char *));
+		m->uniform = vmalloc(m->nr_chunks);
+		if ((!m->leaf) || (!m->uniform)) {
+			sba_debug(1, "Error: no memory for a sparse type map of %lu blocks\n", nr_blocks);
+			goto out_free;
+		}
+		memset(m->leaf, 0, m->nr_chunks*sizeof(unsigned char *));
+		memset(m->uniform, 0, m->nr_chunks);
+	}
+	else {
+		goto out_free;
+	}
+
+	return m;
+
+out_free:
+	/*the leaves are still all NULL*/
+	m->nr_chunks = 0;
+	sba_ext3_map_destroy(m);
+	return NULL;
+}
+
+/*sets the dir and indir blocks known so far in m*/
+static int sba_ext3_map_add_tables(sba_ext3_state *es, sba_ext3_map *m, int gfp)
+{
+	int blk;
+	int ok = 1;
+
+	ht_open_scan(es->dir_blocks);
+	while (ht_scan(es->dir_blocks, &blk) > 0) {
+		ok &= sba_ext3_map_fill(m, blk, 1, SBA_EXT3_DIR, gfp);
+	}
+
+	ht_open_scan(es->indir_blocks);
+	while (ht_scan(es->indir_blocks, &blk) > 0) {
+		ok &= sba_ext3_map_fill(m, blk, 1, SBA_EXT3_INDIR, gfp);
+	}
+
+	return ok;
+}
+
+/*
+ * builds the type map from the layout read by sba_ext3_start and the
+ * dir and indir blocks known so far. without one (ext3_type_map 0, or
+ * no memory) the blocks are classified with the probes. the new map
+ * replaces the old one, which is freed once the io in flight that may
+ * still be reading it is done.
+ */
+int sba_ext3_map_build(sba_dev *dev)
+{
+	sba_ext3_state *es = dev->ext3;
+	sba_ext3_layout *l = es->layout;
+	sba_ext3_map *m = NULL;
+	sba_ext3_map *old;
+	sba_ext3_map *failed = NULL;
+	unsigned long nr_blocks = dev->size >> (SBA_BLKSIZE_BITS - 10);
+	int group;
+	int ok = 1;
+
+	if ((ext3_type_map != SBA_EXT3_MAP_NONE) && (nr_blocks)) {
+		m = sba_ext3_map_alloc(nr_blocks);
+	}
+
+	if (!m) {
+		goto lock;
+	}
+
+	/*nobody sees the new map yet, fill it without the lock*/
+	ok &= sba_ext3_map_fill(m, 0, 1, SBA_EXT3_SUPER, GFP_KERNEL);
+	ok &= sba_ext3_map_fill(m, 1, 1, SBA_EXT3_GROUP, GFP_KERNEL);
+
+	/*only START_SBA and CLEAN_ALL_STAT replace the layout, and they are not run together*/
+	for (group = 0; (ok) && (l) && (group < l->nr_groups); group ++) {
+		/*its descriptor could not be read*/
+		if (!l->group[group].inode_table) {
+			continue;
+		}
+
+		ok &= sba_ext3_map_fill(m, l->group[group].inode_table, es->inode_blks_per_group, SBA_EXT3_INODE, GFP_KERNEL);
+		ok &= sba_ext3_map_fill(m, l->group[group].inode_bitmap, 1, SBA_EXT3_IBITMAP, GFP_KERNEL);
+		ok &= sba_ext3_map_fill(m, l->group[group].block_bitmap, 1, SBA_EXT3_DBITMAP, GFP_KERNEL);
+
+		if (sba_ext3_group_has_super(l, group)) {
+			ok &= sba_ext3_map_fill(m, l->first_data_block + group*l->blocks_per_group + 1, l->gdt_blocks, SBA_EXT3_GROUP, GFP_KERNEL);
 		}
 	}
+
+	ok &= sba_ext3_map_add_tables(es, m, GFP_KERNEL);
+
+lock:
+	/*the INIT_*_BLKS ioctls wait until the new map is in place*/
+	spin_lock(&es->map_lock);
+	if (!m) {
+		goto publish;
+	}
+
+	/*the dir and indir blocks added meanwhile, they mostly hit leaves we have*/
+	if (ok) {
+		ok = sba_ext3_map_add_tables(es, m, GFP_ATOMIC);
+	}
+
+	/*a partial map would call inode and bitmap blocks data*/
+	if (!ok) {
+		sba_debug(1, "sba%d: out of memory building the type map, using the probes\n", dev->id);
+		failed = m;
+		m = NULL;
+	}
+
+publish:
+	old = es->map;
+	rcu_assign_pointer(es->map, m);
+	spin_unlock(&es->map_lock);
+
+	if (failed) {
+		sba_ext3_map_destroy(failed);
+	}
+
+	if (old) {
+		synchronize_kernel();
+		sba_ext3_map_destroy(old);
+	}
+
+	if (!m) {
+		return 0;
+	}
+
+	if (m->dense) {
+		sba_debug(1, "sba%d: dense type map of %lu blocks (%lu KB)\n", dev->id, nr_blocks, nr_blocks >> 10);
+	}
 	else {
-		int blk = SBA_SECTOR_TO_BLOCK(sector);
+		sba_debug(1, "sba%d: sparse type map of %lu blocks, %d of %lu chunks mixed (%lu KB)\n", dev->id, nr_blocks,
+		m->nr_leaves, m->nr_chunks, (m->nr_chunks*(sizeof(unsigned char *) + 1) + m->nr_leaves*SBA_EXT3_MAP_CHUNK) >> 10);
+	}
 
-		if (ht_lookup(h_sba_ext3_journal, blk)) {
+	return 1;
+}
+
+int sba_ext3_journal_request(struct bio *sba_bio)
+{
+	if (jour_dev) {
+		if (iminor(sba_bio->bi_bdev->bd_inode) == JOUR_MINOR) {
 			return 1;
 		}
+	}
+
+	return 0;
+}
+
+/*the first extent of the journal that starts after blk, called with the lock held*/
+static int sba_ext3_journal_search(sba_ext3_journal *j, u32 blk)
+{
+	int lo = 0;
+	int hi = j->nr_ext;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (j->ext[mid].start <= blk) {
+			lo = mid + 1;
+		}
 		else {
-			return 0;
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/*is blk a block of the journal*/
+static int sba_ext3_journal_lookup(sba_ext3_journal *j, u32 blk)
+{
+	unsigned long flags;
+	int i, ret = 0;
+
+	spin_lock_irqsave(&j->lock, flags);
+	if (j->nr_ext == 1) {
+		/*the usual case: a contiguous journal*/
+		ret = ((blk >= j->ext[0].start) && (blk - j->ext[0].start < j->ext[0].len));
+	}
+	else
+	if (j->nr_ext > 1) {
+		i = sba_ext3_journal_search(j, blk);
+		ret = ((i > 0) && (blk - j->ext[i - 1].start < j->ext[i - 1].len));
+	}
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	return ret;
+}
+
+/*
+ * adds blk to the journal, merging it with the extents it touches.
+ * returns 1 if it was added, 0 if it already was in the journal and
+ * -1 if there is no memory.
+ */
+static int sba_ext3_journal_add(sba_dev *dev, u32 blk)
+{
+	sba_ext3_journal *j = &dev->ext3->journal;
+	sba_ext3_extent *ext;
+	unsigned long flags;
+	int i, ret = 1;
+
+	spin_lock_irqsave(&j->lock, flags);
+
+	/*the journal is mostly added in order, to the end of the last extent*/
+	if ((j->nr_ext) && (blk == j->ext[j->nr_ext - 1].start + j->ext[j->nr_ext - 1].len)) {
+		j->ext[j->nr_ext - 1].len ++;
+		goto out;
+	}
+
+	i = sba_ext3_journal_search(j, blk);
+
+	if ((i > 0) && (blk - j->ext[i - 1].start < j->ext[i - 1].len)) {
+		ret = 0;
+		goto out_unlock;
+	}
+
+	if ((i > 0) && (blk == j->ext[i - 1].start + j->ext[i - 1].len)) {
+		j->ext[i - 1].len ++;
+
+		if ((i < j->nr_ext) && (j->ext[i].start == blk + 1)) {
+			j->ext[i - 1].len += j->ext[i].len;
+			memmove(&j->ext[i], &j->ext[i + 1], (j->nr_ext - i - 1)*sizeof(sba_ext3_extent));
+			j->nr_ext --;
+		}
+		goto out;
+	}
+
+	if ((i < j->nr_ext) && (j->ext[i].start == blk + 1)) {
+		j->ext[i].start --;
+		j->ext[i].len ++;
+		goto out;
+	}
+
+	if (j->nr_ext == j->max_ext) {
+		ext = kmalloc((j->max_ext ? 2*j->max_ext : 16)*sizeof(sba_ext3_extent), GFP_ATOMIC);
+		if (!ext) {
+			ret = -1;
+			goto out_unlock;
+		}
+
+		if (j->ext) {
+			memcpy(ext, j->ext, j->nr_ext*sizeof(sba_ext3_extent));
+			kfree(j->ext);
 		}
+		j->ext = ext;
+		j->max_ext = j->max_ext ? 2*j->max_ext : 16;
 	}
+
+	memmove(&j->ext[i + 1], &j->ext[i], (j->nr_ext - i)*sizeof(sba_ext3_extent));
+	j->ext[i].start = blk;
+	j->ext[i].len = 1;
+	j->nr_ext ++;
+
+out:
+	j->nr_blocks ++;
+out_unlock:
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	if (ret < 0) {
+		sba_debug(1, "Error: cannot allocate memory for journal block %u\n", blk);
+	}
+
+	return ret;
 }
 
-int sba_ext3_mkfs_write(struct bio *sba_bio)
+int sba_ext3_journal_block(sba_dev *dev, struct bio *sba_bio, sector_t sector)
+{
+	if ((jour_dev) && (!sba_ext3_journal_request(sba_bio))) {
+		return 0;
+	}
+
+	return sba_ext3_journal_lookup(&dev->ext3->journal, SBA_SECTOR_TO_BLOCK(sector));
+}
+
+int sba_ext3_mkfs_write(sba_dev *dev, struct bio *sba_bio)
 {
 	int blk = SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector);
 	sba_debug(1, "Received WRITE for blk# %d\n", blk);
@@ -410,34 +927,130 @@ int sba_ext3_mkfs_write(struct bio *sba_bio)
 	/*if a separate device is used for the journal, then return*/
 	if (jour_dev) {
 		if (sba_ext3_journal_request(sba_bio)) {
-			ht_add(h_sba_ext3_journal, blk);
+			sba_ext3_journal_add(dev, blk);
 		}	
 	}
 	else {
 		/*don't have to cache anything. the new code reads the blocks
-		 *of the journal and builds the h_sba_ext3_journal*/
-		sba_debug(0, "Not adding %d to h_sba_ext3_journal\n", blk);
+		 *of the journal and builds the journal table*/
+		sba_debug(0, "Not adding %d to the journal table\n", blk);
 	}
 
 	return 1;
 }
 
-int sba_ext3_print_journal()
+int sba_ext3_print_journal(sba_dev *dev)
 {
-	ht_print(h_sba_ext3_journal);
+	sba_ext3_journal *j = &dev->ext3->journal;
+	int i;
+
+	spin_lock_irq(&j->lock);
+	sba_debug(1, "Journal: %lu blocks in %d extents\n", j->nr_blocks, j->nr_ext);
+	for (i = 0; i < j->nr_ext; i ++) {
+		sba_debug(1, "Extent %d: blocks %u - %u\n", i, j->ext[i].start, j->ext[i].start + j->ext[i].len - 1);
+	}
+	spin_unlock_irq(&j->lock);
+
 	return 1;
 }
 
-int sba_ext3_start()
+/*
+ * reads the descriptors of all the groups into a new layout and swaps
+ * it in for dev->ext3->layout. the table takes as many blocks as needed
+ * after the super block, they are read GDT_BATCH at a time.
+ */
+#define GDT_BATCH	64
+static int sba_ext3_read_groups(sba_dev *dev, int nr_groups, int first_data_block, int blocks_per_group, int sparse_super)
+{
+	sba_ext3_state *es = dev->ext3;
+	sba_ext3_layout *l, *old;
+	sba_ext3_group *groups;
+	struct ext3_group_desc *gd;
+	int blocks[GDT_BATCH];
+	char *data[GDT_BATCH];
+	int per_block = 4096/sizeof(struct ext3_group_desc);
+	int gdt_blocks, i, j, n, group;
+	int ret = 1;
+
+	if (nr_groups <= 0) {
+		return -1;
+	}
+
+	l = vmalloc(sizeof(sba_ext3_layout) + nr_groups*sizeof(sba_ext3_group));
+	if (!l) {
+		sba_debug(1, "Error: mem allocation for %d groups\n", nr_groups);
+		return -1;
+	}
+	memset(l, 0, sizeof(sba_ext3_layout) + nr_groups*sizeof(sba_ext3_group));
+
+	gdt_blocks = (nr_groups + per_block - 1) / per_block;
+
+	groups = (sba_ext3_group *)(l + 1);
+	l->group = groups;
+	l->nr_groups = nr_groups;
+	l->first_data_block = first_data_block;
+	l->blocks_per_group = blocks_per_group;
+	l->gdt_blocks = gdt_blocks;
+	l->sparse_super = sparse_super;
+
+	for (i = 0; i < gdt_blocks; i += n) {
+		n = ((gdt_blocks - i) < GDT_BATCH) ? (gdt_blocks - i) : GDT_BATCH;
+		for (j = 0; j < n; j ++) {
+			blocks[j] = first_data_block + 1 + i + j;
+		}
+
+		read_blocks(dev, blocks, n, data);
+
+		for (j = 0; j < n; j ++) {
+			if (!data[j]) {
+				sba_debug(1, "Error: unable to read grp desc block %d\n", blocks[j]);
+				ret = -1;
+				continue;
+			}
+
+			for (group = (i + j)*per_block; (group < nr_groups) && (group < (i + j + 1)*per_block); group ++) {
+				gd = ((struct ext3_group_desc *)data[j]) + (group % per_block);
+
+				sba_debug(0, "GDesc %d: blockbitmap = %d, inodebitmap = %d, inodetable = %d\n", 
+				group, gd->bg_block_bitmap, gd->bg_inode_bitmap, gd->bg_inode_table);
+
+				groups[group].block_bitmap = gd->bg_block_bitmap;
+				groups[group].inode_bitmap = gd->bg_inode_bitmap;
+				groups[group].inode_table = gd->bg_inode_table;
+			}
+
+			put_block(data[j]);
+		}
+	}
+
+	/*a new START_SBA replaces the layout, free the old one once no reader can hold it*/
+	old = es->layout;
+	rcu_assign_pointer(es->layout, l);
+	if (old) {
+		synchronize_kernel();
+		vfree(old);
+	}
+
+	sba_debug(1, "Read the descriptors of %d groups from %d blocks\n", nr_groups, gdt_blocks);
+
+	return ret;
+}
+
+int sba_ext3_start(sba_dev *dev)
 {
 	char *data;
 	int sb_block = 1; /*copied from ext3_read_super*/
 	int blocksize = 4096;
+	int nr_groups = 0;
+	int first_data_block = 0;
+	int blocks_per_group = 0;
+	int sparse_super = 0;
 
-	sba_ext3_find_journal_entries();
+	sba_ext3_find_journal_entries(dev);
+	sba_debug(1, "Journal: %lu blocks in %d extents\n", dev->ext3->journal.nr_blocks, dev->ext3->journal.nr_ext);
 
-	/*initialize the sba_ext3_inode_blks_per_group*/
-	if ((data = read_block(0)) != NULL) {
+	/*initialize the inode_blks_per_group*/
+	if ((data = read_block(dev, 0)) != NULL) {
 		struct ext3_super_block *es;
 		int offset = (sb_block * EXT3_MIN_BLOCK_SIZE) % blocksize;
 
@@ -446,185 +1059,203 @@ int sba_ext3_start()
 		if (es->s_magic == EXT3_SUPER_MAGIC) {
 			sba_debug(1, "Correctly identified ext3 super block\n");
 
-			sba_ext3_inode_blks_per_group = (es->s_inodes_per_group * EXT3_GOOD_OLD_INODE_SIZE)/blocksize;
+			dev->ext3->inode_blks_per_group = (es->s_inodes_per_group * EXT3_GOOD_OLD_INODE_SIZE)/blocksize;
 			sba_debug(1, "inodes per gp = %d\n", es->s_inodes_per_group);
-			sba_debug(1, "inode blks per gp = %d\n", sba_ext3_inode_blks_per_group);
+			sba_debug(1, "inode blks per gp = %d\n", dev->ext3->inode_blks_per_group);
+
+			nr_groups = (es->s_blocks_count - es->s_first_data_block + es->s_blocks_per_group - 1) / es->s_blocks_per_group;
+			first_data_block = es->s_first_data_block;
+			blocks_per_group = es->s_blocks_per_group;
+			sparse_super = (es->s_feature_ro_compat & EXT3_FEATURE_RO_COMPAT_SPARSE_SUPER) ? 1 : 0;
 		}
 		else {
 			sba_debug(1, "Error: ext3 super block magic number does not match\n");
 		}
 		
-		free_page((int)data);
+		put_block(data);
 	}
 	else {
 		sba_debug(1, "Error: unable to read the ext3 super block\n");
 	}
 
-	if ((data = read_block(1)) != NULL) {
-		int i;
-		struct ext3_group_desc *gd;
-	
-		for (i = 0; i < 128; i ++) {
-			gd = ((struct ext3_group_desc *)data) + i;
-
-			if (gd->bg_block_bitmap == 0) {
-				break;
-			}
-
-			sba_debug(1, "GDesc %d: blockbitmap = %d, inodebitmap = %d, inodetable = %d\n", 
-			i, gd->bg_block_bitmap, gd->bg_inode_bitmap, gd->bg_inode_table);
-
-			ht_add_val(h_ext3_inode_table_start, i, gd->bg_inode_table);
-			ht_add_val(h_ext3_inode_bitmap, i, gd->bg_inode_bitmap);
-			ht_add_val(h_ext3_data_bitmap, i, gd->bg_block_bitmap);
-		}
-		free_page((int)data);
-	}
-	else {
+	if (sba_ext3_read_groups(dev, nr_groups, first_data_block, blocks_per_group, sparse_super) < 0) {
 		sba_debug(1, "Error: unable to read the ext3 grp desc\n");
 	}
 
+	sba_ext3_map_build(dev);
 
 	return 1;
 }
 
-/*we read the journal blocks and build the h_sba_ext3_journal*/
-int sba_ext3_find_journal_entries()
+/*
+ * adds the n blocks to the journal and, for depth > 0, the blocks they
+ * point to, down to depth levels of indirection. each level is read
+ * before the next one, JOURNAL_BATCH blocks per read_blocks call.
+ */
+#define JOURNAL_BATCH	64
+static int sba_ext3_journal_walk(sba_dev *dev, u32 *blocks, int n, int depth)
 {
-	char *data;
-	
-	if ((data = read_block(JOURNAL_INODE_BLK)) != NULL) {
-		char *data2;
-		char *data3;
-		char *data4;
-		char *buf;
-		int i;
-		struct ext3_inode *inode;
+	int batch[JOURNAL_BATCH];
+	char *data[JOURNAL_BATCH];
+	u32 *level = blocks;
+	u32 *next, *ptr;
+	int nr_next, max_next;
+	int i, j, k, m;
+	int ret = 1;
+
+	for (;;) {
+		for (i = 0; i < n; i ++) {
+			if (!sba_ext3_journal_add(dev, level[i])) {
+				sba_debug(1, "Error: duplicate entry %u in the journal table\n", level[i]);
+			}
 
-		buf = data + JOURNAL_INODE_NO*sizeof(struct ext3_inode);
-		inode = (struct ext3_inode*)buf;
+			if (depth > 0) {
+				ht_add(dev->ext3->journal_indir_blocks, level[i]);
+			}
+		}
 
-		for (i = 0; i < 15; i ++) {
-			if (inode->i_block[i]) {
+		if ((depth == 0) || (n == 0)) {
+			break;
+		}
 
-				if (i == 0) {
-					sba_debug(1, "First journal block = %d\n", inode->i_block[i]);
-				}
+		next = NULL;
+		nr_next = max_next = 0;
 
-				if (!ht_lookup(h_sba_ext3_journal, inode->i_block[i])) {
-					ht_add(h_sba_ext3_journal, inode->i_block[i]);
-				}
-				else {
-					sba_debug(1, "Error: duplicate entry %d in h_sba_ext3_journal\n", inode->i_block[i]);
-					return -1;
-				}
+		for (i = 0; i < n; i += m) {
+			m = ((n - i) < JOURNAL_BATCH) ? (n - i) : JOURNAL_BATCH;
+			for (j = 0; j < m; j ++) {
+				batch[j] = level[i + j];
 			}
-		}
 
-		//separately add the indir blocks
-		for (i = 12; i < 15; i ++) {
-			if (inode->i_block[i]) {
-				ht_add(h_ext3_journal_indir_blocks, inode->i_block[i]);
-			}
-		}
+			read_blocks(dev, batch, m, data);
 
+			for (j = 0; j < m; j ++) {
+				if (!data[j]) {
+					sba_debug(1, "Error: unable to read the journal indir block %d\n", batch[j]);
+					ret = -1;
+					continue;
+				}
 
-		//adding the values from in-direct indir pointer
-		if ((data2 = read_block(inode->i_block[12])) != NULL) {
-			int *blkno = (int *)data2;
-			
-			for(i = 0; i< 1024; i++) {
-				int blk = *(int *)(blkno + i);
+				/*room for all the pointers of the block*/
+				if (nr_next + SBA_BLKSIZE/4 > max_next) {
+					max_next = max_next ? 2*max_next : SBA_BLKSIZE/4*m;
+					ptr = vmalloc(max_next*sizeof(u32));
+					if (!ptr) {
+						sba_debug(1, "Error: cannot allocate memory for the journal walk\n");
+						for (k = j; k < m; k ++) {
+							if (data[k]) {
+								put_block(data[k]);
+							}
+						}
+						ret = -1;
+						goto out;
+					}
+
+					if (next) {
+						memcpy(ptr, next, nr_next*sizeof(u32));
+						vfree(next);
+					}
+					next = ptr;
+				}
+
+				ptr = (u32 *)data[j];
+				for (k = 0; k < SBA_BLKSIZE/4; k ++) {
+					if (ptr[k]) {
+						next[nr_next ++] = ptr[k];
+					}
+				}
 
-				if (blk) {
-					ht_add(h_sba_ext3_journal, blk);
-				}	
+				put_block(data[j]);
 			}
+		}
 
-			free_page((int)data2);
+		if (level != blocks) {
+			vfree(level);
 		}
-		else {
-			sba_debug(1, "Error: unable to read the journal indir block\n");
-			return -1;
+		level = next;
+		n = nr_next;
+		depth --;
+
+		if (!level) {
+			break;
 		}
+	}
 
-		if (inode->i_block[13]) {
-			//adding the values from double in-direct pointer
-			if ((data3 = read_block(inode->i_block[13])) != NULL) {
-				int *blkno1 = (int *)data3;
-				
-				for(i = 0; i< 1024; i++) {
-					int blk1 = *(int *)(blkno1 + i);
+	if ((level) && (level != blocks)) {
+		vfree(level);
+	}
 
-					if (blk1) {
+	return ret;
 
-						//separately add the indir blocks
-						if (inode->i_block[i]) {
-							ht_add(h_ext3_journal_indir_blocks, blk1);
-						}
+out:
+	if (next) {
+		vfree(next);
+	}
+	if (level != blocks) {
+		vfree(level);
+	}
 
-						ht_add(h_sba_ext3_journal, blk1);
+	return ret;
+}
 
-						if (blk1) {
-							//adding values from single indir pointers
-							if ((data4 = read_block(blk1)) != NULL) {
-								int j;
-								int *blkno2 = (int *)data4;
+/*we read the journal blocks and build the journal table*/
+int sba_ext3_find_journal_entries(sba_dev *dev)
+{
+	char *data;
+	u32 direct[EXT3_NDIR_BLOCKS];
+	int i, n = 0;
+	int ret = 1;
+	
+	if ((data = read_block(dev, JOURNAL_INODE_BLK)) != NULL) {
+		struct ext3_inode *inode;
 
-								for(j = 0; j< 1024; j++) {
+		inode = (struct ext3_inode *)(data + JOURNAL_INODE_NO*sizeof(struct ext3_inode));
 
-									int blk2 = *(int *)(blkno2 + j);
+		sba_debug(1, "First journal block = %d\n", inode->i_block[0]);
 
-									if (blk2) {
-										ht_add(h_sba_ext3_journal, blk2);
-									}	
-								}
+		for (i = 0; i < EXT3_NDIR_BLOCKS; i ++) {
+			if (inode->i_block[i]) {
+				direct[n ++] = inode->i_block[i];
+			}
+		}
+		sba_ext3_journal_walk(dev, direct, n, 0);
 
-								free_page((int)data4);
-							}
-							else {
-								sba_debug(1, "Error: unable to read the journal indir block %d\n", blk1);
-								return -1;
-							}
-						}
-					}
+		/*the single, double and triple indirect trees*/
+		for (i = EXT3_IND_BLOCK; i <= EXT3_TIND_BLOCK; i ++) {
+			if (inode->i_block[i]) {
+				if (sba_ext3_journal_walk(dev, &inode->i_block[i], 1, i - EXT3_IND_BLOCK + 1) < 0) {
+					ret = -1;
 				}
-
-				free_page((int)data3);
-			}
-			else {
-				sba_debug(1, "Error: unable to read the journal indir block %d\n",inode->i_block[13]);
-				return -1;
 			}
 		}
 
-		free_page((int)data);
+		put_block(data);
 	}
 	else {
 		sba_debug(1, "Error: unable to find the journal inode block\n");
 		sba_debug(1, "Setting journal begin and end to -1\n");
 	}
 
-	return 1;
+	return ret;
 }
 
-int sba_ext3_insert_journaled_blocks(int key, int blocknr)
+int sba_ext3_insert_journaled_blocks(sba_dev *dev, int key, int blocknr)
 {
-	if (ht_lookup(h_ext3_journaled_blocks, key)) {
+	if (ht_lookup(dev->ext3->journaled_blocks, key)) {
 		sba_debug(1, "Key %d is being journaled again\n", key);
 		return -1;
 	}
 
-	ht_add_val(h_ext3_journaled_blocks, key, blocknr);
+	ht_add_val(dev->ext3->journaled_blocks, key, blocknr);
 	return 1;
 }
 
-int sba_ext3_remove_journaled_blocks(int key)
+int sba_ext3_remove_journaled_blocks(sba_dev *dev, int key)
 {
 	int blocknr = -1;
 
-	if (ht_lookup_val(h_ext3_journaled_blocks, key, &blocknr)) {
-		if (ht_remove(h_ext3_journaled_blocks, key) < 0) {
+	if (ht_lookup_val(dev->ext3->journaled_blocks, key, &blocknr)) {
+		if (ht_remove(dev->ext3->journaled_blocks, key) < 0) {
 			sba_debug(1, "Error removing the key %d\n", key);
 			return blocknr;
 		}
@@ -633,16 +1264,16 @@ int sba_ext3_remove_journaled_blocks(int key)
 	return blocknr;
 }
 
-int sba_ext3_journaled_block(int blocknr)
+int sba_ext3_journaled_block(sba_dev *dev, int blocknr)
 {
-	if (ht_lookup(h_ext3_journaled_blocks, blocknr)) {
+	if (ht_lookup(dev->ext3->journaled_blocks, blocknr)) {
 		return 1;
 	}
 
 	return 0;
 }
 
-int sba_ext3_handle_descriptor_block(char *data, sector_t sector, int rw)
+int sba_ext3_handle_descriptor_block(sba_dev *dev, char *data, sector_t sector, int rw)
 {
 	int i = 0;
 	int desc_blknr = SBA_SECTOR_TO_BLOCK(sector);
@@ -661,11 +1292,11 @@ int sba_ext3_handle_descriptor_block(char *data, sector_t sector, int rw)
 
 		sba_debug(0, "Descriptor tag: block number = %ld\n", blocknr);
 
-		if (sba_ext3_insert_journaled_blocks(desc_blknr + i, blocknr) == -1) {
+		if (sba_ext3_insert_journaled_blocks(dev, desc_blknr + i, blocknr) == -1) {
 			sba_debug(1, "Error: inserting blk=%ld into journaled blocks list\n", blocknr);
 		}
 
-		sba_common_add_desc_stats(blocknr);
+		sba_common_add_desc_stats(dev, blocknr);
 
 		/*go to the next tag*/
 		tagp += sizeof(journal_block_tag_t);
@@ -684,11 +1315,11 @@ int sba_ext3_handle_descriptor_block(char *data, sector_t sector, int rw)
 	return 1;
 }
 
-int sba_ext3_journal_indir_block(sector_t sector)
+int sba_ext3_journal_indir_block(sba_dev *dev, sector_t sector)
 {
 	int blocknr = SBA_SECTOR_TO_BLOCK(sector);
 
-	if (ht_lookup(h_ext3_journal_indir_blocks, blocknr)) {
+	if (ht_lookup(dev->ext3->journal_indir_blocks, blocknr)) {
 		return 1;
 	}
 	
@@ -696,22 +1327,22 @@ int sba_ext3_journal_indir_block(sector_t sector)
 
 }
 
-int sba_ext3_indir_block(int sector)
+int sba_ext3_indir_block(sba_dev *dev, int sector)
 {
 	int blocknr = SBA_SECTOR_TO_BLOCK(sector);
 
-	if (ht_lookup(h_ext3_indir_blocks, blocknr)) {
+	if (ht_lookup(dev->ext3->indir_blocks, blocknr)) {
 		return 1;
 	}
 	
 	return -1;
 }
 
-int sba_ext3_dir_block(int sector)
+int sba_ext3_dir_block(sba_dev *dev, int sector)
 {
 	int blocknr = SBA_SECTOR_TO_BLOCK(sector);
 
-	if (ht_lookup(h_ext3_dir_blocks, blocknr)) {
+	if (ht_lookup(dev->ext3->dir_blocks, blocknr)) {
 		return 1;
 	}
 	
@@ -734,7 +1365,7 @@ int sba_ext3_unjournaled_block_type(int blocknr)
 }
 
 
-int sba_ext3_non_journal_block_type(long sector, char *type, int size)
+int sba_ext3_non_journal_block_type(sba_dev *dev, long sector, char *type, int size)
 {
 	int ret;
 
@@ -742,7 +1373,11 @@ int sba_ext3_non_journal_block_type(long sector, char *type, int size)
         ret = UNKNOWN_BLOCK;
     }
     else
-    if (sba_ext3_inode_block(sector) >= 0) {
+    if ((ret = sba_ext3_map_lookup(dev, SBA_SECTOR_TO_BLOCK(sector))) >= 0) {
+        /*the type map knows the block*/
+    }
+    else
+    if (sba_ext3_inode_block(dev, sector) >= 0) {
         ret = SBA_EXT3_INODE;
     }
     else
@@ -750,23 +1385,23 @@ int sba_ext3_non_journal_block_type(long sector, char *type, int size)
         ret =  SBA_EXT3_SUPER;
     }
     else
-    if (sba_ext3_inode_bitmap_block(sector) >= 0) {
+    if (sba_ext3_inode_bitmap_block(dev, sector) >= 0) {
         ret =  SBA_EXT3_IBITMAP;
     }
     else
-    if (sba_ext3_data_bitmap_block(sector) >= 0) {
+    if (sba_ext3_data_bitmap_block(dev, sector) >= 0) {
         ret =  SBA_EXT3_DBITMAP;
     }
     else
-    if (sba_ext3_group_desc_block(sector) >= 0) {
+    if (sba_ext3_group_desc_block(dev, sector) >= 0) {
         ret =  SBA_EXT3_GROUP;
     }
     else
-    if (sba_ext3_dir_block(sector) >= 0) {
+    if (sba_ext3_dir_block(dev, sector) >= 0) {
         ret =  SBA_EXT3_DIR;
     }
     else
-    if (sba_ext3_indir_block(sector) >= 0) {
+    if (sba_ext3_indir_block(dev, sector) >= 0) {
         ret =  SBA_EXT3_INDIR;
     }
 	else {
@@ -777,16 +1412,16 @@ int sba_ext3_non_journal_block_type(long sector, char *type, int size)
 	return ret;
 }
 
-int sba_ext3_block_type(char *data, sector_t sector, char *type, struct bio *sba_bio)
+int sba_ext3_block_type(sba_dev *dev, char *data, sector_t sector, char *type, struct bio *sba_bio)
 {
 	journal_header_t *header = NULL;
 	int ret = UNKNOWN_BLOCK;
 
-	if (sba_ext3_journal_block(sba_bio, sector)) {
+	if (sba_ext3_journal_block(dev, sba_bio, sector)) {
 
 		/*before checking other things, first see if this is 
 		 *the journal indir blocks. if so, return*/
-		if (sba_ext3_journal_indir_block(sector) >= 0) {
+		if (sba_ext3_journal_indir_block(dev, sector) >= 0) {
 			ret = SBA_EXT3_JINDIR;
 			strcpy(type, sba_ext3_get_block_type_str(ret));
 		}
@@ -830,7 +1465,7 @@ int sba_ext3_block_type(char *data, sector_t sector, char *type, struct bio *sba
 						 * write comes, it can be identified properly.
 						 */
 						sba_debug(0, "Block %ld is a journal desc block\n", SBA_SECTOR_TO_BLOCK(sector));
-						sba_ext3_handle_descriptor_block(data, sector, SBA_WRITE);
+						sba_ext3_handle_descriptor_block(dev, data, sector, SBA_WRITE);
 
 						break;
 
@@ -854,7 +1489,7 @@ int sba_ext3_block_type(char *data, sector_t sector, char *type, struct bio *sba
 						ret = SBA_EXT3_JDATA;
 						strcpy(type, sba_ext3_get_block_type_str(ret));
 
-						ref_blocknr = sba_ext3_remove_journaled_blocks(SBA_SECTOR_TO_BLOCK(sector));
+						ref_blocknr = sba_ext3_remove_journaled_blocks(dev, SBA_SECTOR_TO_BLOCK(sector));
 						sba_debug(1, "%d is %ldth journaled block\n", ref_blocknr, SBA_SECTOR_TO_BLOCK(sector));
 						}
 				}
@@ -865,13 +1500,13 @@ int sba_ext3_block_type(char *data, sector_t sector, char *type, struct bio *sba
 				ret = SBA_EXT3_JDATA;
 				strcpy(type, sba_ext3_get_block_type_str(ret));
 
-				ref_blocknr = sba_ext3_remove_journaled_blocks(SBA_SECTOR_TO_BLOCK(sector));
+				ref_blocknr = sba_ext3_remove_journaled_blocks(dev, SBA_SECTOR_TO_BLOCK(sector));
 				sba_debug(0, "%d is %ldth journaled block\n", ref_blocknr, SBA_SECTOR_TO_BLOCK(sector));
 			}
 		}
 	}
 	else {
-		ret = sba_ext3_non_journal_block_type(sector, type, bio_sectors(sba_bio)*SBA_HARDSECT);
+		ret = sba_ext3_non_journal_block_type(dev, sector, type, bio_sectors(sba_bio)*SBA_HARDSECT);
 	}
 
 	sba_debug(0, "returning block type %d\n", ret);
@@ -880,7 +1515,7 @@ int sba_ext3_block_type(char *data, sector_t sector, char *type, struct bio *sba
 
 /* input is the inodenr of the file. we read the inode 
  * and find the indir blocks that are allocated to the file*/
-int sba_ext3_init_indir_blocks(unsigned long inodenr)
+int sba_ext3_init_indir_blocks(sba_dev *dev, unsigned long inodenr)
 {
 	/*we check if this is the inode block with the specified inode*/
 	int blocknr, offset;
@@ -889,9 +1524,9 @@ int sba_ext3_init_indir_blocks(unsigned long inodenr)
 
 	if (inodenr > 0) {
 
-		sba_ext3_inodenr_2_blocknr(inodenr, &blocknr, &offset);
+		sba_ext3_inodenr_2_blocknr(dev, inodenr, &blocknr, &offset);
 
-		if ((data = read_block(blocknr)) != NULL) {
+		if ((data = read_block_cached(dev, blocknr)) != NULL) {
 			int blocks;
 
 			offset *= sizeof(struct ext3_inode);
@@ -903,20 +1538,23 @@ int sba_ext3_init_indir_blocks(unsigned long inodenr)
 
 			if (ei->i_block[EXT3_IND_BLOCK]) {
 				sba_debug(1, "Single indir block = %d\n", ei->i_block[EXT3_IND_BLOCK]);
-				ht_add_val(h_ext3_indir_blocks, ei->i_block[EXT3_IND_BLOCK], inodenr);
+				ht_add_val(dev->ext3->indir_blocks, ei->i_block[EXT3_IND_BLOCK], inodenr);
+				sba_ext3_map_set(dev, ei->i_block[EXT3_IND_BLOCK], SBA_EXT3_INDIR);
 			}
 
 			if (ei->i_block[EXT3_DIND_BLOCK]) {
 				sba_debug(1, "Double indir block = %d\n", ei->i_block[EXT3_DIND_BLOCK]);
-				ht_add_val(h_ext3_indir_blocks, ei->i_block[EXT3_DIND_BLOCK], inodenr);
+				ht_add_val(dev->ext3->indir_blocks, ei->i_block[EXT3_DIND_BLOCK], inodenr);
+				sba_ext3_map_set(dev, ei->i_block[EXT3_DIND_BLOCK], SBA_EXT3_INDIR);
 			}
 
 			if (ei->i_block[EXT3_TIND_BLOCK]) {
 				sba_debug(1, "Triple indir block = %d\n", ei->i_block[EXT3_TIND_BLOCK]);
-				ht_add_val(h_ext3_indir_blocks, ei->i_block[EXT3_TIND_BLOCK], inodenr);
+				ht_add_val(dev->ext3->indir_blocks, ei->i_block[EXT3_TIND_BLOCK], inodenr);
+				sba_ext3_map_set(dev, ei->i_block[EXT3_TIND_BLOCK], SBA_EXT3_INDIR);
 			}
 
-			free_page((int)data);
+			put_block(data);
 		}
 	}
 
@@ -925,7 +1563,7 @@ int sba_ext3_init_indir_blocks(unsigned long inodenr)
 
 /* input is the inodenr of the dir block. we read the inode 
  * and find the blocks that are allocated to the dir */
-int sba_ext3_init_dir_blocks(unsigned long inodenr)
+int sba_ext3_init_dir_blocks(sba_dev *dev, unsigned long inodenr)
 {
 	/*we check if this is the inode block with the specified inode*/
 	int blocknr, offset;
@@ -935,9 +1573,9 @@ int sba_ext3_init_dir_blocks(unsigned long inodenr)
 
 	if (inodenr > 0) {
 
-		sba_ext3_inodenr_2_blocknr(inodenr, &blocknr, &offset);
+		sba_ext3_inodenr_2_blocknr(dev, inodenr, &blocknr, &offset);
 
-		if ((data = read_block(blocknr)) != NULL) {
+		if ((data = read_block_cached(dev, blocknr)) != NULL) {
 			int blocks;
 
 			offset *= sizeof(struct ext3_inode);
@@ -951,15 +1589,17 @@ int sba_ext3_init_dir_blocks(unsigned long inodenr)
 
 			if (blocks > EXT3_N_BLOCKS) {
 				sba_debug(1, "Error: we dont handle large dirs for now\n");
+				put_block(data);
 				return -1;
 			}
 
 			for (i = 0; i < blocks; i ++) {
 				sba_debug(1, "Adding block %d as the dir data block\n", ei->i_block[i]);
-				ht_add_val(h_ext3_dir_blocks, ei->i_block[i], inodenr);
+				ht_add_val(dev->ext3->dir_blocks, ei->i_block[i], inodenr);
+				sba_ext3_map_set(dev, ei->i_block[i], SBA_EXT3_DIR);
 			}
 
-			free_page((int)data);
+			put_block(data);
 		}
 	}
 
@@ -974,7 +1614,7 @@ int sba_ext3_init_dir_blocks(unsigned long inodenr)
  * then we have to see if the inode block that we got here has the inode
  * that is specified in the fault
  */
-int sba_ext3_fault_match(char *data, sector_t sector, fault *sba_fault)
+int sba_ext3_fault_match(sba_dev *dev, char *data, sector_t sector, fault *sba_fault)
 {
 	sba_debug(0, "Block type of %ld for fault match is %s\n", 
 	SBA_SECTOR_TO_BLOCK(sector), sba_ext3_get_block_type_str(sba_fault->blk_type));
@@ -1016,7 +1656,7 @@ int sba_ext3_fault_match(char *data, sector_t sector, fault *sba_fault)
 
 			if (inodenr > 0) {
 
-				sba_ext3_inodenr_2_blocknr(inodenr, &blocknr, &offset);
+				sba_ext3_inodenr_2_blocknr(dev, inodenr, &blocknr, &offset);
 
 				if (sector != SBA_BLOCK_TO_SECTOR(blocknr)) {
 					return 0;
@@ -1065,7 +1705,95 @@ int sba_ext3_fault_match(char *data, sector_t sector, fault *sba_fault)
 	return 0;
 }
 
-int sba_ext3_process_fault(fault *sba_fault)
+/*the block that sba_ext3_fault_match binds the fault to, or -1*/
+int sba_ext3_fault_blocknr(sba_dev *dev, fault *sba_fault)
+{
+	int blocknr, offset;
+
+	switch(sba_fault->blk_type) {
+		case SBA_EXT3_INODE:
+			if ((sba_fault->spec.ext3.inodenr > 0) && (dev->ext3) &&
+			(sba_ext3_inodenr_2_blocknr(dev, sba_fault->spec.ext3.inodenr, &blocknr, &offset) >= 0)) {
+				return blocknr;
+			}
+			return -1;
+
+		case SBA_EXT3_REVOKE:
+		case SBA_EXT3_COMMIT:
+		case SBA_EXT3_DESC:
+		case SBA_EXT3_DBITMAP:
+		case SBA_EXT3_IBITMAP:
+		case SBA_EXT3_DATA:
+		case SBA_EXT3_JDATA:
+		case SBA_EXT3_DIR:
+		case SBA_EXT3_INDIR:
+			return (sba_fault->blocknr >= 0) ? sba_fault->blocknr : -1;
+
+		default:
+			return -1;
+	}
+}
+
+/*
+ * finds the field that an SBA_CORRUPT_FIELD fault sets in the block
+ * at sector: its byte offset and size. returns 0 if the block does
+ * not have the field.
+ */
+int sba_ext3_field_location(sba_dev *dev, fault *sba_fault, sector_t sector, int *offset, int *size)
+{
+	int index = sba_fault->corrupt_index;
+	int blocknr, ioffset = 0;
+
+	*size = sizeof(__u32);
+
+	switch(sba_fault->corrupt_field) {
+		case EXT3_INODE_I_BLOCK:
+			if ((sba_fault->blk_type != SBA_EXT3_INODE) || (index < 0) || (index >= EXT3_N_BLOCKS)) {
+				return 0;
+			}
+
+			if (sba_fault->spec.ext3.inodenr > 0) {
+				if ((sba_ext3_inodenr_2_blocknr(dev, sba_fault->spec.ext3.inodenr, &blocknr, &ioffset) < 0) ||
+				(sector != SBA_BLOCK_TO_SECTOR(blocknr))) {
+					return 0;
+				}
+			}
+
+			*offset = ioffset*sizeof(struct ext3_inode) + offsetof(struct ext3_inode, i_block) + index*sizeof(__u32);
+			return 1;
+
+		case EXT3_INODE_BITMAP:
+		case EXT3_DATA_BITMAP:
+			if ((sba_fault->blk_type != ((sba_fault->corrupt_field == EXT3_INODE_BITMAP) ? SBA_EXT3_IBITMAP : SBA_EXT3_DBITMAP)) ||
+			(index < 0) || (index >= SBA_BLKSIZE/sizeof(__u32))) {
+				return 0;
+			}
+
+			*offset = index*sizeof(__u32);
+			return 1;
+
+		/*index is the group, of the descriptors in this block*/
+		case EXT3_GRPDESC_BLOCK_BITMAP:
+		case EXT3_GRPDESC_INODE_BITMAP:
+			if ((sba_fault->blk_type != SBA_EXT3_GROUP) || (index < 0) || (index >= SBA_BLKSIZE/sizeof(struct ext3_group_desc))) {
+				return 0;
+			}
+
+			*offset = index*sizeof(struct ext3_group_desc);
+			if (sba_fault->corrupt_field == EXT3_GRPDESC_BLOCK_BITMAP) {
+				*offset += offsetof(struct ext3_group_desc, bg_block_bitmap);
+			}
+			else {
+				*offset += offsetof(struct ext3_group_desc, bg_inode_bitmap);
+			}
+			return 1;
+
+		default:
+			return 0;
+	}
+}
+
+int sba_ext3_process_fault(sba_dev *dev, fault *sba_fault)
 {
 	switch(sba_fault->blk_type) {
 		case SBA_EXT3_DESC:
@@ -1085,7 +1813,7 @@ int sba_ext3_process_fault(fault *sba_fault)
 				int blocknr, offset;
 				int inodenr = sba_fault->spec.ext3.inodenr;
 
-				sba_ext3_inodenr_2_blocknr(inodenr, &blocknr, &offset);
+				sba_ext3_inodenr_2_blocknr(dev, inodenr, &blocknr, &offset);
 				sba_fault->blocknr = blocknr;
 				sba_debug(1, "Inode block to be failed = %d\n", sba_fault->blocknr);
 			}
@@ -1099,10 +1827,10 @@ int sba_ext3_process_fault(fault *sba_fault)
 				int log_blknr;
 				int inodenr = sba_fault->spec.ext3.inodenr;
 
-				sba_ext3_inodenr_2_blocknr(inodenr, &blocknr, &offset);
+				sba_ext3_inodenr_2_blocknr(dev, inodenr, &blocknr, &offset);
 
-				/*initialize the sba_ext3_inode_blks_per_group*/
-				if ((data = read_block(blocknr)) != NULL) {
+				/*initialize the inode_blks_per_group*/
+				if ((data = read_block_cached(dev, blocknr)) != NULL) {
 
 					offset *= sizeof(struct ext3_inode);
 
@@ -1120,7 +1848,7 @@ int sba_ext3_process_fault(fault *sba_fault)
 
 					sba_debug(1, "Data block to be failed = %d\n", sba_fault->blocknr);
 
-					free_page((int)data);
+					put_block(data);
 				}
 			}
 			break;
@@ -1132,10 +1860,10 @@ int sba_ext3_process_fault(fault *sba_fault)
 				struct ext3_inode *ei;
 				int inodenr = sba_fault->spec.ext3.inodenr;
 
-				sba_ext3_inodenr_2_blocknr(inodenr, &blocknr, &offset);
+				sba_ext3_inodenr_2_blocknr(dev, inodenr, &blocknr, &offset);
 
-				/*initialize the sba_ext3_inode_blks_per_group*/
-				if ((data = read_block(blocknr)) != NULL) {
+				/*initialize the inode_blks_per_group*/
+				if ((data = read_block_cached(dev, blocknr)) != NULL) {
 
 					offset *= sizeof(struct ext3_inode);
 
@@ -1144,11 +1872,11 @@ int sba_ext3_process_fault(fault *sba_fault)
 
 					sba_fault->blocknr = ei->i_block[0];
 
-					free_page((int)data);
+					put_block(data);
 				}
 
 				/*Also initialize all the dir blocks*/
-				sba_ext3_init_dir_blocks(inodenr);
+				sba_ext3_init_dir_blocks(dev, inodenr);
 			}
 		break;
 
@@ -1159,10 +1887,10 @@ int sba_ext3_process_fault(fault *sba_fault)
 				struct ext3_inode *ei;
 				int inodenr = sba_fault->spec.ext3.inodenr;
 
-				sba_ext3_inodenr_2_blocknr(inodenr, &blocknr, &offset);
+				sba_ext3_inodenr_2_blocknr(dev, inodenr, &blocknr, &offset);
 
-				/*initialize the sba_ext3_inode_blks_per_group*/
-				if ((data = read_block(blocknr)) != NULL) {
+				/*initialize the inode_blks_per_group*/
+				if ((data = read_block_cached(dev, blocknr)) != NULL) {
 
 					offset *= sizeof(struct ext3_inode);
 
@@ -1186,11 +1914,11 @@ int sba_ext3_process_fault(fault *sba_fault)
 							sba_fault->blocknr = -1;
 					}
 
-					free_page((int)data);
+					put_block(data);
 				}
 
 				/*Also initialize all the indir blocks*/
-				sba_ext3_init_indir_blocks(inodenr);
+				sba_ext3_init_indir_blocks(dev, inodenr);
 			}
 		break;
 	}
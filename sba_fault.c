@@ -0,0 +1,463 @@
+/*
+ * This file contains the fault table of sba.
+ *
+ * An instance can have thousands of faults armed at once, each with
+ * its own mode and hit counter. Matching a block must not scan them
+ * all, so an armed fault is indexed either by the one block it can
+ * match (a DATA fault with a blocknr, an INODE fault of an inode, ...)
+ * or by its block type. A segment then only looks at the two chains
+ * of its block and the two of its type (its rw and SBA_READ_WRITE),
+ * and the fs still has the last word on every fault of those chains.
+ *
+ * A fault that matches a block does not always fire on it: its
+ * trigger (SBA_TRIGGER_*) and its time window decide. The random
+ * draws of an instance come from its own seed (fault_seed, FAULT_SEED)
+ * and are made under the table lock, so a run with the same io gives
+ * the same faults.
+ *
+ * The table takes the fault from the caller; the fs specific work
+ * (sba_common_process_fault) is done before a fault is added.
+ */
+
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include "sba.h"
+
+/*faults an instance can hold*/
+static int max_faults = 4096;
+module_param(max_faults, int, 0);
+
+extern unsigned int fault_seed;
+
+static inline hash_table *sba_fault_index(sba_fault_table *ft, sba_fault_slot *s)
+{
+	return s->exact ? ft->by_blk[s->f.rw] : ft->by_type[s->f.rw];
+}
+
+/*puts an armed fault at the head of its chain, called with ft->lock held*/
+static void sba_fault_link(sba_fault_table *ft, int id)
+{
+	sba_fault_slot *s = &ft->slots[id];
+	hash_table *ht = sba_fault_index(ft, s);
+	int head;
+
+	if (ht_lookup_val(ht, s->key, &head)) {
+		s->next = head;
+	}
+	else {
+		s->next = -1;
+	}
+	ht_add_force(ht, s->key, id);
+
+	s->armed = 1;
+	ft->nr_armed ++;
+}
+
+/*takes a fault off its chain, called with ft->lock held*/
+static void sba_fault_unlink(sba_fault_table *ft, int id)
+{
+	sba_fault_slot *s = &ft->slots[id];
+	hash_table *ht = sba_fault_index(ft, s);
+	int prev;
+
+	if (!s->armed) {
+		return;
+	}
+
+	if (ht_lookup_val(ht, s->key, &prev)) {
+		if (prev == id) {
+			if (s->next < 0) {
+				ht_remove(ht, s->key);
+			}
+			else {
+				ht_add_force(ht, s->key, s->next);
+			}
+		}
+		else {
+			while ((prev >= 0) && (ft->slots[prev].next != id)) {
+				prev = ft->slots[prev].next;
+			}
+			if (prev >= 0) {
+				ft->slots[prev].next = s->next;
+			}
+		}
+	}
+
+	s->next = -1;
+	s->armed = 0;
+	ft->nr_armed --;
+}
+
+/*where a fault goes in the index. may read the fs tables, so not under ft->lock*/
+static int sba_fault_key(sba_dev *dev, fault *f, int *exact, int *key)
+{
+	int blocknr;
+
+	if ((f->rw < SBA_READ) || (f->rw > SBA_READ_WRITE)) {
+		sba_debug(1, "Error: unknown io type %d of a fault\n", f->rw);
+		return -EINVAL;
+	}
+
+	blocknr = sba_common_fault_blocknr(dev, f);
+	if (blocknr >= 0) {
+		*exact = 1;
+		*key = blocknr;
+	}
+	else {
+		*exact = 0;
+		*key = f->blk_type;
+	}
+
+	return 0;
+}
+
+int sba_fault_init(sba_dev *dev)
+{
+	sba_fault_table *ft = &dev->faults;
+	char name[30];
+	int i, rw;
+
+	memset(ft, 0, sizeof(sba_fault_table));
+	spin_lock_init(&ft->lock);
+
+	ft->nr_slots = (max_faults > 0) ? max_faults : 1;
+	ft->slots = vmalloc(ft->nr_slots*sizeof(sba_fault_slot));
+	if (!ft->slots) {
+		sba_debug(1, "Error: cannot allocate %d fault slots\n", ft->nr_slots);
+		return 0;
+	}
+	memset(ft->slots, 0, ft->nr_slots*sizeof(sba_fault_slot));
+
+	for (i = 0; i < ft->nr_slots; i ++) {
+		ft->slots[i].next = (i + 1 < ft->nr_slots) ? i + 1 : -1;
+	}
+	ft->free = 0;
+
+	sba_fault_seed(dev, fault_seed + dev->id);
+
+	for (rw = SBA_READ; rw <= SBA_READ_WRITE; rw ++) {
+		sprintf(name, "sba%d_fault_blk%d", dev->id, rw);
+		ht_create(&ft->by_blk[rw], name);
+		sprintf(name, "sba%d_fault_type%d", dev->id, rw);
+		ht_create(&ft->by_type[rw], name);
+	}
+
+	return 1;
+}
+
+int sba_fault_cleanup(sba_dev *dev)
+{
+	sba_fault_table *ft = &dev->faults;
+	int rw;
+
+	for (rw = SBA_READ; rw <= SBA_READ_WRITE; rw ++) {
+		if (ft->by_blk[rw]) {
+			ht_destroy(ft->by_blk[rw]);
+			ft->by_blk[rw] = NULL;
+		}
+
+		if (ft->by_type[rw]) {
+			ht_destroy(ft->by_type[rw]);
+			ft->by_type[rw] = NULL;
+		}
+	}
+
+	if (ft->slots) {
+		vfree(ft->slots);
+		ft->slots = NULL;
+	}
+
+	return 1;
+}
+
+/*arms a copy of f, returns its id or -errno*/
+int sba_fault_add(sba_dev *dev, fault *f)
+{
+	sba_fault_table *ft = &dev->faults;
+	sba_fault_slot *s;
+	unsigned long flags;
+	int exact, key, id;
+
+	if ((id = sba_fault_key(dev, f, &exact, &key)) < 0) {
+		return id;
+	}
+
+	spin_lock_irqsave(&ft->lock, flags);
+	id = ft->free;
+	if (id < 0) {
+		spin_unlock_irqrestore(&ft->lock, flags);
+		sba_debug(1, "Error: all %d faults of sba%d are in use\n", ft->nr_slots, dev->id);
+		return -ENOSPC;
+	}
+
+	s = &ft->slots[id];
+	ft->free = s->next;
+	ft->nr_faults ++;
+
+	memcpy(&s->f, f, sizeof(fault));
+	s->used = 1;
+	s->matches = 0;
+	s->hits = 0;
+	s->exact = exact;
+	s->key = key;
+	sba_fault_link(ft, id);
+	spin_unlock_irqrestore(&ft->lock, flags);
+
+	return id;
+}
+
+/*replaces fault id with f and arms it again*/
+int sba_fault_update(sba_dev *dev, int id, fault *f)
+{
+	sba_fault_table *ft = &dev->faults;
+	sba_fault_slot *s;
+	unsigned long flags;
+	int exact, key;
+
+	if ((id < 0) || (id >= ft->nr_slots)) {
+		return -EINVAL;
+	}
+
+	if (sba_fault_key(dev, f, &exact, &key) < 0) {
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&ft->lock, flags);
+	s = &ft->slots[id];
+	if (!s->used) {
+		spin_unlock_irqrestore(&ft->lock, flags);
+		return -ENOENT;
+	}
+
+	sba_fault_unlink(ft, id);
+	memcpy(&s->f, f, sizeof(fault));
+	s->matches = 0;
+	s->hits = 0;
+	s->exact = exact;
+	s->key = key;
+	sba_fault_link(ft, id);
+	spin_unlock_irqrestore(&ft->lock, flags);
+
+	return 0;
+}
+
+/*called with ft->lock held*/
+static void sba_fault_free(sba_fault_table *ft, int id)
+{
+	sba_fault_slot *s = &ft->slots[id];
+
+	sba_fault_unlink(ft, id);
+	s->used = 0;
+	s->next = ft->free;
+	ft->free = id;
+	ft->nr_faults --;
+}
+
+int sba_fault_del(sba_dev *dev, int id)
+{
+	sba_fault_table *ft = &dev->faults;
+	unsigned long flags;
+
+	if ((id < 0) || (id >= ft->nr_slots)) {
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&ft->lock, flags);
+	if (!ft->slots[id].used) {
+		spin_unlock_irqrestore(&ft->lock, flags);
+		return -ENOENT;
+	}
+	sba_fault_free(ft, id);
+	spin_unlock_irqrestore(&ft->lock, flags);
+
+	return 0;
+}
+
+/*removes all the faults, or with REM_NOFORCE the ones that are not STICKY*/
+int sba_fault_clear(sba_dev *dev, int force)
+{
+	sba_fault_table *ft = &dev->faults;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&ft->lock, flags);
+	for (i = 0; (i < ft->nr_slots) && (ft->nr_faults); i ++) {
+		if ((ft->slots[i].used) && ((force == REM_FORCE) || (ft->slots[i].f.fault_mode != STICKY))) {
+			sba_fault_free(ft, i);
+		}
+	}
+	spin_unlock_irqrestore(&ft->lock, flags);
+
+	return 0;
+}
+
+/*fills in info for the fault info->id*/
+int sba_fault_get(sba_dev *dev, sba_fault_info *info)
+{
+	sba_fault_table *ft = &dev->faults;
+	sba_fault_slot *s;
+	unsigned long flags;
+
+	if ((info->id < 0) || (info->id >= ft->nr_slots)) {
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&ft->lock, flags);
+	s = &ft->slots[info->id];
+	if (!s->used) {
+		spin_unlock_irqrestore(&ft->lock, flags);
+		return -ENOENT;
+	}
+	info->armed = s->armed;
+	info->matches = s->matches;
+	info->hits = s->hits;
+	memcpy(&info->f, &s->f, sizeof(fault));
+	spin_unlock_irqrestore(&ft->lock, flags);
+
+	return 0;
+}
+
+/*counts a match of the fault in s and tells if it fires. called with ft->lock held*/
+static int sba_fault_trigger(sba_fault_table *ft, sba_fault_slot *s)
+{
+	fault *f = &s->f;
+	unsigned long long since;
+
+	if (f->window_end_msecs) {
+		if (!ft->workload_start) {
+			return 0;
+		}
+
+		since = sba_common_get_time_ns() - ft->workload_start;
+		if ((since < (unsigned long long)f->window_start_msecs*1000000) ||
+		(since >= (unsigned long long)f->window_end_msecs*1000000)) {
+			return 0;
+		}
+	}
+
+	s->matches ++;
+
+	switch(f->trigger) {
+		case SBA_TRIGGER_PROB:
+			ft->rand = sba_common_xorshift(ft->rand);
+			return ((ft->rand % 1000000) < f->trigger_ppm);
+
+		/*a TRANSIENT fault is disarmed once it fired*/
+		case SBA_TRIGGER_NTH:
+			return (s->matches == f->trigger_n);
+
+		case SBA_TRIGGER_EVERY:
+			return ((f->trigger_n <= 1) || ((s->matches % f->trigger_n) == 0));
+
+		default:
+			return 1;
+	}
+}
+
+/*the first fault on the chain of key that fires on the segment, or -1*/
+static int sba_fault_find(sba_dev *dev, hash_table *ht, int key, char *data, sector_t sector, struct bio *sba_bio, sba_request *sba_req, int seg)
+{
+	sba_fault_table *ft = &dev->faults;
+	int id;
+
+	if (!ht_lookup_val(ht, key, &id)) {
+		return -1;
+	}
+
+	for (; id >= 0; id = ft->slots[id].next) {
+		if ((sba_common_fault_match(&ft->slots[id].f, data, sector, sba_bio, sba_req, seg)) &&
+		(sba_fault_trigger(ft, &ft->slots[id]))) {
+			return id;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * finds the fault that fires on segment seg of a request and copies
+ * it to f. a fault on the block goes before one on the block type.
+ * returns its id, or -1 if no fault fires. a TRANSIENT fault is
+ * disarmed once it fired.
+ */
+int sba_fault_lookup(sba_dev *dev, char *data, sector_t sector, struct bio *sba_bio, sba_request *sba_req, int seg, fault *f)
+{
+	sba_fault_table *ft = &dev->faults;
+	sba_fault_slot *s;
+	unsigned long flags;
+	int rw = (bio_data_dir(sba_bio) == WRITE) ? SBA_WRITE : SBA_READ;
+	int blocknr = SBA_SECTOR_TO_BLOCK(sector);
+	int btype = sba_common_get_block_type(sba_req, seg);
+	int id;
+
+	if (!ft->nr_armed) {
+		return -1;
+	}
+
+	spin_lock_irqsave(&ft->lock, flags);
+	id = sba_fault_find(dev, ft->by_blk[rw], blocknr, data, sector, sba_bio, sba_req, seg);
+	if (id < 0) {
+		id = sba_fault_find(dev, ft->by_blk[SBA_READ_WRITE], blocknr, data, sector, sba_bio, sba_req, seg);
+	}
+	if (id < 0) {
+		id = sba_fault_find(dev, ft->by_type[rw], btype, data, sector, sba_bio, sba_req, seg);
+	}
+	if (id < 0) {
+		id = sba_fault_find(dev, ft->by_type[SBA_READ_WRITE], btype, data, sector, sba_bio, sba_req, seg);
+	}
+
+	if (id >= 0) {
+		s = &ft->slots[id];
+		s->hits ++;
+		memcpy(f, &s->f, sizeof(fault));
+
+		if (s->f.fault_mode != STICKY) {
+			sba_fault_unlink(ft, id);
+		}
+	}
+	spin_unlock_irqrestore(&ft->lock, flags);
+
+	return id;
+}
+
+/*prints the faults of the instance*/
+int sba_fault_print(sba_dev *dev)
+{
+	sba_fault_info info;
+
+	sba_debug(1, "sba%d: %d faults, %d armed\n", dev->id, dev->faults.nr_faults, dev->faults.nr_armed);
+
+	for (info.id = 0; info.id < dev->faults.nr_slots; info.id ++) {
+		if (sba_fault_get(dev, &info) == 0) {
+			sba_debug(1, "fault %d: %s, %u matches, %u hits\n", info.id, info.armed ? "armed" : "disarmed", info.matches, info.hits);
+			sba_common_print_fault(&info.f);
+		}
+	}
+
+	return 1;
+}
+
+/*restarts the random draws of the triggers of the instance*/
+int sba_fault_seed(sba_dev *dev, unsigned int seed)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->faults.lock, flags);
+	/*xorshift gets stuck at 0*/
+	dev->faults.rand = seed ? seed : 1;
+	spin_unlock_irqrestore(&dev->faults.lock, flags);
+
+	return 1;
+}
+
+/*WORKLOAD_START: the time windows of the faults start now*/
+int sba_fault_workload_start(sba_dev *dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->faults.lock, flags);
+	dev->faults.workload_start = sba_common_get_time_ns();
+	spin_unlock_irqrestore(&dev->faults.lock, flags);
+
+	return 1;
+}
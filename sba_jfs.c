@@ -5,38 +5,42 @@
 #include "sba_jfs.h"
 #include "sba_common.h"
 
-/*jfs journal info*/
-int jfs_jour_start;
-int jfs_jour_size;
-
 /*do we have a separate journal device*/
 extern int jour_dev;
 
-//this is where we store the faults issued
-extern fault *sba_fault;
-
 /*the journaling mode under which we work*/
 extern int journaling_mode;
 
-/*We need a journal table - journal is not contiguous!*/
-hash_table *h_sba_jfs_journal = NULL;
+int sba_jfs_init(sba_dev *dev)
+{
+	sba_jfs_state *js;
 
-/*We need a hash table to keep track of the journaled blocks*/
-hash_table *h_jfs_journaled_blocks = NULL;
+	sba_debug(1, "Initializing the jfs data structures of sba%d\n", dev->id);
 
-int sba_jfs_init(void)
-{
-	sba_debug(1, "Initializing the jfs data structures\n");
-	ht_create(&h_sba_jfs_journal, "jfs_journal");
-	ht_create(&h_jfs_journaled_blocks, "jfs_journal");
+	js = kmalloc(sizeof(sba_jfs_state), GFP_KERNEL);
+	if (!js) {
+		sba_debug(1, "Error: cannot allocate memory\n");
+		return 0;
+	}
+	memset(js, 0, sizeof(sba_jfs_state));
+
+	ht_create(&js->journal, "jfs_journal");
+	ht_create(&js->journaled_blocks, "jfs_journal");
+
+	dev->jfs = js;
 
 	return 1;
 }
 
-int sba_jfs_cleanup(void)
+int sba_jfs_cleanup(sba_dev *dev)
 {
-	ht_destroy(h_sba_jfs_journal);
-	ht_destroy(h_jfs_journaled_blocks);
+	if (dev->jfs) {
+		ht_destroy(dev->jfs->journal);
+		ht_destroy(dev->jfs->journaled_blocks);
+		kfree(dev->jfs);
+		dev->jfs = NULL;
+	}
+
 	return 1;
 }
 
@@ -51,13 +55,13 @@ int sba_jfs_journal_request(struct bio *sba_bio)
 	return 0;
 }
 
-int sba_jfs_journal_block(struct bio *sba_bio, sector_t sector)
+int sba_jfs_journal_block(sba_dev *dev, struct bio *sba_bio, sector_t sector)
 {
 	if (jour_dev) {
 		if (sba_jfs_journal_request(sba_bio)) {
 			int blk = SBA_SECTOR_TO_BLOCK(sector);
 
-			if (ht_lookup(h_sba_jfs_journal, blk)) {
+			if (ht_lookup(dev->jfs->journal, blk)) {
 				return 1;
 			}
 			else {
@@ -71,7 +75,7 @@ int sba_jfs_journal_block(struct bio *sba_bio, sector_t sector)
 	else {
 		int blk = SBA_SECTOR_TO_BLOCK(sector);
 
-		if (ht_lookup(h_sba_jfs_journal, blk)) {
+		if (ht_lookup(dev->jfs->journal, blk)) {
 			return 1;
 		}
 		else {
@@ -80,7 +84,7 @@ int sba_jfs_journal_block(struct bio *sba_bio, sector_t sector)
 	}
 }
 
-int sba_jfs_mkfs_write(struct bio *sba_bio)
+int sba_jfs_mkfs_write(sba_dev *dev, struct bio *sba_bio)
 {
 	int blk = SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector);
 	sba_debug(1, "Mkfs write: Received WRITE for blk# %d\n", blk);
@@ -88,85 +92,85 @@ int sba_jfs_mkfs_write(struct bio *sba_bio)
 	/*if a separate device is used for the journal, then return*/
 	if (jour_dev) {
 		if (sba_jfs_journal_request(sba_bio)) {
-			ht_add(h_sba_jfs_journal, blk);
+			ht_add(dev->jfs->journal, blk);
 		}	
 	}
 	else {
 		/*don't have to cache anything. the new code reads the blocks
-		 *of the journal and builds the h_sba_jfs_journal*/
-		sba_debug(0, "Not adding %d to h_sba_jfs_journal\n", blk);
+		 *of the journal and builds the journal table*/
+		sba_debug(0, "Not adding %d to the journal table\n", blk);
 	}
 
 	return 1;
 }
 
-int sba_jfs_print_journal(void)
+int sba_jfs_print_journal(sba_dev *dev)
 {
-	ht_print(h_sba_jfs_journal);
+	ht_print(dev->jfs->journal);
 	return 1;
 }
 
-int sba_jfs_start(void)
+int sba_jfs_start(sba_dev *dev)
 {
-	sba_jfs_find_journal_entries();
+	sba_jfs_find_journal_entries(dev);
 
 	return 1;
 }
 
-int sba_jfs_find_journal_entries(void)
+int sba_jfs_find_journal_entries(sba_dev *dev)
 {
 	char *data;
 	
-	if ((data = read_block(JFS_SUPER)) != NULL) {
+	if ((data = read_block(dev, JFS_SUPER)) != NULL) {
 		int i;
 
 		struct jfs_superblock *jfs_sb = (struct jfs_superblock *)data;
 		sba_debug(1, "magic number = %s\n", jfs_sb->s_magic);
 		sba_debug(1, "block size = %d\n", jfs_sb->s_bsize);
 
-		jfs_jour_start = addressPXD(&jfs_sb->s_logpxd);
-		jfs_jour_size = lengthPXD(&jfs_sb->s_logpxd);
+		dev->jfs->jour_start = addressPXD(&jfs_sb->s_logpxd);
+		dev->jfs->jour_size = lengthPXD(&jfs_sb->s_logpxd);
 
-		sba_debug(1, "log address = %d\n", jfs_jour_start);
-		sba_debug(1, "log size = %d\n", jfs_jour_size);
+		sba_debug(1, "log address = %d\n", dev->jfs->jour_start);
+		sba_debug(1, "log size = %d\n", dev->jfs->jour_size);
 
-		for (i = 0; i < jfs_jour_size; i ++) {
-			ht_add(h_sba_jfs_journal, i+jfs_jour_start);
+		for (i = 0; i < dev->jfs->jour_size; i ++) {
+			ht_add(dev->jfs->journal, i+dev->jfs->jour_start);
 		}
 
-		sba_debug(1, "Added log blocks from %d to %d\n", jfs_jour_start, jfs_jour_start + jfs_jour_size - 1);
-		free_page((int)data);
+		sba_debug(1, "Added log blocks from %d to %d\n", dev->jfs->jour_start, dev->jfs->jour_start + dev->jfs->jour_size - 1);
+		put_block(data);
 	}
 
 	return 1;
 }
 
-int sba_jfs_print_journaled_blocks(void)
+int sba_jfs_print_journaled_blocks(sba_dev *dev)
 {
 	int blocknr;
-	ht_open_scan(h_jfs_journaled_blocks);
+	ht_open_scan(dev->jfs->journaled_blocks);
 
-	while (ht_scan(h_jfs_journaled_blocks, &blocknr) > 0) {
+	while (ht_scan(dev->jfs->journaled_blocks, &blocknr) > 0) {
 		sba_debug(1, "Block %d is journaled\n", blocknr);
 	}
 
 	return 1;
 }
 
-int sba_jfs_insert_journaled_blocks(int blocknr)
+int sba_jfs_insert_journaled_blocks(sba_dev *dev, int blocknr)
 {
-	if (ht_lookup(h_jfs_journaled_blocks, blocknr)) {
+	if (ht_lookup(dev->jfs->journaled_blocks, blocknr)) {
 		sba_debug(0, "Block %d is being journaled again\n", blocknr);
 		return 1;
 	}
 
-	ht_add_val(h_jfs_journaled_blocks, blocknr, 0);
+	ht_add_val(dev->jfs->journaled_blocks, blocknr, 0);
 	return 1;
 }
 
-int sba_jfs_remove_journaled_blocks(int blocknr)
+int sba_jfs_remove_journaled_blocks(sba_dev *dev, int blocknr)
 {
-	if (ht_remove(h_jfs_journaled_blocks, blocknr) < 0) {
+	if (ht_remove(dev->jfs->journaled_blocks, blocknr) < 0) {
 		sba_debug(1, "Error removing the blocknr %d\n", blocknr);
 		return -1;
 	}
@@ -174,9 +178,9 @@ int sba_jfs_remove_journaled_blocks(int blocknr)
 	return 1;
 }
 
-int sba_jfs_journaled_block(int blocknr)
+int sba_jfs_journaled_block(sba_dev *dev, int blocknr)
 {
-	if (ht_lookup(h_jfs_journaled_blocks, blocknr)) {
+	if (ht_lookup(dev->jfs->journaled_blocks, blocknr)) {
 		return 1;
 	}
 
@@ -198,7 +202,7 @@ int sba_jfs_unjournaled_block_type(int blocknr)
 	}
 }
 
-int sba_jfs_non_journal_block_type(char *data, long sector, char *type, int size)
+int sba_jfs_non_journal_block_type(sba_dev *dev, char *data, long sector, char *type, int size)
 {
 	/* Check if this blocknr is in the list of journaled blocks. 
 	 * If so, return CHECKPOINT_BLOCK. Else return ORDERED_BLOCK 
@@ -206,8 +210,8 @@ int sba_jfs_non_journal_block_type(char *data, long sector, char *type, int size
 	
 	int blocknr = SBA_SECTOR_TO_BLOCK(sector);
 
-	if (sba_jfs_journaled_block(blocknr)) {
-		sba_jfs_remove_journaled_blocks(blocknr);
+	if (sba_jfs_journaled_block(dev, blocknr)) {
+		sba_jfs_remove_journaled_blocks(dev, blocknr);
 
 		return CHECKPOINT_BLOCK;
 	}
@@ -243,9 +247,9 @@ int sba_jfs_get_next_log_record(int nwords, int *target, char *data, int *offset
 	return 1;
 }
 
-int sba_jfs_journal_super_block(int sector)
+int sba_jfs_journal_super_block(sba_dev *dev, int sector)
 {
-	if (jfs_jour_start + LOGSUPER_B == SBA_SECTOR_TO_BLOCK(sector)) {
+	if (dev->jfs->jour_start + LOGSUPER_B == SBA_SECTOR_TO_BLOCK(sector)) {
 		return 1;
 	}
 
@@ -253,7 +257,7 @@ int sba_jfs_journal_super_block(int sector)
 }
 
 /* look at jfs_logredo() and logRead() from logredo in jfsutils */
-int sba_jfs_handle_journal_block(int sector, char *data)
+int sba_jfs_handle_journal_block(sba_dev *dev, int sector, char *data)
 {
 	int off;
 	int ret;
@@ -265,7 +269,7 @@ int sba_jfs_handle_journal_block(int sector, char *data)
 	int nwords;
 	int type = JOURNAL_DATA_BLOCK;
 
-	if (sba_jfs_journal_super_block(sector)) {
+	if (sba_jfs_journal_super_block(dev, sector)) {
 		return JOURNAL_SUPER_BLOCK;
 	}
 
@@ -334,7 +338,7 @@ int sba_jfs_handle_journal_block(int sector, char *data)
 			}
 
 			if (blocknr != -1) {
-				if (sba_jfs_insert_journaled_blocks(blocknr) == -1) {
+				if (sba_jfs_insert_journaled_blocks(dev, blocknr) == -1) {
 					sba_debug(1, "Error: inserting blk=%lld into journaled blocks list\n", blocknr);
 				}
 			}
@@ -369,28 +373,28 @@ int sba_jfs_handle_journal_block(int sector, char *data)
 	return type;
 }
 
-int sba_jfs_block_type(char *data, sector_t sector, char *type, struct bio *sba_bio)
+int sba_jfs_block_type(sba_dev *dev, char *data, sector_t sector, char *type, struct bio *sba_bio)
 {
 	int ret = UNKNOWN_BLOCK;
 
 	sba_debug(0, "Got block %ld\n", SBA_SECTOR_TO_BLOCK(sector));
 
-	if (sba_jfs_journal_block(sba_bio, sector)) {
+	if (sba_jfs_journal_block(dev, sba_bio, sector)) {
 		sba_debug(0, "Block %ld is a journal block\n", SBA_SECTOR_TO_BLOCK(sector));
 		
-		ret = sba_jfs_handle_journal_block(sector, data);
+		ret = sba_jfs_handle_journal_block(dev, sector, data);
 	}
 	else {
 		sba_debug(0, "Block %ld is a non-journal block\n", SBA_SECTOR_TO_BLOCK(sector));
 
-		ret = sba_jfs_non_journal_block_type(data, sector, type, bio_sectors(sba_bio)*SBA_HARDSECT);
+		ret = sba_jfs_non_journal_block_type(dev, data, sector, type, bio_sectors(sba_bio)*SBA_HARDSECT);
 	}
 
 	sba_debug(0, "returning block type %d\n", ret);
 	return ret;
 }
 
-int sba_jfs_fault_match(char *data, sector_t sector, fault *sba_fault)
+int sba_jfs_fault_match(sba_dev *dev, char *data, sector_t sector, fault *sba_fault)
 {
 	switch(sba_fault->blk_type) {
 		case JOURNAL_DESC_BLOCK:
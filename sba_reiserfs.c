@@ -5,39 +5,42 @@
 #include "sba_reiserfs.h"
 #include "sba_common.h"
 
-/*reiserfs journal info*/
-int reiser_jour_start;
-int reiser_jour_size;
-int reiserfs_trans_id; /*to keep track of commit block*/
-
 /*do we have a separate journal device*/
 extern int jour_dev;
 
-//this is where we store the faults issued
-extern fault *sba_fault;
-
 /*the journaling mode under which we work*/
 extern int journaling_mode;
 
-/*We need a journal table - journal is not contiguous!*/
-hash_table *h_sba_reiserfs_journal = NULL;
+int sba_reiserfs_init(sba_dev *dev)
+{
+	sba_reiserfs_state *rs;
 
-/*We need a hash table to keep track of the journaled blocks*/
-hash_table *h_reiserfs_journaled_blocks = NULL;
+	sba_debug(1, "Initializing the reiserfs data structures of sba%d\n", dev->id);
 
-int sba_reiserfs_init(void)
-{
-	sba_debug(1, "Initializing the reiserfs data structures\n");
-	ht_create(&h_sba_reiserfs_journal, "reiserfs_journal");
-	ht_create(&h_reiserfs_journaled_blocks, "reiserfs_journal");
+	rs = kmalloc(sizeof(sba_reiserfs_state), GFP_KERNEL);
+	if (!rs) {
+		sba_debug(1, "Error: cannot allocate memory\n");
+		return 0;
+	}
+	memset(rs, 0, sizeof(sba_reiserfs_state));
+
+	ht_create(&rs->journal, "reiserfs_journal");
+	ht_create(&rs->journaled_blocks, "reiserfs_journal");
+
+	dev->reiserfs = rs;
 
 	return 1;
 }
 
-int sba_reiserfs_cleanup(void)
+int sba_reiserfs_cleanup(sba_dev *dev)
 {
-	ht_destroy(h_sba_reiserfs_journal);
-	ht_destroy(h_reiserfs_journaled_blocks);
+	if (dev->reiserfs) {
+		ht_destroy(dev->reiserfs->journal);
+		ht_destroy(dev->reiserfs->journaled_blocks);
+		kfree(dev->reiserfs);
+		dev->reiserfs = NULL;
+	}
+
 	return 1;
 }
 
@@ -52,13 +55,13 @@ int sba_reiserfs_journal_request(struct bio *sba_bio)
 	return 0;
 }
 
-int sba_reiserfs_journal_block(struct bio *sba_bio, sector_t sector)
+int sba_reiserfs_journal_block(sba_dev *dev, struct bio *sba_bio, sector_t sector)
 {
 	if (jour_dev) {
 		if (sba_reiserfs_journal_request(sba_bio)) {
 			int blk = SBA_SECTOR_TO_BLOCK(sector);
 
-			if (ht_lookup(h_sba_reiserfs_journal, blk)) {
+			if (ht_lookup(dev->reiserfs->journal, blk)) {
 				return 1;
 			}
 			else {
@@ -72,7 +75,7 @@ int sba_reiserfs_journal_block(struct bio *sba_bio, sector_t sector)
 	else {
 		int blk = SBA_SECTOR_TO_BLOCK(sector);
 
-		if (ht_lookup(h_sba_reiserfs_journal, blk)) {
+		if (ht_lookup(dev->reiserfs->journal, blk)) {
 			return 1;
 		}
 		else {
@@ -81,7 +84,7 @@ int sba_reiserfs_journal_block(struct bio *sba_bio, sector_t sector)
 	}
 }
 
-int sba_reiserfs_mkfs_write(struct bio *sba_bio)
+int sba_reiserfs_mkfs_write(sba_dev *dev, struct bio *sba_bio)
 {
 	int blk = SBA_SECTOR_TO_BLOCK(sba_bio->bi_sector);
 	sba_debug(1, "Received WRITE for blk# %d\n", blk);
@@ -89,27 +92,27 @@ int sba_reiserfs_mkfs_write(struct bio *sba_bio)
 	/*if a separate device is used for the journal, then return*/
 	if (jour_dev) {
 		if (sba_reiserfs_journal_request(sba_bio)) {
-			ht_add(h_sba_reiserfs_journal, blk);
+			ht_add(dev->reiserfs->journal, blk);
 		}	
 	}
 	else {
 		/*don't have to cache anything. the new code reads the blocks
-		 *of the journal and builds the h_sba_reiserfs_journal*/
-		sba_debug(0, "Not adding %d to h_sba_reiserfs_journal\n", blk);
+		 *of the journal and builds the journal table*/
+		sba_debug(0, "Not adding %d to the journal table\n", blk);
 	}
 
 	return 1;
 }
 
-int sba_reiserfs_print_journal(void)
+int sba_reiserfs_print_journal(sba_dev *dev)
 {
-	ht_print(h_sba_reiserfs_journal);
+	ht_print(dev->reiserfs->journal);
 	return 1;
 }
 
-int sba_reiserfs_start(void)
+int sba_reiserfs_start(sba_dev *dev)
 {
-	sba_reiserfs_find_journal_entries();
+	sba_reiserfs_find_journal_entries(dev);
 
 	return 1;
 }
@@ -134,12 +137,12 @@ int sba_reiserfs_is_any_reiserfs_magic_string (struct reiserfs_super_block *rs)
 	return (sba_reiserfs_is_reiserfs_3_5 (rs) || sba_reiserfs_is_reiserfs_3_6 (rs) || sba_reiserfs_is_reiserfs_jr (rs));
 }
 
-int sba_reiserfs_find_journal_entries(void)
+int sba_reiserfs_find_journal_entries(sba_dev *dev)
 {
 	int i;
 	char *data;
 	
-	if ((data = read_block(REISER_SUPER)) != NULL) {
+	if ((data = read_block(dev, REISER_SUPER)) != NULL) {
 		struct reiserfs_super_block *rsb = (struct reiserfs_super_block *)data;
 
 		if (sba_reiserfs_is_any_reiserfs_magic_string (rsb)) {
@@ -154,37 +157,37 @@ int sba_reiserfs_find_journal_entries(void)
 			sba_debug(1,"Commit age = %u Trans age = %u\n", 
 			rsb->s_v1.s_journal.jp_journal_max_commit_age, rsb->s_v1.s_journal.jp_journal_max_trans_age);
 
-			reiser_jour_start = rsb->s_v1.s_journal.jp_journal_1st_block;
-			reiser_jour_size = rsb->s_v1.s_journal.jp_journal_size;
+			dev->reiserfs->jour_start = rsb->s_v1.s_journal.jp_journal_1st_block;
+			dev->reiserfs->jour_size = rsb->s_v1.s_journal.jp_journal_size;
 		}
 
-		free_page((int)data);
+		put_block(data);
 	}
 
 	
-	for (i = 0; i < reiser_jour_size; i ++) {
-		ht_add(h_sba_reiserfs_journal, reiser_jour_start + i);
+	for (i = 0; i < dev->reiserfs->jour_size; i ++) {
+		ht_add(dev->reiserfs->journal, dev->reiserfs->jour_start + i);
 	}
 
-	sba_debug(1, "Begin = %d End = %d\n", reiser_jour_start, reiser_jour_start + reiser_jour_size - 1);
+	sba_debug(1, "Begin = %d End = %d\n", dev->reiserfs->jour_start, dev->reiserfs->jour_start + dev->reiserfs->jour_size - 1);
 
 	return 1;
 }
 
-int sba_reiserfs_insert_journaled_blocks(int blocknr)
+int sba_reiserfs_insert_journaled_blocks(sba_dev *dev, int blocknr)
 {
-	if (ht_lookup(h_reiserfs_journaled_blocks, blocknr)) {
+	if (ht_lookup(dev->reiserfs->journaled_blocks, blocknr)) {
 		sba_debug(1, "Block %d is being journaled again\n", blocknr);
 		return 1;
 	}
 
-	ht_add_val(h_reiserfs_journaled_blocks, blocknr, 0);
+	ht_add_val(dev->reiserfs->journaled_blocks, blocknr, 0);
 	return 1;
 }
 
-int sba_reiserfs_remove_journaled_blocks(int blocknr)
+int sba_reiserfs_remove_journaled_blocks(sba_dev *dev, int blocknr)
 {
-	if (ht_remove(h_reiserfs_journaled_blocks, blocknr) < 0) {
+	if (ht_remove(dev->reiserfs->journaled_blocks, blocknr) < 0) {
 		sba_debug(1, "Error removing the blocknr %d\n", blocknr);
 		return -1;
 	}
@@ -192,16 +195,16 @@ int sba_reiserfs_remove_journaled_blocks(int blocknr)
 	return 1;
 }
 
-int sba_reiserfs_journaled_block(int blocknr)
+int sba_reiserfs_journaled_block(sba_dev *dev, int blocknr)
 {
-	if (ht_lookup(h_reiserfs_journaled_blocks, blocknr)) {
+	if (ht_lookup(dev->reiserfs->journaled_blocks, blocknr)) {
 		return 1;
 	}
 
 	return 0;
 }
 
-int sba_reiserfs_handle_descriptor_block(char *data)
+int sba_reiserfs_handle_descriptor_block(sba_dev *dev, char *data)
 {
 	int i;
 	int blocknr;
@@ -217,7 +220,7 @@ int sba_reiserfs_handle_descriptor_block(char *data)
 			blocknr = le32_to_cpu(desc->j_realblock[i]);
 			sba_debug(1, "Descriptor tag: block number = %d\n", blocknr);
 
-			if (sba_reiserfs_insert_journaled_blocks(blocknr) == -1) {
+			if (sba_reiserfs_insert_journaled_blocks(dev, blocknr) == -1) {
 				sba_debug(1, "Error: inserting blk=%d into journaled blocks list\n", blocknr);
 			}
 		}
@@ -241,7 +244,7 @@ int sba_reiserfs_unjournaled_block_type(int blocknr)
 	}
 }
 
-int sba_reiserfs_non_journal_block_type(char *data, long sector, char *type, int size)
+int sba_reiserfs_non_journal_block_type(sba_dev *dev, char *data, long sector, char *type, int size)
 {
 	/* Check if this blocknr is in the list of journaled blocks. 
 	 * If so, return CHECKPOINT_BLOCK. Else return ORDERED_BLOCK 
@@ -249,8 +252,8 @@ int sba_reiserfs_non_journal_block_type(char *data, long sector, char *type, int
 	
 	int blocknr = SBA_SECTOR_TO_BLOCK(sector);
 
-	if (sba_reiserfs_journaled_block(blocknr)) {
-		sba_reiserfs_remove_journaled_blocks(blocknr);
+	if (sba_reiserfs_journaled_block(dev, blocknr)) {
+		sba_reiserfs_remove_journaled_blocks(dev, blocknr);
 
 		#if 0
 		/*
@@ -268,12 +271,12 @@ int sba_reiserfs_non_journal_block_type(char *data, long sector, char *type, int
 		#endif
 	}
 	else {
-		if (reiser_jour_start + reiser_jour_size == blocknr) {
+		if (dev->reiserfs->jour_start + dev->reiserfs->jour_size == blocknr) {
 			int oldest_start;
 			struct reiserfs_journal_header * jh;
 			jh = (struct reiserfs_journal_header *)data;
 
-			oldest_start = reiser_jour_start + le32_to_cpu(jh->j_first_unflushed_offset);
+			oldest_start = dev->reiserfs->jour_start + le32_to_cpu(jh->j_first_unflushed_offset);
 			sba_debug(1, "first unflushed offset = %d oldest start = %d\n",
 			le32_to_cpu(jh->j_first_unflushed_offset), oldest_start);
 
@@ -285,13 +288,13 @@ int sba_reiserfs_non_journal_block_type(char *data, long sector, char *type, int
 	}
 }
 
-int sba_reiserfs_journal_commit_block(char *data)
+int sba_reiserfs_journal_commit_block(sba_dev *dev, char *data)
 {
 	struct reiserfs_journal_commit *commit;
 	commit = (struct reiserfs_journal_commit *)(data) ;
 
-	if (commit->j_trans_id == reiserfs_trans_id) {
-		reiserfs_trans_id = -1;
+	if (commit->j_trans_id == dev->reiserfs->trans_id) {
+		dev->reiserfs->trans_id = -1;
 	 	return 1;
 	}
 
@@ -304,13 +307,13 @@ char *sba_reiserfs_get_journal_desc_magic(char *data)
 	return (data + 4096 - 12);
 }
 
-int sba_reiserfs_journal_desc_block(char *data)
+int sba_reiserfs_journal_desc_block(sba_dev *dev, char *data)
 {
 	struct reiserfs_journal_desc *desc;
 	desc = (struct reiserfs_journal_desc *)(data) ;
 
 	if (memcmp(sba_reiserfs_get_journal_desc_magic(data), JOURNAL_DESC_MAGIC, 8) == 0) {
-		reiserfs_trans_id = desc->j_trans_id;
+		dev->reiserfs->trans_id = desc->j_trans_id;
 	 	return 1;
 	}
 
@@ -328,18 +331,18 @@ int sba_reiserfs_journal_super_block(char *data)
 	return 0;
 }
 
-int sba_reiserfs_block_type(char *data, sector_t sector, char *type, struct bio *sba_bio)
+int sba_reiserfs_block_type(sba_dev *dev, char *data, sector_t sector, char *type, struct bio *sba_bio)
 {
 	int ret = UNKNOWN_BLOCK;
 
 	sba_debug(0, "Got block %ld\n", SBA_SECTOR_TO_BLOCK(sector));
 
-	if (sba_reiserfs_journal_block(sba_bio, sector)) {
+	if (sba_reiserfs_journal_block(dev, sba_bio, sector)) {
 	
 		sba_debug(0, "Block %ld is a journal block\n", SBA_SECTOR_TO_BLOCK(sector));
 		
 		/* FIXME: what about revoke blocks ?? */
-		if (sba_reiserfs_journal_desc_block(data)) {
+		if (sba_reiserfs_journal_desc_block(dev, data)) {
 			strcpy(type, "J_D");
 			ret = JOURNAL_DESC_BLOCK;
 
@@ -350,10 +353,10 @@ int sba_reiserfs_block_type(char *data, sector_t sector, char *type, struct bio
 			 * write comes, it can be identified properly.
 			 */
 
-			sba_reiserfs_handle_descriptor_block(data);
+			sba_reiserfs_handle_descriptor_block(dev, data);
 		}
 		else
-		if (sba_reiserfs_journal_commit_block(data)) {
+		if (sba_reiserfs_journal_commit_block(dev, data)) {
 			strcpy(type, "J_C");
 			ret = JOURNAL_COMMIT_BLOCK;
 		}
@@ -380,14 +383,14 @@ int sba_reiserfs_block_type(char *data, sector_t sector, char *type, struct bio
 	else {
 		sba_debug(0, "Block %ld is a non-journal block\n", SBA_SECTOR_TO_BLOCK(sector));
 
-		ret = sba_reiserfs_non_journal_block_type(data, sector, type, bio_sectors(sba_bio)*SBA_HARDSECT);
+		ret = sba_reiserfs_non_journal_block_type(dev, data, sector, type, bio_sectors(sba_bio)*SBA_HARDSECT);
 	}
 
 	sba_debug(0, "returning block type %d\n", ret);
 	return ret;
 }
 
-int sba_reiserfs_fault_match(char *data, sector_t sector, fault *sba_fault)
+int sba_reiserfs_fault_match(sba_dev *dev, char *data, sector_t sector, fault *sba_fault)
 {
 	switch(sba_fault->blk_type) {
 		case JOURNAL_DESC_BLOCK:
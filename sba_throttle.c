@@ -0,0 +1,270 @@
+/*
+ * This file contains the throttle of sba.
+ *
+ * Every class of blocks (SBA_THR_*) has a token bucket for bytes
+ * and one for ios. A bucket is kept as the time at which it would
+ * be full of debt again (tat): an io advances tat by its cost, and
+ * has to wait for whatever of tat lies in the future beyond the
+ * burst. The wait is served by the delay queue of sba.c, so the io
+ * path never sleeps here. Each instance has its own buckets.
+ */
+
+#include "sba.h"
+
+#define SBA_NSEC_PER_SEC	1000000000ULL
+
+extern int journaling_mode;
+
+int sba_throttle_init(sba_dev *dev)
+{
+	int i;
+
+	memset(dev->throttle, 0, sizeof(dev->throttle));
+	for (i = 0; i < SBA_THR_CLASSES; i ++) {
+		spin_lock_init(&dev->throttle[i].lock);
+		dev->throttle[i].limit.tclass = i;
+		atomic_set(&dev->throttle[i].depth, 0);
+	}
+	dev->throttling = 0;
+
+	return 1;
+}
+
+/*maps the block types of all the file systems to a throttle class*/
+int sba_throttle_class(int btype)
+{
+	switch(btype) {
+		case SBA_EXT3_JDATA:
+		case SBA_EXT3_DESC:
+		case SBA_EXT3_REVOKE:
+		case SBA_EXT3_JSUPER:
+		case SBA_EXT3_JINDIR:
+		case JOURNAL_DATA_BLOCK:
+		case JOURNAL_DESC_BLOCK:
+		case JOURNAL_REVOKE_BLOCK:
+		case JOURNAL_SUPER_BLOCK:
+			return SBA_THR_JDATA;
+
+		case SBA_EXT3_COMMIT:
+		case JOURNAL_COMMIT_BLOCK:
+			return SBA_THR_COMMIT;
+
+		case SBA_EXT3_INODE:
+			return SBA_THR_INODE;
+
+		case SBA_EXT3_DBITMAP:
+		case SBA_EXT3_IBITMAP:
+			return SBA_THR_BITMAP;
+
+		case SBA_EXT3_SUPER:
+		case SBA_EXT3_GROUP:
+		case SBA_EXT3_DIR:
+		case SBA_EXT3_INDIR:
+		case SBA_EXT3_SINDIR:
+		case SBA_EXT3_DINDIR:
+		case SBA_EXT3_TINDIR:
+		case CHECKPOINT_BLOCK:
+			return SBA_THR_CHECKPOINT;
+
+		case ORDERED_BLOCK:
+			return SBA_THR_ORDERED;
+
+		/*ext3 data blocks are not typed by the journaling mode*/
+		case SBA_EXT3_DATA:
+			if (journaling_mode == ORDERED_JOURNALING) {
+				return SBA_THR_ORDERED;
+			}
+			else
+			if (journaling_mode == DATA_JOURNALING) {
+				return SBA_THR_CHECKPOINT;
+			}
+			return SBA_THR_UNORDERED;
+
+		default:
+			return SBA_THR_UNORDERED;
+	}
+}
+
+int sba_throttle_set(sba_dev *dev, sba_throttle_limit *l)
+{
+	sba_throttle *t;
+	unsigned long flags;
+	int i, n = 0;
+
+	if ((l->tclass < 0) || (l->tclass >= SBA_THR_CLASSES)) {
+		sba_debug(1, "Error: invalid throttle class %d\n", l->tclass);
+		return 0;
+	}
+
+	t = &dev->throttle[l->tclass];
+
+	spin_lock_irqsave(&t->lock, flags);
+	t->limit = *l;
+	/*start with full buckets*/
+	t->byte_tat = 0;
+	t->io_tat = 0;
+	spin_unlock_irqrestore(&t->lock, flags);
+
+	for (i = 0; i < SBA_THR_CLASSES; i ++) {
+		if ((dev->throttle[i].limit.bps) || (dev->throttle[i].limit.iops)) {
+			n ++;
+		}
+	}
+	dev->throttling = n;
+
+	sba_debug(1, "sba%d: throttle class %d: %u bytes/s %u ios/s burst %u ms\n", dev->id, l->tclass, l->bps, l->iops, l->burst_msecs);
+
+	return 1;
+}
+
+/*charges cost ns to the bucket and returns how long the io must wait*/
+static unsigned long long sba_throttle_bucket(unsigned long long *tat, unsigned long long cost, unsigned long long burst, unsigned long long now)
+{
+	if (*tat + burst < now) {
+		*tat = now - burst;
+	}
+	*tat += cost;
+
+	return (*tat > now + burst) ? *tat - now - burst : 0;
+}
+
+/*charges bytes of one io of dev to the class, returns the wait in ns*/
+static unsigned long long sba_throttle_charge(sba_dev *dev, int tclass, int bytes)
+{
+	sba_throttle *t = &dev->throttle[tclass];
+	unsigned long long now;
+	unsigned long long burst;
+	unsigned long long cost;
+	unsigned long long wait = 0;
+	unsigned long long io_wait;
+	unsigned long flags;
+	int depth;
+
+	now = sba_common_get_time_ns();
+
+	spin_lock_irqsave(&t->lock, flags);
+
+	t->stat.ios ++;
+	burst = (unsigned long long)t->limit.burst_msecs*1000000;
+
+	if (t->limit.bps) {
+		cost = (unsigned long long)bytes*SBA_NSEC_PER_SEC;
+		do_div(cost, t->limit.bps);
+		wait = sba_throttle_bucket(&t->byte_tat, cost, burst, now);
+	}
+
+	if (t->limit.iops) {
+		cost = SBA_NSEC_PER_SEC;
+		do_div(cost, t->limit.iops);
+		io_wait = sba_throttle_bucket(&t->io_tat, cost, burst, now);
+		if (io_wait > wait) {
+			wait = io_wait;
+		}
+	}
+
+	if (wait) {
+		t->stat.throttled ++;
+		t->stat.throttled_ns += wait;
+
+		/*the caller holds the io until sba_throttle_release*/
+		depth = atomic_inc_return(&t->depth);
+		if ((unsigned int)depth > t->stat.max_depth) {
+			t->stat.max_depth = depth;
+		}
+	}
+
+	spin_unlock_irqrestore(&t->lock, flags);
+
+	return wait;
+}
+
+/*
+ * charges the blocks of the request to their classes, and sets
+ * delay_msecs to the longest wait. the block types must be built.
+ */
+int sba_throttle_request(struct bio *sba_bio, sba_request *sba_req)
+{
+	sba_dev *dev = sba_req->dev;
+	int i;
+	int c;
+	int bytes[SBA_THR_CLASSES];
+	struct bio_vec *bvl;
+	unsigned long long wait;
+
+	memset(bytes, 0, sizeof(bytes));
+
+	bio_for_each_segment(bvl, sba_bio, i) {
+		if (i >= sba_req->nr_btypes) {
+			break;
+		}
+		bytes[sba_throttle_class(sba_req->btype[i])] += bvl->bv_len;
+	}
+
+	for (c = 0; c < SBA_THR_CLASSES; c ++) {
+		if (!bytes[c]) {
+			continue;
+		}
+
+		wait = sba_throttle_charge(dev, c, bytes[c]);
+		if (!wait) {
+			continue;
+		}
+
+		/*round up to the resolution of the delay queue*/
+		wait += 999999;
+		do_div(wait, 1000000);
+		if ((int)wait > sba_req->delay_msecs) {
+			sba_req->delay_msecs = (int)wait;
+		}
+
+		/*sba_throttle_charge counted it as held*/
+		sba_req->throttle_mask |= 1 << c;
+	}
+
+	return 1;
+}
+
+/*called when a held request leaves the delay queue*/
+int sba_throttle_release(sba_request *sba_req)
+{
+	int c;
+
+	for (c = 0; c < SBA_THR_CLASSES; c ++) {
+		if (sba_req->throttle_mask & (1 << c)) {
+			atomic_dec(&sba_req->dev->throttle[c].depth);
+		}
+	}
+	sba_req->throttle_mask = 0;
+
+	return 1;
+}
+
+/*fills in the SBA_THR_CLASSES stats of dev*/
+int sba_throttle_get_stats(sba_dev *dev, sba_throttle_stat *st)
+{
+	int c;
+	unsigned long flags;
+
+	for (c = 0; c < SBA_THR_CLASSES; c ++) {
+		spin_lock_irqsave(&dev->throttle[c].lock, flags);
+		st[c] = dev->throttle[c].stat;
+		spin_unlock_irqrestore(&dev->throttle[c].lock, flags);
+		st[c].depth = atomic_read(&dev->throttle[c].depth);
+	}
+
+	return 1;
+}
+
+int sba_throttle_zero_stats(sba_dev *dev)
+{
+	int c;
+	unsigned long flags;
+
+	for (c = 0; c < SBA_THR_CLASSES; c ++) {
+		spin_lock_irqsave(&dev->throttle[c].lock, flags);
+		memset(&dev->throttle[c].stat, 0, sizeof(sba_throttle_stat));
+		spin_unlock_irqrestore(&dev->throttle[c].lock, flags);
+	}
+
+	return 1;
+}
@@ -0,0 +1,537 @@
+/*
+ * This file contains the trace buffer of sba.
+ *
+ * Every cpu owns a fixed size ring of binary trace records. A ring
+ * has exactly one producer - the cpu it belongs to, running with
+ * local interrupts off while it writes a record - and one consumer,
+ * the extraction code. So, no lock is taken on the io path. The
+ * consumer merges the rings by the start time of the records.
+ *
+ * When a ring is full the producer either drops the new record or
+ * overwrites the oldest one (trace_policy). In the latter case the
+ * consumer may be copying the slot that is being overwritten, so it
+ * checks the reserve counter after the copy and retries if needed.
+ *
+ * Every sba instance has its own buffer. It can also be mapped by a
+ * user level reader through the sba_traceN misc device of the
+ * instance. The reader then is the consumer: it updates the tails
+ * in the header itself. The header pages are writable by the
+ * reader, so the kernel never trusts the geometry stored there.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/miscdevice.h>
+#include "sba.h"
+
+/*number of records in each cpu ring - must be a power of 2*/
+static int trace_ring_size = SBA_TRACE_RING_SIZE;
+module_param(trace_ring_size, int, 0);
+
+/*what to do when a ring is full (SBA_TRACE_DROP_NEWEST or SBA_TRACE_OVERWRITE_OLDEST)*/
+static int trace_policy = SBA_TRACE_DROP_NEWEST;
+module_param(trace_policy, int, 0);
+
+static struct file_operations sba_trace_fops;
+
+/*the ring counters are updated behind our back*/
+#define SBA_TRACE_READ(x)	(*(volatile unsigned int *)&(x))
+
+/*the rings start on the first page after the header*/
+#define SBA_TRACE_DATA_OFFSET	PAGE_ALIGN(sizeof(sba_trace_hdr))
+
+/*--------------------------------------------------------------------------*/
+
+static inline sba_trace_rec *sba_trace_slot(sba_trace_buf *tb, int ring, unsigned int pos)
+{
+	sba_trace_rec *data = (sba_trace_rec *)(tb->buf + SBA_TRACE_DATA_OFFSET);
+
+	return data + ring*tb->size + (pos & (tb->size - 1));
+}
+
+/*sets up the buffer of instance id and registers its sba_traceN device*/
+int sba_trace_init(sba_trace_buf *tb, int id)
+{
+	sba_trace_hdr *trace_hdr;
+
+	int cpu;
+	int nr_rings = 0;
+
+	if ((trace_ring_size < 2) || (trace_ring_size & (trace_ring_size - 1))) {
+		sba_debug(1, "Error: trace_ring_size %d is not a power of 2, using %d\n", trace_ring_size, SBA_TRACE_RING_SIZE);
+		trace_ring_size = SBA_TRACE_RING_SIZE;
+	}
+
+	if ((trace_policy != SBA_TRACE_DROP_NEWEST) && (trace_policy != SBA_TRACE_OVERWRITE_OLDEST)) {
+		sba_debug(1, "Error: invalid trace_policy %d, dropping the newest records\n", trace_policy);
+		trace_policy = SBA_TRACE_DROP_NEWEST;
+	}
+
+	/*one ring for every cpu that may ever come up*/
+	for (cpu = 0; cpu < NR_CPUS; cpu ++) {
+		if (cpu_possible(cpu)) {
+			nr_rings = cpu + 1;
+		}
+	}
+
+	if (nr_rings > SBA_TRACE_MAX_RINGS) {
+		sba_debug(1, "Error: only %d of the %d cpus will be traced\n", SBA_TRACE_MAX_RINGS, nr_rings);
+		nr_rings = SBA_TRACE_MAX_RINGS;
+	}
+
+	memset(tb, 0, sizeof(sba_trace_buf));
+	tb->buf_size = SBA_TRACE_DATA_OFFSET + PAGE_ALIGN(nr_rings*trace_ring_size*sizeof(sba_trace_rec));
+
+	tb->buf = vmalloc(tb->buf_size);
+	if (!tb->buf) {
+		sba_debug(1, "Error: unable to allocate %ld bytes for the trace buffer\n", tb->buf_size);
+		return 0;
+	}
+	memset(tb->buf, 0, tb->buf_size);
+
+	trace_hdr = (sba_trace_hdr *)tb->buf;
+	trace_hdr->magic = SBA_TRACE_MAGIC;
+	trace_hdr->version = SBA_TRACE_VERSION;
+	trace_hdr->nr_rings = nr_rings;
+	trace_hdr->ring_size = trace_ring_size;
+	trace_hdr->rec_size = sizeof(sba_trace_rec);
+	trace_hdr->policy = trace_policy;
+	trace_hdr->data_offset = SBA_TRACE_DATA_OFFSET;
+
+	tb->hdr = trace_hdr;
+	tb->nr_rings = nr_rings;
+	tb->size = trace_ring_size;
+	tb->policy = trace_policy;
+
+	init_MUTEX(&tb->sem);
+
+	sprintf(tb->name, "sba_trace%d", id);
+	tb->miscdev.minor = MISC_DYNAMIC_MINOR;
+	tb->miscdev.name = tb->name;
+	tb->miscdev.fops = &sba_trace_fops;
+
+	if (misc_register(&tb->miscdev)) {
+		sba_debug(1, "Error: unable to register the %s device\n", tb->name);
+		vfree(tb->buf);
+		tb->buf = NULL;
+		tb->hdr = NULL;
+		return 0;
+	}
+
+	sba_debug(1, "%s: %d rings of %d records\n", tb->name, nr_rings, trace_ring_size);
+
+	return 1;
+}
+
+int sba_trace_cleanup(sba_trace_buf *tb)
+{
+	if (tb->buf) {
+		misc_deregister(&tb->miscdev);
+		vfree(tb->buf);
+	}
+
+	tb->buf = NULL;
+	tb->hdr = NULL;
+	tb->buf_size = 0;
+
+	return 1;
+}
+
+/*the trace event of a READ/WRITE or SBA_* event code*/
+int sba_trace_event(int rw)
+{
+	switch(rw) {
+		case READ:
+		case READA:
+		case READ_SYNC:
+			return SBA_TRACE_EV_READ;
+
+		case WRITE:
+		case WRITE_SYNC:
+			return SBA_TRACE_EV_WRITE;
+
+		case SBA_FAIL:
+			return SBA_TRACE_EV_FAIL;
+
+		case SBA_DELAY:
+			return SBA_TRACE_EV_DELAY;
+
+		case SBA_CORRUPT:
+			return SBA_TRACE_EV_CORRUPT;
+
+		case SBA_CRASH:
+			return SBA_TRACE_EV_CRASH;
+
+		case SBA_DESC:
+			return SBA_TRACE_EV_DESC;
+
+		case SBA_WKLOAD_START:
+			return SBA_TRACE_EV_WKLOAD_START;
+
+		case SBA_WKLOAD_END:
+			return SBA_TRACE_EV_WKLOAD_END;
+
+		case SBA_START:
+			return SBA_TRACE_EV_START;
+
+		default:
+			return SBA_TRACE_EV_UNKNOWN;
+	}
+}
+
+/*the trace block type of a file system block type*/
+int sba_trace_btype(int btype)
+{
+	switch(btype) {
+		case SBA_EXT3_INODE:	return SBA_TRACE_BT_INODE;
+		case SBA_EXT3_DBITMAP:	return SBA_TRACE_BT_DBITMAP;
+		case SBA_EXT3_IBITMAP:	return SBA_TRACE_BT_IBITMAP;
+		case SBA_EXT3_SUPER:	return SBA_TRACE_BT_SUPER;
+		case SBA_EXT3_GROUP:	return SBA_TRACE_BT_GROUP;
+		case SBA_EXT3_DATA:		return SBA_TRACE_BT_DATA;
+		case SBA_EXT3_REVOKE:	return SBA_TRACE_BT_REVOKE;
+		case SBA_EXT3_DESC:		return SBA_TRACE_BT_DESC;
+		case SBA_EXT3_COMMIT:	return SBA_TRACE_BT_COMMIT;
+		case SBA_EXT3_JSUPER:	return SBA_TRACE_BT_JSUPER;
+		case SBA_EXT3_JDATA:	return SBA_TRACE_BT_JDATA;
+		case SBA_EXT3_DIR:		return SBA_TRACE_BT_DIR;
+		case SBA_EXT3_INDIR:	return SBA_TRACE_BT_INDIR;
+		case SBA_EXT3_SINDIR:	return SBA_TRACE_BT_SINDIR;
+		case SBA_EXT3_DINDIR:	return SBA_TRACE_BT_DINDIR;
+		case SBA_EXT3_TINDIR:	return SBA_TRACE_BT_TINDIR;
+		case SBA_EXT3_JINDIR:	return SBA_TRACE_BT_JINDIR;
+		default:				return SBA_TRACE_BT_UNKNOWN;
+	}
+}
+
+/*
+ * adds a record to the ring of the current cpu. this is called
+ * from the io completion path as well, so it must not sleep.
+ * returns 0 if the record was dropped.
+ */
+int sba_trace_add(sba_trace_buf *tb, sba_trace_rec *rec)
+{
+	unsigned long flags;
+	sba_trace_ring *r;
+	unsigned int head;
+	int cpu;
+	int ret = 1;
+
+	if (!tb->hdr) {
+		return 0;
+	}
+
+	/*nobody else writes to this ring as long as we
+	 *are not interrupted in the middle of it*/
+	local_irq_save(flags);
+
+	cpu = smp_processor_id();
+	if (cpu >= tb->nr_rings) {
+		local_irq_restore(flags);
+		return 0;
+	}
+
+	r = &tb->hdr->ring[cpu];
+	head = r->head;
+
+	if ((head - SBA_TRACE_READ(r->tail) >= tb->size) &&
+		(tb->policy == SBA_TRACE_DROP_NEWEST)) {
+		r->dropped ++;
+		ret = 0;
+	}
+	else {
+		/*tell the consumer that the slot is going to change*/
+		r->reserve = head + 1;
+		smp_wmb();
+
+		memcpy(sba_trace_slot(tb, cpu, head), rec, sizeof(sba_trace_rec));
+
+		/*the record must be visible before the new head*/
+		smp_wmb();
+		r->head = head + 1;
+	}
+
+	local_irq_restore(flags);
+
+	return ret;
+}
+
+/*wall clock time of the trace time 0, for the readers*/
+int sba_trace_set_base(sba_trace_buf *tb, unsigned int sec, unsigned int nsec)
+{
+	if (!tb->hdr) {
+		return -1;
+	}
+
+	tb->hdr->base_sec = sec;
+	tb->hdr->base_nsec = nsec;
+
+	return 1;
+}
+
+int sba_trace_set_policy(sba_trace_buf *tb, int policy)
+{
+	if ((policy != SBA_TRACE_DROP_NEWEST) && (policy != SBA_TRACE_OVERWRITE_OLDEST)) {
+		sba_debug(1, "Error: invalid trace policy %d\n", policy);
+		return -1;
+	}
+
+	tb->policy = policy;
+	if (tb->hdr) {
+		tb->hdr->policy = policy;
+	}
+
+	return 1;
+}
+
+/*total number of records lost because a ring was full*/
+unsigned int sba_trace_dropped(sba_trace_buf *tb)
+{
+	int i;
+	unsigned int dropped = 0;
+
+	if (!tb->hdr) {
+		return 0;
+	}
+
+	for (i = 0; i < tb->nr_rings; i ++) {
+		dropped += SBA_TRACE_READ(tb->hdr->ring[i].dropped);
+		dropped += SBA_TRACE_READ(tb->hdr->ring[i].overwritten);
+	}
+
+	return dropped;
+}
+
+/*returns 0 if somebody else is consuming the buffer*/
+int sba_trace_trylock_consumer(sba_trace_buf *tb)
+{
+	return !down_trylock(&tb->sem);
+}
+
+int sba_trace_unlock_consumer(sba_trace_buf *tb)
+{
+	up(&tb->sem);
+	return 1;
+}
+
+/*
+ * copies the oldest record of a ring into rec without consuming it.
+ * returns 0 if the ring is empty. the caller holds the consumer lock.
+ */
+static int sba_trace_ring_peek(sba_trace_buf *tb, int ring, sba_trace_rec *rec)
+{
+	sba_trace_ring *r = &tb->hdr->ring[ring];
+	unsigned int size = tb->size;
+	unsigned int head, tail, reserve;
+
+	while (1) {
+		head = SBA_TRACE_READ(r->head);
+		smp_rmb();
+
+		tail = r->tail;
+		if (head == tail) {
+			return 0;
+		}
+
+		/*the producer has wrapped around and overwritten the oldest records*/
+		reserve = SBA_TRACE_READ(r->reserve);
+		if (reserve - tail > size) {
+			r->overwritten += reserve - size - tail;
+			r->tail = tail = reserve - size;
+		}
+
+		memcpy(rec, sba_trace_slot(tb, ring, tail), sizeof(sba_trace_rec));
+		smp_rmb();
+
+		/*the copy is good unless the slot was reused meanwhile*/
+		if (SBA_TRACE_READ(r->reserve) - tail <= size) {
+			return 1;
+		}
+	}
+}
+
+/*
+ * finds the oldest record (by start time) at the tail of all
+ * the rings. returns the ring it belongs to, or -1 when all
+ * the rings are empty. only the ring consumed last is looked
+ * at again, so a record costs one copy and a pass over the
+ * cached heads. the caller holds the consumer lock.
+ */
+int sba_trace_peek(sba_trace_buf *tb, sba_trace_rec *rec)
+{
+	int i;
+	int ret = -1;
+
+	if (!tb->hdr) {
+		return -1;
+	}
+
+	for (i = 0; i < tb->nr_rings; i ++) {
+		if (!tb->next_valid[i]) {
+			tb->next_valid[i] = sba_trace_ring_peek(tb, i, &tb->next[i]);
+		}
+
+		if (tb->next_valid[i]) {
+			if ((ret < 0) || (tb->next[i].stime < tb->next[ret].stime)) {
+				ret = i;
+			}
+		}
+	}
+
+	if (ret >= 0) {
+		memcpy(rec, &tb->next[ret], sizeof(sba_trace_rec));
+	}
+
+	return ret;
+}
+
+/*consumes the record last returned by sba_trace_peek() for this ring*/
+int sba_trace_consume(sba_trace_buf *tb, int ring)
+{
+	sba_trace_ring *r = &tb->hdr->ring[ring];
+
+	smp_mb();
+	r->tail ++;
+	tb->next_valid[ring] = 0;
+
+	return 1;
+}
+
+/*forgets the cached heads, eg. when somebody else consumes the rings*/
+static void sba_trace_forget_heads(sba_trace_buf *tb)
+{
+	memset(tb->next_valid, 0, sizeof(tb->next_valid));
+}
+
+/*throws away all the records in the rings. the caller holds the consumer lock*/
+int sba_trace_reset(sba_trace_buf *tb)
+{
+	int i;
+	sba_trace_ring *r;
+
+	if (!tb->hdr) {
+		return -1;
+	}
+
+	for (i = 0; i < tb->nr_rings; i ++) {
+		r = &tb->hdr->ring[i];
+		r->tail = SBA_TRACE_READ(r->head);
+		r->dropped = r->overwritten = 0;
+	}
+
+	sba_trace_forget_heads(tb);
+
+	return 1;
+}
+
+/*--------------------------------------------------------------------------*/
+
+/*
+ * the sba_traceN devices. only one reader may have a device open,
+ * and the in kernel extraction of that instance fails with -EBUSY
+ * while it is open. the other ioctls are the same as on the sba
+ * block device.
+ */
+static sba_trace_buf *sba_trace_find(int minor)
+{
+	int i;
+	sba_dev *dev;
+
+	for (i = 0; (dev = sba_get_dev(i)) != NULL; i ++) {
+		if ((dev->trace.hdr) && (dev->trace.miscdev.minor == minor)) {
+			return &dev->trace;
+		}
+	}
+
+	return NULL;
+}
+
+static int sba_trace_open(struct inode *inode, struct file *filp)
+{
+	sba_trace_buf *tb = sba_trace_find(iminor(inode));
+
+	if (!tb) {
+		return -ENODEV;
+	}
+
+	if (!sba_trace_trylock_consumer(tb)) {
+		return -EBUSY;
+	}
+
+	/*the reader moves the tails from now on*/
+	sba_trace_forget_heads(tb);
+	filp->private_data = tb;
+
+	return 0;
+}
+
+static int sba_trace_release(struct inode *inode, struct file *filp)
+{
+	sba_trace_unlock_consumer((sba_trace_buf *)filp->private_data);
+	return 0;
+}
+
+static int sba_trace_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	sba_trace_buf *tb = (sba_trace_buf *)filp->private_data;
+
+	/*they consume the buffer, which the reader holds until it closes the device*/
+	switch (cmd) {
+		case EXTRACT_STATS:
+		case CLEAN_STAT:
+		case CLEAN_ALL_STAT:
+			return -EBUSY;
+	}
+
+	return sba_dev_ioctl(container_of(tb, sba_dev, trace), cmd, arg);
+}
+
+static struct page *sba_trace_vma_nopage(struct vm_area_struct *vma, unsigned long address, int *type)
+{
+	sba_trace_buf *tb = (sba_trace_buf *)vma->vm_private_data;
+	unsigned long offset;
+	struct page *page;
+
+	offset = (address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+	if (offset >= tb->buf_size) {
+		return NOPAGE_SIGBUS;
+	}
+
+	page = vmalloc_to_page(tb->buf + offset);
+	get_page(page);
+
+	if (type) {
+		*type = VM_FAULT_MINOR;
+	}
+
+	return page;
+}
+
+static struct vm_operations_struct sba_trace_vm_ops = {
+	.nopage = sba_trace_vma_nopage,
+};
+
+static int sba_trace_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	sba_trace_buf *tb = (sba_trace_buf *)filp->private_data;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+
+	if ((offset >= tb->buf_size) || (vma->vm_end - vma->vm_start > tb->buf_size - offset)) {
+		sba_debug(1, "Error: mapping beyond the trace buffer\n");
+		return -EINVAL;
+	}
+
+	vma->vm_ops = &sba_trace_vm_ops;
+	vma->vm_private_data = tb;
+	vma->vm_flags |= VM_RESERVED;
+
+	return 0;
+}
+
+static struct file_operations sba_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = sba_trace_open,
+	.release = sba_trace_release,
+	.mmap = sba_trace_mmap,
+	.ioctl = sba_trace_ioctl,
+};
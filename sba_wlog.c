@@ -0,0 +1,387 @@
+/*
+ * This file contains the write log of sba.
+ *
+ * While the log of an instance is on, every write the instance sends
+ * to its storage is appended to a log file with its data, its block
+ * type and its barrier/sync flags, and so is the completion of every
+ * write (see sba_wlog_defs.h). tools/sba_replay builds the images a
+ * crash could have left on the storage from the log, any number of
+ * them from a single run.
+ *
+ * The records are built on the io path and queued; a thread of the
+ * log writes them to the file. When memory or the file runs out the
+ * log is cut: nothing more is added, so the file stays a prefix of
+ * what happened.
+ */
+
+#include <linux/moduleparam.h>
+#include <linux/highmem.h>
+#include <linux/file.h>
+#include "sba.h"
+
+/*records that may wait for the thread before the log is cut*/
+static int wlog_max_queued = 16384;
+module_param(wlog_max_queued, int, 0);
+
+typedef struct _sba_wlog {
+	struct file *filp;
+	loff_t pos;
+	spinlock_t lock;
+	struct list_head queue;			//records waiting for the thread
+	int queued;
+	unsigned int seq;				//of the next bio
+	int cut;
+	int werror;						//a write to the file failed
+	atomic_t refs;					//the instance and the bios in flight
+	wait_queue_head_t wait;
+	struct work_struct work;
+	struct workqueue_struct *wq;
+	char name[16];
+} sba_wlog;
+
+typedef struct _sba_wlog_entry {
+	struct list_head list;
+	sba_wlog_rec rec;
+	char *data;						//rec.len bytes
+} sba_wlog_entry;
+
+/*follows a logged bio to its completion, done is its DONE record*/
+typedef struct _sba_wlog_io {
+	sba_wlog *wl;
+	bio_end_io_t *end_io;
+	void *private;
+	sba_wlog_entry done;
+} sba_wlog_io;
+
+static void sba_wlog_free(sba_wlog_entry *e)
+{
+	if (e->rec.type == SBA_WLOG_DONE) {
+		kfree(container_of(e, sba_wlog_io, done));
+	}
+	else {
+		kfree(e);
+	}
+}
+
+static void sba_wlog_put(sba_wlog *wl)
+{
+	if (atomic_dec_and_test(&wl->refs)) {
+		wake_up(&wl->wait);
+	}
+}
+
+/*called with wl->lock held*/
+static void sba_wlog_cut(sba_wlog *wl)
+{
+	if (!wl->cut) {
+		sba_debug(1, "Error: %s is cut after %u writes\n", wl->name, wl->seq);
+		wl->cut = 1;
+	}
+}
+
+/*
+ * appends the n records on entries to the queue in one go, so that
+ * the records of a bio stay together. the records of a new bio get
+ * its seq (returned in seq) here, so that the bios are in the log in
+ * the order of their seq. frees the records if the log is cut.
+ */
+static void sba_wlog_queue(sba_wlog *wl, struct list_head *entries, int n, unsigned int *seq)
+{
+	sba_wlog_entry *e;
+	unsigned long flags;
+
+	spin_lock_irqsave(&wl->lock, flags);
+	if (seq) {
+		*seq = wl->seq ++;
+		list_for_each_entry(e, entries, list) {
+			e->rec.seq = *seq;
+		}
+	}
+
+	if (wl->queued + n > wlog_max_queued) {
+		sba_wlog_cut(wl);
+	}
+
+	while (!list_empty(entries)) {
+		e = list_entry(entries->next, sba_wlog_entry, list);
+		if (wl->cut) {
+			list_del(&e->list);
+			sba_wlog_free(e);
+		}
+		else {
+			list_move_tail(&e->list, &wl->queue);
+			wl->queued ++;
+		}
+	}
+	spin_unlock_irqrestore(&wl->lock, flags);
+
+	queue_work(wl->wq, &wl->work);
+}
+
+static int sba_wlog_end_io(struct bio *sba_bio, unsigned int bytes, int error)
+{
+	sba_wlog_io *io = (sba_wlog_io *)sba_bio->bi_private;
+	sba_wlog *wl = io->wl;
+	LIST_HEAD(entries);
+
+	if (sba_bio->bi_size) {
+		return 1;
+	}
+
+	sba_bio->bi_end_io = io->end_io;
+	sba_bio->bi_private = io->private;
+
+	io->done.rec.stime = sba_common_get_time_ns();
+	if (!test_bit(BIO_UPTODATE, &sba_bio->bi_flags)) {
+		io->done.rec.flags |= SBA_WLOG_ERROR;
+	}
+	list_add_tail(&io->done.list, &entries);
+	sba_wlog_queue(wl, &entries, 1, NULL);
+	sba_wlog_put(wl);
+
+	return sba_bio->bi_end_io(sba_bio, bytes, error);
+}
+
+/*
+ * logs a write that is about to be sent to the storage. rw is the
+ * bi_rw of the bio from the fs (the clones don't keep the barrier
+ * and sync bits), sba_req gives the block types when there is one.
+ */
+void sba_wlog_write(sba_dev *dev, struct bio *sba_bio, unsigned long rw, sba_request *sba_req)
+{
+	sba_wlog *wl;
+	sba_wlog_io *io;
+	sba_wlog_entry *e;
+	struct bio_vec *bvec;
+	unsigned long long sector = sba_bio->bi_sector;
+	unsigned long long now = sba_common_get_time_ns();
+	unsigned short flags = 0;
+	unsigned long irqflags;
+	LIST_HEAD(entries);
+	char *addr;
+	int i, n = 0;
+
+	spin_lock_irqsave(&dev->lock, irqflags);
+	wl = dev->wlog;
+	if (wl) {
+		atomic_inc(&wl->refs);
+	}
+	spin_unlock_irqrestore(&dev->lock, irqflags);
+
+	if (!wl) {
+		return;
+	}
+
+	if (rw & (1 << BIO_RW_BARRIER)) {
+		flags |= SBA_WLOG_BARRIER;
+	}
+	if (rw & (1 << BIO_RW_SYNC)) {
+		flags |= SBA_WLOG_SYNC;
+	}
+
+	io = kmalloc(sizeof(sba_wlog_io), GFP_NOIO);
+	if (!io) {
+		goto nomem;
+	}
+	memset(io, 0, sizeof(sba_wlog_io));
+
+	bio_for_each_segment(bvec, sba_bio, i) {
+		e = kmalloc(sizeof(sba_wlog_entry) + bvec->bv_len, GFP_NOIO);
+		if (!e) {
+			goto nomem;
+		}
+		e->data = (char *)(e + 1);
+
+		addr = kmap_atomic(bvec->bv_page, KM_USER0);
+		memcpy(e->data, addr + bvec->bv_offset, bvec->bv_len);
+		kunmap_atomic(addr, KM_USER0);
+
+		memset(&e->rec, 0, sizeof(sba_wlog_rec));
+		e->rec.type = SBA_WLOG_WRITE;
+		e->rec.sector = sector;
+		e->rec.len = bvec->bv_len;
+		e->rec.flags = flags;
+		e->rec.stime = now;
+		if ((sba_req) && (i < sba_req->nr_btypes)) {
+			e->rec.btype = sba_trace_btype(sba_req->btype[i]);
+		}
+		list_add_tail(&e->list, &entries);
+
+		sector += bvec->bv_len >> SBA_HARDSECT_BITS;
+		n ++;
+	}
+
+	sba_wlog_queue(wl, &entries, n, &io->done.rec.seq);
+
+	io->done.rec.type = SBA_WLOG_DONE;
+	io->wl = wl;
+	io->end_io = sba_bio->bi_end_io;
+	io->private = sba_bio->bi_private;
+	sba_bio->bi_end_io = sba_wlog_end_io;
+	sba_bio->bi_private = io;
+
+	return;
+
+nomem:
+	while (!list_empty(&entries)) {
+		e = list_entry(entries.next, sba_wlog_entry, list);
+		list_del(&e->list);
+		kfree(e);
+	}
+	if (io) {
+		kfree(io);
+	}
+
+	spin_lock_irqsave(&wl->lock, irqflags);
+	sba_wlog_cut(wl);
+	spin_unlock_irqrestore(&wl->lock, irqflags);
+
+	sba_wlog_put(wl);
+}
+
+static int sba_wlog_append(sba_wlog *wl, void *buf, int len)
+{
+	mm_segment_t old_fs;
+	ssize_t ret;
+
+	old_fs = get_fs();
+	set_fs(get_ds());
+	ret = vfs_write(wl->filp, buf, len, &wl->pos);
+	set_fs(old_fs);
+
+	return (ret == len);
+}
+
+static void sba_wlog_work(void *data)
+{
+	sba_wlog *wl = (sba_wlog *)data;
+	sba_wlog_entry *e;
+	int ok;
+
+	for (;;) {
+		e = NULL;
+
+		spin_lock_irq(&wl->lock);
+		if (!list_empty(&wl->queue)) {
+			e = list_entry(wl->queue.next, sba_wlog_entry, list);
+			list_del(&e->list);
+			wl->queued --;
+		}
+		spin_unlock_irq(&wl->lock);
+
+		if (!e) {
+			break;
+		}
+
+		/*a record half written at the end of the file is dropped by the tools*/
+		if (!wl->werror) {
+			ok = sba_wlog_append(wl, &e->rec, sizeof(sba_wlog_rec));
+			if ((ok) && (e->rec.len)) {
+				ok = sba_wlog_append(wl, e->data, e->rec.len);
+			}
+
+			if (!ok) {
+				wl->werror = 1;
+				spin_lock_irq(&wl->lock);
+				sba_wlog_cut(wl);
+				spin_unlock_irq(&wl->lock);
+			}
+		}
+
+		sba_wlog_free(e);
+	}
+}
+
+/*starts logging the writes of the instance to the file at path (truncated)*/
+int sba_wlog_start(sba_dev *dev, char *path)
+{
+	sba_wlog *wl;
+	sba_wlog_hdr hdr;
+	struct file *filp;
+	int ret = -ENOMEM;
+
+	if (dev->wlog) {
+		return -EBUSY;
+	}
+
+	filp = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+	if (IS_ERR(filp)) {
+		return PTR_ERR(filp);
+	}
+
+	wl = kmalloc(sizeof(sba_wlog), GFP_KERNEL);
+	if (!wl) {
+		goto out_close;
+	}
+	memset(wl, 0, sizeof(sba_wlog));
+
+	wl->filp = filp;
+	spin_lock_init(&wl->lock);
+	INIT_LIST_HEAD(&wl->queue);
+	atomic_set(&wl->refs, 1);
+	init_waitqueue_head(&wl->wait);
+	INIT_WORK(&wl->work, sba_wlog_work, wl);
+	sprintf(wl->name, "sba_wlog%d", dev->id);
+
+	wl->wq = create_singlethread_workqueue(wl->name);
+	if (!wl->wq) {
+		goto out_free;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SBA_WLOG_MAGIC;
+	hdr.version = SBA_WLOG_VERSION;
+	hdr.rec_size = sizeof(sba_wlog_rec);
+	if (!sba_wlog_append(wl, &hdr, sizeof(hdr))) {
+		ret = -EIO;
+		goto out_wq;
+	}
+
+	spin_lock_irq(&dev->lock);
+	if (dev->wlog) {
+		spin_unlock_irq(&dev->lock);
+		ret = -EBUSY;
+		goto out_wq;
+	}
+	dev->wlog = wl;
+	spin_unlock_irq(&dev->lock);
+
+	sba_debug(1, "Logging the writes of sba%d to %s\n", dev->id, path);
+
+	return 0;
+
+out_wq:
+	destroy_workqueue(wl->wq);
+out_free:
+	kfree(wl);
+out_close:
+	filp_close(filp, NULL);
+	return ret;
+}
+
+/*stops the log, once the writes in flight are done and logged*/
+int sba_wlog_stop(sba_dev *dev)
+{
+	sba_wlog *wl;
+
+	spin_lock_irq(&dev->lock);
+	wl = dev->wlog;
+	dev->wlog = NULL;
+	spin_unlock_irq(&dev->lock);
+
+	if (!wl) {
+		return -ENXIO;
+	}
+
+	sba_wlog_put(wl);
+	wait_event(wl->wait, atomic_read(&wl->refs) == 0);
+
+	flush_workqueue(wl->wq);
+	destroy_workqueue(wl->wq);
+	filp_close(wl->filp, NULL);
+
+	sba_debug(1, "Stopped %s after %u writes%s\n", wl->name, wl->seq, wl->cut ? " (cut)" : "");
+	kfree(wl);
+
+	return 0;
+}
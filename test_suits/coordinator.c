@@ -39,6 +39,10 @@ int total_workloads = 15;
 
 /*to issue ioctl calls to the device*/
 int disk_fd = -1;
+char *device = DEVICE;
+
+/*block type of the image the snapshot holds, -1 without one*/
+int pristine_block_type = -1;
 
 /*log file where all the results will go*/
 char *logfile = "logfile";
@@ -122,8 +126,12 @@ int init_sys()
 	sba_fault = (fault *)malloc(sizeof(fault));
 	memset(sba_fault, 0, sizeof(fault));
 
-	if ((disk_fd = open(DEVICE, O_RDONLY)) < 0) {
-		fprintf(stderr, "Error: unable to open the dev %s\n", DEVICE);
+	if (getenv(DEVICE_ENV)) {
+		device = getenv(DEVICE_ENV);
+	}
+
+	if ((disk_fd = open(device, O_RDONLY)) < 0) {
+		fprintf(stderr, "Error: unable to open the dev %s\n", device);
 		exit(-1);
 	}
 
@@ -134,6 +142,7 @@ int init_sys()
 
 int cleanup_sys()
 {
+	ioctl(disk_fd, DROP_SNAPSHOT);
 	free(sba_fault);
 	close(disk_fd);
 
@@ -285,6 +294,10 @@ int print_fault(fault *fs_fault, char *fault_info)
 			ftype = "corrupt";
 		break;
 
+		case SBA_DELAY:
+			ftype = "delay";
+		break;
+
 		default:
 			ftype = "unknown";
 		break;
@@ -356,6 +369,84 @@ int get_fault_specification(char *fault_spec)
 		else 
 		if (strcmp(input, "corrupt") == 0) {
 			sba_fault->fault_type = SBA_CORRUPT;
+
+			/*corrupt: <bitflip seed [bits]|zero offset len|pattern offset len|field name index value>*/
+			if (fscanf(fspec, "corrupt: %s", input) < 1) {
+				goto fspec_err;
+			}
+
+			if (strcmp(input, "bitflip") == 0) {
+				sba_fault->corrupt_mode = SBA_CORRUPT_BITFLIP;
+				sba_fault->corrupt_count = 1;
+				if (fscanf(fspec, "%u %d\n", &sba_fault->corrupt_seed, &sba_fault->corrupt_count) < 1) {
+					goto fspec_err;
+				}
+			}
+			else 
+			if ((strcmp(input, "zero") == 0) || (strcmp(input, "pattern") == 0)) {
+				sba_fault->corrupt_mode = (strcmp(input, "zero") == 0) ? SBA_CORRUPT_ZERO : SBA_CORRUPT_PATTERN;
+				if (fscanf(fspec, "%d %d\n", &sba_fault->corrupt_offset, &sba_fault->corrupt_len) < 2) {
+					goto fspec_err;
+				}
+			}
+			else 
+			if (strcmp(input, "field") == 0) {
+				sba_fault->corrupt_mode = SBA_CORRUPT_FIELD;
+				if (fscanf(fspec, "%s %d %u\n", input, &sba_fault->corrupt_index, &sba_fault->corrupt_value) < 3) {
+					goto fspec_err;
+				}
+
+				if (strcmp(input, "i_block") == 0) {
+					sba_fault->corrupt_field = EXT3_INODE_I_BLOCK;
+				}
+				else 
+				if (strcmp(input, "inode_bitmap") == 0) {
+					sba_fault->corrupt_field = EXT3_INODE_BITMAP;
+				}
+				else 
+				if (strcmp(input, "data_bitmap") == 0) {
+					sba_fault->corrupt_field = EXT3_DATA_BITMAP;
+				}
+				else 
+				if (strcmp(input, "gd_block_bitmap") == 0) {
+					sba_fault->corrupt_field = EXT3_GRPDESC_BLOCK_BITMAP;
+				}
+				else 
+				if (strcmp(input, "gd_inode_bitmap") == 0) {
+					sba_fault->corrupt_field = EXT3_GRPDESC_INODE_BITMAP;
+				}
+				else {
+					goto fspec_err;
+				}
+			}
+			else {
+				goto fspec_err;
+			}
+		}
+		else 
+		if (strcmp(input, "delay") == 0) {
+			sba_fault->fault_type = SBA_DELAY;
+
+			/*delay: <fixed|uniform|exp> <msecs> [max_msecs]*/
+			sba_fault->delay_max_msecs = 0;
+			if (fscanf(fspec, "delay: %s %d %d\n", input, &sba_fault->delay_msecs, &sba_fault->delay_max_msecs) < 2) {
+				goto fspec_err;
+			}
+
+			if (strcmp(input, "fixed") == 0) {
+				sba_fault->delay_dist = SBA_DELAY_FIXED;
+			}
+			else 
+			if (strcmp(input, "uniform") == 0) {
+				sba_fault->delay_dist = SBA_DELAY_UNIFORM;
+			}
+			else 
+			if (strcmp(input, "exp") == 0) {
+				sba_fault->delay_dist = SBA_DELAY_EXP;
+			}
+			else {
+				goto fspec_err;
+			}
 		}
 		else {
 			goto fspec_err;
@@ -373,6 +464,38 @@ int get_fault_specification(char *fault_spec)
 			goto fspec_err;
 		}
 
+		/*optional. trigger: <first|prob ppm|nth n|every k>*/
+		sba_fault->trigger = SBA_TRIGGER_FIRST;
+		if (fscanf(fspec, "trigger: %s", input) == 1) {
+			if (strcmp(input, "first") == 0) {
+				fscanf(fspec, "\n");
+			}
+			else 
+			if (strcmp(input, "prob") == 0) {
+				sba_fault->trigger = SBA_TRIGGER_PROB;
+				if (fscanf(fspec, "%u\n", &sba_fault->trigger_ppm) < 1) {
+					goto fspec_err;
+				}
+			}
+			else 
+			if ((strcmp(input, "nth") == 0) || (strcmp(input, "every") == 0)) {
+				sba_fault->trigger = (strcmp(input, "nth") == 0) ? SBA_TRIGGER_NTH : SBA_TRIGGER_EVERY;
+				if (fscanf(fspec, "%u\n", &sba_fault->trigger_n) < 1) {
+					goto fspec_err;
+				}
+			}
+			else {
+				goto fspec_err;
+			}
+		}
+
+		/*optional. window: <start_msecs> <end_msecs> after the workload starts*/
+		sba_fault->window_start_msecs = 0;
+		sba_fault->window_end_msecs = 0;
+		if (fscanf(fspec, "window: %u %u\n", &sba_fault->window_start_msecs, &sba_fault->window_end_msecs) == 1) {
+			goto fspec_err;
+		}
+
 		fscanf(fspec, "filesystem: %s\n", input);
 		if (strcmp(input, "ext3") == 0) {
 			sba_fault->filesystem = EXT3;
@@ -764,7 +887,7 @@ int create_filesystem()
 	switch(sba_fault->filesystem) {
 		case EXT3:
 			/* mke2fs -j -J size=32 -b 4096 /dev/SBA */
-			sprintf(cmd, "mke2fs -j -J size=%d -b 4096 %s", jsize, DEVICE);
+			sprintf(cmd, "mke2fs -j -J size=%d -b 4096 %s", jsize, device);
 			system(cmd);
 		break;
 
@@ -814,15 +937,15 @@ int mount_filesystem()
 
 	switch (sba_fault->filesystem) {
 		case EXT3:
-			sprintf(cmd, "mount -o commit=%d -o data=%s %s /mnt/sba -t ext3 >> %s", jcommit, jmode, DEVICE, logfile);
+			sprintf(cmd, "mount -o commit=%d -o data=%s %s /mnt/sba -t ext3 >> %s", jcommit, jmode, device, logfile);
 		break;
 
 		case REISERFS:
-			sprintf(cmd, "mount -o commit=%d -o data=%s %s /mnt/sba -t reiserfs >> %s", jcommit, jmode, DEVICE, logfile);
+			sprintf(cmd, "mount -o commit=%d -o data=%s %s /mnt/sba -t reiserfs >> %s", jcommit, jmode, device, logfile);
 		break;
 
 		case JFS:
-			sprintf(cmd, "mount %s /mnt/sba -t jfs >> %s", DEVICE, logfile);
+			sprintf(cmd, "mount %s /mnt/sba -t jfs >> %s", device, logfile);
 		break;
 
 		default:
@@ -857,14 +980,30 @@ int create_setup(int block_type)
 	/*stop interpreting the fs traffic*/
 	notify_sba("stop");
 
-	/*create the new file system*/
-	build_fs();
+	if ((block_type == pristine_block_type) && (ioctl(disk_fd, ROLLBACK) >= 0)) {
+		/*back to the image built for this block type*/
+		mount_filesystem();
+		notify_sba("start");
+	}
+	else {
+		pristine_block_type = -1;
+		ioctl(disk_fd, DROP_SNAPSHOT);
 
-	/*move the system to the required state for testing*/
-	create_test_state(block_type);
+		/*create the new file system*/
+		build_fs();
 
-	/*flush cache and remount the system freshly*/
-	flush_from_cache();
+		/*move the system to the required state for testing*/
+		create_test_state(block_type);
+
+		/*keep the image, the next setups of the block type roll back to it*/
+		unmount_filesystem();
+		if (ioctl(disk_fd, SNAPSHOT) >= 0) {
+			pristine_block_type = block_type;
+		}
+
+		/*remount the system freshly*/
+		mount_filesystem();
+	}
 
 	/*start testing the system*/
 	notify_sba("test_system");
@@ -2264,7 +2403,7 @@ int run_workload(int workload, int blocktype, int minor_blktype)
 
 			/*now run the test*/
 			argc = 6;
-			argv[1] = DEVICE;
+			argv[1] = device;
 			argv[2] = "/mnt/sba/";
 			argv[3] = "ext3";
 			argv[4] = "0";
@@ -15,7 +15,9 @@
 #include "fslib.h"
 #include "posix_lib.h"
 
-#define DEVICE	"/dev/SBA"
+/*the instance to test, $SBA_DEV picks another one than sba0, e.g. /dev/SBA1*/
+#define DEVICE			"/dev/SBA"
+#define DEVICE_ENV		"SBA_DEV"
 
 #define MAX_WORKLOAD			100
 
@@ -5,20 +5,63 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/sysmacros.h>
 #include "sba_common_defs.h"
+#include "sba_trace_defs.h"
+#include "sba_wlog_defs.h"
 
+/*the instance, $SBA_DEV picks another one than sba0, e.g. /dev/SBA1*/
 #define DEV		"/dev/SBA"
+#define DEV_ENV	"SBA_DEV"
+
+/*names of the SBA_THR_* classes*/
+char *throttle_classes[SBA_THR_CLASSES] = {"jdata", "commit", "checkpoint", "ordered", "unordered", "inode", "bitmap"};
+
+int throttle_class(char *name)
+{
+	int i;
+
+	for (i = 0; i < SBA_THR_CLASSES; i ++) {
+		if (strcmp(name, throttle_classes[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*major and minor of a block device node*/
+int block_device(char *path, unsigned int *major, unsigned int *minor)
+{
+	struct stat st;
+
+	if ((stat(path, &st) < 0) || (!S_ISBLK(st.st_mode))) {
+		fprintf(stderr, "%s is not a block device\n", path);
+		return -1;
+	}
+
+	*major = major(st.st_rdev);
+	*minor = minor(st.st_rdev);
+
+	return 1;
+}
 
 int main(int argc, char *argv[])
 {
 	int fd;
+	char *dev;
 
 	if (argc < 2) {
-		printf("Usage: sba <start|stop|print_stat|zero_stat|remove_fault|print_fault|test_system|dont_test|move_2_start|squash_writes|allow_writes|print_jblocks|clean_stats|clean_all_stats|extract_stats|crash_commit|dont_crash_commit|workload_start|workload_end>\n");
+		printf("Usage: sba <start|stop|print_stat|zero_stat|remove_fault|print_fault|test_system|dont_test|move_2_start|squash_writes|allow_writes|print_jblocks|clean_stats|clean_all_stats|extract_stats|crash_commit|dont_crash_commit|workload_start|workload_end|trace_dropped|trace_policy <drop|overwrite>|throttle <class> <bytes/s> <ios/s> [burst_ms]|throttle_stats|attach <dev> [journal_dev]|attach ram <MB>|attach file <path>|detach|snapshot|rollback|drop_snapshot|wlog_start <file>|wlog_stop|get_fault <id>|del_fault <id>|fault_seed <seed>>\n");
 		return -1;
 	}
 
-	fd = open(DEV, O_RDONLY);
+	dev = getenv(DEV_ENV) ? getenv(DEV_ENV) : DEV;
+	fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		perror(dev);
+		return -1;
+	}
 
 	if (strcmp(argv[1], "start") == 0) {
 		fprintf(stderr, "Starting sba ...\n");
@@ -82,12 +125,18 @@ int main(int argc, char *argv[])
 	else
 	if (strcmp(argv[1], "clean_stats") == 0) {
 		fprintf(stderr, "cleaning the statistics ...\n");
-		ioctl(fd, CLEAN_STAT);
+		if (ioctl(fd, CLEAN_STAT) < 0) {
+			perror("clean_stats");
+			return 1;
+		}
 	}
 	else
 	if (strcmp(argv[1], "clean_all_stats") == 0) {
 		fprintf(stderr, "cleaning all the statistics ...\n");
-		ioctl(fd, CLEAN_ALL_STAT);
+		if (ioctl(fd, CLEAN_ALL_STAT) < 0) {
+			perror("clean_all_stats");
+			return 1;
+		}
 	}
 	else
 	if (strcmp(argv[1], "extract_stats") == 0) {
@@ -101,7 +150,11 @@ int main(int argc, char *argv[])
 			do {
 				fprintf(stderr, "Looping ...");
 				memset(buf, '\0', MAX_UBUF_SIZE);
-				ioctl(fd, EXTRACT_STATS, buf);
+				if (ioctl(fd, EXTRACT_STATS, buf) < 0) {
+					perror("extract_stats");
+					free(buf);
+					return 1;
+				}
 				fprintf(stderr, "over \n");
 				printf("%s\n", buf);
 			} while(!(strstr(buf, "COPY")));
@@ -128,6 +181,157 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "ending the workload ...\n");
 		ioctl(fd, WORKLOAD_END);
 	}
+	else
+	if (strcmp(argv[1], "trace_dropped") == 0) {
+		unsigned int dropped = 0;
+		if (ioctl(fd, TRACE_DROPPED, &dropped) < 0) {
+			perror("trace_dropped");
+		}
+		else {
+			printf("%u trace records dropped\n", dropped);
+		}
+	}
+	else
+	if ((strcmp(argv[1], "trace_policy") == 0) && (argc > 2)) {
+		if (strcmp(argv[2], "overwrite") == 0) {
+			fprintf(stderr, "overwriting the oldest trace records ...\n");
+			ioctl(fd, TRACE_POLICY, SBA_TRACE_OVERWRITE_OLDEST);
+		}
+		else {
+			fprintf(stderr, "dropping the newest trace records ...\n");
+			ioctl(fd, TRACE_POLICY, SBA_TRACE_DROP_NEWEST);
+		}
+	}
+	else
+	if ((strcmp(argv[1], "throttle") == 0) && (argc > 4)) {
+		sba_throttle_limit limit;
+
+		limit.tclass = throttle_class(argv[2]);
+		limit.bps = strtoul(argv[3], NULL, 0);
+		limit.iops = strtoul(argv[4], NULL, 0);
+		limit.burst_msecs = (argc > 5) ? strtoul(argv[5], NULL, 0) : 0;
+
+		if ((limit.tclass < 0) || (ioctl(fd, SET_THROTTLE, &limit) < 0)) {
+			fprintf(stderr, "invalid throttle class %s\n", argv[2]);
+		}
+	}
+	else
+	if (strcmp(argv[1], "throttle_stats") == 0) {
+		sba_throttle_stat st[SBA_THR_CLASSES];
+		int i;
+
+		if (ioctl(fd, THROTTLE_STATS, st) < 0) {
+			fprintf(stderr, "unable to get the throttle statistics\n");
+			return 1;
+		}
+
+		printf("%-12s %10s %10s %6s %9s %14s\n", "class", "ios", "throttled", "depth", "max_depth", "throttled_ms");
+		for (i = 0; i < SBA_THR_CLASSES; i ++) {
+			printf("%-12s %10u %10u %6u %9u %14llu\n", throttle_classes[i], st[i].ios, st[i].throttled,
+			st[i].depth, st[i].max_depth, st[i].throttled_ns/1000000);
+		}
+	}
+	else
+	if ((strcmp(argv[1], "attach") == 0) && (argc > 2)) {
+		sba_backing att;
+
+		memset(&att, 0, sizeof(att));
+		if ((strcmp(argv[2], "ram") == 0) && (argc > 3)) {
+			att.type = SBA_BACKEND_RAM;
+			att.size_mb = strtoul(argv[3], NULL, 0);
+		}
+		else
+		if ((strcmp(argv[2], "file") == 0) && (argc > 3)) {
+			att.type = SBA_BACKEND_FILE;
+			strncpy(att.path, argv[3], sizeof(att.path) - 1);
+		}
+		else {
+			att.type = SBA_BACKEND_BLOCK;
+			if ((block_device(argv[2], &att.f_major, &att.f_minor) < 0) ||
+			((argc > 3) && (block_device(argv[3], &att.j_major, &att.j_minor) < 0))) {
+				return 1;
+			}
+		}
+
+		fprintf(stderr, "attaching sba to %s ...\n", argv[argc - 1]);
+		if (ioctl(fd, ATTACH_DEV, &att) < 0) {
+			perror("attach");
+		}
+	}
+	else
+	if (strcmp(argv[1], "detach") == 0) {
+		fprintf(stderr, "detaching sba ...\n");
+		if (ioctl(fd, DETACH_DEV) < 0) {
+			perror("detach");
+		}
+	}
+	else
+	if (strcmp(argv[1], "snapshot") == 0) {
+		fprintf(stderr, "taking a snapshot ...\n");
+		if (ioctl(fd, SNAPSHOT) < 0) {
+			perror("snapshot");
+		}
+	}
+	else
+	if (strcmp(argv[1], "rollback") == 0) {
+		fprintf(stderr, "rolling back to the snapshot ...\n");
+		if (ioctl(fd, ROLLBACK) < 0) {
+			perror("rollback");
+		}
+	}
+	else
+	if (strcmp(argv[1], "drop_snapshot") == 0) {
+		fprintf(stderr, "dropping the snapshot ...\n");
+		if (ioctl(fd, DROP_SNAPSHOT) < 0) {
+			perror("drop_snapshot");
+		}
+	}
+	else
+	if ((strcmp(argv[1], "wlog_start") == 0) && (argc > 2)) {
+		char path[SBA_WLOG_PATH_LEN];
+
+		memset(path, 0, sizeof(path));
+		strncpy(path, argv[2], sizeof(path) - 1);
+
+		fprintf(stderr, "logging the writes to %s ...\n", path);
+		if (ioctl(fd, WLOG_START, path) < 0) {
+			perror("wlog_start");
+		}
+	}
+	else
+	if (strcmp(argv[1], "wlog_stop") == 0) {
+		fprintf(stderr, "stopping the write log ...\n");
+		if (ioctl(fd, WLOG_STOP) < 0) {
+			perror("wlog_stop");
+		}
+	}
+	else
+	if ((strcmp(argv[1], "get_fault") == 0) && (argc > 2)) {
+		sba_fault_info info;
+
+		memset(&info, 0, sizeof(info));
+		info.id = atoi(argv[2]);
+		if (ioctl(fd, GET_FAULT, &info) < 0) {
+			perror("get_fault");
+			return 1;
+		}
+
+		printf("fault %d: %s, %u matches, %u hits, rw %d type %d mode %d blk_type %x blocknr %d trigger %d\n", info.id,
+		info.armed ? "armed" : "disarmed", info.matches, info.hits, info.f.rw, info.f.fault_type, info.f.fault_mode,
+		info.f.blk_type, info.f.blocknr, info.f.trigger);
+	}
+	else
+	if ((strcmp(argv[1], "del_fault") == 0) && (argc > 2)) {
+		fprintf(stderr, "deleting fault %s ...\n", argv[2]);
+		if (ioctl(fd, DEL_FAULT, atoi(argv[2])) < 0) {
+			perror("del_fault");
+		}
+	}
+	else
+	if ((strcmp(argv[1], "fault_seed") == 0) && (argc > 2)) {
+		fprintf(stderr, "seeding the fault triggers with %s ...\n", argv[2]);
+		ioctl(fd, FAULT_SEED, strtoul(argv[2], NULL, 0));
+	}
 	else {
 		fprintf(stderr, "Invalid command\n");
 	}
@@ -0,0 +1,159 @@
+/*
+ * Compares the throughput and latency of the sba device with those
+ * of the device underneath it. Both devices get the same sequence
+ * of O_DIRECT block ios. Reads only, unless -w is given: writes
+ * destroy the file system on the devices.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include "sba_common_defs.h"
+
+typedef struct _bench_result {
+	double secs;
+	double lat_avg;
+	double lat_p50;
+	double lat_p99;
+	double lat_max;
+} bench_result;
+
+int nr_ios = 100000;
+int span = 262144;			//blocks the ios are spread over
+int random_io = 0;
+int do_writes = 0;
+unsigned int seed = 1;
+
+double now_usecs(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec*1e6 + tv.tv_usec;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+	double x = *(double *)a, y = *(double *)b;
+	return (x > y) - (x < y);
+}
+
+int run(char *dev, bench_result *res)
+{
+	int fd;
+	int i;
+	char *buf;
+	double *lat;
+	double start, t;
+	unsigned int rseed = seed;
+	off_t block;
+	ssize_t ret;
+
+	fd = open(dev, (do_writes ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0) {
+		perror(dev);
+		return -1;
+	}
+
+	lat = (double *)malloc(nr_ios*sizeof(double));
+	if ((!lat) || (posix_memalign((void **)&buf, SBA_BLKSIZE, SBA_BLKSIZE))) {
+		fprintf(stderr, "unable to allocate memory\n");
+		close(fd);
+		return -1;
+	}
+	memset(buf, 0, SBA_BLKSIZE);
+
+	start = now_usecs();
+	for (i = 0; i < nr_ios; i ++) {
+		block = random_io ? (rand_r(&rseed) % span) : (i % span);
+
+		t = now_usecs();
+		if (do_writes) {
+			ret = pwrite(fd, buf, SBA_BLKSIZE, block*SBA_BLKSIZE);
+		}
+		else {
+			ret = pread(fd, buf, SBA_BLKSIZE, block*SBA_BLKSIZE);
+		}
+		lat[i] = now_usecs() - t;
+
+		if (ret != SBA_BLKSIZE) {
+			perror("io");
+			free(lat);
+			close(fd);
+			return -1;
+		}
+	}
+	res->secs = (now_usecs() - start)/1e6;
+
+	res->lat_avg = 0;
+	for (i = 0; i < nr_ios; i ++) {
+		res->lat_avg += lat[i];
+	}
+	res->lat_avg /= nr_ios;
+
+	qsort(lat, nr_ios, sizeof(double), cmp_double);
+	res->lat_p50 = lat[nr_ios/2];
+	res->lat_p99 = lat[(nr_ios*99)/100];
+	res->lat_max = lat[nr_ios - 1];
+
+	free(lat);
+	free(buf);
+	close(fd);
+
+	return 1;
+}
+
+void report(char *dev, bench_result *res)
+{
+	printf("%-16s %9.0f iops %8.1f MB/s  lat avg %7.1f p50 %7.1f p99 %7.1f max %8.1f us\n", dev,
+	nr_ios/res->secs, (double)nr_ios*SBA_BLKSIZE/(1024*1024)/res->secs,
+	res->lat_avg, res->lat_p50, res->lat_p99, res->lat_max);
+}
+
+int main(int argc, char *argv[])
+{
+	char *sba_dev = NULL;
+	char *raw_dev = NULL;
+	bench_result sba_res, raw_res;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:S:rw")) != -1) {
+		switch(c) {
+			case 'n': nr_ios = atoi(optarg); break;
+			case 's': span = atoi(optarg); break;
+			case 'S': seed = atoi(optarg); break;
+			case 'r': random_io = 1; break;
+			case 'w': do_writes = 1; break;
+			default: goto usage;
+		}
+	}
+
+	if ((argc - optind != 2) || (nr_ios <= 0) || (span <= 0)) {
+		goto usage;
+	}
+
+	sba_dev = argv[optind];
+	raw_dev = argv[optind + 1];
+
+	printf("%d %s %s ios of %d bytes over %d blocks\n", nr_ios, random_io ? "random" : "sequential",
+	do_writes ? "write" : "read", SBA_BLKSIZE, span);
+
+	/*warm up the raw device first, so that the order doesn't favour sba*/
+	if ((run(raw_dev, &raw_res) < 0) || (run(sba_dev, &sba_res) < 0) || (run(raw_dev, &raw_res) < 0)) {
+		return -1;
+	}
+
+	report(raw_dev, &raw_res);
+	report(sba_dev, &sba_res);
+	printf("sba/raw: throughput %.3f, avg latency %.3f\n", raw_res.secs/sba_res.secs, sba_res.lat_avg/raw_res.lat_avg);
+
+	return 1;
+
+usage:
+	printf("Usage: sba_bench [-n ios] [-s span_blocks] [-S seed] [-r] [-w] <sba_dev> <raw_dev>\n");
+	return -1;
+}
@@ -0,0 +1,385 @@
+/*
+ * Builds on an image a state that a crash could have left the storage
+ * of an sba instance in, from a write log (sba wlog_start). The image
+ * must hold what the storage held when the log was started, e.g. a
+ * copy taken right after a snapshot.
+ *
+ * -n N crashes after the first N writes (bios) were issued, all of
+ * them by default. Without -r they are all applied, in order. With -r
+ * the writes that could still have been in flight at the crash are
+ * kept or lost at random, and the kept ones are applied in a random
+ * order that never moves a write across a kept barrier: every seed
+ * gives another state. A write is on the storage
+ * once it completed before the crash, or with -b (a volatile write
+ * cache) only once a barrier after it completed. A barrier is only
+ * kept if all the writes before it are, and nothing after a lost
+ * barrier is kept. Writes the storage failed are never applied.
+ *
+ * -l lists the log instead.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "sba_common_defs.h"
+#include "sba_trace_defs.h"
+#include "sba_wlog_defs.h"
+
+typedef struct _wlog_entry {
+	sba_wlog_rec rec;
+	off_t off;				//of the data in the log
+} wlog_entry;
+
+typedef struct _wlog_bio {
+	int first;				//its WRITE entries are [first, last)
+	int last;
+	int done;				//its DONE entry, -1 if it did not complete
+	int keep;				//KEEP_*
+} wlog_bio;
+
+#define KEEP_LOST		0
+#define KEEP_STABLE		1		//on the storage at the crash
+#define KEEP_IN_FLIGHT	2		//in flight at the crash, but it made it
+
+wlog_entry *entries;
+int nr_entries;
+wlog_bio *bios;
+int nr_bios;
+
+/*reads the records of the log, up to the first one that is incomplete*/
+int load_log(int fd)
+{
+	sba_wlog_hdr hdr;
+	struct stat st;
+	off_t off;
+	int max = 0;
+
+	if ((fstat(fd, &st) < 0) || (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))) {
+		perror("log");
+		return -1;
+	}
+
+	if ((hdr.magic != SBA_WLOG_MAGIC) || (hdr.version != SBA_WLOG_VERSION) || (hdr.rec_size != sizeof(sba_wlog_rec))) {
+		fprintf(stderr, "not a write log of this version (magic %x version %u)\n", hdr.magic, hdr.version);
+		return -1;
+	}
+
+	off = sizeof(hdr);
+	while (off + sizeof(sba_wlog_rec) <= st.st_size) {
+		if (nr_entries == max) {
+			max = max ? 2*max : 4096;
+			entries = (wlog_entry *)realloc(entries, max*sizeof(wlog_entry));
+			if (!entries) {
+				fprintf(stderr, "unable to allocate memory\n");
+				return -1;
+			}
+		}
+
+		if (pread(fd, &entries[nr_entries].rec, sizeof(sba_wlog_rec), off) != sizeof(sba_wlog_rec)) {
+			perror("log");
+			return -1;
+		}
+		off += sizeof(sba_wlog_rec);
+
+		entries[nr_entries].off = off;
+		off += entries[nr_entries].rec.len;
+		if (off > st.st_size) {
+			break;
+		}
+
+		nr_entries ++;
+	}
+
+	return 1;
+}
+
+/*groups the entries by bio. the WRITEs of the bios are in the log in seq order*/
+int index_bios(void)
+{
+	wlog_entry *e;
+	int i;
+
+	for (i = 0; i < nr_entries; i ++) {
+		if ((entries[i].rec.type == SBA_WLOG_WRITE) && (entries[i].rec.seq >= nr_bios)) {
+			nr_bios = entries[i].rec.seq + 1;
+		}
+	}
+
+	bios = (wlog_bio *)calloc(nr_bios + 1, sizeof(wlog_bio));
+	if (!bios) {
+		fprintf(stderr, "unable to allocate memory\n");
+		return -1;
+	}
+	for (i = 0; i < nr_bios; i ++) {
+		bios[i].first = -1;
+		bios[i].done = -1;
+	}
+
+	for (i = 0; i < nr_entries; i ++) {
+		e = &entries[i];
+		if (e->rec.seq >= nr_bios) {
+			continue;
+		}
+
+		if (e->rec.type == SBA_WLOG_WRITE) {
+			if (bios[e->rec.seq].first < 0) {
+				bios[e->rec.seq].first = i;
+			}
+			bios[e->rec.seq].last = i + 1;
+		}
+		else
+		if (e->rec.type == SBA_WLOG_DONE) {
+			bios[e->rec.seq].done = i;
+		}
+	}
+
+	return 1;
+}
+
+void list_log(void)
+{
+	sba_trace_rec tr;
+	wlog_entry *e;
+	int i;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.event = SBA_TRACE_EV_WRITE;
+
+	for (i = 0; i < nr_entries; i ++) {
+		e = &entries[i];
+		if (e->rec.type == SBA_WLOG_WRITE) {
+			tr.btype = e->rec.btype;
+			printf("%16llu W %8u blk %10llu len %5u %s%s%s\n", e->rec.stime, e->rec.seq,
+			(unsigned long long)SBA_SECTOR_TO_BLOCK(e->rec.sector), e->rec.len, sba_trace_btype_name(&tr),
+			(e->rec.flags & SBA_WLOG_BARRIER) ? " barrier" : "", (e->rec.flags & SBA_WLOG_SYNC) ? " sync" : "");
+		}
+		else {
+			printf("%16llu D %8u%s\n", e->rec.stime, e->rec.seq, (e->rec.flags & SBA_WLOG_ERROR) ? " error" : "");
+		}
+	}
+
+	printf("%d writes\n", nr_bios);
+}
+
+/*
+ * decides which of the first n bios are on the storage at a crash
+ * right after the n-th was issued
+ */
+void choose(int n, int random_order, int write_cache, unsigned int seed)
+{
+	int crash = n ? bios[n - 1].last : 0;	//the entries before it happened before the crash
+	int stable = -1;		//the bios up to here are on the storage
+	int blocked = 0;
+	int lost = 0;
+	int i;
+
+	/*the last barrier that completed before the crash*/
+	for (i = 0; i < n; i ++) {
+		if ((bios[i].first >= 0) && (entries[bios[i].first].rec.flags & SBA_WLOG_BARRIER) && (bios[i].done >= 0) && (bios[i].done < crash)) {
+			stable = i;
+		}
+	}
+
+	srand(seed);
+	for (i = 0; i < n; i ++) {
+		/*its records were not logged or it failed on the storage*/
+		if ((bios[i].first < 0) || ((bios[i].done >= 0) && (entries[bios[i].done].rec.flags & SBA_WLOG_ERROR))) {
+			bios[i].keep = KEEP_LOST;
+			continue;
+		}
+
+		if ((!random_order) || (i <= stable) || ((!write_cache) && (bios[i].done >= 0) && (bios[i].done < crash))) {
+			bios[i].keep = KEEP_STABLE;
+			continue;
+		}
+
+		if (entries[bios[i].first].rec.flags & SBA_WLOG_BARRIER) {
+			/*everything before a barrier is on the storage before it*/
+			bios[i].keep = ((!blocked) && (!lost) && (rand() & 1)) ? KEEP_IN_FLIGHT : KEEP_LOST;
+			if (bios[i].keep == KEEP_LOST) {
+				blocked = 1;
+			}
+		}
+		else {
+			bios[i].keep = ((!blocked) && (rand() & 1)) ? KEEP_IN_FLIGHT : KEEP_LOST;
+		}
+
+		if (bios[i].keep == KEEP_LOST) {
+			lost ++;
+		}
+	}
+}
+
+int apply_bio(int log_fd, int img_fd, wlog_bio *bio)
+{
+	static char *buf = NULL;
+	static unsigned int buf_len = 0;
+	wlog_entry *e;
+	int i;
+
+	for (i = bio->first; i < bio->last; i ++) {
+		e = &entries[i];
+		if (e->rec.type != SBA_WLOG_WRITE) {
+			continue;
+		}
+
+		if (e->rec.len > buf_len) {
+			buf_len = e->rec.len;
+			buf = (char *)realloc(buf, buf_len);
+			if (!buf) {
+				fprintf(stderr, "unable to allocate memory\n");
+				return -1;
+			}
+		}
+
+		if ((pread(log_fd, buf, e->rec.len, e->off) != e->rec.len) ||
+		(pwrite(img_fd, buf, e->rec.len, (off_t)e->rec.sector*SBA_HARDSECT) != e->rec.len)) {
+			perror("replay");
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
+/*shuffles order[first, last)*/
+void shuffle(int *order, int first, int last)
+{
+	int i, j, t;
+
+	for (i = last - 1; i > first; i --) {
+		j = first + rand() % (i - first + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+}
+
+/*
+ * applies the bios that were on the storage in order, then the ones
+ * that were in flight at the crash and made it. those are applied in
+ * a random order between the kept barriers, each barrier after all
+ * the writes issued before it and before all the ones issued after it
+ */
+int replay(int log_fd, int img_fd, int n)
+{
+	int *order;
+	int i, seg, stable, nr = 0, applied = 0;
+
+	order = (int *)malloc((n + 1)*sizeof(int));
+	if (!order) {
+		fprintf(stderr, "unable to allocate memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < n; i ++) {
+		if (bios[i].keep == KEEP_STABLE) {
+			order[nr ++] = i;
+		}
+	}
+
+	stable = nr;
+
+	for (i = 0; i < n; i ++) {
+		if (bios[i].keep == KEEP_IN_FLIGHT) {
+			order[nr ++] = i;
+		}
+	}
+
+	for (i = seg = stable; i < nr; i ++) {
+		if (entries[bios[order[i]].first].rec.flags & SBA_WLOG_BARRIER) {
+			shuffle(order, seg, i);
+			seg = i + 1;
+		}
+	}
+	shuffle(order, seg, nr);
+
+	for (i = 0; i < nr; i ++) {
+		if (apply_bio(log_fd, img_fd, &bios[order[i]]) < 0) {
+			free(order);
+			return -1;
+		}
+		applied ++;
+	}
+
+	free(order);
+
+	fprintf(stderr, "applied %d of the first %d writes\n", applied, n);
+	for (i = 0; i < n; i ++) {
+		if (bios[i].keep == KEEP_LOST) {
+			fprintf(stderr, "lost write %d\n", i);
+		}
+	}
+
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int log_fd, img_fd;
+	int n = -1;
+	int list = 0;
+	int random_order = 0;
+	int write_cache = 0;
+	unsigned int seed = 1;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:r:bl")) != -1) {
+		switch(c) {
+			case 'n': n = atoi(optarg); break;
+			case 'r': random_order = 1; seed = strtoul(optarg, NULL, 0); break;
+			case 'b': write_cache = 1; break;
+			case 'l': list = 1; break;
+			default: goto usage;
+		}
+	}
+
+	if (argc - optind != (list ? 1 : 2)) {
+		goto usage;
+	}
+
+	log_fd = open(argv[optind], O_RDONLY);
+	if (log_fd < 0) {
+		perror(argv[optind]);
+		return -1;
+	}
+
+	if ((load_log(log_fd) < 0) || (index_bios() < 0)) {
+		return -1;
+	}
+
+	if (list) {
+		list_log();
+		return 1;
+	}
+
+	if ((n < 0) || (n > nr_bios)) {
+		n = nr_bios;
+	}
+
+	img_fd = open(argv[optind + 1], O_WRONLY);
+	if (img_fd < 0) {
+		perror(argv[optind + 1]);
+		return -1;
+	}
+
+	choose(n, random_order, write_cache, seed);
+	if (replay(log_fd, img_fd, n) < 0) {
+		return -1;
+	}
+
+	fsync(img_fd);
+	close(img_fd);
+	close(log_fd);
+
+	return 1;
+
+usage:
+	printf("Usage: sba_replay [-n writes] [-r seed] [-b] <log> <image>\n       sba_replay -l <log>\n");
+	return -1;
+}
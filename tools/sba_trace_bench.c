@@ -0,0 +1,106 @@
+/*
+ * Compares the cost of the binary trace records with the old text
+ * traces: bytes and cpu time per million traced blocks. The records
+ * are synthetic; this measures the formats, not the io path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "sba_common_defs.h"
+#include "sba_trace_reader.h"
+
+#define MILLION		1000000
+
+/*what a stat_info looked like before the trace buffer*/
+typedef struct _old_stat_info {
+	char btype[6];
+	long blocknr;
+	long ref_blocknr;
+	struct timeval stv;
+	struct timeval etv;
+	int rw;
+	struct _old_stat_info *prev;
+	struct _old_stat_info *next;
+} old_stat_info;
+
+double cpu_secs(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+}
+
+void make_record(sba_trace_rec *rec, int i)
+{
+	rec->blocknr = 1000 + i;
+	rec->event = (i % 4) ? SBA_TRACE_EV_WRITE : SBA_TRACE_EV_READ;
+	rec->btype = i % (SBA_TRACE_BT_JINDIR + 1);
+	rec->pad = 0;
+	rec->stime = (unsigned long long)i*13000;
+	rec->etime = rec->stime + 250000;
+}
+
+void report(char *what, unsigned long long bytes, double secs, int n)
+{
+	double scale = (double)MILLION/n;
+
+	printf("%-28s %10.1f MB %10.3f s\n", what, bytes*scale/(1024*1024), secs*scale);
+}
+
+int main(int argc, char *argv[])
+{
+	int n = MILLION;
+	int i;
+	sba_trace_rec *recs;
+	char *text;
+	unsigned long long bytes;
+	double start;
+	size_t pos;
+
+	if (argc > 1) {
+		n = atoi(argv[1]);
+	}
+	if (n <= 0) {
+		printf("Usage: sba_trace_bench [records]\n");
+		return -1;
+	}
+
+	recs = (sba_trace_rec *)malloc((size_t)n*sizeof(sba_trace_rec));
+	text = (char *)malloc((size_t)n*128);
+	if ((!recs) || (!text)) {
+		fprintf(stderr, "unable to allocate memory\n");
+		return -1;
+	}
+
+	printf("record sizes: old stat_info %d bytes, sba_trace_rec %d bytes (version %d)\n",
+	(int)sizeof(old_stat_info), (int)sizeof(sba_trace_rec), SBA_TRACE_VERSION);
+	printf("%d records, scaled to a million:\n", n);
+
+	/*binary: what the producer writes into the ring*/
+	start = cpu_secs();
+	for (i = 0; i < n; i ++) {
+		make_record(&recs[i], i);
+	}
+	report("binary records", (unsigned long long)n*sizeof(sba_trace_rec), cpu_secs() - start, n);
+
+	/*text: what EXTRACT_STATS copies out*/
+	start = cpu_secs();
+	pos = 0;
+	for (i = 0; i < n; i ++) {
+		pos += sba_reader_format(&recs[i], text + pos, 0, NULL);
+	}
+	bytes = pos;
+	report("text lines (sprintf)", bytes, cpu_secs() - start, n);
+
+	/*the old per block memory in the kernel*/
+	report("old stat_info memory", (unsigned long long)n*sizeof(old_stat_info), 0, n);
+
+	free(recs);
+	free(text);
+
+	return 1;
+}
@@ -0,0 +1,72 @@
+/*
+ * Converts a binary trace dump (sba_trace_tail -b) into the text
+ * format of EXTRACT_STATS, so that the old parsers keep working.
+ * -n prints the times with nano second resolution and -w prints
+ * wall clock times instead of the times since the driver was loaded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sba_common_defs.h"
+#include "sba_trace_reader.h"
+
+/*records decoded per read*/
+#define BATCH	4096
+
+int main(int argc, char *argv[])
+{
+	FILE *fp = stdin;
+	sba_trace_dump_hdr dh;
+	sba_trace_rec *recs;
+	char line[128];
+	int flags = 0;
+	size_t n, i;
+	int arg;
+
+	for (arg = 1; arg < argc; arg ++) {
+		if (strcmp(argv[arg], "-n") == 0) {
+			flags |= SBA_FMT_NSEC;
+		}
+		else
+		if (strcmp(argv[arg], "-w") == 0) {
+			flags |= SBA_FMT_WALL;
+		}
+		else
+		if ((argv[arg][0] != '-') && (fp == stdin)) {
+			fp = fopen(argv[arg], "r");
+			if (!fp) {
+				perror("fopen");
+				return -1;
+			}
+		}
+		else {
+			printf("Usage: sba_trace_decode [-n] [-w] [dump]\n");
+			return -1;
+		}
+	}
+
+	if (!sba_reader_read_dump_hdr(fp, &dh)) {
+		return -1;
+	}
+
+	recs = (sba_trace_rec *)malloc(BATCH*sizeof(sba_trace_rec));
+	if (!recs) {
+		fprintf(stderr, "unable to allocate memory\n");
+		return -1;
+	}
+
+	while ((n = fread(recs, sizeof(sba_trace_rec), BATCH, fp)) > 0) {
+		for (i = 0; i < n; i ++) {
+			sba_reader_format(&recs[i], line, flags, &dh);
+			fputs(line, stdout);
+		}
+	}
+
+	free(recs);
+	if (fp != stdin) {
+		fclose(fp);
+	}
+
+	return 1;
+}
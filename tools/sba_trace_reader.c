@@ -0,0 +1,240 @@
+/*
+ * User level reader of the sba trace buffer. It maps /dev/sba_trace
+ * and consumes the per cpu rings in place, merging them by the start
+ * time of the records. See sba_trace.c for the ring protocol.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "sba_common_defs.h"
+#include "sba_trace_reader.h"
+
+#define READ_ONCE(x)	(*(volatile unsigned int *)&(x))
+#define mb()			__sync_synchronize()
+
+int sba_reader_open(sba_reader *r, char *dev)
+{
+	sba_trace_hdr *hdr;
+
+	memset(r, 0, sizeof(sba_reader));
+
+	r->fd = open(dev ? dev : SBA_TRACE_DEV, O_RDWR);
+	if (r->fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/*map the header first to learn the size of the buffer*/
+	hdr = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, r->fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("mmap");
+		close(r->fd);
+		return -1;
+	}
+
+	if ((hdr->magic != SBA_TRACE_MAGIC) || (hdr->version != SBA_TRACE_VERSION) || (hdr->rec_size != sizeof(sba_trace_rec))) {
+		fprintf(stderr, "Error: incompatible trace buffer (magic %x, version %d, record size %d)\n", hdr->magic, hdr->version, hdr->rec_size);
+		munmap(hdr, getpagesize());
+		close(r->fd);
+		return -1;
+	}
+
+	r->size = hdr->data_offset + (unsigned long)hdr->nr_rings*hdr->ring_size*hdr->rec_size;
+	munmap(hdr, getpagesize());
+
+	r->buf = mmap(NULL, r->size, PROT_READ|PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if (r->buf == MAP_FAILED) {
+		perror("mmap");
+		close(r->fd);
+		return -1;
+	}
+
+	r->hdr = (sba_trace_hdr *)r->buf;
+
+	return 1;
+}
+
+int sba_reader_close(sba_reader *r)
+{
+	munmap(r->buf, r->size);
+	close(r->fd);
+	r->buf = NULL;
+	r->hdr = NULL;
+
+	return 1;
+}
+
+static sba_trace_rec *sba_reader_slot(sba_reader *r, int ring, unsigned int pos)
+{
+	sba_trace_rec *data = (sba_trace_rec *)(r->buf + r->hdr->data_offset);
+
+	return data + ring*r->hdr->ring_size + (pos & (r->hdr->ring_size - 1));
+}
+
+/*copies the oldest record of a ring without consuming it*/
+static int sba_reader_peek(sba_reader *r, int ring, sba_trace_rec *rec)
+{
+	sba_trace_ring *tr = &r->hdr->ring[ring];
+	unsigned int size = r->hdr->ring_size;
+	unsigned int head, tail, reserve;
+
+	while (1) {
+		head = READ_ONCE(tr->head);
+		mb();
+
+		tail = tr->tail;
+		if (head == tail) {
+			return 0;
+		}
+
+		reserve = READ_ONCE(tr->reserve);
+		if (reserve - tail > size) {
+			tr->overwritten += reserve - size - tail;
+			tr->tail = tail = reserve - size;
+		}
+
+		memcpy(rec, sba_reader_slot(r, ring, tail), sizeof(sba_trace_rec));
+		mb();
+
+		if (READ_ONCE(tr->reserve) - tail <= size) {
+			return 1;
+		}
+	}
+}
+
+/*
+ * consumes the oldest record of the buffer. returns 1 if a
+ * record was copied into rec, 0 if the buffer is empty.
+ */
+int sba_reader_next(sba_reader *r, sba_trace_rec *rec)
+{
+	int i;
+	int ring = -1;
+	sba_trace_rec cur;
+
+	for (i = 0; i < r->hdr->nr_rings; i ++) {
+		if (sba_reader_peek(r, i, &cur)) {
+			if ((ring < 0) || (cur.stime < rec->stime)) {
+				memcpy(rec, &cur, sizeof(sba_trace_rec));
+				ring = i;
+			}
+		}
+	}
+
+	if (ring < 0) {
+		return 0;
+	}
+
+	/*we are done with the slot before the producer may reuse it*/
+	mb();
+	r->hdr->ring[ring].tail ++;
+
+	return 1;
+}
+
+/*hands every record in the buffer to fn. returns the number of records*/
+int sba_reader_drain(sba_reader *r, sba_reader_fn fn, void *arg)
+{
+	sba_trace_rec rec;
+	int count = 0;
+
+	while ((!r->stop) && (sba_reader_next(r, &rec))) {
+		count ++;
+		if (!fn(&rec, arg)) {
+			r->stop = 1;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * keeps handing records to fn as they arrive, polling the
+ * buffer every poll_usecs when it is empty. returns when
+ * fn returns 0 or r->stop is set.
+ */
+int sba_reader_tail(sba_reader *r, sba_reader_fn fn, void *arg, int poll_usecs)
+{
+	while (!r->stop) {
+		if (!sba_reader_drain(r, fn, arg)) {
+			usleep(poll_usecs);
+		}
+	}
+
+	return 1;
+}
+
+unsigned int sba_reader_dropped(sba_reader *r)
+{
+	int i;
+	unsigned int dropped = 0;
+
+	for (i = 0; i < r->hdr->nr_rings; i ++) {
+		dropped += READ_ONCE(r->hdr->ring[i].dropped);
+		dropped += READ_ONCE(r->hdr->ring[i].overwritten);
+	}
+
+	return dropped;
+}
+
+/*
+ * prints a record in the text format of EXTRACT_STATS into buf.
+ * with SBA_FMT_WALL the times are moved by the wall clock base
+ * in dh. returns the length of the line.
+ */
+int sba_reader_format(sba_trace_rec *rec, char *buf, int flags, sba_trace_dump_hdr *dh)
+{
+	unsigned long long stime = rec->stime;
+	unsigned long long etime = rec->etime;
+	unsigned long long base;
+
+	if ((flags & SBA_FMT_WALL) && (dh)) {
+		base = (unsigned long long)dh->base_sec*1000000000 + dh->base_nsec;
+		stime += base;
+		etime += base;
+	}
+
+	if (flags & SBA_FMT_NSEC) {
+		return sprintf(buf, "%c %d t= %s b= %llu.%09llu e= %llu.%09llu\n", sba_trace_event_char(rec->event), 
+		rec->blocknr, sba_trace_btype_name(rec), stime/1000000000, stime%1000000000, 
+		etime/1000000000, etime%1000000000);
+	}
+
+	return sprintf(buf, "%c %d t= %s b= %llu.%06llu e= %llu.%06llu\n", sba_trace_event_char(rec->event), 
+	rec->blocknr, sba_trace_btype_name(rec), stime/1000000000, (stime%1000000000)/1000, 
+	etime/1000000000, (etime%1000000000)/1000);
+}
+
+int sba_reader_write_dump_hdr(sba_reader *r, FILE *fp)
+{
+	sba_trace_dump_hdr dh;
+
+	memset(&dh, 0, sizeof(dh));
+	dh.magic = SBA_TRACE_DUMP_MAGIC;
+	dh.version = SBA_TRACE_VERSION;
+	dh.rec_size = sizeof(sba_trace_rec);
+	dh.base_sec = r->hdr->base_sec;
+	dh.base_nsec = r->hdr->base_nsec;
+
+	return fwrite(&dh, sizeof(dh), 1, fp);
+}
+
+/*returns 1 if fp starts with a dump header this reader understands*/
+int sba_reader_read_dump_hdr(FILE *fp, sba_trace_dump_hdr *dh)
+{
+	if (fread(dh, sizeof(sba_trace_dump_hdr), 1, fp) != 1) {
+		fprintf(stderr, "Error: no dump header\n");
+		return 0;
+	}
+
+	if ((dh->magic != SBA_TRACE_DUMP_MAGIC) || (dh->version != SBA_TRACE_VERSION) || (dh->rec_size != sizeof(sba_trace_rec))) {
+		fprintf(stderr, "Error: incompatible dump (magic %x, version %d, record size %d)\n", dh->magic, dh->version, dh->rec_size);
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,37 @@
+#ifndef __INCLUDE_SBA_TRACE_READER_H__
+#define __INCLUDE_SBA_TRACE_READER_H__
+
+#include <stdio.h>
+#include "sba_trace_defs.h"
+
+#define SBA_TRACE_DEV		"/dev/sba_trace"
+
+/*
+ * A reader maps the trace buffer of the driver and consumes
+ * the records in place. Only one reader can be open at a time.
+ */
+typedef struct _sba_reader {
+	int fd;
+	char *buf;
+	unsigned long size;
+	sba_trace_hdr *hdr;
+	volatile int stop;			//set to end sba_reader_tail()
+} sba_reader;
+
+typedef int (*sba_reader_fn)(sba_trace_rec *rec, void *arg);
+
+/*flags of sba_reader_format()*/
+#define SBA_FMT_NSEC	0x1		//times with nano second resolution
+#define SBA_FMT_WALL	0x2		//wall clock times instead of times since load
+
+int sba_reader_open(sba_reader *r, char *dev);
+int sba_reader_close(sba_reader *r);
+int sba_reader_next(sba_reader *r, sba_trace_rec *rec);
+int sba_reader_drain(sba_reader *r, sba_reader_fn fn, void *arg);
+int sba_reader_tail(sba_reader *r, sba_reader_fn fn, void *arg, int poll_usecs);
+unsigned int sba_reader_dropped(sba_reader *r);
+int sba_reader_format(sba_trace_rec *rec, char *buf, int flags, sba_trace_dump_hdr *dh);
+int sba_reader_write_dump_hdr(sba_reader *r, FILE *fp);
+int sba_reader_read_dump_hdr(FILE *fp, sba_trace_dump_hdr *dh);
+
+#endif
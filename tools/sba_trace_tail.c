@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "sba_common_defs.h"
+#include "sba_trace_reader.h"
+
+/*how often to look at an empty buffer when following it*/
+#define POLL_USECS	10000
+
+sba_reader reader;
+
+/*flags of sba_reader_format()*/
+int fmt_flags = 0;
+
+void stop_reading(int sig)
+{
+	reader.stop = 1;
+}
+
+int print_record(sba_trace_rec *rec, void *arg)
+{
+	char line[128];
+
+	sba_reader_format(rec, line, fmt_flags, NULL);
+	fputs(line, stdout);
+
+	return 1;
+}
+
+/*binary dumps are decoded later by sba_trace_decode*/
+int dump_record(sba_trace_rec *rec, void *arg)
+{
+	return (fwrite(rec, sizeof(sba_trace_rec), 1, stdout) == 1);
+}
+
+int main(int argc, char *argv[])
+{
+	int follow = 0;
+	int binary = 0;
+	char *dev = SBA_TRACE_DEV;
+	sba_reader_fn fn;
+	int i;
+
+	for (i = 1; i < argc; i ++) {
+		if (strcmp(argv[i], "-f") == 0) {
+			follow = 1;
+		}
+		else
+		if (strcmp(argv[i], "-b") == 0) {
+			binary = 1;
+		}
+		else
+		if (strcmp(argv[i], "-n") == 0) {
+			fmt_flags |= SBA_FMT_NSEC;
+		}
+		else
+		if (argv[i][0] != '-') {
+			dev = argv[i];
+		}
+		else {
+			printf("Usage: sba_trace_tail [-f] [-b|-n] [dev]\n");
+			return -1;
+		}
+	}
+
+	if (sba_reader_open(&reader, dev) < 0) {
+		return -1;
+	}
+
+	signal(SIGINT, stop_reading);
+	signal(SIGTERM, stop_reading);
+
+	if (binary) {
+		sba_reader_write_dump_hdr(&reader, stdout);
+		fn = dump_record;
+	}
+	else {
+		fn = print_record;
+	}
+
+	if (follow) {
+		if (!binary) {
+			setvbuf(stdout, NULL, _IOLBF, 0);
+		}
+		sba_reader_tail(&reader, fn, NULL, POLL_USECS);
+	}
+	else {
+		sba_reader_drain(&reader, fn, NULL);
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%u trace records dropped\n", sba_reader_dropped(&reader));
+	sba_reader_close(&reader);
+
+	return 1;
+}
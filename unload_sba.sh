@@ -7,4 +7,4 @@ device="SBA"
 
 # Remove stale nodes
 
-rm -f /dev/${device} /dev/${device}0 /dev/${device}1
+rm -f /dev/${device} /dev/${device}[0-9]* /dev/sba_trace /dev/sba_trace[0-9]*